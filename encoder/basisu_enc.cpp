@@ -536,7 +536,7 @@ namespace basisu
 		return false;
 	}
 	
-	bool save_png(uint8_vec &output_buf, const image& img, uint32_t image_save_flags, uint32_t grayscale_comp, int filter_index, const uint8_t* pFilters, uint64_t *pFile_size)
+	bool save_png(uint8_vec &output_buf, const image& img, uint32_t image_save_flags, uint32_t grayscale_comp, int filter_index, const uint8_t* pFilters, uint64_t *pFile_size, bool use_miniz, uint64_t* pHuff_freq)
 	{
 		output_buf.resize(0);
 
@@ -556,6 +556,10 @@ namespace basisu
 
 		state.encoder.filter_strategy = LFS_MINSUM;
 
+		static_assert(sizeof(uint64_t) == sizeof(unsigned long long), "sizeof(uint64_t) == sizeof(unsigned long long)");
+		state.encoder.zlibsettings.use_miniz = use_miniz;
+		state.encoder.zlibsettings.huff_freq = reinterpret_cast<unsigned long long*>(pHuff_freq);
+
 		uint8_vec filters;
 		if (filter_index != -1)
 		{
@@ -654,11 +658,11 @@ namespace basisu
 		return true;
 	}
 
-	bool save_png(const char* pFilename, const image& img, uint32_t image_save_flags, uint32_t grayscale_comp, int filter_index, const uint8_t* pFilters, uint64_t* pFile_size)
+	bool save_png(const char* pFilename, const image& img, uint32_t image_save_flags, uint32_t grayscale_comp, int filter_index, const uint8_t* pFilters, uint64_t* pFile_size, bool use_miniz, uint64_t* pHuff_freq)
 	{
 		uint8_vec output_buf;
 
-		if (!save_png(output_buf, img, image_save_flags, grayscale_comp, filter_index, pFilters, pFile_size))
+		if (!save_png(output_buf, img, image_save_flags, grayscale_comp, filter_index, pFilters, pFile_size, use_miniz, pHuff_freq))
 			return false;
 
 		if (!write_vec_to_file(pFilename, output_buf))
@@ -3260,13 +3260,15 @@ namespace basisu
 		cImageSaveIgnoreAlpha = 2
 	};
 
-	bool save_png(uint8_vec& output_buf, const image& img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr);
+	// If use_miniz is false, lodepng's built in (slower, but stronger) deflate is used instead of miniz.
+	// If pHuff_freq isn't nullptr, miniz adds the literal/length and distance symbol counts of each dynamic block it writes to pHuff_freq[2][288].
+	bool save_png(uint8_vec& output_buf, const image& img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr, bool use_miniz = true, uint64_t* pHuff_freq = nullptr);
 
-	bool save_png(const char* pFilename, const image& img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr);
+	bool save_png(const char* pFilename, const image& img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr, bool use_miniz = true, uint64_t* pHuff_freq = nullptr);
 	
-	inline bool save_png(const std::string &filename, const image &img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr)
+	inline bool save_png(const std::string &filename, const image &img, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, int filter_index = -1, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr, bool use_miniz = true, uint64_t* pHuff_freq = nullptr)
 	{ 
-		return save_png(filename.c_str(), img, image_save_flags, grayscale_comp, filter_index, pFilters, pFile_size); 
+		return save_png(filename.c_str(), img, image_save_flags, grayscale_comp, filter_index, pFilters, pFile_size, use_miniz, pHuff_freq); 
 	}
 	
 	bool read_file_to_vec(const char* pFilename, uint8_vec& data);
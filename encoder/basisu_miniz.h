@@ -493,6 +493,10 @@ enum
 //  The caller must free() the returned block when it's no longer needed.
 void *tdefl_compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags);
 
+// tdefl_compress_mem_to_heap_ex() is tdefl_compress_mem_to_heap(), but if pHuff_freq isn't NULL the literal/length and distance symbol 
+// counts of each dynamic block are added to pHuff_freq[0..TDEFL_MAX_HUFF_SYMBOLS-1] and pHuff_freq[TDEFL_MAX_HUFF_SYMBOLS..TDEFL_MAX_HUFF_SYMBOLS*2-1].
+void *tdefl_compress_mem_to_heap_ex(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags, mz_uint64 *pHuff_freq);
+
 // tdefl_compress_mem_to_mem() compresses a block in memory to another block in memory.
 // Returns 0 on failure.
 size_t tdefl_compress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags);
@@ -569,6 +573,7 @@ typedef struct
   mz_uint16 m_next[TDEFL_LZ_DICT_SIZE];
   mz_uint16 m_hash[TDEFL_LZ_HASH_SIZE];
   mz_uint8 m_output_buf[TDEFL_OUT_BUF_SIZE];
+  mz_uint64 *m_pHuff_freq;
 } tdefl_compressor;
 
 // Initializes the compressor.
@@ -1622,8 +1627,6 @@ static void tdefl_optimize_huffman_table(tdefl_compressor *d, int table_num, int
 
 static mz_uint8 s_tdefl_packed_code_size_syms_swizzle[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-uint64_t g_defl_freq[2][TDEFL_MAX_HUFF_SYMBOLS];
-
 static void tdefl_start_dynamic_block(tdefl_compressor *d)
 {
   int num_lit_codes, num_dist_codes, num_bit_lengths; mz_uint i, total_code_sizes_to_pack, num_packed_code_sizes, rle_z_count, rle_repeat_count, packed_code_sizes_index;
@@ -1631,12 +1634,14 @@ static void tdefl_start_dynamic_block(tdefl_compressor *d)
 
   d->m_huff_count[0][256] = 1;
 
-  // HACK HACK
-  for (uint32_t i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++)
-      g_defl_freq[0][i] += d->m_huff_count[0][i];
+  if (d->m_pHuff_freq)
+  {
+    for (uint32_t i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++)
+        d->m_pHuff_freq[i] += d->m_huff_count[0][i];
 
-  for (uint32_t i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++)
-      g_defl_freq[1][i] += d->m_huff_count[1][i];
+    for (uint32_t i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++)
+        d->m_pHuff_freq[TDEFL_MAX_HUFF_SYMBOLS + i] += d->m_huff_count[1][i];
+  }
 
   tdefl_optimize_huffman_table(d, 0, TDEFL_MAX_HUFF_SYMBOLS_0, 15, MZ_FALSE);
   tdefl_optimize_huffman_table(d, 1, TDEFL_MAX_HUFF_SYMBOLS_1, 15, MZ_FALSE);
@@ -2406,6 +2411,7 @@ tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_fun
   d->m_pIn_buf = NULL; d->m_pOut_buf = NULL;
   d->m_pIn_buf_size = NULL; d->m_pOut_buf_size = NULL;
   d->m_flush = TDEFL_NO_FLUSH; d->m_pSrc = NULL; d->m_src_buf_left = 0; d->m_out_buf_ofs = 0;
+  d->m_pHuff_freq = NULL;
   memset(&d->m_huff_count[0][0], 0, sizeof(d->m_huff_count[0][0]) * TDEFL_MAX_HUFF_SYMBOLS_0);
   memset(&d->m_huff_count[1][0], 0, sizeof(d->m_huff_count[1][0]) * TDEFL_MAX_HUFF_SYMBOLS_1);
   return TDEFL_STATUS_OKAY;
@@ -2421,15 +2427,21 @@ mz_uint32 tdefl_get_adler32(tdefl_compressor *d)
   return d->m_adler32;
 }
 
-mz_bool tdefl_compress_mem_to_output(const void *pBuf, size_t buf_len, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags)
+static mz_bool tdefl_compress_mem_to_output_ex(const void *pBuf, size_t buf_len, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags, mz_uint64 *pHuff_freq)
 {
   tdefl_compressor *pComp; mz_bool succeeded; if (((buf_len) && (!pBuf)) || (!pPut_buf_func)) return MZ_FALSE;
   pComp = (tdefl_compressor*)MZ_MALLOC(sizeof(tdefl_compressor)); if (!pComp) return MZ_FALSE;
   succeeded = (tdefl_init(pComp, pPut_buf_func, pPut_buf_user, flags) == TDEFL_STATUS_OKAY);
+  pComp->m_pHuff_freq = pHuff_freq;
   succeeded = succeeded && (tdefl_compress_buffer(pComp, pBuf, buf_len, TDEFL_FINISH) == TDEFL_STATUS_DONE);
   MZ_FREE(pComp); return succeeded;
 }
 
+mz_bool tdefl_compress_mem_to_output(const void *pBuf, size_t buf_len, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags)
+{
+  return tdefl_compress_mem_to_output_ex(pBuf, buf_len, pPut_buf_func, pPut_buf_user, flags, NULL);
+}
+
 typedef struct
 {
   size_t m_size, m_capacity;
@@ -2452,15 +2464,20 @@ static mz_bool tdefl_output_buffer_putter(const void *pBuf, int len, void *pUser
   return MZ_TRUE;
 }
 
-void *tdefl_compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+void *tdefl_compress_mem_to_heap_ex(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags, mz_uint64 *pHuff_freq)
 {
   tdefl_output_buffer out_buf; MZ_CLEAR_OBJ(out_buf);
   if (!pOut_len) return MZ_FALSE; else *pOut_len = 0;
   out_buf.m_expandable = MZ_TRUE;
-  if (!tdefl_compress_mem_to_output(pSrc_buf, src_buf_len, tdefl_output_buffer_putter, &out_buf, flags)) return NULL;
+  if (!tdefl_compress_mem_to_output_ex(pSrc_buf, src_buf_len, tdefl_output_buffer_putter, &out_buf, flags, pHuff_freq)) return NULL;
   *pOut_len = out_buf.m_size; return out_buf.m_pBuf;
 }
 
+void *tdefl_compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+{
+  return tdefl_compress_mem_to_heap_ex(pSrc_buf, src_buf_len, pOut_len, flags, NULL);
+}
+
 size_t tdefl_compress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags)
 {
   tdefl_output_buffer out_buf; MZ_CLEAR_OBJ(out_buf);
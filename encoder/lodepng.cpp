@@ -2040,25 +2040,21 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
-#if LODEPNG_USE_MINIZ
-bool g_use_miniz = true;
-#endif
-
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings) {
 
 #if LODEPNG_USE_MINIZ
-    if (g_use_miniz)
+    if (settings->use_miniz)
     {
         (void)settings;
 
         size_t out_len = 0;
 
 #if LODEPNG_FASTER_MINIZ_COMP
-        void* p = buminiz::tdefl_compress_mem_to_heap(in, insize, &out_len, buminiz::TDEFL_WRITE_ZLIB_HEADER | buminiz::TDEFL_GREEDY_PARSING_FLAG | 1);
+        void* p = buminiz::tdefl_compress_mem_to_heap_ex(in, insize, &out_len, buminiz::TDEFL_WRITE_ZLIB_HEADER | buminiz::TDEFL_GREEDY_PARSING_FLAG | 1, settings->huff_freq);
 #else
-        void* p = buminiz::tdefl_compress_mem_to_heap(in, insize, &out_len, buminiz::TDEFL_WRITE_ZLIB_HEADER | buminiz::TDEFL_MAX_PROBES_MASK);
+        void* p = buminiz::tdefl_compress_mem_to_heap_ex(in, insize, &out_len, buminiz::TDEFL_WRITE_ZLIB_HEADER | buminiz::TDEFL_MAX_PROBES_MASK, settings->huff_freq);
 #endif
         if (!p)
         {
@@ -2130,9 +2126,12 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+
+  settings->use_miniz = 1;
+  settings->huff_freq = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 1, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -308,6 +308,12 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Basis Universal specific modification: when built with miniz, whether to compress with miniz instead of the
+  built in encoder (default: true), and if not null, where miniz adds its literal/length and distance symbol counts
+  ([2][288], see tdefl_compress_mem_to_heap_ex())*/
+  unsigned use_miniz;
+  unsigned long long* huff_freq;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -32,6 +32,28 @@
 
 #include "encoder/lodepng.h"
 
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+	#ifndef PSAPI_VERSION
+		#define PSAPI_VERSION (2)
+	#endif
+	#include <psapi.h>
+#else
+	#include <sys/stat.h>
+	#include <sys/resource.h>
+	#include <dirent.h>
+	#include <glob.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
 // Set BASISU_CATCH_EXCEPTIONS if you want exceptions to crash the app, otherwise main() catches them.
 #ifndef BASISU_CATCH_EXCEPTIONS
 	#define BASISU_CATCH_EXCEPTIONS 1
@@ -41,11 +63,49 @@
 
 #define RDO_PNG_USE_APPROX_ACOS (1)
 
+// Set to 0 to make -uber QOI score all 16384 LUMA candidates per pixel, instead of skipping the ones which provably can't win. The output is the same either way.
+#ifndef RDO_PNG_PRUNE_QOI_LUMA
+	#define RDO_PNG_PRUNE_QOI_LUMA (1)
+#endif
+
+// SSE2 is always available on x64, so the QOI candidate scoring kernel uses it there.
+#ifndef RDO_PNG_USE_SSE2
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+		#define RDO_PNG_USE_SSE2 (1)
+	#else
+		#define RDO_PNG_USE_SSE2 (0)
+	#endif
+#endif
+
+#if RDO_PNG_USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+// Set to 1 to make the compact Oklab conversion the default (-oklab_table/-oklab_compact override it at run time). The compact conversion computes each 
+// Oklab color as it's needed instead of looking it up in the 96MB table, so the tables take well under 1MB.
+#ifndef RDO_PNG_COMPACT_OKLAB
+	#define RDO_PNG_COMPACT_OKLAB (0)
+#endif
+
+// Set to 1 to count the Oklab colors the error metrics look up (or compute, with the compact conversion), and print the count per pixel after each encode.
+// For profiling only, every lookup increments one counter shared by all threads.
+#ifndef RDO_PNG_COUNT_OKLAB_LOOKUPS
+	#define RDO_PNG_COUNT_OKLAB_LOOKUPS (0)
+#endif
+
+// Set to 1 to count the candidates the searches score vs. prune with can_beat_best_t(), and print the counts after each encode. Also for profiling only.
+#ifndef RDO_PNG_COUNT_CANDIDATES
+	#define RDO_PNG_COUNT_CANDIDATES (0)
+#endif
+
 const float DEF_MAX_SMOOTH_STD_DEV = 35.0f;
 const float DEF_SMOOTH_MAX_MSE_SCALE = 250.0f;
 const float DEF_MAX_ULTRA_SMOOTH_STD_DEV = 5.0F;
 const float DEF_ULTRA_SMOOTH_MAX_MSE_SCALE = 1500.0F;
 
+// The -adaptive_huff interval -bench_huff uses if none is given.
+const uint32_t DEF_ADAPTIVE_HUFF_ROWS = 8;
+
 const float QOI_DEF_SMOOTH_MAX_MSE_SCALE = 2500.0f;
 const float QOI_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE = 5000.0f;
 
@@ -55,13 +115,6 @@ const float LZ4I_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE = 10000.0f;
 using namespace basisu;
 using namespace buminiz;
 
-extern bool g_use_miniz;
-
-namespace buminiz
-{
-	extern uint64_t g_defl_freq[2][TDEFL_MAX_HUFF_SYMBOLS];
-}
-
 const float RAD_TO_DEG = 57.29577951f;
 
 const uint32_t MAX_DELTA_COLORS = 12;
@@ -322,6 +375,9 @@ enum speed_mode
 	cFastestSpeed
 };
 
+class encoder_tables;
+struct rdo_image_cache;
+
 struct rdo_png_params
 {
 	rdo_png_params()
@@ -381,6 +437,7 @@ struct rdo_png_params
 		m_match_only = false;
 		
 		m_two_pass = false;
+		m_adaptive_huff_rows = 0;
 		
 		m_alpha_is_opacity = true;
 
@@ -397,6 +454,23 @@ struct rdo_png_params
 		m_ultra_smooth_max_mse_scale = DEF_ULTRA_SMOOTH_MAX_MSE_SCALE;
 
 		m_no_mse_scaling = false;
+
+		m_num_threads = 1;
+		m_wavefront = false;
+		m_parallel_filters = false;
+
+		m_target_bpp = 0.0f;
+		m_target_psnr = 0.0f;
+		m_target_tolerance = 0.0f;
+
+		m_lz4i_tile_width = 0;
+		m_lz4i_tile_height = 0;
+		m_lz4i_hc = false;
+		m_lz4i_cleanup = true;
+		m_lz4i_stream = false;
+
+		m_pTables = nullptr;
+		m_pCache = nullptr;
 	}
 
 	void print()
@@ -418,6 +492,7 @@ struct rdo_png_params
 		printf("perceptual error: %u\n", m_perceptual_error);
 		printf("match only: %u\n", m_match_only);
 		printf("two pass: %u\n", m_two_pass);
+		printf("adaptive huffman rows: %u\n", m_adaptive_huff_rows);
 		printf("alpha is opacity: %u\n", m_alpha_is_opacity);
 		printf("speed mode: %u\n", (uint32_t)m_speed_mode);
 		printf("normal map: %u\n", m_normal_map);
@@ -428,6 +503,16 @@ struct rdo_png_params
 		printf("max ultra smooth std dev: %f\n", m_max_ultra_smooth_std_dev);
 		printf("ultra smooth max mse scale: %f\n", m_ultra_smooth_max_mse_scale);
 		printf("no MSE scaling: %u\n", m_no_mse_scaling);
+		printf("num threads: %u\n", m_num_threads);
+		printf("wavefront: %u\n", m_wavefront);
+		printf("parallel filters: %u\n", m_parallel_filters);
+		printf("target bpp: %f\n", m_target_bpp);
+		printf("target PSNR: %f\n", m_target_psnr);
+		printf("target tolerance: %f\n", m_target_tolerance);
+		printf("LZ4I tile size: %ux%u\n", m_lz4i_tile_width, m_lz4i_tile_height);
+		printf("LZ4I HC: %u\n", m_lz4i_hc);
+		printf("LZ4I cleanup: %u\n", m_lz4i_cleanup);
+		printf("LZ4I stream: %u\n", m_lz4i_stream);
 	}
 
 	// TODO: results - move
@@ -466,6 +551,7 @@ struct rdo_png_params
 
 	bool m_match_only;
 	bool m_two_pass;
+	uint32_t m_adaptive_huff_rows; // if nonzero, the PNG Huffman cost tables are rebuilt from the committed scanlines every this many rows (see png_adaptive_huffman)
 
 	bool m_alpha_is_opacity;
 
@@ -481,6 +567,33 @@ struct rdo_png_params
 	float m_ultra_smooth_max_mse_scale;
 	
 	bool m_no_mse_scaling;
+
+	uint32_t m_num_threads;
+	bool m_wavefront;
+	bool m_parallel_filters;
+
+	// If either is non-zero, rdo_search_lambda() searches for the lambda giving the largest bitrate <= m_target_bpp, or the smallest RGB(A) PSNR >= m_target_psnr.
+	float m_target_bpp;
+	float m_target_psnr;
+	float m_target_tolerance;
+
+	// If either is non-zero, rdo_lz4i() writes a tiled (version 2) .LZ4I file using tiles of this size. 0 means the full image width or height, so 0xN codes N scanline tall strips.
+	uint32_t m_lz4i_tile_width;
+	uint32_t m_lz4i_tile_height;
+
+	// By default the LZ4 block is written directly from the RDO parse's matches. m_lz4i_hc recompresses the coded pixels with LZ4HC's slowest level instead.
+	// m_lz4i_cleanup lets the direct writer extend the parse's matches and find matches in its literal runs.
+	bool m_lz4i_hc;
+	bool m_lz4i_cleanup;
+
+	// Makes encode_file() code the image with rdo_lz4i_stream(), which writes a tiled .LZ4I file one row of tiles at a time without holding the whole coded image in memory.
+	bool m_lz4i_stream;
+
+	// Set from the encoder_context by rdo_png()/rdo_qoi()/rdo_lz4i().
+	const encoder_tables* m_pTables;
+
+	// Optional lambda independent data shared by repeated encodes of the same image. Filled in by the first encode which sees it empty.
+	rdo_image_cache* m_pCache;
 };
 
 struct rdo_png_level
@@ -659,23 +772,26 @@ private:
 	uint64_t m_total2;
 };
 
-static inline vec3F decode_normal(const color_rgba& c, const rdo_png_params& params)
+// Decodes one normal map component. The encoder_tables normal decode tables hold this for each 8-bit value.
+static inline float decode_normal_comp(uint32_t v, bool snorm8)
 {
-	if (params.m_snorm8)
+	if (snorm8)
 	{
 		// snomr8 - supported by GPU's. Zero can be represented exactly, two values for -1.
-		return vec3F(
-			clamp((float)(c.r - 128) * (1.0f / 127.0f), -1.0f, 1.0f),
-			clamp((float)(c.g - 128) * (1.0f / 127.0f), -1.0f, 1.0f),
-			clamp((float)(c.b - 128) * (1.0f / 127.0f), -1.0f, 1.0f));
+		return clamp((float)((int)v - 128) * (1.0f / 127.0f), -1.0f, 1.0f);
 	}
 	else
 	{
 		// unorm8 - zero cannot be represented exactly
-		return vec3F((c.r * (1.0f / 255.0f)) * 2.0f - 1.0f, (c.g * (1.0f / 255.0f)) * 2.0f - 1.0f, (c.b * (1.0f / 255.0f)) * 2.0f - 1.0f);
+		return (v * (1.0f / 255.0f)) * 2.0f - 1.0f;
 	}
 }
 
+static inline vec3F decode_normal(const color_rgba& c, const rdo_png_params& params)
+{
+	return vec3F(decode_normal_comp(c.r, params.m_snorm8), decode_normal_comp(c.g, params.m_snorm8), decode_normal_comp(c.b, params.m_snorm8));
+}
+
 static inline color_rgba encode_normal(const vec3F& v, int alpha, const rdo_png_params& params)
 {
 	color_rgba result;
@@ -788,9 +904,12 @@ static inline color_rgba png_predict(const color_rgba& trial_c, uint32_t x, uint
 {
 	assert(filter);
 		
+	// The previous pixel filter never touches the scanline above, which may belong to a strip that's still being coded.
+	const bool uses_prev_scanline = (filter != PNG_PREV_PIXEL_FILTER) && (y > 0);
+
 	const color_rgba ca(x ? coded_img(x - 1, y) : g_black_color);
-	const color_rgba cb(y ? coded_img(x, y - 1) : g_black_color);
-	const color_rgba cc((x && y) ? coded_img(x - 1, y - 1) : g_black_color);
+	const color_rgba cb(uses_prev_scanline ? coded_img(x, y - 1) : g_black_color);
+	const color_rgba cc((x && uses_prev_scanline) ? coded_img(x - 1, y - 1) : g_black_color);
 
 	color_rgba res;
 
@@ -826,9 +945,12 @@ static inline color_rgba png_unpredict(const color_rgba& delta_c, uint32_t x, ui
 {
 	color_rgba res;
 
+	// The previous pixel filter never touches the scanline above, which may belong to a strip that's still being coded.
+	const bool uses_prev_scanline = (filter != PNG_PREV_PIXEL_FILTER) && (y > 0);
+
 	const color_rgba ca(x ? coded_img(x - 1, y) : g_black_color);
-	const color_rgba cb(y ? coded_img(x, y - 1) : g_black_color);
-	const color_rgba cc((x && y) ? coded_img(x - 1, y - 1) : g_black_color);
+	const color_rgba cb(uses_prev_scanline ? coded_img(x, y - 1) : g_black_color);
+	const color_rgba cc((x && uses_prev_scanline) ? coded_img(x - 1, y - 1) : g_black_color);
 
 	for (uint32_t c = 0; c < num_comps; c++)
 	{
@@ -867,9 +989,10 @@ static inline Lab linear_srgb_to_oklab(RGB c)
 	float m = 0.2119034982f * c.r + 0.6806995451f * c.g + 0.1073969566f * c.b;
 	float s = 0.0883024619f * c.r + 0.2817188376f * c.g + 0.6299787005f * c.b;
 
-	float l_ = std::cbrtf(l);
-	float m_ = std::cbrtf(m);
-	float s_ = std::cbrtf(s);
+	// Correctly rounded cube roots (unlike std::cbrtf() on some platforms), so the Oklab table doesn't depend on the C library and matches the SSE2 table builder.
+	float l_ = (float)cbrt((double)l);
+	float m_ = (float)cbrt((double)m);
+	float s_ = (float)cbrt((double)s);
 
 	return 
 	{
@@ -879,8 +1002,6 @@ static inline Lab linear_srgb_to_oklab(RGB c)
 	};
 }
 
-static float g_srgb_to_linear[256];
-
 static float f_inv(float x)
 {
 	if (x <= 0.04045f)
@@ -889,12 +1010,6 @@ static float f_inv(float x)
 		return powf(((x + 0.055f) / 1.055f), 2.4f);
 }
 
-static void init_srgb_to_linear()
-{
-	for (uint32_t i = 0; i < 256; i++)
-		g_srgb_to_linear[i] = f_inv(i / 255.0f);
-}
-
 #pragma pack(push, 1)
 struct Lab16
 {
@@ -902,7 +1017,17 @@ struct Lab16
 };
 #pragma pack(pop)
 
-basisu::vector<Lab16> g_srgb_to_oklab16;
+// The smallest and largest Lab16 components over one bounds table block of sRGB colors.
+struct Lab16_bounds
+{
+	Lab16 m_lo, m_hi;
+};
+
+// The bounds table uses 4x4x4 blocks with the Oklab table, and 8x8x8 blocks (384KB) with the compact conversion.
+const uint32_t OKLAB_BOUNDS_BLOCK_SHIFT = 2;
+const uint32_t OKLAB_BOUNDS_BLOCK_SIZE = 1 << OKLAB_BOUNDS_BLOCK_SHIFT;
+const uint32_t OKLAB_COMPACT_BOUNDS_BLOCK_SHIFT = 3;
+static_assert(OKLAB_BOUNDS_BLOCK_SHIFT <= OKLAB_COMPACT_BOUNDS_BLOCK_SHIFT, "find_best_qoi_luma() sizes its run arrays for the smallest bounds table block");
 
 const float SCALE_L = 1.0f / 65535.0f;
 const float SCALE_A = (1.0f / 65535.0f) * (0.276216f - (-0.233887f));
@@ -914,3355 +1039,7317 @@ const float MIN_L = 0.000000f, MAX_L = 1.000000f;
 const float MIN_A = -0.233888f, MAX_A = 0.276217f;
 const float MIN_B = -0.311529f, MAX_B = 0.198570f;
 
-static inline Lab srgb_to_oklab(const color_rgba &c)
-{
-	const Lab16 &l = g_srgb_to_oklab16[c.r + c.g * 256 + c.b * 65536];
-	
-	Lab res;
-	res.L = l.m_L * SCALE_L;
-	res.a = l.m_a * SCALE_A + OFS_A;
-	res.b = l.m_b * SCALE_B + OFS_B;
+// The compact Oklab conversion's cube roots interpolate between this many roots of 1.0-2.0.
+const uint32_t CBRT_MANTISSA_BITS = 8;
+const uint32_t CBRT_TABLE_SIZE = 1 << CBRT_MANTISSA_BITS;
 
-	return res;
+// Quantizes an Oklab component to 16 bits, like the table builder but rounding with truncation so the scalar and SSE2 compact conversions agree.
+static inline uint16_t quantize_oklab16(float v, float lo, float hi)
+{
+	v = clamp((v - lo) * (65535.0f / (hi - lo)), 0.0f, 65535.0f);
+	return (uint16_t)(int)(v + .5f);
 }
 
-static inline Lab srgb_to_oklab_norm(const color_rgba& c)
+// A read only memory mapping of a whole file. Processes mapping the same file share one copy of its pages.
+class read_only_file_mapping
 {
-	const Lab16& l = g_srgb_to_oklab16[c.r + c.g * 256 + c.b * 65536];
+public:
+	read_only_file_mapping() : m_pData(nullptr), m_size(0)
+#ifdef _WIN32
+		, m_hFile(INVALID_HANDLE_VALUE), m_hMapping(nullptr)
+#endif
+	{
+	}
 
-	Lab res;
-	res.L = l.m_L * SCALE_L;
-	res.a = l.m_a * SCALE_L;
-	res.b = l.m_b * SCALE_L;
+	~read_only_file_mapping() { close(); }
 
-	return res;
-}
+	read_only_file_mapping(const read_only_file_mapping&) = delete;
+	read_only_file_mapping& operator= (const read_only_file_mapping&) = delete;
 
-static void init_oklab_table(const char *pExec, bool quiet, bool caching_enabled)
-{
-	g_srgb_to_oklab16.resize(256 * 256 * 256);
+	bool open(const char* pFilename)
+	{
+		close();
 
-	std::string path(pExec);
+#ifdef _WIN32
+		m_hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
 
-	if (caching_enabled)
-	{
-		string_get_pathname(pExec, path);
-		path += "oklab.bin";
+		LARGE_INTEGER size;
+		if ((!GetFileSizeEx(m_hFile, &size)) || (!size.QuadPart))
+		{
+			close();
+			return false;
+		}
 
-		uint8_vec file_data;
-		if (read_file_to_vec(path.c_str(), file_data))
+		m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!m_hMapping)
 		{
-			if (file_data.size() == 256 * 256 * 256 * 6)
-			{
-				memcpy(g_srgb_to_oklab16.data(), file_data.data(), file_data.size_in_bytes());
-				if (!quiet)
-					printf("Read Oklab table data from file %s\n", path.c_str());
-				return;
-			}
+			close();
+			return false;
 		}
-	}
-	
-	if (!quiet)
-		printf("Computing Oklab table\n");
 
-	for (uint32_t r = 0; r <= 255; r++)
-	{
-		//printf("%u\n", r);
+		m_pData = (const uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (!m_pData)
+		{
+			close();
+			return false;
+		}
 
-		for (uint32_t g = 0; g <= 255; g++)
+		m_size = (size_t)size.QuadPart;
+#else
+		const int fd = ::open(pFilename, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || (st.st_size <= 0))
 		{
-			for (uint32_t b = 0; b <= 255; b++)
-			{
-				color_rgba c(r, g, b, 255);
-				Lab l(linear_srgb_to_oklab({ g_srgb_to_linear[c.r], g_srgb_to_linear[c.g], g_srgb_to_linear[c.b] }));
+			::close(fd);
+			return false;
+		}
 
-				assert(l.L >= MIN_L && l.L <= MAX_L);
-				assert(l.a >= MIN_A && l.a <= MAX_A);
-				assert(l.b >= MIN_B && l.b <= MAX_B);
-				
-				float lL = std::round(((l.L - MIN_L) / (MAX_L - MIN_L)) * 65535.0f);
-				float la = std::round(((l.a - MIN_A) / (MAX_A - MIN_A)) * 65535.0f);
-				float lb = std::round(((l.b - MIN_B) / (MAX_B - MIN_B)) * 65535.0f);
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		
+		// The mapping stays valid after the descriptor is closed.
+		::close(fd);
 
-				lL = clamp(lL, 0.0f, 65535.0f);
-				la = clamp(la, 0.0f, 65535.0f);
-				lb = clamp(lb, 0.0f, 65535.0f);
+		if (p == MAP_FAILED)
+			return false;
 
-				Lab16& v = g_srgb_to_oklab16[r + g * 256 + b * 65536];
-				v.m_L = (uint16_t)lL;
-				v.m_a = (uint16_t)la;
-				v.m_b = (uint16_t)lb;
+		m_pData = (const uint8_t*)p;
+		m_size = (size_t)st.st_size;
+#endif
 
-				Lab cl = srgb_to_oklab(c);
+		return true;
+	}
 
-				//printf("%f %f %f, %f %f %f\n", l.L, l.a, l.b, cl.L, cl.a, cl.b);
-			}
-		}
+	void close()
+	{
+#ifdef _WIN32
+		if (m_pData)
+			UnmapViewOfFile(m_pData);
+		if (m_hMapping)
+			CloseHandle(m_hMapping);
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+		m_hMapping = nullptr;
+		m_hFile = INVALID_HANDLE_VALUE;
+#else
+		if (m_pData)
+			munmap((void*)m_pData, m_size);
+#endif
+		m_pData = nullptr;
+		m_size = 0;
 	}
 
-	if (caching_enabled)
+	const uint8_t* get_ptr() const { return m_pData; }
+	size_t get_size() const { return m_size; }
+
+private:
+	const uint8_t* m_pData;
+	size_t m_size;
+#ifdef _WIN32
+	HANDLE m_hFile, m_hMapping;
+#endif
+};
+
+// The oklab.bin cache file is this header followed by the 256^3 Lab16 table. The header is 64 bytes so the table is cache line aligned in the mapping.
+const uint32_t OKLAB_CACHE_SIG = 0x424C4B4F; // "OKLB"
+const uint32_t OKLAB_CACHE_VERSION = 2;
+const uint32_t OKLAB_TABLE_SIZE_IN_BYTES = 256 * 256 * 256 * sizeof(Lab16);
+
+struct oklab_cache_header
+{
+	uint32_t m_sig;
+	uint32_t m_version;
+	uint32_t m_header_size;
+	uint32_t m_table_size;
+	uint64_t m_table_checksum; // compute_oklab_cache_checksum() of the table
+	uint8_t m_reserved[40];
+};
+
+static_assert(sizeof(oklab_cache_header) == 64, "oklab_cache_header must be 64 bytes");
+
+// Checksum of the cached Oklab table. Four independent multiply/xor lanes over 64-bit words, so checking the 96MB table at startup is quick.
+static uint64_t compute_oklab_cache_checksum(const uint8_t* pData, size_t size)
+{
+	const uint64_t PRIME = 0x9E3779B97F4A7C15ULL;
+	uint64_t h[4] = { 1, 2, 3, 4 };
+
+	size_t i = 0;
+	for ( ; (i + 32) <= size; i += 32)
 	{
-		if (write_data_to_file(path.c_str(), g_srgb_to_oklab16.data(), g_srgb_to_oklab16.size_in_bytes()))
+		for (uint32_t j = 0; j < 4; j++)
 		{
-			if (!quiet)
-				printf("Wrote oklab lookup table to file %s\n", path.c_str());
-		}
-		else
-		{
-			fprintf(stderr, "Failed writing oklab lookup table to file %s\n", path.c_str());
+			uint64_t w;
+			memcpy(&w, pData + i + j * 8, sizeof(w));
+			h[j] = (h[j] ^ w) * PRIME;
+			h[j] ^= h[j] >> 29;
 		}
 	}
+
+	for ( ; i < size; i++)
+		h[0] = (h[0] ^ pData[i]) * PRIME;
+
+	uint64_t res = size;
+	for (uint32_t j = 0; j < 4; j++)
+	{
+		res = (res ^ h[j]) * PRIME;
+		res ^= res >> 32;
+	}
+
+	return res;
 }
 
+#if RDO_PNG_COUNT_OKLAB_LOOKUPS
+static std::atomic<uint64_t> g_total_oklab_lookups;
+#define RDO_PNG_COUNT_OKLAB_LOOKUP(n) g_total_oklab_lookups.fetch_add(n, std::memory_order_relaxed)
+#else
+#define RDO_PNG_COUNT_OKLAB_LOOKUP(n) do { } while (0)
+#endif
+
 const uint32_t ACOS_LOOKUP_SIZE = 1024;
-float g_acos_lookup[ACOS_LOOKUP_SIZE + 1];
 const float ACOS_LOW_ANGLE_THRESHOLD = .95f;
 
-static inline float approx_acos(float f)
+// Lookup tables used by the error metrics. They're built once at startup by init(), and are read only after that so any number of encodes can share them.
+class encoder_tables
 {
-	const bool is_neg = f < 0.0f;
-	f = clamp(fabs(f), 0.0f, 1.0f);
-		
-	float r;
-	// Use Taylor at low angles, otherwise table+bilinear.
-	if (f >= ACOS_LOW_ANGLE_THRESHOLD)
+public:
+	// If compact is true the Oklab colors are computed as they're needed (see compute_oklab16()), instead of being read from the 96MB table.
+	// If the table isn't cached it's computed on num_threads threads.
+	void init(const char* pExec, bool quiet, bool caching_enabled, bool compact, uint32_t num_threads = 1)
 	{
-		r = sqrtf(2.0f * (1.0f - f)) * RAD_TO_DEG;
+		m_compact = compact;
+		m_pSrgb_to_oklab16 = nullptr;
+		m_bounds_block_shift = compact ? OKLAB_COMPACT_BOUNDS_BLOCK_SHIFT : OKLAB_BOUNDS_BLOCK_SHIFT;
+
+		init_srgb_to_linear();
+		init_cbrt_tables();
+		if (!compact)
+			init_oklab_table(pExec, quiet, caching_enabled, num_threads);
+		init_acos_lookup();
+		init_normal_decode();
+		init_oklab_bounds();
+
+		if ((compact) && (!quiet))
+			printf("Using compact Oklab conversion, %u KB of tables\n", (uint32_t)((get_total_size() + 1023) / 1024));
 	}
-	else
+
+	bool is_compact() const { return m_compact; }
+
+	// Size of the lookup tables in bytes.
+	size_t get_total_size() const
 	{
-		float fract = f - floor(f);
-		int index = (int)(f * (ACOS_LOOKUP_SIZE - 1));
-		assert(index < ACOS_LOOKUP_SIZE);
-		r = g_acos_lookup[index] * (1.0f - fract) + g_acos_lookup[index + 1] * fract;
+		return sizeof(m_srgb_to_linear) + sizeof(m_cbrt_exp) + sizeof(m_cbrt_base) + sizeof(m_cbrt_slope) + sizeof(m_acos_lookup) + sizeof(m_normal_decode) + m_srgb_to_oklab16.size_in_bytes() + m_oklab16_bounds.size_in_bytes();
 	}
 
-	return is_neg ? (180.0f - r) : r;
-}
+	// Cube root of x, or 0 if x <= 0 (or denormal). For x = 1.m * 2^e the root is m_cbrt_exp[e] (the root of 2^e) times the root of 1.m, which 
+	// is linearly interpolated from a table. The relative error is below 1e-6.
+	inline float fast_cbrtf(float x) const
+	{
+		int32_t i;
+		memcpy(&i, &x, sizeof(i));
+		if (i <= 0)
+			return 0.0f;
 
-static void init_acos_lookup()
-{
-	for (uint32_t i = 0; i < ACOS_LOOKUP_SIZE; i++)
-		g_acos_lookup[i] = acos((float)i / (float)(ACOS_LOOKUP_SIZE - 1)) * RAD_TO_DEG;
+		const uint32_t m = (i >> (23 - CBRT_MANTISSA_BITS)) & (CBRT_TABLE_SIZE - 1);
+		const float frac = (float)(i & ((1 << (23 - CBRT_MANTISSA_BITS)) - 1)) * (1.0f / (1 << (23 - CBRT_MANTISSA_BITS)));
+		
+		return m_cbrt_exp[i >> 23] * (m_cbrt_base[m] + m_cbrt_slope[m] * frac);
+	}
 
-	g_acos_lookup[ACOS_LOOKUP_SIZE] = g_acos_lookup[ACOS_LOOKUP_SIZE - 1];
+	// Computes c's Lab16 color without the table: the Oklab matrices applied to m_srgb_to_linear[], using fast_cbrtf() instead of cbrt(). 
+	// Each component is within 1 of the table's.
+	inline Lab16 compute_oklab16(const color_rgba& c) const
+	{
+		const float r = m_srgb_to_linear[c.r], g = m_srgb_to_linear[c.g], b = m_srgb_to_linear[c.b];
 
-#if 0
-	double tot_err = 0;
-	const uint32_t N = 32768;
-	double max_err = 0;
-	for (uint32_t i = 0; i < N; i++)
-	{
-		float f = ((float)i / (float)(N - 1)) * 2.0f - 1.0f;
-		float err = approx_acos(f) - acos(f) * RAD_TO_DEG;
-		printf("%f %f %f %f\n", f, approx_acos(f), acos(f) * RAD_TO_DEG, err);
-		tot_err += fabs(err);
-		max_err = maximum<double>(max_err, fabs(err));
-	}
-	printf("Total err: %f, avg: %f, max: %f\n", tot_err, tot_err / N, max_err);
-	exit(0);
-#endif
-}
+		const float l_ = fast_cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+		const float m_ = fast_cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+		const float s_ = fast_cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
 
-static inline float compute_se(const color_rgba& a, const color_rgba& orig, uint32_t num_comps, const rdo_png_params &params)
-{
-	float dist;
-			
-	if (params.m_normal_map)
+		Lab16 res;
+		res.m_L = quantize_oklab16(0.2104542553f * l_ + 0.7936177850f * m_ - 0.0040720468f * s_, MIN_L, MAX_L);
+		res.m_a = quantize_oklab16(1.9779984951f * l_ - 2.4285922050f * m_ + 0.4505937099f * s_, MIN_A, MAX_A);
+		res.m_b = quantize_oklab16(0.0259040371f * l_ + 0.7827717662f * m_ - 0.8086757660f * s_, MIN_B, MAX_B);
+		return res;
+	}
+
+	inline Lab srgb_to_oklab(const color_rgba &c) const
 	{
-		vec3F caf(decode_normal(a, params));
-		vec3F cbf(decode_normal(orig, params));
+		const Lab16 l(get_oklab16(c));
+	
+		Lab res;
+		res.L = l.m_L * SCALE_L;
+		res.a = l.m_a * SCALE_A + OFS_A;
+		res.b = l.m_b * SCALE_B + OFS_B;
 
-		float len_a = caf.length();
-		if (len_a != 0)
-			caf /= len_a;
+		return res;
+	}
 
-		float len_b = cbf.length();
-		if (len_b != 0)
-			cbf /= len_b;
+	inline Lab16 get_oklab16(const color_rgba& c) const
+	{
+		RDO_PNG_COUNT_OKLAB_LOOKUP(1);
 
-		float dot = caf.dot(cbf);
-		
-#if RDO_PNG_USE_APPROX_ACOS
-		float ang_err = approx_acos(dot);
-#else
-		float ang_err = acosf(clamp<float>(dot, -1.0f, 1.0f)) * RAD_TO_DEG;
-#endif
-								
-		float len_err = fabsf(len_a - 1.0f);
-		// If the length is close enough to 1.0 then don't incentivize the encoder to reduce it.
-		const float LEN_ERR_THRESH = .1f;
-		if (len_err < LEN_ERR_THRESH)
-			len_err = 0.0f;
-		else
-			len_err -= LEN_ERR_THRESH;
-		len_err *= 255.0f;
+		if (m_compact)
+			return compute_oklab16(c);
 
-		const float ANG_ERR_SCALE = 4.0f; // normalization factor, so lambda is roughly comparable to -linear
-		const float LEN_ERR_SCALE = .1f; // prevent the encoder from over-optimizing for length=1.0
-		dist = square(ang_err) * ANG_ERR_SCALE + square(len_err) * LEN_ERR_SCALE;
+		return m_pSrgb_to_oklab16[c.r + c.g * 256 + c.b * 65536];
+	}
 
-		if (num_comps == 4)
+#if RDO_PNG_USE_SSE2
+	// The Lab16 components of 4 colors, scaled by SCALE_L. The same values as get_oklab16(), with the compact conversion done 4 colors at a time.
+	inline void get_oklab16_norm_x4(const color_rgba* p, __m128& L, __m128& a, __m128& b) const
+	{
+		const __m128 scale_l = _mm_set1_ps(SCALE_L);
+
+		RDO_PNG_COUNT_OKLAB_LOOKUP(4);
+
+		if (!m_compact)
 		{
-			int da = (int)a[3] - (int)orig[3];
-			dist += (float)params.m_chan_weights[3] * square((float)da);
+			const Lab16& l0 = m_pSrgb_to_oklab16[p[0].r + p[0].g * 256 + p[0].b * 65536];
+			const Lab16& l1 = m_pSrgb_to_oklab16[p[1].r + p[1].g * 256 + p[1].b * 65536];
+			const Lab16& l2 = m_pSrgb_to_oklab16[p[2].r + p[2].g * 256 + p[2].b * 65536];
+			const Lab16& l3 = m_pSrgb_to_oklab16[p[3].r + p[3].g * 256 + p[3].b * 65536];
+
+			L = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(l0.m_L, l1.m_L, l2.m_L, l3.m_L)), scale_l);
+			a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(l0.m_a, l1.m_a, l2.m_a, l3.m_a)), scale_l);
+			b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(l0.m_b, l1.m_b, l2.m_b, l3.m_b)), scale_l);
+			return;
 		}
-	}
-	else if (params.m_perceptual_error)
-	{
-		Lab la = srgb_to_oklab_norm(a);
-		Lab lb = srgb_to_oklab_norm(orig);
 
-		la.L -= lb.L;
-		la.a -= lb.a;
-		la.b -= lb.b;
-						
-		float L_d = la.L * la.L;
-		float a_d = la.a * la.a;
-		float b_d = la.b * la.b;
+		const __m128 r = _mm_setr_ps(m_srgb_to_linear[p[0].r], m_srgb_to_linear[p[1].r], m_srgb_to_linear[p[2].r], m_srgb_to_linear[p[3].r]);
+		const __m128 g = _mm_setr_ps(m_srgb_to_linear[p[0].g], m_srgb_to_linear[p[1].g], m_srgb_to_linear[p[2].g], m_srgb_to_linear[p[3].g]);
+		const __m128 bl = _mm_setr_ps(m_srgb_to_linear[p[0].b], m_srgb_to_linear[p[1].b], m_srgb_to_linear[p[2].b], m_srgb_to_linear[p[3].b]);
 
-		L_d *= params.m_chan_weights_lab[0];
-		a_d *= params.m_chan_weights_lab[1];
-		b_d *= params.m_chan_weights_lab[2];
-						
-		dist = L_d + a_d + b_d;
-	
-		// TODO: Scales the error to bring it into a range where lambda will be roughly comparable to plain MSE.
-		const float NORM_ERROR_SCALE = 350000.0f;
-		dist *= NORM_ERROR_SCALE;
+		// Same operation order as compute_oklab16(), so the results are bit identical.
+		auto dot3 = [](__m128 x, __m128 y, __m128 z, float cx, float cy, float cz)
+		{
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(cx), x), _mm_mul_ps(_mm_set1_ps(cy), y)), _mm_mul_ps(_mm_set1_ps(cz), z));
+		};
 
-		if (num_comps == 4)
+		auto cbrt4 = [this](__m128 x)
 		{
-			int da = (int)a[3] - (int)orig[3];
-			dist += params.m_chan_weights_lab[3] * square((float)da);
-		}
-	}
-	else if (params.m_use_chan_weights)
-	{
-		int dr = (int)a[0] - (int)orig[0];
-		int dg = (int)a[1] - (int)orig[1];
-		int db = (int)a[2] - (int)orig[2];
+			const __m128i bits = _mm_castps_si128(x);
+			const __m128i is_pos = _mm_cmpgt_epi32(bits, _mm_setzero_si128());
 
-		uint32_t idist = (uint32_t)(params.m_chan_weights[0] * (uint32_t)(dr * dr) + params.m_chan_weights[1] * (uint32_t)(dg * dg) + params.m_chan_weights[2] * (uint32_t)(db * db));
-		if (num_comps == 4)
+			int32_t e[4], m[4];
+			_mm_storeu_si128((__m128i*)e, _mm_and_si128(_mm_srli_epi32(bits, 23), is_pos));
+			_mm_storeu_si128((__m128i*)m, _mm_and_si128(_mm_srli_epi32(bits, 23 - CBRT_MANTISSA_BITS), _mm_set1_epi32(CBRT_TABLE_SIZE - 1)));
+
+			const __m128 frac = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(bits, _mm_set1_epi32((1 << (23 - CBRT_MANTISSA_BITS)) - 1))), _mm_set1_ps(1.0f / (1 << (23 - CBRT_MANTISSA_BITS))));
+			const __m128 exp_root = _mm_setr_ps(m_cbrt_exp[e[0]], m_cbrt_exp[e[1]], m_cbrt_exp[e[2]], m_cbrt_exp[e[3]]);
+			const __m128 base = _mm_setr_ps(m_cbrt_base[m[0]], m_cbrt_base[m[1]], m_cbrt_base[m[2]], m_cbrt_base[m[3]]);
+			const __m128 slope = _mm_setr_ps(m_cbrt_slope[m[0]], m_cbrt_slope[m[1]], m_cbrt_slope[m[2]], m_cbrt_slope[m[3]]);
+
+			return _mm_and_ps(_mm_castsi128_ps(is_pos), _mm_mul_ps(exp_root, _mm_add_ps(base, _mm_mul_ps(slope, frac))));
+		};
+
+		auto quantize = [&scale_l](__m128 v, float lo, float hi)
 		{
-			int da = (int)a[3] - (int)orig[3];
-			idist += params.m_chan_weights[3] * (uint32_t)(da * da);
-		}
+			v = _mm_mul_ps(_mm_sub_ps(v, _mm_set1_ps(lo)), _mm_set1_ps(65535.0f / (hi - lo)));
+			v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(65535.0f));
+			return _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(.5f)))), scale_l);
+		};
+
+		const __m128 l_ = cbrt4(dot3(r, g, bl, 0.4122214708f, 0.5363325363f, 0.0514459929f));
+		const __m128 m_ = cbrt4(dot3(r, g, bl, 0.2119034982f, 0.6806995451f, 0.1073969566f));
+		const __m128 s_ = cbrt4(dot3(r, g, bl, 0.0883024619f, 0.2817188376f, 0.6299787005f));
+
+		L = quantize(dot3(l_, m_, s_, 0.2104542553f, 0.7936177850f, -0.0040720468f), MIN_L, MAX_L);
+		a = quantize(dot3(l_, m_, s_, 1.9779984951f, -2.4285922050f, 0.4505937099f), MIN_A, MAX_A);
+		b = quantize(dot3(l_, m_, s_, 0.0259040371f, 0.7827717662f, -0.8086757660f), MIN_B, MAX_B);
+	}
+#endif
 
-		dist = (float)idist;
+	// Bounds of the Lab16 colors over the 4x4x4 (or with the compact conversion 8x8x8) block of colors containing (r,g,b).
+	inline const Lab16_bounds& get_oklab16_bounds(uint32_t r, uint32_t g, uint32_t b) const
+	{
+		const uint32_t shift = m_bounds_block_shift, dim = 256 >> shift;
+		return m_oklab16_bounds[(r >> shift) + (g >> shift) * dim + (b >> shift) * dim * dim];
 	}
-	else
+
+	// log2 of the bounds table's block size.
+	inline uint32_t get_oklab16_bounds_block_shift() const { return m_bounds_block_shift; }
+
+	inline Lab srgb_to_oklab_norm(const color_rgba& c) const
 	{
-		int dr = (int)a[0] - (int)orig[0];
-		int dg = (int)a[1] - (int)orig[1];
-		int db = (int)a[2] - (int)orig[2];
+		const Lab16 l(get_oklab16(c));
 
-		uint32_t idist = (uint32_t)(dr * dr + dg * dg + db * db);
-		if (num_comps == 4)
+		Lab res;
+		res.L = l.m_L * SCALE_L;
+		res.a = l.m_a * SCALE_L;
+		res.b = l.m_b * SCALE_L;
+
+		return res;
+	}
+
+	inline float approx_acos(float f) const
+	{
+		const bool is_neg = f < 0.0f;
+		f = clamp(fabs(f), 0.0f, 1.0f);
+		
+		float r;
+		// Use Taylor at low angles, otherwise table+bilinear.
+		if (f >= ACOS_LOW_ANGLE_THRESHOLD)
 		{
-			int da = (int)a[3] - (int)orig[3];
-			idist += da * da;
+			r = sqrtf(2.0f * (1.0f - f)) * RAD_TO_DEG;
+		}
+		else
+		{
+			float fract = f - floor(f);
+			int index = (int)(f * (ACOS_LOOKUP_SIZE - 1));
+			assert(index < ACOS_LOOKUP_SIZE);
+			r = m_acos_lookup[index] * (1.0f - fract) + m_acos_lookup[index + 1] * fract;
 		}
 
-		dist = (float)idist;
+		return is_neg ? (180.0f - r) : r;
 	}
 
-	return dist;
-}
+	// decode_normal_comp() of each 8-bit value, for UNORM8 or SNORM8 normals.
+	inline const float* get_normal_decode(bool snorm8) const { return m_normal_decode[snorm8]; }
 
-static inline bool should_reject(const color_rgba& trial_color, const color_rgba& orig_color, uint32_t num_comps, const rdo_png_params& params)
-{
-	if ((params.m_transparent_reject_test) && (num_comps == 4))
+private:
+	bool m_compact;
+	uint32_t m_bounds_block_shift;
+	float m_srgb_to_linear[256];
+	float m_cbrt_exp[256];
+	float m_cbrt_base[CBRT_TABLE_SIZE], m_cbrt_slope[CBRT_TABLE_SIZE];
+	const Lab16* m_pSrgb_to_oklab16; // the 256^3 Oklab table, either m_srgb_to_oklab16 or the table in m_oklab_cache
+	basisu::vector<Lab16> m_srgb_to_oklab16; // only used if the table had to be computed
+	read_only_file_mapping m_oklab_cache;
+	basisu::vector<Lab16_bounds> m_oklab16_bounds;
+	float m_acos_lookup[ACOS_LOOKUP_SIZE + 1];
+	float m_normal_decode[2][256];
+
+	void init_srgb_to_linear()
 	{
-		if ((orig_color[3] == 0) && (trial_color[3] > 0))
-			return true;
-
-		if ((orig_color[3] == 255) && (trial_color[3] < 255))
-			return true;
+		for (uint32_t i = 0; i < 256; i++)
+			m_srgb_to_linear[i] = f_inv(i / 255.0f);
 	}
 
-	if (params.m_use_reject_thresholds)
+	void init_cbrt_tables()
 	{
-		if (params.m_perceptual_error)
+		// Exponent 0 is zero or a denormal, and 255 is inf/NaN.
+		m_cbrt_exp[0] = 0.0f;
+		for (int e = 1; e < 256; e++)
+			m_cbrt_exp[e] = (float)exp2((e - 127) / 3.0);
+
+		for (uint32_t i = 0; i < CBRT_TABLE_SIZE; i++)
 		{
-			Lab t(srgb_to_oklab_norm(trial_color));
-			Lab o(srgb_to_oklab_norm(orig_color));
+			const double lo = cbrt(1.0 + (double)i / CBRT_TABLE_SIZE), hi = cbrt(1.0 + (double)(i + 1) / CBRT_TABLE_SIZE);
+			m_cbrt_base[i] = (float)lo;
+			m_cbrt_slope[i] = (float)(hi - lo);
+		}
+	}
 
-			float L_diff = fabs(t.L - o.L);
-									
-			if (L_diff > params.m_reject_thresholds_lab[0])
-				return true;
+	// Maps the table from the oklab.bin cache file in the executable's directory, if it's there and valid. Otherwise the table is computed, and written
+	// to the cache file. The file is mapped read only, so every rdopng process on the machine shares one copy of it.
+	void init_oklab_table(const char *pExec, bool quiet, bool caching_enabled, uint32_t num_threads)
+	{
+		std::string path;
 
-			float ab_dist = squaref(t.a - o.a) + squaref(t.b - o.b);
-			
-			if (ab_dist > (params.m_reject_thresholds_lab[1] * params.m_reject_thresholds_lab[1]))
-				return true;
+		if (caching_enabled)
+		{
+			string_get_pathname(pExec, path);
+			path += "oklab.bin";
 
-			if (num_comps == 4)
+			if (m_oklab_cache.open(path.c_str()))
 			{
-				uint32_t delta_a = abs((int)trial_color[3] - (int)orig_color[3]);
-				if (delta_a > params.m_reject_thresholds[3])
-					return true;
+				if (is_valid_oklab_cache(m_oklab_cache.get_ptr(), m_oklab_cache.get_size()))
+				{
+					m_pSrgb_to_oklab16 = (const Lab16*)(m_oklab_cache.get_ptr() + sizeof(oklab_cache_header));
+					if (!quiet)
+						printf("Mapped Oklab table data from file %s\n", path.c_str());
+					return;
+				}
+
+				m_oklab_cache.close();
+
+				if (!quiet)
+					printf("Oklab table file %s is invalid or out of date\n", path.c_str());
 			}
 		}
-		else
-		{
-			uint32_t delta_r = abs((int)trial_color[0] - (int)orig_color[0]);
-			uint32_t delta_g = abs((int)trial_color[1] - (int)orig_color[1]);
-			uint32_t delta_b = abs((int)trial_color[2] - (int)orig_color[2]);
+	
+		m_srgb_to_oklab16.resize(256 * 256 * 256);
+		m_pSrgb_to_oklab16 = m_srgb_to_oklab16.data();
 
-			if (delta_r > params.m_reject_thresholds[0])
-				return true;
-			if (delta_g > params.m_reject_thresholds[1])
-				return true;
-			if (delta_b > params.m_reject_thresholds[2])
-				return true;
+		if (!quiet)
+			printf("Computing Oklab table\n");
 
-			if (num_comps == 4)
+		interval_timer tm;
+		tm.start();
+
+		compute_oklab_table(num_threads);
+
+		if (!quiet)
+			printf("Computed Oklab table in %3.3f secs on %u threads\n", tm.get_elapsed_secs(), num_threads);
+
+		if (caching_enabled)
+		{
+			if (write_oklab_cache(path))
 			{
-				uint32_t delta_a = abs((int)trial_color[3] - (int)orig_color[3]);
-				if (delta_a > params.m_reject_thresholds[3])
-					return true;
+				if (!quiet)
+					printf("Wrote oklab lookup table to file %s\n", path.c_str());
+			}
+			else
+			{
+				fprintf(stderr, "Failed writing oklab lookup table to file %s\n", path.c_str());
 			}
 		}
 	}
 
-	return false;
-}
-
-static inline int compute_png_match_dist(int xa, int ya, int xb, int yb, int width, int height, int num_comps)
-{
-	return (xa * num_comps + (ya * (width * num_comps + 1))) - (xb * num_comps + (yb * (width * num_comps + 1)));
-}
+	// Fills m_srgb_to_oklab16, one job per blue value (each one a contiguous 384KB slice of the table) on num_threads threads.
+	void compute_oklab_table(uint32_t num_threads)
+	{
+		if (num_threads > 1)
+		{
+			job_pool pool(num_threads);
+			for (uint32_t b = 0; b < 256; b++)
+				pool.add_job([this, b] { compute_oklab_table_slice(b); });
+			pool.wait_for_all();
+		}
+		else
+		{
+			for (uint32_t b = 0; b < 256; b++)
+				compute_oklab_table_slice(b);
+		}
+	}
 
-static void find_optimal1(
-	color_rgba& best_delta_color, float& best_bits, float& best_squared_err, float& best_t, uint32_t& best_type,
-	uint32_t x, uint32_t y,
-	const image& orig_img, const image& coded_img, const image& delta_img,
-	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1, 
-	const vector2D<float>& smooth_block_mse_scales,
-	uint32_t filter, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
-{
-	const uint32_t width = orig_img.get_width(), height = orig_img.get_height();
+	static inline uint16_t quantize_oklab_table_entry(float v, float lo, float hi)
+	{
+		return (uint16_t)clamp(std::round(((v - lo) / (hi - lo)) * 65535.0f), 0.0f, 65535.0f);
+	}
 
-	color_rgba orig_color(orig_img(x, y));
-	color_rgba orig_delta_color(png_predict(orig_color, x, y, coded_img, filter, num_comps));
+#if RDO_PNG_USE_SSE2
+	// Cube roots of 4 positive floats (0 for x <= 0), correctly rounded like linear_srgb_to_oklab()'s.
+	// A bit trick estimate is refined by two Newton steps in float, then two in double.
+	static inline __m128 cbrt_ps(__m128 x)
+	{
+		const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+		const __m128 is_pos = _mm_cmpgt_ps(x, _mm_setzero_ps());
+		const __m128 xs = _mm_or_ps(_mm_and_ps(is_pos, x), _mm_andnot_ps(is_pos, _mm_set1_ps(1.0f)));
 
-	best_delta_color = orig_delta_color;
-	best_bits = (float)(h0.get_code_sizes()[best_delta_color[0]] + h0.get_code_sizes()[best_delta_color[1]] + h0.get_code_sizes()[best_delta_color[2]]);
-	if (num_comps == 4)
-		best_bits += (float)h0.get_code_sizes()[best_delta_color[3]];
+		__m128 y = _mm_castsi128_ps(_mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(xs)), third)), _mm_set1_epi32(709921077)));
 
-	best_t = best_bits * lambda;
-	best_squared_err = 0;
-	best_type = 0;
+		for (uint32_t i = 0; i < 2; i++)
+			y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(y, y), _mm_div_ps(xs, _mm_mul_ps(y, y))), third);
 
-	if (!params.m_match_only)
-	{
-		bool all_zero = true;
-		if (orig_delta_color.r + orig_delta_color.g + orig_delta_color.b)
-			all_zero = false;
-		if ((num_comps == 4) && orig_delta_color.a)
-			all_zero = false;
+		const __m128d third_d = _mm_set1_pd(1.0 / 3.0);
+		__m128d x_lo = _mm_cvtps_pd(xs), x_hi = _mm_cvtps_pd(_mm_movehl_ps(xs, xs));
+		__m128d y_lo = _mm_cvtps_pd(y), y_hi = _mm_cvtps_pd(_mm_movehl_ps(y, y));
 
-		if (!all_zero)
+		for (uint32_t i = 0; i < 2; i++)
 		{
-			for (uint32_t t = 1; t < ((num_comps == 4) ? 16U : 8U); t++)
-			{
-				color_rgba delta_color(orig_delta_color);
-				for (uint32_t c = 0; c < num_comps; c++)
-				{
-					if (t & (1 << c))
-					{
-						int8_t v = (int8_t)delta_color[c];
-						if (v < 0)
-							delta_color[c]++;
-						else if (v > 0)
-							delta_color[c]--;
-					}
-				}
+			y_lo = _mm_mul_pd(_mm_add_pd(_mm_add_pd(y_lo, y_lo), _mm_div_pd(x_lo, _mm_mul_pd(y_lo, y_lo))), third_d);
+			y_hi = _mm_mul_pd(_mm_add_pd(_mm_add_pd(y_hi, y_hi), _mm_div_pd(x_hi, _mm_mul_pd(y_hi, y_hi))), third_d);
+		}
 
-				color_rgba trial_coded_color(png_unpredict(delta_color, x, y, coded_img, filter, num_comps));
+		return _mm_and_ps(is_pos, _mm_movelh_ps(_mm_cvtpd_ps(y_lo), _mm_cvtpd_ps(y_hi)));
+	}
 
-				if (!should_reject(trial_coded_color, orig_color, num_comps, params))
-				{
-					float mse = compute_se(trial_coded_color, orig_color, num_comps, params);
-					float bits = (float)(h0.get_code_sizes()[delta_color[0]] + h0.get_code_sizes()[delta_color[1]] + h0.get_code_sizes()[delta_color[2]]);
-					if (num_comps == 4)
-						bits += (float)h0.get_code_sizes()[delta_color[3]];
+	// Same as quantize_oklab_table_entry() on 4 values. std::round() rounds halves away from zero, and negative values clamp to 0 either way.
+	static inline __m128i quantize_oklab_table_entries(__m128 v, float lo, float hi)
+	{
+		v = _mm_mul_ps(_mm_div_ps(_mm_sub_ps(v, _mm_set1_ps(lo)), _mm_set1_ps(hi - lo)), _mm_set1_ps(65535.0f));
+		v = _mm_min_ps(v, _mm_set1_ps(65535.0f));
 
-					float trial_t = smooth_block_mse_scales(x, y) * mse + bits * lambda;
-					if (trial_t < best_t)
-					{
-						best_delta_color = delta_color;
-						best_t = trial_t;
-						best_bits = bits;
-						best_squared_err = mse;
-						best_type = 1;
-					}
-				}
-			}
-		}
+		__m128i i = _mm_cvttps_epi32(v);
+		const __m128 round_up = _mm_cmpge_ps(_mm_sub_ps(v, _mm_cvtepi32_ps(i)), _mm_set1_ps(.5f));
+		i = _mm_sub_epi32(i, _mm_castps_si128(round_up));
+
+		return _mm_andnot_si128(_mm_cmplt_epi32(i, _mm_setzero_si128()), i);
 	}
+#endif
 
-	for (int yd = 0; yd < (int)pLevel->m_num_scanlines_to_check; yd++)
+	void compute_oklab_table_slice(uint32_t b)
 	{
-		if (((int)y - yd) < 0)
-			break;
+		Lab16* pDst = &m_srgb_to_oklab16[b * 65536];
 
-		int x_start, x_end;
-		const int total_passes = ((yd == 1) && !pLevel->m_exhaustive_search) ? 2 : 1;
-		for (int pass = 0; pass < total_passes; pass++)
+		for (uint32_t g = 0; g <= 255; g++, pDst += 256)
 		{
-			if (pLevel->m_exhaustive_search)
+#if RDO_PNG_USE_SSE2
+			// 4 reds at a time, with the same operation order as linear_srgb_to_oklab().
+			const __m128 lg = _mm_set1_ps(m_srgb_to_linear[g]), lb = _mm_set1_ps(m_srgb_to_linear[b]);
+
+			auto dot3 = [](__m128 x, __m128 y, __m128 z, float cx, float cy, float cz)
 			{
-				x_end = yd ? ((int)width - 1) : ((int)x - 1);
-				x_start = 0;
-			}
-			else
+				return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(cx), x), _mm_mul_ps(_mm_set1_ps(cy), y)), _mm_mul_ps(_mm_set1_ps(cz), z));
+			};
+
+			for (uint32_t r = 0; r <= 255; r += 4)
 			{
-				if (!yd)
-				{
-					if (x < 1)
-						continue;
+				const __m128 lr = _mm_loadu_ps(&m_srgb_to_linear[r]);
 
-					x_start = maximum<int>((int)x - pLevel->m_search_dist * 2, 0);
-					x_end = maximum<int>((int)x - 1, 0);
-				}
-				else if ((yd == 1) && (pass == 0))
-				{
-					if (width <= (uint32_t)pLevel->m_search_dist*2)
-						continue;
+				const __m128 l_ = cbrt_ps(dot3(lr, lg, lb, 0.4122214708f, 0.5363325363f, 0.0514459929f));
+				const __m128 m_ = cbrt_ps(dot3(lr, lg, lb, 0.2119034982f, 0.6806995451f, 0.1073969566f));
+				const __m128 s_ = cbrt_ps(dot3(lr, lg, lb, 0.0883024619f, 0.2817188376f, 0.6299787005f));
 
-					x_start = maximum<int>((int)width - pLevel->m_search_dist, 0);
-					x_end = width - 1;
-				}
-				else
+				int32_t L[4], A[4], B[4];
+				_mm_storeu_si128((__m128i*)L, quantize_oklab_table_entries(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2104542553f), l_), _mm_mul_ps(_mm_set1_ps(0.7936177850f), m_)), _mm_mul_ps(_mm_set1_ps(0.0040720468f), s_)), MIN_L, MAX_L));
+				_mm_storeu_si128((__m128i*)A, quantize_oklab_table_entries(dot3(l_, m_, s_, 1.9779984951f, -2.4285922050f, 0.4505937099f), MIN_A, MAX_A));
+				_mm_storeu_si128((__m128i*)B, quantize_oklab_table_entries(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.0259040371f), l_), _mm_mul_ps(_mm_set1_ps(0.7827717662f), m_)), _mm_mul_ps(_mm_set1_ps(0.8086757660f), s_)), MIN_B, MAX_B));
+
+				for (uint32_t i = 0; i < 4; i++)
 				{
-					x_start = maximum<int>((int)x - pLevel->m_search_dist, 0);
-					x_end = minimum<int>((int)x + pLevel->m_search_dist, (int)width - 1);
+					Lab16& v = pDst[r + i];
+					v.m_L = (uint16_t)L[i];
+					v.m_a = (uint16_t)A[i];
+					v.m_b = (uint16_t)B[i];
 				}
 			}
-
-			for (int xd = x_end; xd >= x_start; xd--)
+#else
+			for (uint32_t r = 0; r <= 255; r++)
 			{
-				assert(xd < (int)width);
-				assert((yd != 0) || (xd < (int)x));
+				Lab l(linear_srgb_to_oklab({ m_srgb_to_linear[r], m_srgb_to_linear[g], m_srgb_to_linear[b] }));
 
-				const uint32_t match_dist = compute_png_match_dist(x, y, xd, y - yd, width, height, num_comps);
-				assert(match_dist >= 3);
+				assert(l.L >= MIN_L && l.L <= MAX_L);
+				assert(l.a >= MIN_A && l.a <= MAX_A);
+				assert(l.b >= MIN_B && l.b <= MAX_B);
 
-				color_rgba delta_color(delta_img(xd, y - yd));
+				Lab16& v = pDst[r];
+				v.m_L = quantize_oklab_table_entry(l.L, MIN_L, MAX_L);
+				v.m_a = quantize_oklab_table_entry(l.a, MIN_A, MAX_A);
+				v.m_b = quantize_oklab_table_entry(l.b, MIN_B, MAX_B);
+			}
+#endif
+		}
+	}
 
-				color_rgba trial_coded_color(png_unpredict(delta_color, x, y, coded_img, filter, num_comps));
-				
-				float mse = compute_se(trial_coded_color, orig_img(x, y), num_comps, params);
-				float bits = (float)compute_match_cost(match_dist, num_comps, h0, h1);
-				float trial_t = smooth_block_mse_scales(x, y) * mse + bits * lambda;
-				if (trial_t < best_t)
-				{
-					if (!should_reject(trial_coded_color, orig_color, num_comps, params))
-					{
-						best_delta_color = delta_img(xd, y - yd);
-						best_t = trial_t;
-						best_bits = bits;
-						best_squared_err = mse;
-						best_type = 2;
-					}
-				}
+	static bool is_valid_oklab_cache(const uint8_t* pData, size_t size)
+	{
+		if (size != sizeof(oklab_cache_header) + OKLAB_TABLE_SIZE_IN_BYTES)
+			return false;
 
-			} // xd
+		oklab_cache_header hdr;
+		memcpy(&hdr, pData, sizeof(hdr));
 
-		} // pass
+		if ((hdr.m_sig != OKLAB_CACHE_SIG) || (hdr.m_version != OKLAB_CACHE_VERSION) || (hdr.m_header_size != sizeof(oklab_cache_header)) || (hdr.m_table_size != OKLAB_TABLE_SIZE_IN_BYTES))
+			return false;
 
-	} // yd
-}
+		return hdr.m_table_checksum == compute_oklab_cache_checksum(pData + sizeof(oklab_cache_header), OKLAB_TABLE_SIZE_IN_BYTES);
+	}
 
-static void find_optimal_n(
-	int n,
-	color_rgba* pBest_delta_colors, float& best_bits, float& best_squared_err, float& best_t, 
-	uint32_t x, uint32_t y,
-	const image& orig_img, image& coded_img, const image& delta_img,
-	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1, 
-	const vector2D<float>& smooth_block_mse_scales,
-	uint32_t filter, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
-{
-	assert(n >= 1 && n <= MAX_DELTA_COLORS);
-	const uint32_t width = orig_img.get_width(), height = orig_img.get_height();
-	const float oon = 1.0f / (float)n;
-	
-	for (int yd = 0; yd < (int)pLevel->m_num_scanlines_to_check; yd++)
+	// Writes the table to a temporary file next to path, then renames it over path. Processes racing to create the cache each write their own
+	// temporary file, and readers only ever see a complete file.
+	bool write_oklab_cache(const std::string& path) const
 	{
-		if (((int)y - yd) < 0)
-			break;
+		oklab_cache_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.m_sig = OKLAB_CACHE_SIG;
+		hdr.m_version = OKLAB_CACHE_VERSION;
+		hdr.m_header_size = sizeof(oklab_cache_header);
+		hdr.m_table_size = OKLAB_TABLE_SIZE_IN_BYTES;
+		hdr.m_table_checksum = compute_oklab_cache_checksum((const uint8_t*)m_srgb_to_oklab16.data(), OKLAB_TABLE_SIZE_IN_BYTES);
+
+#ifdef _WIN32
+		const std::string temp_path(path + ".tmp" + std::to_string(GetCurrentProcessId()));
+#else
+		const std::string temp_path(path + ".tmp" + std::to_string(getpid()));
+#endif
 
-		int x_start, x_end;
-		const int total_passes = ((yd == 1) && !pLevel->m_exhaustive_search) ? 2 : 1;
-		for (int pass = 0; pass < total_passes; pass++)
+		FILE* pFile = fopen(temp_path.c_str(), "wb");
+		if (!pFile)
+			return false;
+
+		bool success = (fwrite(&hdr, sizeof(hdr), 1, pFile) == 1) && (fwrite(m_srgb_to_oklab16.data(), OKLAB_TABLE_SIZE_IN_BYTES, 1, pFile) == 1);
+		success = (fclose(pFile) == 0) && success;
+
+#ifdef _WIN32
+		// Fails if another process has the old cache file mapped, in which case the next run replaces it.
+		success = success && (MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+		success = success && (rename(temp_path.c_str(), path.c_str()) == 0);
+#endif
+
+		if (!success)
+			remove(temp_path.c_str());
+
+		return success;
+	}
+
+	void init_oklab_bounds()
+	{
+		const uint32_t shift = m_bounds_block_shift, dim = 256 >> shift;
+
+		m_oklab16_bounds.resize(dim * dim * dim);
+
+		for (uint32_t i = 0; i < m_oklab16_bounds.size(); i++)
 		{
-			if (pLevel->m_exhaustive_search)
-			{
-				x_end = yd ? ((int)width - n) : ((int)x - n);
-				x_start = 0;
-			}
-			else
-			{
-				if (!yd)
-				{
-					if ((int)x < n)
-						continue;
+			Lab16_bounds& bounds = m_oklab16_bounds[i];
+			bounds.m_lo.m_L = UINT16_MAX; bounds.m_lo.m_a = UINT16_MAX; bounds.m_lo.m_b = UINT16_MAX;
+			bounds.m_hi.m_L = 0; bounds.m_hi.m_a = 0; bounds.m_hi.m_b = 0;
+		}
 
-					x_start = maximum<int>((int)x - pLevel->m_search_dist * 2, 0);
-					x_end = maximum<int>((int)x - n, 0);
-				}
-				else if ((yd == 1) && (pass == 0))
-				{
-					if (width <= (uint32_t)pLevel->m_search_dist * 2)
-						continue;
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			for (uint32_t g = 0; g < 256; g++)
+			{
+				Lab16_bounds* pBounds = &m_oklab16_bounds[(g >> shift) * dim + (b >> shift) * dim * dim];
 
-					x_start = maximum<int>((int)width - pLevel->m_search_dist, 0);
-					x_end = width - n;
-				}
-				else
+				for (uint32_t r = 0; r < 256; r++)
 				{
-					x_start = maximum<int>((int)x - pLevel->m_search_dist, 0);
-					x_end = minimum<int>((int)x + pLevel->m_search_dist, (int)width - n);
+					const Lab16 l(get_oklab16(color_rgba(r, g, b, 255)));
+					Lab16_bounds& bounds = pBounds[r >> shift];
+
+					bounds.m_lo.m_L = minimum(bounds.m_lo.m_L, l.m_L);
+					bounds.m_lo.m_a = minimum(bounds.m_lo.m_a, l.m_a);
+					bounds.m_lo.m_b = minimum(bounds.m_lo.m_b, l.m_b);
+					bounds.m_hi.m_L = maximum(bounds.m_hi.m_L, l.m_L);
+					bounds.m_hi.m_a = maximum(bounds.m_hi.m_a, l.m_a);
+					bounds.m_hi.m_b = maximum(bounds.m_hi.m_b, l.m_b);
 				}
 			}
+		}
+	}
 
-			for (int xd = x_end; xd >= x_start; xd--)
-			{
-				assert((xd + n - 1) < (int)width);
-				assert((yd != 0) || ((xd + n - 1) < (int)x));
+	void init_acos_lookup()
+	{
+		for (uint32_t i = 0; i < ACOS_LOOKUP_SIZE; i++)
+			m_acos_lookup[i] = acos((float)i / (float)(ACOS_LOOKUP_SIZE - 1)) * RAD_TO_DEG;
 
-				const uint32_t match_dist = compute_png_match_dist(x, y, xd, y - yd, width, height, num_comps);
-				assert(match_dist >= 3);
+		m_acos_lookup[ACOS_LOOKUP_SIZE] = m_acos_lookup[ACOS_LOOKUP_SIZE - 1];
 
-				color_rgba delta_color[MAX_DELTA_COLORS];
-				for (uint32_t i = 0; i < (uint32_t)n; i++)
-					delta_color[i] = delta_img(xd + i, y - yd);
+#if 0
+		double tot_err = 0;
+		const uint32_t N = 32768;
+		double max_err = 0;
+		for (uint32_t i = 0; i < N; i++)
+		{
+			float f = ((float)i / (float)(N - 1)) * 2.0f - 1.0f;
+			float err = approx_acos(f) - acos(f) * RAD_TO_DEG;
+			printf("%f %f %f %f\n", f, approx_acos(f), acos(f) * RAD_TO_DEG, err);
+			tot_err += fabs(err);
+			max_err = maximum<double>(max_err, fabs(err));
+		}
+		printf("Total err: %f, avg: %f, max: %f\n", tot_err, tot_err / N, max_err);
+		exit(0);
+#endif
+	}
 
-				color_rgba trial_coded_color[MAX_DELTA_COLORS];
-				for (uint32_t i = 0; i < (uint32_t)n; i++)
-				{
-					trial_coded_color[i] = png_unpredict(delta_color[i], x + i, y, coded_img, filter, num_comps);
-					coded_img(x + i, y) = trial_coded_color[i];
-				}
+	void init_normal_decode()
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			m_normal_decode[0][i] = decode_normal_comp(i, false);
+			m_normal_decode[1][i] = decode_normal_comp(i, true);
+		}
+	}
+};
 
-				float se = 0.0f;
-				for (uint32_t i = 0; i < (uint32_t)n; i++)
-					se += compute_se(trial_coded_color[i], orig_img(x + i, y), num_comps, params);
+// Everything an encode needs besides its parameters, which used to be process wide globals: the lookup tables, the collected DEFLATE symbol 
+// statistics and the choice of zlib backend. Concurrent rdo_png()/rdo_qoi()/rdo_lz4i() calls need their own contexts, which can share one encoder_tables.
+class encoder_context
+{
+public:
+	enum zlib_backend
+	{
+		cZlibMiniz,		// fast, and collects DEFLATE symbol statistics
+		cZlibLodePNG	// slower, but compresses better
+	};
 
-				float mse = se * oon;
+	encoder_context(const encoder_tables& tables) : 
+		m_tables(tables)
+	{
+		clear_deflate_stats();
+	}
 
-				float bits = (float)compute_match_cost(match_dist, n * num_comps, h0, h1);
+	const encoder_tables& get_tables() const { return m_tables; }
 
-				float mse_scale = 0.0f;
-				for (uint32_t i = 0; i < (uint32_t)n; i++)
-					mse_scale = maximum(mse_scale, smooth_block_mse_scales(x + i, y));
+	void clear_deflate_stats()
+	{
+		memset(m_huff_freq, 0, sizeof(m_huff_freq));
+	}
 
-				float trial_t = mse_scale * mse + bits * lambda;
-				if (trial_t < best_t)
-				{
-					bool reject_flag = false;
-					for (uint32_t i = 0; i < (uint32_t)n; i++)
-					{
-						if (should_reject(trial_coded_color[i], orig_img(x + i, y), num_comps, params))
-						{
-							reject_flag = true;
-							break;
-						}
-					}
-					if (!reject_flag)
-					{
-						for (uint32_t i = 0; i < (uint32_t)n; i++)
-							pBest_delta_colors[i] = delta_color[i];
+	// Literal/length (0) and distance (1) symbol counts of everything deflated by save_png() with cZlibMiniz since the last clear_deflate_stats().
+	const uint64_t* get_deflate_stats(uint32_t table) const { assert(table < 2); return m_huff_freq[table]; }
 
-						best_t = trial_t;
-						best_bits = bits;
-						best_squared_err = se;
-					}
-				}
-			} // xd
+	bool save_png(uint8_vec& output_buf, const image& img, zlib_backend backend, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr)
+	{
+		return basisu::save_png(output_buf, img, image_save_flags, grayscale_comp, -1, pFilters, pFile_size, backend == cZlibMiniz, (backend == cZlibMiniz) ? &m_huff_freq[0][0] : nullptr);
+	}
 
-		} // pass
-	
-	} // yd
-}
+	bool save_png(const char* pFilename, const image& img, zlib_backend backend, uint32_t image_save_flags = 0, uint32_t grayscale_comp = 0, const uint8_t* pFilters = nullptr, uint64_t* pFile_size = nullptr)
+	{
+		return basisu::save_png(pFilename, img, image_save_flags, grayscale_comp, -1, pFilters, pFile_size, backend == cZlibMiniz, (backend == cZlibMiniz) ? &m_huff_freq[0][0] : nullptr);
+	}
 
-static float compute_image_metrics(const image& a, const image& b, uint32_t num_comps, float& y_psnr, bool print)
-{
-	image_metrics im;
-	im.calc(a, b, 0, 3);
-	if (print)
-		im.print("RGB    ");
+private:
+	const encoder_tables& m_tables;
 
-	float psnr = im.m_psnr;
+	uint64_t m_huff_freq[2][TDEFL_MAX_HUFF_SYMBOLS];
+};
 
-	if (num_comps == 4)
-	{
-		im.calc(a, b, 0, 4);
-		if (print)
-			im.print("RGBA   ");
+// The error metric compute_se() and should_reject() use. The candidate search loops are instantiated for each mode and channel count (see 
+// METRIC_KERNEL_TABLE()), and each encode picks its instantiation once, so the kernels don't test the params on every candidate.
+enum metric_mode
+{
+	cMetricRGB,
+	cMetricWeightedRGB,
+	cMetricOklab,
+	cMetricNormalMap,
+	cTotalMetricModes
+};
 
-		psnr = im.m_psnr;
+static inline metric_mode get_metric_mode(const rdo_png_params& params)
+{
+	if (params.m_normal_map)
+		return cMetricNormalMap;
+	if (params.m_perceptual_error)
+		return cMetricOklab;
+	if (params.m_use_chan_weights)
+		return cMetricWeightedRGB;
+	return cMetricRGB;
+}
+
+// A [cTotalMetricModes][2] initializer of func's <MODE, NUM_COMPS> instantiations, indexed by get_metric_mode() and num_comps - 3.
+#define METRIC_KERNEL_TABLE(func) \
+	{ \
+		{ func<cMetricRGB, 3>, func<cMetricRGB, 4> }, \
+		{ func<cMetricWeightedRGB, 3>, func<cMetricWeightedRGB, 4> }, \
+		{ func<cMetricOklab, 3>, func<cMetricOklab, 4> }, \
+		{ func<cMetricNormalMap, 3>, func<cMetricNormalMap, 4> } \
 	}
 
-	if (print)
-	{
-		im.calc(a, b, 0, 1);
-		im.print("R      ");
+// The Oklab color compute_se() and should_reject() compare candidates against. The candidate loops look it up once per original pixel, 
+// instead of once per candidate. It's only needed (and only looked up) with the perceptual metrics. In normal map mode it's the original's 
+// decoded normal instead, normalized (x, y and z in L, a and b), so the normal map metric only has to normalize the trial normals.
+static inline Lab get_orig_lab(const color_rgba& orig, const rdo_png_params& params)
+{
+	const metric_mode mode = get_metric_mode(params);
 
-		im.calc(a, b, 1, 1);
-		im.print("G      ");
+	if (mode == cMetricNormalMap)
+	{
+		const float* pDecode = params.m_pTables->get_normal_decode(params.m_snorm8);
+		vec3F n(pDecode[orig.r], pDecode[orig.g], pDecode[orig.b]);
 
-		im.calc(a, b, 2, 1);
-		im.print("B      ");
+		float len = n.length();
+		if (len != 0)
+			n /= len;
 
-		if (num_comps == 4)
-		{
-			im.calc(a, b, 3, 1);
-			im.print("A      ");
-		}
+		Lab res = { n[0], n[1], n[2] };
+		return res;
 	}
 
-	im.calc(a, b, 0, 0);
-	if (print)
-		im.print("Y 709  ");
-
-	y_psnr = im.m_psnr;
+	if (mode != cMetricOklab)
+	{
+		Lab res = { 0.0f, 0.0f, 0.0f };
+		return res;
+	}
 
-	if (print)
-		printf("\n");
-		
-	return psnr;
+	return params.m_pTables->srgb_to_oklab_norm(orig);
 }
 
-static float compute_normal_map_image_metrics(const image& enc_img, const image& orig_img, bool print_flag, const rdo_png_params& params)
+// The normal map error of a trial normal, given its decoded length len_a and the dot product of its normalized vector with the original's unit normal.
+static inline float compute_normal_map_dist(float dot, float len_a, const rdo_png_params& params)
 {
-	float max_err = -1e+9f, min_err = 1e+9f;
+#if RDO_PNG_USE_APPROX_ACOS
+	float ang_err = params.m_pTables->approx_acos(dot);
+#else
+	float ang_err = acosf(clamp<float>(dot, -1.0f, 1.0f)) * RAD_TO_DEG;
+#endif
+							
+	float len_err = fabsf(len_a - 1.0f);
+	// If the length is close enough to 1.0 then don't incentivize the encoder to reduce it.
+	const float LEN_ERR_THRESH = .1f;
+	if (len_err < LEN_ERR_THRESH)
+		len_err = 0.0f;
+	else
+		len_err -= LEN_ERR_THRESH;
+	len_err *= 255.0f;
 
-	double total_err = 0.0f, total_err2 = 0.0f;
-	running_stat len_a_stats, len_b_stats;
+	const float ANG_ERR_SCALE = 4.0f; // normalization factor, so lambda is roughly comparable to -linear
+	const float LEN_ERR_SCALE = .1f; // prevent the encoder from over-optimizing for length=1.0
+	return square(ang_err) * ANG_ERR_SCALE + square(len_err) * LEN_ERR_SCALE;
+}
 
-	uint32_t total_invalid_a = 0, total_invalid_b = 0;
+// The trial color's Oklab color for the *_lab_t() kernels. Like get_orig_lab(), it's only looked up in the Oklab mode.
+template<metric_mode MODE>
+static inline Lab get_trial_lab_t(const color_rgba& c, const rdo_png_params& params)
+{
+	if (MODE != cMetricOklab)
+	{
+		Lab res = { 0.0f, 0.0f, 0.0f };
+		return res;
+	}
 
-	const float INVALID_LEN_THRESHOLD = .4f;
+	return params.m_pTables->srgb_to_oklab_norm(c);
+}
 
-	for (uint32_t y = 0; y < orig_img.get_height(); y++)
-	{
-		for (uint32_t x = 0; x < orig_img.get_width(); x++)
-		{
-			const color_rgba& ca = enc_img(x, y);
-			const color_rgba& cb = orig_img(x, y);
-						
-			vec3F caf(decode_normal(ca, params));
-			vec3F cbf(decode_normal(cb, params));
-			
-			float len_a = caf.length();
-			len_a_stats.push(len_a);
+// compute_se_t() given a's Oklab color, a_lab = get_trial_lab_t<MODE>(a, params).
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline float compute_se_lab_t(const color_rgba& a, const Lab& a_lab, const color_rgba& orig, const Lab& orig_lab, const rdo_png_params &params)
+{
+	float dist;
 			
-			if (len_a < INVALID_LEN_THRESHOLD)
-				total_invalid_a++;
-			if (len_a > (1.0f + INVALID_LEN_THRESHOLD))
-				total_invalid_a++;
+	if (MODE == cMetricNormalMap)
+	{
+		// orig_lab is the original's unit normal (see get_orig_lab()).
+		const float* pDecode = params.m_pTables->get_normal_decode(params.m_snorm8);
+		vec3F caf(pDecode[a.r], pDecode[a.g], pDecode[a.b]);
 
-			if (len_a != 0)
-				caf /= len_a;
+		float len_a = caf.length();
+		if (len_a != 0)
+			caf /= len_a;
 
-			float len_b = cbf.length();
-			len_b_stats.push(len_b);
+		float dot = caf[0] * orig_lab.L + caf[1] * orig_lab.a + caf[2] * orig_lab.b;
+		
+		dist = compute_normal_map_dist(dot, len_a, params);
 
-			if (len_b < INVALID_LEN_THRESHOLD)
-				total_invalid_b++;
+		if (NUM_COMPS == 4)
+		{
+			int da = (int)a[3] - (int)orig[3];
+			dist += (float)params.m_chan_weights[3] * square((float)da);
+		}
+	}
+	else if (MODE == cMetricOklab)
+	{
+		Lab la(a_lab);
 
-			if (len_b != 0)
-				cbf /= len_b;
+		la.L -= orig_lab.L;
+		la.a -= orig_lab.a;
+		la.b -= orig_lab.b;
+						
+		float L_d = la.L * la.L;
+		float a_d = la.a * la.a;
+		float b_d = la.b * la.b;
 
-			float dot = clamp<float>(caf.dot(cbf), -1.0f, 1.0f);
-			
-			float err_degrees = acosf(dot) * RAD_TO_DEG;
+		L_d *= params.m_chan_weights_lab[0];
+		a_d *= params.m_chan_weights_lab[1];
+		b_d *= params.m_chan_weights_lab[2];
+						
+		dist = L_d + a_d + b_d;
+	
+		// TODO: Scales the error to bring it into a range where lambda will be roughly comparable to plain MSE.
+		const float NORM_ERROR_SCALE = 350000.0f;
+		dist *= NORM_ERROR_SCALE;
 
-			max_err = maximum(max_err, err_degrees);
-			min_err = minimum(min_err, err_degrees);
-			total_err += err_degrees;
-			total_err2 += err_degrees * err_degrees;
-		} // x
-	} // y
+		if (NUM_COMPS == 4)
+		{
+			int da = (int)a[3] - (int)orig[3];
+			dist += params.m_chan_weights_lab[3] * square((float)da);
+		}
+	}
+	else if (MODE == cMetricWeightedRGB)
+	{
+		int dr = (int)a[0] - (int)orig[0];
+		int dg = (int)a[1] - (int)orig[1];
+		int db = (int)a[2] - (int)orig[2];
 
-	const double total_pixels = (double)orig_img.get_total_pixels();
+		uint32_t idist = (uint32_t)(params.m_chan_weights[0] * (uint32_t)(dr * dr) + params.m_chan_weights[1] * (uint32_t)(dg * dg) + params.m_chan_weights[2] * (uint32_t)(db * db));
+		if (NUM_COMPS == 4)
+		{
+			int da = (int)a[3] - (int)orig[3];
+			idist += params.m_chan_weights[3] * (uint32_t)(da * da);
+		}
 
-	if (print_flag)
+		dist = (float)idist;
+	}
+	else
 	{
-		printf("Total apparently invalid (len < %3.3f or >%3.3f): Encoded: %u Original: %u\n", INVALID_LEN_THRESHOLD, INVALID_LEN_THRESHOLD + 1.0f, total_invalid_a, total_invalid_b);
-		printf("Length statistics: Encoded: Avg %3.3f Std Dev %3.3f, Original: Avg %3.3f Std Dev: %3.3f\n",
-			len_a_stats.get_mean(), len_a_stats.get_std_dev(),
-			len_b_stats.get_mean(), len_b_stats.get_std_dev());
+		int dr = (int)a[0] - (int)orig[0];
+		int dg = (int)a[1] - (int)orig[1];
+		int db = (int)a[2] - (int)orig[2];
 
-		printf("Angular error:\n");
-		printf("Minimum: %3.3f degrees\nMaximum: %3.3f degrees\n", min_err, max_err);
-		printf("Average: %3.3f degrees\n", total_err / total_pixels);
-		printf("Std Dev: %3.3f degrees\n", sqrt(total_pixels * total_err2 - total_err * total_err) / total_pixels);
-	}
+		uint32_t idist = (uint32_t)(dr * dr + dg * dg + db * db);
+		if (NUM_COMPS == 4)
+		{
+			int da = (int)a[3] - (int)orig[3];
+			idist += da * da;
+		}
 
-	const double rms_error = sqrt(total_err2 / total_pixels);
-	
-	if (print_flag)
-	{
-		printf("RMS:     %3.3f degrees\n\n", rms_error);
+		dist = (float)idist;
 	}
 
-	return (float)rms_error;
+	return dist;
 }
 
-struct find_optimal_hash_key
+// compute_se() specialized for params' metric mode (get_metric_mode()) and channel count. orig_lab must be get_orig_lab(orig, params).
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline float compute_se_t(const color_rgba& a, const color_rgba& orig, const Lab& orig_lab, const rdo_png_params &params)
 {
-	uint32_t m_x_ofs;
-	color_rgba m_prev_delta_colors[MAX_DELTA_COLORS];
+	return compute_se_lab_t<MODE, NUM_COMPS>(a, get_trial_lab_t<MODE>(a, params), orig, orig_lab, params);
+}
 
-	operator size_t() const
-	{
-		return hash_hsieh((const uint8_t*)&m_x_ofs, sizeof(m_x_ofs) + sizeof(color_rgba) * m_x_ofs);
-	}
+// orig_lab must be get_orig_lab(orig, params).
+static inline float compute_se(const color_rgba& a, const color_rgba& orig, const Lab& orig_lab, uint32_t num_comps, const rdo_png_params &params)
+{
+	assert((num_comps == 3) || (num_comps == 4));
+	const bool has_alpha = (num_comps == 4);
 
-	bool operator== (const find_optimal_hash_key& rhs) const
+	switch (get_metric_mode(params))
 	{
-		if (m_x_ofs != rhs.m_x_ofs)
-			return false;
-		for (uint32_t i = 0; i < m_x_ofs; i++)
-			if (m_prev_delta_colors[i] != rhs.m_prev_delta_colors[i])
-				return false;
-		return true;
+	case cMetricRGB: return has_alpha ? compute_se_t<cMetricRGB, 4>(a, orig, orig_lab, params) : compute_se_t<cMetricRGB, 3>(a, orig, orig_lab, params);
+	case cMetricWeightedRGB: return has_alpha ? compute_se_t<cMetricWeightedRGB, 4>(a, orig, orig_lab, params) : compute_se_t<cMetricWeightedRGB, 3>(a, orig, orig_lab, params);
+	case cMetricOklab: return has_alpha ? compute_se_t<cMetricOklab, 4>(a, orig, orig_lab, params) : compute_se_t<cMetricOklab, 3>(a, orig, orig_lab, params);
+	default: return has_alpha ? compute_se_t<cMetricNormalMap, 4>(a, orig, orig_lab, params) : compute_se_t<cMetricNormalMap, 3>(a, orig, orig_lab, params);
 	}
-};
+}
 
-struct find_optimal_hash_value
+static inline float compute_se(const color_rgba& a, const color_rgba& orig, uint32_t num_comps, const rdo_png_params &params)
 {
-	color_rgba m_delta_colors[MAX_DELTA_COLORS];
-	float m_bits;
-	float m_t;
-	float m_squared_err;
-};
-
-typedef basisu::hash_map<find_optimal_hash_key, find_optimal_hash_value> find_optimal_hash_map;
+	return compute_se(a, orig, get_orig_lab(orig, params), num_comps, params);
+}
 
-static color_rgba get_match_len_color(uint32_t l)
+// The -transparent_reject_test half of should_reject_t(): transparent pixels must stay transparent, and opaque pixels must stay opaque.
+template<uint32_t NUM_COMPS>
+static inline bool transparent_reject_t(const color_rgba& trial_color, const color_rgba& orig_color, const rdo_png_params& params)
 {
-	color_rgba c = g_black_color;
-	switch (l)
+	if ((NUM_COMPS == 4) && (params.m_transparent_reject_test))
 	{
-	case 1: c.set(255, 0, 0, 255); break;
-	case 2: c.set(255, 255, 0, 255); break;
-	case 3: c.set(255, 0, 255, 255); break;
-	case 4: c.set(128, 128, 128, 255); break;
-	case 5: c.set(255, 128, 255, 255); break;
-	case 6: c.set(255, 255, 128, 255); break;
-	case 7: c.set(255, 128, 0, 255); break;
-	case 8: c.set(255, 64, 64, 255); break;
-	case 9: c.set(255, 255, 64, 255); break;
-	case 10: c.set(64, 64, 255, 255); break;
-	case 11: c.set(255, 64, 255, 255); break;
-	case 12: c.set(255, 255, 255, 255); break;
+		if ((orig_color[3] == 0) && (trial_color[3] > 0))
+			return true;
+
+		if ((orig_color[3] == 255) && (trial_color[3] < 255))
+			return true;
 	}
-	return c;
+
+	return false;
 }
 
-static void eval_matches(int m, 
-	uint32_t num_match_order, const match_order *pMatch_order,
-	int x, int y, 
-	float &best_t, float &best_se, float &best_bits, color_rgba *best_delta_color, uint32_t &best_idx,
-	find_optimal_hash_map* pFind_optimal_hashers,
-	int filter,
-	float lambda, 
-	const image& orig_img,
-	image& delta_img,
-	image& coded_img,
-	const huffman_encoding_table &h0, 
-	const huffman_encoding_table& h1,
-	const vector2D<float> &smooth_block_mse_scales, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
+// The reject thresholds half of should_reject_t(), given trial_lab = get_trial_lab_t<MODE>(trial_color, params).
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline bool threshold_reject_lab_t(const color_rgba& trial_color, const Lab& trial_lab, const color_rgba& orig_color, const Lab& orig_lab, const rdo_png_params& params)
 {
-	assert(pMatch_order[0].v[1] == m);
-
-	best_t = 1e+9f;
-	best_se = 1e+9f;
-	best_bits = 1e+9f;
-	best_idx = 0;
+	if (params.m_use_reject_thresholds)
+	{
+		if (MODE == cMetricOklab)
+		{
+			const Lab& t = trial_lab;
+			const Lab& o = orig_lab;
 
-	float mse_smooth_factor = 0;
-	for (uint32_t i = 0; i < (uint32_t)m; i++)
-		mse_smooth_factor = maximum(mse_smooth_factor, smooth_block_mse_scales(x + i, y));
+			float L_diff = fabs(t.L - o.L);
+									
+			if (L_diff > params.m_reject_thresholds_lab[0])
+				return true;
 
-	for (uint32_t i = 0; i < (uint32_t)m; i++)
-		pFind_optimal_hashers[i].reset();
-	
-	for (uint32_t i = 0; i < num_match_order; i++)
-	{
-		const uint32_t n = pMatch_order[i].v[0];
+			float ab_dist = squaref(t.a - o.a) + squaref(t.b - o.b);
+			
+			if (ab_dist > (params.m_reject_thresholds_lab[1] * params.m_reject_thresholds_lab[1]))
+				return true;
 
-		color_rgba delta_color[MAX_DELTA_COLORS];
-		float bits[MAX_DELTA_COLORS], st[MAX_DELTA_COLORS], squared_err[MAX_DELTA_COLORS];
-		for (uint32_t j = 0; j < (uint32_t)m; j++)
-		{
-			bits[j] = 1e+9f;
-			st[j] = 1e+9f;
-			squared_err[j] = 1e+9;
+			if (NUM_COMPS == 4)
+			{
+				uint32_t delta_a = abs((int)trial_color[3] - (int)orig_color[3]);
+				if (delta_a > params.m_reject_thresholds[3])
+					return true;
+			}
 		}
-
-		uint32_t x_ofs = 0;
-		for (uint32_t j = 0; j < n; j++)
+		else
 		{
-			const uint32_t len = pMatch_order[i].v[j + 1];
-			assert((int)len <= m);
-
-			st[j] = 1e+9f;
-														
-			if (len == 1)
-			{
-				uint32_t best_type;
-
-				find_optimal_hash_key k;
-				k.m_x_ofs = x_ofs;
-				for (uint32_t q = 0; q < x_ofs; q++)
-					k.m_prev_delta_colors[q] = delta_img(x + q, y);
-
-				auto find_res = pFind_optimal_hashers[0].find(k);
-				if (find_res != pFind_optimal_hashers[0].end())
-				{
-					const find_optimal_hash_value& v = find_res->second;
-
-					delta_color[j] = v.m_delta_colors[0];
-					bits[j] = v.m_bits;
-					st[j] = v.m_t;
-					squared_err[j] = v.m_squared_err;
-				}
-				else
-				{
-					find_optimal1(
-						delta_color[j], bits[j], squared_err[j], st[j], best_type,
-						x + x_ofs, y,
-						orig_img, coded_img, delta_img,
-						lambda, h0, h1, 
-						smooth_block_mse_scales, filter, num_comps, pLevel, params);
+			uint32_t delta_r = abs((int)trial_color[0] - (int)orig_color[0]);
+			uint32_t delta_g = abs((int)trial_color[1] - (int)orig_color[1]);
+			uint32_t delta_b = abs((int)trial_color[2] - (int)orig_color[2]);
 
-					find_optimal_hash_value v;
-					v.m_delta_colors[0] = delta_color[j];
-					v.m_bits = bits[j];
-					v.m_t = st[j];
-					v.m_squared_err = squared_err[j];
+			if (delta_r > params.m_reject_thresholds[0])
+				return true;
+			if (delta_g > params.m_reject_thresholds[1])
+				return true;
+			if (delta_b > params.m_reject_thresholds[2])
+				return true;
 
-					pFind_optimal_hashers[0].insert(k, v);
-				}
-			}
-			else
+			if (NUM_COMPS == 4)
 			{
-				find_optimal_hash_key k;
-				k.m_x_ofs = x_ofs;
-				for (uint32_t q = 0; q < x_ofs; q++)
-					k.m_prev_delta_colors[q] = delta_img(x + q, y);
+				uint32_t delta_a = abs((int)trial_color[3] - (int)orig_color[3]);
+				if (delta_a > params.m_reject_thresholds[3])
+					return true;
+			}
+		}
+	}
 
-				auto find_res = pFind_optimal_hashers[len - 1].find(k);
-				if (find_res != pFind_optimal_hashers[len - 1].end())
-				{
-					const find_optimal_hash_value& v = find_res->second;
+	return false;
+}
 
-					for (uint32_t q = 0; q < len; q++)
-						delta_color[j + q] = v.m_delta_colors[q];
+// should_reject() specialized for params' metric mode and channel count. orig_lab must be get_orig_lab(orig_color, params).
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline bool should_reject_t(const color_rgba& trial_color, const color_rgba& orig_color, const Lab& orig_lab, const rdo_png_params& params)
+{
+	if (transparent_reject_t<NUM_COMPS>(trial_color, orig_color, params))
+		return true;
 
-					bits[j] = v.m_bits;
-					st[j] = v.m_t;
-					squared_err[j] = v.m_squared_err;
-				}
-				else
-				{
-					find_optimal_n(len,
-						delta_color + j, bits[j], squared_err[j], st[j],
-						x + x_ofs, y,
-						orig_img, coded_img, delta_img,
-						lambda, h0, h1, 
-						smooth_block_mse_scales, filter, num_comps, pLevel, params);
+	if (!params.m_use_reject_thresholds)
+		return false;
 
-					find_optimal_hash_value v;
-					for (uint32_t q = 0; q < len; q++)
-						v.m_delta_colors[q] = delta_color[j + q];
-					v.m_bits = bits[j];
-					v.m_t = st[j];
-					v.m_squared_err = squared_err[j];
+	return threshold_reject_lab_t<MODE, NUM_COMPS>(trial_color, get_trial_lab_t<MODE>(trial_color, params), orig_color, orig_lab, params);
+}
 
-					pFind_optimal_hashers[len - 1].insert(k, v);
-				}
-			}
+// should_reject_t() and compute_se_t() in one call, which the candidate searches use to score each trial color. Returns false if trial_color is rejected, 
+// otherwise returns true and sets se to its error. The trial's Oklab color is only looked up once for both. orig_lab must be get_orig_lab(orig_color, params).
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline bool evaluate_candidate_t(const color_rgba& trial_color, const color_rgba& orig_color, const Lab& orig_lab, const rdo_png_params& params, float& se)
+{
+	if (transparent_reject_t<NUM_COMPS>(trial_color, orig_color, params))
+		return false;
 
-			for (uint32_t k = 0; k < len; k++)
-			{
-				delta_img(x + x_ofs + k, y) = delta_color[j + k];
-				coded_img(x + x_ofs + k, y) = png_unpredict(delta_color[j + k], x + x_ofs + k, y, coded_img, filter, num_comps);
-			}
+	const Lab trial_lab(get_trial_lab_t<MODE>(trial_color, params));
 
-			x_ofs += len;
-		}
-		assert(x_ofs == m);
+	if (threshold_reject_lab_t<MODE, NUM_COMPS>(trial_color, trial_lab, orig_color, orig_lab, params))
+		return false;
 
-		float total_bits = 0.0f;
-		float total_se = 0.0f;
-		for (uint32_t j = 0; j < n; j++)
-		{
-			total_bits += bits[j];
-			total_se += squared_err[j];
-		}
-		float mse = total_se / (float)m;
-		float t = mse * mse_smooth_factor + total_bits * lambda;
-		if (t < best_t)
-		{
-			best_t = t;
-			best_idx = i;
-			best_bits = total_bits;
-			best_se = total_se;
+	se = compute_se_lab_t<MODE, NUM_COMPS>(trial_color, trial_lab, orig_color, orig_lab, params);
+	return true;
+}
 
-			for (uint32_t k = 0; k < (uint32_t)m; k++)
-			{
-				best_delta_color[k] = delta_img(x + k, y);
-			}
+// The candidate counters RDO_PNG_COUNT_CANDIDATES enables.
+enum candidate_counter
+{
+	cCandidatesScored,		// the error was computed (unless the candidate was rejected)
+	cCandidatesPruned,		// skipped by can_beat_best_t() before computing the error
+	cCandidatesCutShort,	// multi-pixel candidates whose error sum was abandoned partway, once it couldn't beat the best cost
+	cTotalCandidateCounters
+};
 
-			if (mse == 0.0f)
-				break;
-		}
+#if RDO_PNG_COUNT_CANDIDATES
+static std::atomic<uint64_t> g_candidate_counters[cTotalCandidateCounters];
+#define RDO_PNG_COUNT_CANDIDATES_ADD(counter, n) g_candidate_counters[counter].fetch_add(n, std::memory_order_relaxed)
+#else
+#define RDO_PNG_COUNT_CANDIDATES_ADD(counter, n) do { } while (0)
+#endif
 
-	} // i
+// Rate lower bound for the candidate searches. A candidate's cost is mse_scale * mse + bits_t (bits_t = bits * lambda), where mse_scale and mse are 
+// never negative, so its cost can't be lower than bits_t. If bits_t alone doesn't beat best_t the candidate can be skipped without computing its error. 
+// Adding a nonnegative float never rounds a sum below bits_t, so pruning doesn't change which candidate wins.
+static inline bool can_beat_best_t(float bits_t, float best_t, uint32_t num_cands = 1)
+{
+	if (bits_t < best_t)
+	{
+		RDO_PNG_COUNT_CANDIDATES_ADD(cCandidatesScored, num_cands);
+		return true;
+	}
 
-	assert(best_t != 1e+9f);
+	RDO_PNG_COUNT_CANDIDATES_ADD(cCandidatesPruned, num_cands);
+	return false;
 }
 
-static void create_smooth_maps(
-	vector2D<float> &smooth_block_mse_scales,
-	const image& orig_img,
-	rdo_png_params &params)
+// orig_lab must be get_orig_lab(orig_color, params).
+static inline bool should_reject(const color_rgba& trial_color, const color_rgba& orig_color, const Lab& orig_lab, uint32_t num_comps, const rdo_png_params& params)
 {
-	const uint32_t width = orig_img.get_width();
-	const uint32_t height = orig_img.get_height();
-	const uint32_t total_pixels = orig_img.get_total_pixels();
-	const bool has_alpha = orig_img.has_alpha();
-	const uint32_t num_comps = has_alpha ? 4 : 3;
+	assert((num_comps == 3) || (num_comps == 4));
+	const bool has_alpha = (num_comps == 4);
 
-	if (params.m_no_mse_scaling)
+	switch (get_metric_mode(params))
 	{
-		smooth_block_mse_scales.set_all(1.0f);
-		return;
+	case cMetricRGB: return has_alpha ? should_reject_t<cMetricRGB, 4>(trial_color, orig_color, orig_lab, params) : should_reject_t<cMetricRGB, 3>(trial_color, orig_color, orig_lab, params);
+	case cMetricWeightedRGB: return has_alpha ? should_reject_t<cMetricWeightedRGB, 4>(trial_color, orig_color, orig_lab, params) : should_reject_t<cMetricWeightedRGB, 3>(trial_color, orig_color, orig_lab, params);
+	case cMetricOklab: return has_alpha ? should_reject_t<cMetricOklab, 4>(trial_color, orig_color, orig_lab, params) : should_reject_t<cMetricOklab, 3>(trial_color, orig_color, orig_lab, params);
+	default: return has_alpha ? should_reject_t<cMetricNormalMap, 4>(trial_color, orig_color, orig_lab, params) : should_reject_t<cMetricNormalMap, 3>(trial_color, orig_color, orig_lab, params);
 	}
+}
 
-	image smooth_vis(width, height);
-	image alpha_edge_vis(width, height);
-	image ultra_smooth_vis(width, height);
+static inline bool should_reject(const color_rgba& trial_color, const color_rgba& orig_color, uint32_t num_comps, const rdo_png_params& params)
+{
+	return should_reject(trial_color, orig_color, get_orig_lab(orig_color, params), num_comps, params);
+}
 
-	for (uint32_t y = 0; y < height; y++)
+// Scores num_cands candidate colors against orig_color (whose get_orig_lab() is orig_lab), where every candidate costs the same number of bits. This gives the same result as a loop 
+// calling should_reject() and compute_se() (with 4 components) on each candidate in order and keeping the first one with the lowest cost below best_t. 
+// Returns the index of the winning candidate (and updates best_t/best_mse), or -1 if no candidate beat best_t.
+// The Oklab metrics, which are the default and the slowest, and the normal map metrics are scored 4 candidates at a time with SSE2.
+template<metric_mode MODE>
+static int find_best_candidate(
+	const color_rgba* pCands, uint32_t num_cands, const color_rgba& orig_color, const Lab& orig_lab,
+	float mse_scale, float bits, float lambda,
+	float& best_t, float& best_mse,
+	const rdo_png_params& params)
+{
+	const float bits_t = bits * lambda;
+	
+	// Every candidate costs the same number of bits, so they're all pruned or all scored.
+	if (!can_beat_best_t(bits_t, best_t, num_cands))
+		return -1;
+
+	int best_index = -1;
+	uint32_t i = 0;
+
+#if RDO_PNG_USE_SSE2
+	const bool transparent_reject = params.m_transparent_reject_test && ((orig_color.a == 0) || (orig_color.a == 255));
+
+	// Keeps the first of candidates i to i + 3 with the lowest cost below best_t, given their costs, errors and a mask of the rejected candidates.
+	auto keep_best_x4 = [&](__m128 t, __m128 mse, __m128 rejected)
 	{
-		for (uint32_t x = 0; x < width; x++)
+		int mask = _mm_movemask_ps(_mm_andnot_ps(rejected, _mm_cmplt_ps(t, _mm_set1_ps(best_t))));
+		if (!mask)
+			return;
+
+		float lane_t[4], lane_mse[4];
+		_mm_storeu_ps(lane_t, t);
+		_mm_storeu_ps(lane_mse, mse);
+
+		for (uint32_t j = 0; j < 4; j++)
 		{
-			float alpha_edge_yl = 0.0f;
-			if ((num_comps == 4) && (params.m_alpha_is_opacity))
+			if (((mask >> j) & 1) && (lane_t[j] < best_t))
 			{
-				tracked_stat alpha_comp_stats;
-				for (int yd = -3; yd <= 3; yd++)
-				{
-					for (int xd = -3; xd <= 3; xd++)
-					{
-						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
-						alpha_comp_stats.update(p[3]);
-					}
-				}
+				best_t = lane_t[j];
+				best_mse = lane_mse[j];
+				best_index = i + j;
+			}
+		}
+	};
 
-				float max_std_dev = alpha_comp_stats.get_std_dev();
+	if (MODE == cMetricOklab)
+	{
+		const encoder_tables& tables = *params.m_pTables;
+		const __m128 orig_L = _mm_set1_ps(orig_lab.L), orig_a = _mm_set1_ps(orig_lab.a), orig_b = _mm_set1_ps(orig_lab.b);
+		const __m128 weight_L = _mm_set1_ps(params.m_chan_weights_lab[0]), weight_a = _mm_set1_ps(params.m_chan_weights_lab[1]), weight_b = _mm_set1_ps(params.m_chan_weights_lab[2]);
+		const __m128 weight_alpha = _mm_set1_ps(params.m_chan_weights_lab[3]);
+		const __m128 norm_error_scale = _mm_set1_ps(350000.0f);
+		const __m128 mse_scale_v = _mm_set1_ps(mse_scale), bits_t_v = _mm_set1_ps(bits_t);
+		const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		const __m128i orig_alpha = _mm_set1_epi32(orig_color.a);
+		
+		const bool reject = params.m_use_reject_thresholds;
+		const __m128 reject_L = _mm_set1_ps(params.m_reject_thresholds_lab[0]);
+		const __m128 reject_ab = _mm_set1_ps(params.m_reject_thresholds_lab[1] * params.m_reject_thresholds_lab[1]);
+		const __m128i reject_alpha = _mm_set1_epi32((int)minimum<uint32_t>(params.m_reject_thresholds[3], 256));
 
-				float yl = clampf(max_std_dev / params.m_max_smooth_std_dev, 0.0f, 1.0f);
-				alpha_edge_yl = yl * yl;
-			}
+		for ( ; (i + 4) <= num_cands; i += 4)
+		{
+			const color_rgba* p = pCands + i;
+			
+			__m128 cand_L, cand_a, cand_b;
+			tables.get_oklab16_norm_x4(p, cand_L, cand_a, cand_b);
 
-			{
-				tracked_stat comp_stats[4];
-				for (int yd = -1; yd <= 1; yd++)
-				{
-					for (int xd = -1; xd <= 1; xd++)
-					{
-						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
-						comp_stats[0].update(p[0]);
-						comp_stats[1].update(p[1]);
-						comp_stats[2].update(p[2]);
-						if (num_comps == 4)
-							comp_stats[3].update(p[3]);
-					}
-				}
+			const __m128 dL = _mm_sub_ps(cand_L, orig_L);
+			const __m128 da = _mm_sub_ps(cand_a, orig_a);
+			const __m128 db = _mm_sub_ps(cand_b, orig_b);
 
-				float max_std_dev = 0.0f;
-				for (uint32_t i = 0; i < num_comps; i++)
-					max_std_dev = std::max(max_std_dev, comp_stats[i].get_std_dev());
+			const __m128i alpha = _mm_setr_epi32(p[0].a, p[1].a, p[2].a, p[3].a);
+			const __m128i dalpha = _mm_sub_epi32(alpha, orig_alpha);
+			const __m128 dalpha_f = _mm_cvtepi32_ps(dalpha);
 
-				float yl = clampf(max_std_dev / params.m_max_smooth_std_dev, 0.0f, 1.0f);
-				yl = yl * yl;
+			const __m128 dL2 = _mm_mul_ps(dL, dL), da2 = _mm_mul_ps(da, da), db2 = _mm_mul_ps(db, db);
 
-				smooth_block_mse_scales(x, y) = lerp(params.m_smooth_max_mse_scale, 1.0f, yl);
+			// Same operation order as compute_se(), so the results are bit identical.
+			__m128 mse = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dL2, weight_L), _mm_mul_ps(da2, weight_a)), _mm_mul_ps(db2, weight_b));
+			mse = _mm_add_ps(_mm_mul_ps(mse, norm_error_scale), _mm_mul_ps(weight_alpha, _mm_mul_ps(dalpha_f, dalpha_f)));
 
-				if (num_comps == 4)
-				{
-					alpha_edge_vis(x, y).set((int)std::round(alpha_edge_yl * 255.0f));
+			__m128 t = _mm_add_ps(_mm_mul_ps(mse_scale_v, mse), bits_t_v);
 
-					smooth_block_mse_scales(x, y) = lerp(smooth_block_mse_scales(x, y), params.m_smooth_max_mse_scale, alpha_edge_yl);
-				}
+			__m128 rejected = _mm_setzero_ps();
+			if (reject)
+			{
+				rejected = _mm_cmpgt_ps(_mm_and_ps(dL, abs_mask), reject_L);
+				rejected = _mm_or_ps(rejected, _mm_cmpgt_ps(_mm_add_ps(da2, db2), reject_ab));
 
-				smooth_vis(x, y).set(clamp((int)((smooth_block_mse_scales(x, y) - 1.0f) / (params.m_smooth_max_mse_scale - 1.0f) * 255.0f + .5f), 0, 255));
+				const __m128i sign = _mm_srai_epi32(dalpha, 31);
+				const __m128i abs_dalpha = _mm_sub_epi32(_mm_xor_si128(dalpha, sign), sign);
+				rejected = _mm_or_ps(rejected, _mm_castsi128_ps(_mm_cmpgt_epi32(abs_dalpha, reject_alpha)));
 			}
 
+			if (transparent_reject)
 			{
-				tracked_stat comp_stats[4];
-
-				const int S = 5;
-				for (int yd = -S; yd < S; yd++)
-				{
-					for (int xd = -S; xd < S; xd++)
-					{
-						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
-						comp_stats[0].update(p[0]);
-						comp_stats[1].update(p[1]);
-						comp_stats[2].update(p[2]);
-						if (num_comps == 4)
-							comp_stats[3].update(p[3]);
-					}
-				}
-
-				float max_std_dev = 0.0f;
-				for (uint32_t i = 0; i < num_comps; i++)
-					max_std_dev = std::max(max_std_dev, comp_stats[i].get_std_dev());
-
-				float yl = clampf(max_std_dev / params.m_max_ultra_smooth_std_dev, 0.0f, 1.0f);
-				yl = powf(yl, 3.0f);
-
-				smooth_block_mse_scales(x, y) = lerp(params.m_ultra_smooth_max_mse_scale, smooth_block_mse_scales(x, y), yl);
-
-				ultra_smooth_vis(x, y).set((int)std::round(yl * 255.0f));
-			}
+				// Transparent pixels must stay transparent, and opaque pixels must stay opaque.
+				rejected = _mm_or_ps(rejected, _mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(alpha, orig_alpha), _mm_set1_epi32(-1))));
+			}
 
+			keep_best_x4(t, mse, rejected);
 		}
 	}
-
-	if (params.m_debug_images)
-	{
-		save_png("dbg_smooth_vis.png", smooth_vis);
-		save_png("dbg_alpha_edge_vis.png", alpha_edge_vis);
-		save_png("dbg_ultra_smooth_vis.png", ultra_smooth_vis);
-	}
-}
-
-static bool rdo_png(rdo_png_params &params)
-{
-	const image& orig_img = params.m_orig_img;
-	
-	const uint32_t width = orig_img.get_width();
-	const uint32_t height = orig_img.get_height();
-	const uint32_t total_pixels = orig_img.get_total_pixels();
-	const bool has_alpha = orig_img.has_alpha();
-	const uint32_t num_comps = has_alpha ? 4 : 3;
-	
-	if (params.m_debug_images)
+	else if (MODE == cMetricNormalMap)
 	{
-		g_use_miniz = false;
-		save_png("dbg_orig.png", orig_img);
-		g_use_miniz = true;
-	}
-		
-	uint8_vec filters(height);
-	filters.set_all(PNG_AVG_FILTER);
-
-	for (uint32_t i = 0; i < 288; i++)
-		buminiz::g_defl_freq[0][i] = 0;
+		const float* pDecode = params.m_pTables->get_normal_decode(params.m_snorm8);
+		const __m128 orig_x = _mm_set1_ps(orig_lab.L), orig_y = _mm_set1_ps(orig_lab.a), orig_z = _mm_set1_ps(orig_lab.b);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 weight_alpha = _mm_set1_ps((float)params.m_chan_weights[3]);
+		const __m128 mse_scale_v = _mm_set1_ps(mse_scale), bits_t_v = _mm_set1_ps(bits_t);
+		const __m128i orig_r = _mm_set1_epi32(orig_color.r), orig_g = _mm_set1_epi32(orig_color.g), orig_b = _mm_set1_epi32(orig_color.b), orig_alpha = _mm_set1_epi32(orig_color.a);
+
+		const bool reject = params.m_use_reject_thresholds;
+		__m128i reject_thresh[4];
+		for (uint32_t c = 0; c < 4; c++)
+			reject_thresh[c] = _mm_set1_epi32((int)minimum<uint32_t>(params.m_reject_thresholds[c], 256));
+
+		auto abs_epi32 = [](__m128i v)
+		{
+			const __m128i sign = _mm_srai_epi32(v, 31);
+			return _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+		};
 
-	for (uint32_t i = 0; i < 32; i++)
-		buminiz::g_defl_freq[1][i] = 0;
+		for ( ; (i + 4) <= num_cands; i += 4)
+		{
+			const color_rgba* p = pCands + i;
 
-	uint8_vec orig_avg_png_file;
-	save_png(orig_avg_png_file, orig_img, 0, 0, -1, filters.data());
+			__m128 x = _mm_setr_ps(pDecode[p[0].r], pDecode[p[1].r], pDecode[p[2].r], pDecode[p[3].r]);
+			__m128 y = _mm_setr_ps(pDecode[p[0].g], pDecode[p[1].g], pDecode[p[2].g], pDecode[p[3].g]);
+			__m128 z = _mm_setr_ps(pDecode[p[0].b], pDecode[p[1].b], pDecode[p[2].b], pDecode[p[3].b]);
 
-	histogram ht0(288), ht1(32);
-	for (uint32_t i = 0; i < 288; i++)
-		ht0[i] = maximum<uint32_t>(1U, (uint32_t)buminiz::g_defl_freq[0][i]);
+			// Same operation order as compute_se(), so the results are bit identical. A zero length normal is left as is.
+			const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+			const __m128 is_zero = _mm_cmpeq_ps(len, _mm_setzero_ps());
+			const __m128 div = _mm_or_ps(_mm_and_ps(is_zero, one), _mm_andnot_ps(is_zero, len));
+			x = _mm_div_ps(x, div);
+			y = _mm_div_ps(y, div);
+			z = _mm_div_ps(z, div);
 
-	for (uint32_t i = 0; i < 32; i++)
-		ht1[i] = maximum<uint32_t>(1U, (uint32_t)buminiz::g_defl_freq[1][i]);
+			const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, orig_x), _mm_mul_ps(y, orig_y)), _mm_mul_ps(z, orig_z));
 
-	if (params.m_debug_images)
-	{
-		write_vec_to_file("dbg_orig_avg.png", orig_avg_png_file);
-	}
-		
-	if (params.m_debug_images)
-	{
-		if (has_alpha)
-		{
-			save_png("dbg_orig_rgb.png", orig_img, cImageSaveIgnoreAlpha);
-			save_png("dbg_orig_alpha.png", orig_img, cImageSaveGrayscale, 3);
-		}
-	}
-	
-	const float lambda = params.m_lambda;
-	
-	// TODO
-	const float max_smooth_std_dev = 35.0f;
-	const float smooth_max_mse_scale = 250.0f;
+			const __m128i alpha = _mm_setr_epi32(p[0].a, p[1].a, p[2].a, p[3].a);
+			const __m128 dalpha_f = _mm_cvtepi32_ps(_mm_sub_epi32(alpha, orig_alpha));
 
-	const float max_ultra_smooth_std_dev = 5.0f;
-	const float ultra_smooth_max_mse_scale = 1500.0f;
+			__m128i rejected = _mm_setzero_si128();
+			if (reject)
+			{
+				const __m128i r = _mm_setr_epi32(p[0].r, p[1].r, p[2].r, p[3].r);
+				const __m128i g = _mm_setr_epi32(p[0].g, p[1].g, p[2].g, p[3].g);
+				const __m128i b = _mm_setr_epi32(p[0].b, p[1].b, p[2].b, p[3].b);
+
+				rejected = _mm_cmpgt_epi32(abs_epi32(_mm_sub_epi32(r, orig_r)), reject_thresh[0]);
+				rejected = _mm_or_si128(rejected, _mm_cmpgt_epi32(abs_epi32(_mm_sub_epi32(g, orig_g)), reject_thresh[1]));
+				rejected = _mm_or_si128(rejected, _mm_cmpgt_epi32(abs_epi32(_mm_sub_epi32(b, orig_b)), reject_thresh[2]));
+				rejected = _mm_or_si128(rejected, _mm_cmpgt_epi32(abs_epi32(_mm_sub_epi32(alpha, orig_alpha)), reject_thresh[3]));
+			}
 
-	assert(params.m_level < MAX_LEVELS);
-	const rdo_png_level* pLevel = &g_levels[params.m_level];
+			if (transparent_reject)
+				rejected = _mm_or_si128(rejected, _mm_xor_si128(_mm_cmpeq_epi32(alpha, orig_alpha), _mm_set1_epi32(-1)));
 
-	const int skip_filter0 = 2;
-				
-	const uint32_t MAX_M = 6;
-	
-	const uint32_t M = pLevel->m_M;
-	const uint32_t num_match_order_a = pLevel->m_num_match_order_a;
-	const match_order* pMatch_order_a = pLevel->m_pMatch_order_a;
+			if (_mm_movemask_epi8(rejected) == 0xFFFF)
+				continue;
 
-	const uint32_t num_match_order_b = pLevel->m_num_match_order_b;
-	const match_order* pMatch_order_b = pLevel->m_pMatch_order_b;
-	
-	image match_vis(width, height);
+			// The angular error's arccosine is looked up per candidate.
+			float lane_dot[4], lane_len[4], lane_dist[4];
+			_mm_storeu_ps(lane_dot, dot);
+			_mm_storeu_ps(lane_len, len);
+			for (uint32_t j = 0; j < 4; j++)
+				lane_dist[j] = compute_normal_map_dist(lane_dot[j], lane_len[j], params);
 
-	vector2D<float> smooth_block_mse_scales(width, height);
+			const __m128 mse = _mm_add_ps(_mm_loadu_ps(lane_dist), _mm_mul_ps(weight_alpha, _mm_mul_ps(dalpha_f, dalpha_f)));
+			const __m128 t = _mm_add_ps(_mm_mul_ps(mse_scale_v, mse), bits_t_v);
 
-	if (params.m_print_progress)
-	{
-		printf("Stage 1\n");
+			keep_best_x4(t, mse, _mm_castsi128_ps(rejected));
+		}
 	}
+#endif
 
-	create_smooth_maps(
-		smooth_block_mse_scales,
-		orig_img,
-		params);
-			
-	uint64_t comp_size = 0;
-
-	const uint32_t num_encoder_passes = params.m_two_pass ? 2 : 1;
-	
-	image delta_img(width, height);
-	image coded_img(width, height);
-
-	for (uint32_t encoder_pass = 0; encoder_pass < num_encoder_passes; encoder_pass++)
+	for ( ; i < num_cands; i++)
 	{
-		if ((params.m_print_progress) && (num_encoder_passes > 1))
-			printf("\n**** Pass %u\n", encoder_pass + 1);
-		
-		if (encoder_pass)
-		{
-			delta_img.set_all(g_black_color);
-			coded_img.set_all(g_black_color);
-		}
+		float mse;
+		if (!evaluate_candidate_t<MODE, 4>(pCands[i], orig_color, orig_lab, params, mse))
+			continue;
 		
-		huffman_encoding_table h0, h1;
-		h0.init(ht0, 15);
-		h1.init(ht1, 15);
-
-		if (params.m_print_debug_output)
+		const float trial_t = mse_scale * mse + bits_t;
+		if (trial_t < best_t)
 		{
-			printf("Literal table:\n");
-			for (uint32_t i = 0; i < 288; i++)
-			{
-				printf("%2u ", h0.get_code_sizes()[i]);
-				if ((i & 15) == 15)
-					printf("\n");
-			}
-			printf("\n");
-
-			printf("Distance table:\n");
-			for (uint32_t i = 0; i < 32; i++)
-			{
-				printf("%2u ", h1.get_code_sizes()[i]);
-				if ((i & 15) == 15)
-					printf("\n");
-			}
-			printf("\n");
+			best_t = trial_t;
+			best_mse = mse;
+			best_index = i;
 		}
+	}
 
-		uint32_t filter_hist[5];
-		clear_obj(filter_hist);
-
-		uint32_t match_len_hist[MAX_DELTA_COLORS + 1];
-		clear_obj(match_len_hist);
+	return best_index;
+}
 
-		assert(num_match_order_a <= 256 && num_match_order_b <= 256);
+static inline int compute_png_match_dist(int xa, int ya, int xb, int yb, int width, int height, int num_comps)
+{
+	return (xa * num_comps + (ya * (width * num_comps + 1))) - (xb * num_comps + (yb * (width * num_comps + 1)));
+}
 
-		uint32_t type_hist_a[256];
-		clear_obj(type_hist_a);
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void find_optimal1(
+	color_rgba& best_delta_color, float& best_bits, float& best_squared_err, float& best_t, uint32_t& best_type,
+	uint32_t x, uint32_t y, uint32_t min_y,
+	const image& orig_img, const image& coded_img, const image& delta_img,
+	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1, 
+	const vector2D<float>& smooth_block_mse_scales,
+	uint32_t filter, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
+{
+	assert(num_comps == NUM_COMPS);
+	const uint32_t width = orig_img.get_width(), height = orig_img.get_height();
 
-		uint32_t type_hist_b[256];
-		clear_obj(type_hist_b);
+	color_rgba orig_color(orig_img(x, y));
+	color_rgba orig_delta_color(png_predict(orig_color, x, y, coded_img, filter, num_comps));
+	const Lab orig_lab(get_orig_lab(orig_color, params));
 
-		find_optimal_hash_map find_optimal_hashers[MAX_DELTA_COLORS];
-		for (uint32_t i = 0; i < MAX_DELTA_COLORS; i++)
-			find_optimal_hashers[i].reserve(4);
+	best_delta_color = orig_delta_color;
+	best_bits = (float)(h0.get_code_sizes()[best_delta_color[0]] + h0.get_code_sizes()[best_delta_color[1]] + h0.get_code_sizes()[best_delta_color[2]]);
+	if (NUM_COMPS == 4)
+		best_bits += (float)h0.get_code_sizes()[best_delta_color[3]];
 
-		uint32_t total_match_a = 0, total_match_b = 0;
+	best_t = best_bits * lambda;
+	best_squared_err = 0;
+	best_type = 0;
 
-		if (params.m_print_progress)
-		{
-			printf("Stage 2\n");
-		}
+	if (!params.m_match_only)
+	{
+		bool all_zero = true;
+		if (orig_delta_color.r + orig_delta_color.g + orig_delta_color.b)
+			all_zero = false;
+		if ((NUM_COMPS == 4) && orig_delta_color.a)
+			all_zero = false;
 
-		for (uint32_t y = 0; y < height; y++)
+		if (!all_zero)
 		{
-			if (params.m_print_progress)
+			for (uint32_t t = 1; t < ((NUM_COMPS == 4) ? 16U : 8U); t++)
 			{
-				if ((y & 15) == 0)
+				color_rgba delta_color(orig_delta_color);
+				for (uint32_t c = 0; c < NUM_COMPS; c++)
 				{
-					printf("\b\b\b\b\b\b\b\b%3.2f%%", y * 100.0f / height);
-					fflush(stdout);
+					if (t & (1 << c))
+					{
+						int8_t v = (int8_t)delta_color[c];
+						if (v < 0)
+							delta_color[c]++;
+						else if (v > 0)
+							delta_color[c]--;
+					}
 				}
-			}
 
-			float best_scanline_t = 1e+9f;
-			float best_scanline_err = 1e+9f;
-			uint32_t best_filter = 0;
-			std::vector<color_rgba> best_delta_pixels(width);
-			std::vector<color_rgba> best_coded_pixels(width);
+				float bits = (float)(h0.get_code_sizes()[delta_color[0]] + h0.get_code_sizes()[delta_color[1]] + h0.get_code_sizes()[delta_color[2]]);
+				if (NUM_COMPS == 4)
+					bits += (float)h0.get_code_sizes()[delta_color[3]];
 
-			for (uint32_t filter = pLevel->m_first_filter; filter <= pLevel->m_last_filter; filter++)
-			{
-				if ((int)filter == skip_filter0)
+				if (!can_beat_best_t(bits * lambda, best_t))
 					continue;
 
-				float total_squared_err = 0.0f;
-				float total_bits = 0;
+				color_rgba trial_coded_color(png_unpredict(delta_color, x, y, coded_img, filter, num_comps));
 
-				if (pLevel->m_double_width)
+				float mse;
+				if (evaluate_candidate_t<MODE, NUM_COMPS>(trial_coded_color, orig_color, orig_lab, params, mse))
 				{
-					uint32_t x = 0;
-					while (x < width)
+					float trial_t = smooth_block_mse_scales(x, y) * mse + bits * lambda;
+					if (trial_t < best_t)
 					{
-						if ((x + M * 2) > width)
-						{
-							color_rgba best_delta_color;
-							float best_bits, best_t, best_squared_err;
-							uint32_t best_type;
-
-							find_optimal1(best_delta_color, best_bits, best_squared_err, best_t, best_type,
-								x, y,
-								orig_img, coded_img, delta_img,
-								lambda, h0, h1,
-								smooth_block_mse_scales, filter, num_comps, pLevel, params);
-
-							delta_img(x, y) = best_delta_color;
-							coded_img(x, y) = png_unpredict(best_delta_color, x, y, coded_img, filter, num_comps);
+						best_delta_color = delta_color;
+						best_t = trial_t;
+						best_bits = bits;
+						best_squared_err = mse;
+						best_type = 1;
+					}
+				}
+			}
+		}
+	}
 
-							total_squared_err += compute_se(coded_img(x, y), orig_img(x, y), num_comps, params);
-							total_bits += best_bits;
+	for (int yd = 0; yd < (int)pLevel->m_num_scanlines_to_check; yd++)
+	{
+		if (((int)y - yd) < (int)min_y)
+			break;
 
-							match_len_hist[1]++;
+		int x_start, x_end;
+		const int total_passes = ((yd == 1) && !pLevel->m_exhaustive_search) ? 2 : 1;
+		for (int pass = 0; pass < total_passes; pass++)
+		{
+			if (pLevel->m_exhaustive_search)
+			{
+				x_end = yd ? ((int)width - 1) : ((int)x - 1);
+				x_start = 0;
+			}
+			else
+			{
+				if (!yd)
+				{
+					if (x < 1)
+						continue;
 
-							if (best_type == 0)
-								match_vis(x, y).set(0, 255, 0, 255);
-							else if (best_type == 1)
-								match_vis(x, y).set(255, 255, 0, 255);
-							else
-								match_vis(x, y).set(255, 255, 255, 255);
+					x_start = maximum<int>((int)x - pLevel->m_search_dist * 2, 0);
+					x_end = maximum<int>((int)x - 1, 0);
+				}
+				else if ((yd == 1) && (pass == 0))
+				{
+					// The end of the previous scanline isn't coded yet while running as a wavefront.
+					if ((params.m_wavefront) || (width <= (uint32_t)pLevel->m_search_dist*2))
+						continue;
 
-							x++;
-						}
-						else
-						{
-							float best_t[3], best_se[3], best_bits[3];
-							uint32_t best_idx[3];
-							color_rgba best_delta_color[3][MAX_M * 2];
+					x_start = maximum<int>((int)width - pLevel->m_search_dist, 0);
+					x_end = width - 1;
+				}
+				else
+				{
+					x_start = maximum<int>((int)x - pLevel->m_search_dist, 0);
+					x_end = minimum<int>((int)x + pLevel->m_search_dist, (int)width - 1);
+				}
+			}
 
-							for (uint32_t o = 0; o < 2; o++)
-							{
-								eval_matches(M,
-									num_match_order_a, pMatch_order_a,
-									x + o * M, y,
-									best_t[o], best_se[o], best_bits[o], best_delta_color[o], best_idx[o],
-									find_optimal_hashers,
-									filter,
-									lambda,
-									orig_img,
-									delta_img,
-									coded_img,
-									h0,
-									h1,
-									smooth_block_mse_scales, num_comps, pLevel, params);
-
-								for (uint32_t k = 0; k < M; k++)
-								{
-									delta_img(x + o * M + k, y) = best_delta_color[o][k];
-									coded_img(x + o * M + k, y) = png_unpredict(best_delta_color[o][k], x + o * M + k, y, coded_img, filter, num_comps);
-								}
-							}
+			for (int xd = x_end; xd >= x_start; xd--)
+			{
+				assert(xd < (int)width);
+				assert((yd != 0) || (xd < (int)x));
 
-							eval_matches(M * 2,
-								num_match_order_b, pMatch_order_b,
-								x, y,
-								best_t[2], best_se[2], best_bits[2], best_delta_color[2], best_idx[2],
-								find_optimal_hashers,
-								filter,
-								lambda,
-								orig_img,
-								delta_img,
-								coded_img,
-								h0,
-								h1,
-								smooth_block_mse_scales, num_comps, pLevel, params);
-
-							float overall_mse_smooth_factor = 0;
-							for (uint32_t i = 0; i < M * 2; i++)
-								overall_mse_smooth_factor = maximum(overall_mse_smooth_factor, smooth_block_mse_scales(x + i, y));
-
-							float best_se_a = best_se[0] + best_se[1];
-							float best_mse_a = best_se_a * (1.0f / (float)(M * 2));
-							float best_bits_a = best_bits[0] + best_bits[1];
-							float best_t_a = best_mse_a * overall_mse_smooth_factor + best_bits_a * lambda;
-
-							if (best_t_a < best_t[2])
-							{
-								total_match_a++;
-								total_bits += best_bits_a;
+				const uint32_t match_dist = compute_png_match_dist(x, y, xd, y - yd, width, height, num_comps);
+				assert(match_dist >= 3);
 
-								for (uint32_t o = 0; o < 2; o++)
-								{
-									for (uint32_t k = 0; k < M; k++)
-									{
-										delta_img(x + o * M + k, y) = best_delta_color[o][k];
-										coded_img(x + o * M + k, y) = png_unpredict(best_delta_color[o][k], x + o * M + k, y, coded_img, filter, num_comps);
+				float bits = (float)compute_match_cost(match_dist, num_comps, h0, h1);
+				if (!can_beat_best_t(bits * lambda, best_t))
+					continue;
 
-										total_squared_err += compute_se(coded_img(x + o * M + k, y), orig_img(x + o * M + k, y), num_comps, params);
-									}
+				color_rgba delta_color(delta_img(xd, y - yd));
 
-									const uint32_t n = pMatch_order_a[best_idx[o]].v[0];
-									int x_ofs = 0;
-									for (uint32_t i = 0; i < n; i++)
-									{
-										uint32_t l = pMatch_order_a[best_idx[o]].v[1 + i];
+				color_rgba trial_coded_color(png_unpredict(delta_color, x, y, coded_img, filter, num_comps));
+				
+				float mse;
+				if (!evaluate_candidate_t<MODE, NUM_COMPS>(trial_coded_color, orig_color, orig_lab, params, mse))
+					continue;
 
-										match_len_hist[l]++;
+				float trial_t = smooth_block_mse_scales(x, y) * mse + bits * lambda;
+				if (trial_t < best_t)
+				{
+					best_delta_color = delta_img(xd, y - yd);
+					best_t = trial_t;
+					best_bits = bits;
+					best_squared_err = mse;
+					best_type = 2;
+				}
 
-										color_rgba c = get_match_len_color(l);
-										for (uint32_t j = 0; j < l; j++)
-											match_vis(x + o * M + x_ofs + j, y) = c;
+			} // xd
 
-										x_ofs += l;
-									}
+		} // pass
 
-									assert(best_idx[o] < num_match_order_a);
-									type_hist_a[best_idx[o]]++;
-								}
-							}
-							else
-							{
-								total_match_b++;
-								total_bits += best_bits[2];
+	} // yd
+}
 
-								for (uint32_t k = 0; k < M * 2; k++)
-								{
-									delta_img(x + k, y) = best_delta_color[2][k];
-									coded_img(x + k, y) = png_unpredict(best_delta_color[2][k], x + k, y, coded_img, filter, num_comps);
-
-									total_squared_err += compute_se(coded_img(x + k, y), orig_img(x + k, y), num_comps, params);
-								}
-
-								const uint32_t n = pMatch_order_b[best_idx[2]].v[0];
-								int x_ofs = 0;
-								for (uint32_t i = 0; i < n; i++)
-								{
-									uint32_t l = pMatch_order_b[best_idx[2]].v[1 + i];
-
-									match_len_hist[l]++;
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void find_optimal_n(
+	int n,
+	color_rgba* pBest_delta_colors, float& best_bits, float& best_squared_err, float& best_t, 
+	uint32_t x, uint32_t y, uint32_t min_y,
+	const image& orig_img, image& coded_img, const image& delta_img,
+	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1, 
+	const vector2D<float>& smooth_block_mse_scales,
+	uint32_t filter, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
+{
+	assert(n >= 1 && n <= MAX_DELTA_COLORS);
+	const uint32_t width = orig_img.get_width(), height = orig_img.get_height();
+	const float oon = 1.0f / (float)n;
 
-									color_rgba c = get_match_len_color(l);
-									for (uint32_t j = 0; j < l; j++)
-										match_vis(x + x_ofs + j, y) = c;
+	color_rgba orig_colors[MAX_DELTA_COLORS];
+	Lab orig_labs[MAX_DELTA_COLORS];
+	for (uint32_t i = 0; i < (uint32_t)n; i++)
+	{
+		orig_colors[i] = orig_img(x + i, y);
+		orig_labs[i] = get_orig_lab(orig_colors[i], params);
+	}
 
-									x_ofs += l;
-								}
+	float mse_scale = 0.0f;
+	for (uint32_t i = 0; i < (uint32_t)n; i++)
+		mse_scale = maximum(mse_scale, smooth_block_mse_scales(x + i, y));
+	
+	for (int yd = 0; yd < (int)pLevel->m_num_scanlines_to_check; yd++)
+	{
+		if (((int)y - yd) < (int)min_y)
+			break;
 
-								assert(best_idx[2] < num_match_order_b);
-								type_hist_b[best_idx[2]]++;
-							}
+		int x_start, x_end;
+		const int total_passes = ((yd == 1) && !pLevel->m_exhaustive_search) ? 2 : 1;
+		for (int pass = 0; pass < total_passes; pass++)
+		{
+			if (pLevel->m_exhaustive_search)
+			{
+				x_end = yd ? ((int)width - n) : ((int)x - n);
+				x_start = 0;
+			}
+			else
+			{
+				if (!yd)
+				{
+					if ((int)x < n)
+						continue;
 
-							x += M * 2;
-						}
+					x_start = maximum<int>((int)x - pLevel->m_search_dist * 2, 0);
+					x_end = maximum<int>((int)x - n, 0);
+				}
+				else if ((yd == 1) && (pass == 0))
+				{
+					if ((params.m_wavefront) || (width <= (uint32_t)pLevel->m_search_dist * 2))
+						continue;
 
-						assert(x <= width);
-					} // while (x < width)
+					x_start = maximum<int>((int)width - pLevel->m_search_dist, 0);
+					x_end = width - n;
 				}
 				else
 				{
-					uint32_t x = 0;
-					while (x < width)
-					{
-						if ((x + M) > width)
-						{
-							color_rgba best_delta_color;
-							float best_bits, best_t, best_squared_err;
-							uint32_t best_type;
-
-							find_optimal1(best_delta_color, best_bits, best_squared_err, best_t, best_type,
-								x, y,
-								orig_img, coded_img, delta_img,
-								lambda, h0, h1,
-								smooth_block_mse_scales, filter, num_comps, pLevel, params);
+					x_start = maximum<int>((int)x - pLevel->m_search_dist, 0);
+					x_end = minimum<int>((int)x + pLevel->m_search_dist, (int)width - n);
+				}
+			}
 
-							delta_img(x, y) = best_delta_color;
-							coded_img(x, y) = png_unpredict(best_delta_color, x, y, coded_img, filter, num_comps);
+			for (int xd = x_end; xd >= x_start; xd--)
+			{
+				assert((xd + n - 1) < (int)width);
+				assert((yd != 0) || ((xd + n - 1) < (int)x));
 
-							total_squared_err += compute_se(coded_img(x, y), orig_img(x, y), num_comps, params);
-							total_bits += best_bits;
+				const uint32_t match_dist = compute_png_match_dist(x, y, xd, y - yd, width, height, num_comps);
+				assert(match_dist >= 3);
 
-							match_len_hist[1]++;
+				float bits = (float)compute_match_cost(match_dist, n * num_comps, h0, h1);
+				if (!can_beat_best_t(bits * lambda, best_t))
+					continue;
 
-							if (best_type == 0)
-								match_vis(x, y).set(0, 255, 0, 255);
-							else if (best_type == 1)
-								match_vis(x, y).set(255, 255, 0, 255);
-							else
-								match_vis(x, y).set(255, 255, 255, 255);
+				color_rgba delta_color[MAX_DELTA_COLORS];
+				for (uint32_t i = 0; i < (uint32_t)n; i++)
+					delta_color[i] = delta_img(xd + i, y - yd);
 
-							x++;
-						}
-						else
-						{
-							float best_t, best_se, best_bits;
-							uint32_t best_idx;
-							color_rgba best_delta_color[MAX_M];
-
-							eval_matches(M,
-								num_match_order_a, pMatch_order_a,
-								x, y,
-								best_t, best_se, best_bits, best_delta_color, best_idx,
-								find_optimal_hashers,
-								filter,
-								lambda,
-								orig_img,
-								delta_img,
-								coded_img,
-								h0,
-								h1,
-								smooth_block_mse_scales, num_comps, pLevel, params);
-
-							for (uint32_t k = 0; k < M; k++)
-							{
-								delta_img(x + k, y) = best_delta_color[k];
-								coded_img(x + k, y) = png_unpredict(best_delta_color[k], x + k, y, coded_img, filter, num_comps);
+				// Any rejected pixel rejects the whole match. The sum only grows, so once the cost of the pixels so far can't beat best_t the rest are skipped. 
+				// The pixels of coded_img this writes are rewritten by every candidate before they're read, and by the caller once the best match is known.
+				float se = 0.0f;
+				bool reject_flag = false;
+				for (uint32_t i = 0; i < (uint32_t)n; i++)
+				{
+					const color_rgba trial_coded_color(png_unpredict(delta_color[i], x + i, y, coded_img, filter, num_comps));
+					coded_img(x + i, y) = trial_coded_color;
 
-								total_squared_err += compute_se(coded_img(x + k, y), orig_img(x + k, y), num_comps, params);
-							}
+					float pixel_se;
+					if (!evaluate_candidate_t<MODE, NUM_COMPS>(trial_coded_color, orig_colors[i], orig_labs[i], params, pixel_se))
+					{
+						reject_flag = true;
+						break;
+					}
+					se += pixel_se;
 
-							total_match_a++;
-							total_bits += best_bits;
+					if (((i + 1) < (uint32_t)n) && ((mse_scale * (se * oon) + bits * lambda) >= best_t))
+					{
+						RDO_PNG_COUNT_CANDIDATES_ADD(cCandidatesCutShort, 1);
+						reject_flag = true;
+						break;
+					}
+				}
+				if (reject_flag)
+					continue;
 
-							const uint32_t n = pMatch_order_a[best_idx].v[0];
-							int x_ofs = 0;
-							for (uint32_t i = 0; i < n; i++)
-							{
-								uint32_t l = pMatch_order_a[best_idx].v[1 + i];
+				float mse = se * oon;
 
-								match_len_hist[l]++;
+				float trial_t = mse_scale * mse + bits * lambda;
+				if (trial_t < best_t)
+				{
+					for (uint32_t i = 0; i < (uint32_t)n; i++)
+						pBest_delta_colors[i] = delta_color[i];
 
-								color_rgba c = get_match_len_color(l);
-								for (uint32_t j = 0; j < l; j++)
-									match_vis(x + x_ofs + j, y) = c;
+					best_t = trial_t;
+					best_bits = bits;
+					best_squared_err = se;
+				}
+			} // xd
 
-								x_ofs += l;
-							}
-							assert(x_ofs == M);
+		} // pass
+	
+	} // yd
+}
 
-							assert(best_idx < num_match_order_a);
-							type_hist_a[best_idx]++;
+static float compute_image_metrics(const image& a, const image& b, uint32_t num_comps, float& y_psnr, bool print)
+{
+	image_metrics im;
+	im.calc(a, b, 0, 3);
+	if (print)
+		im.print("RGB    ");
 
-							x += M;
-						}
+	float psnr = im.m_psnr;
 
-						assert(x <= width);
-					} // while (x < width)
-				}
+	if (num_comps == 4)
+	{
+		im.calc(a, b, 0, 4);
+		if (print)
+			im.print("RGBA   ");
 
-				float scanline_t = (total_squared_err / width) + total_bits * lambda;
+		psnr = im.m_psnr;
+	}
 
-				// TODO - what to default to?
-				//if (scanline_t < best_scanline_t)
-				if (total_squared_err < best_scanline_err)
-				{
-					best_scanline_t = scanline_t;
-					best_scanline_err = total_squared_err;
-					best_filter = filter;
-					memcpy(best_delta_pixels.data(), &delta_img(0, y), width * sizeof(color_rgba));
-					memcpy(best_coded_pixels.data(), &coded_img(0, y), width * sizeof(color_rgba));
-				}
+	if (print)
+	{
+		im.calc(a, b, 0, 1);
+		im.print("R      ");
 
-			} // filter
+		im.calc(a, b, 1, 1);
+		im.print("G      ");
 
-			memcpy(&delta_img(0, y), best_delta_pixels.data(), width * sizeof(color_rgba));
-			memcpy(&coded_img(0, y), best_coded_pixels.data(), width * sizeof(color_rgba));
-			filters[y] = (uint8_t)best_filter;
-			filter_hist[best_filter]++;
+		im.calc(a, b, 2, 1);
+		im.print("B      ");
 
-		} //y
-		
-		if (params.m_print_progress)
+		if (num_comps == 4)
 		{
-			printf("\b\b\b\b\b\b\b\b        \b\b\b\b\b\b\b\b\n");
-			fflush(stdout);
+			im.calc(a, b, 3, 1);
+			im.print("A      ");
 		}
+	}
 
-		if (params.m_print_debug_output)
-		{
-			printf("Total match_a: %u match_b: %u\n", total_match_a, total_match_b);
-			printf("\n");
+	im.calc(a, b, 0, 0);
+	if (print)
+		im.print("Y 709  ");
 
-			printf("Filter hist:\n");
-			for (uint32_t i = 1; i <= 4; i++)
-				printf("%u %u\n", i, filter_hist[i]);
-			printf("\n");
+	y_psnr = im.m_psnr;
 
-			printf("Match len hist:\n");
-			for (uint32_t i = 1; i <= MAX_DELTA_COLORS; i++)
-				printf("%u: %u\n", i, match_len_hist[i]);
-			printf("\n");
+	if (print)
+		printf("\n");
+		
+	return psnr;
+}
 
-			printf("Match order A hist:\n");
-			for (uint32_t i = 0; i < num_match_order_a; i++)
-				printf("%u: %u\n", i, type_hist_a[i]);
-			printf("\n");
+static float compute_normal_map_image_metrics(const image& enc_img, const image& orig_img, bool print_flag, const rdo_png_params& params)
+{
+	float max_err = -1e+9f, min_err = 1e+9f;
 
-			printf("Match order B hist:\n");
-			for (uint32_t i = 0; i < num_match_order_b; i++)
-				printf("%u: %u\n", i, type_hist_b[i]);
-			printf("\n");
+	double total_err = 0.0f, total_err2 = 0.0f;
+	running_stat len_a_stats, len_b_stats;
 
-			char buf[256];
-			sprintf(buf, "dbg_match_vis_%u.png", encoder_pass);
-			save_png(buf, match_vis);
+	uint32_t total_invalid_a = 0, total_invalid_b = 0;
 
-			sprintf(buf, "dbg_delta_img_%u.png", encoder_pass);
-			save_png(buf, delta_img);
-		}
+	const float INVALID_LEN_THRESHOLD = .4f;
 
-		if (encoder_pass == (num_encoder_passes - 1))
+	for (uint32_t y = 0; y < orig_img.get_height(); y++)
+	{
+		for (uint32_t x = 0; x < orig_img.get_width(); x++)
 		{
-			g_use_miniz = false;
-			save_png(params.m_output_file_data, coded_img, 0, 0, -1, filters.data(), &comp_size);
-			g_use_miniz = true;
+			const color_rgba& ca = enc_img(x, y);
+			const color_rgba& cb = orig_img(x, y);
+						
+			vec3F caf(decode_normal(ca, params));
+			vec3F cbf(decode_normal(cb, params));
+			
+			float len_a = caf.length();
+			len_a_stats.push(len_a);
+			
+			if (len_a < INVALID_LEN_THRESHOLD)
+				total_invalid_a++;
+			if (len_a > (1.0f + INVALID_LEN_THRESHOLD))
+				total_invalid_a++;
 
-			params.m_output_image = coded_img;
-		}
-		else
-		{
-			for (uint32_t i = 0; i < 288; i++)
-				buminiz::g_defl_freq[0][i] = 0;
+			if (len_a != 0)
+				caf /= len_a;
 
-			for (uint32_t i = 0; i < 32; i++)
-				buminiz::g_defl_freq[1][i] = 0;
+			float len_b = cbf.length();
+			len_b_stats.push(len_b);
 
-			save_png("pass0_output_miniz.png", coded_img, 0, 0, -1, filters.data(), &comp_size);
+			if (len_b < INVALID_LEN_THRESHOLD)
+				total_invalid_b++;
 
-			for (uint32_t i = 0; i < 288; i++)
-				ht0[i] = maximum<uint32_t>(1U, (uint32_t)buminiz::g_defl_freq[0][i]);
+			if (len_b != 0)
+				cbf /= len_b;
 
-			for (uint32_t i = 0; i < 32; i++)
-				ht1[i] = maximum<uint32_t>(1U, (uint32_t)buminiz::g_defl_freq[1][i]);
+			float dot = clamp<float>(caf.dot(cbf), -1.0f, 1.0f);
+			
+			float err_degrees = acosf(dot) * RAD_TO_DEG;
 
-			g_use_miniz = false;
-			save_png("pass0_output.png", coded_img, 0, 0, -1, filters.data(), &comp_size);
-			g_use_miniz = true;
-		}
+			max_err = maximum(max_err, err_degrees);
+			min_err = minimum(min_err, err_degrees);
+			total_err += err_degrees;
+			total_err2 += err_degrees * err_degrees;
+		} // x
+	} // y
 
-		if (has_alpha)
-		{
-			if (params.m_debug_images)
-			{
-				char buf[256];
-				sprintf(buf, "dbg_coded_rgb_%u.png", encoder_pass);
-				save_png(buf, coded_img, cImageSaveIgnoreAlpha, 0);
-				
-				sprintf(buf, "dbg_coded_alpha_%u.png", encoder_pass);
-				save_png(buf, coded_img, cImageSaveGrayscale, 3);
-			}
-		}
-				
-		params.m_psnr = compute_image_metrics(coded_img, orig_img, num_comps, params.m_y_psnr, params.m_print_stats);
-		if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
-			params.m_angular_rms_error = compute_normal_map_image_metrics(coded_img, orig_img, params.m_print_stats, params);
-		
-		params.m_bpp = (comp_size * 8.0f) / (float)total_pixels;
+	const double total_pixels = (double)orig_img.get_total_pixels();
 
-		if (params.m_print_stats)
-		{
-			printf("Compressed file size: %llu, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
-				(unsigned long long)comp_size,
-				params.m_bpp,
-				params.m_psnr / params.m_bpp,
-				params.m_y_psnr / params.m_bpp);
-		}
+	if (print_flag)
+	{
+		printf("Total apparently invalid (len < %3.3f or >%3.3f): Encoded: %u Original: %u\n", INVALID_LEN_THRESHOLD, INVALID_LEN_THRESHOLD + 1.0f, total_invalid_a, total_invalid_b);
+		printf("Length statistics: Encoded: Avg %3.3f Std Dev %3.3f, Original: Avg %3.3f Std Dev: %3.3f\n",
+			len_a_stats.get_mean(), len_a_stats.get_std_dev(),
+			len_b_stats.get_mean(), len_b_stats.get_std_dev());
 
-		if (params.m_debug_images)
-		{
-			image recovered_img(width, height);
-			for (uint32_t y = 0; y < height; y++)
-				for (uint32_t x = 0; x < width; x++)
-					recovered_img(x, y) = png_unpredict(delta_img(x, y), x, y, recovered_img, filters[y], num_comps);
+		printf("Angular error:\n");
+		printf("Minimum: %3.3f degrees\nMaximum: %3.3f degrees\n", min_err, max_err);
+		printf("Average: %3.3f degrees\n", total_err / total_pixels);
+		printf("Std Dev: %3.3f degrees\n", sqrt(total_pixels * total_err2 - total_err * total_err) / total_pixels);
+	}
 
-			char buf[256];
-			sprintf(buf, "dbg_unpredicted_%u.png", encoder_pass);
-			save_png(buf, recovered_img);
-		}
-
-	} // encoder_pass
+	const double rms_error = sqrt(total_err2 / total_pixels);
 	
-	return true;
+	if (print_flag)
+	{
+		printf("RMS:     %3.3f degrees\n\n", rms_error);
+	}
+
+	return (float)rms_error;
 }
 
-#define QOI_IMPLEMENTATION
-#include "qoi.h"
+struct find_optimal_hash_key
+{
+	uint32_t m_x_ofs;
+	color_rgba m_prev_delta_colors[MAX_DELTA_COLORS];
 
-#pragma pack(push, 1)
-struct qoi_header
+	operator size_t() const
+	{
+		return hash_hsieh((const uint8_t*)&m_x_ofs, sizeof(m_x_ofs) + sizeof(color_rgba) * m_x_ofs);
+	}
+
+	bool operator== (const find_optimal_hash_key& rhs) const
+	{
+		if (m_x_ofs != rhs.m_x_ofs)
+			return false;
+		for (uint32_t i = 0; i < m_x_ofs; i++)
+			if (m_prev_delta_colors[i] != rhs.m_prev_delta_colors[i])
+				return false;
+		return true;
+	}
+};
+
+struct find_optimal_hash_value
 {
-	char magic[4]; // magic bytes "qoif"
-	uint32_t width; // image width in pixels (BE)
-	uint32_t height; // image height in pixels (BE)
-	uint8_t channels; // 3 = RGB, 4 = RGBA
-	uint8_t colorspace; // 0 = sRGB with linear alpha 1 = all channels linear
+	color_rgba m_delta_colors[MAX_DELTA_COLORS];
+	float m_bits;
+	float m_t;
+	float m_squared_err;
 };
-#pragma pack(pop)
 
-static void encode_qoi(const image& img, uint8_vec& data)
+typedef basisu::hash_map<find_optimal_hash_key, find_optimal_hash_value> find_optimal_hash_map;
+
+static color_rgba get_match_len_color(uint32_t l)
 {
-	color_rgba hash[64];
-	clear_obj(hash);
+	color_rgba c = g_black_color;
+	switch (l)
+	{
+	case 1: c.set(255, 0, 0, 255); break;
+	case 2: c.set(255, 255, 0, 255); break;
+	case 3: c.set(255, 0, 255, 255); break;
+	case 4: c.set(128, 128, 128, 255); break;
+	case 5: c.set(255, 128, 255, 255); break;
+	case 6: c.set(255, 255, 128, 255); break;
+	case 7: c.set(255, 128, 0, 255); break;
+	case 8: c.set(255, 64, 64, 255); break;
+	case 9: c.set(255, 255, 64, 255); break;
+	case 10: c.set(64, 64, 255, 255); break;
+	case 11: c.set(255, 64, 255, 255); break;
+	case 12: c.set(255, 255, 255, 255); break;
+	}
+	return c;
+}
 
-	data.resize(0);
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void eval_matches(int m, 
+	uint32_t num_match_order, const match_order *pMatch_order,
+	int x, int y, uint32_t min_y,
+	float &best_t, float &best_se, float &best_bits, color_rgba *best_delta_color, uint32_t &best_idx,
+	find_optimal_hash_map* pFind_optimal_hashers,
+	int filter,
+	float lambda, 
+	const image& orig_img,
+	image& delta_img,
+	image& coded_img,
+	const huffman_encoding_table &h0, 
+	const huffman_encoding_table& h1,
+	const vector2D<float> &smooth_block_mse_scales, uint32_t num_comps, const rdo_png_level *pLevel, const rdo_png_params &params)
+{
+	assert(pMatch_order[0].v[1] == m);
 
-	qoi_header hdr;
-	memcpy(hdr.magic, "qoif", 4);
-	hdr.width = byteswap_32(img.get_width());
-	hdr.height = byteswap_32(img.get_height());
-	hdr.channels = img.has_alpha() ? 4 : 3;
-	hdr.colorspace = 0;
-	data.resize(sizeof(hdr));
-	memcpy(data.data(), &hdr, sizeof(hdr));
+	best_t = 1e+9f;
+	best_se = 1e+9f;
+	best_bits = 1e+9f;
+	best_idx = 0;
 
-	int prev_r = 0, prev_g = 0, prev_b = 0, prev_a = 255;
-	uint32_t cur_run_len = 0;
+	float mse_smooth_factor = 0;
+	for (uint32_t i = 0; i < (uint32_t)m; i++)
+		mse_smooth_factor = maximum(mse_smooth_factor, smooth_block_mse_scales(x + i, y));
 
-	for (uint32_t y = 0; y < img.get_height(); y++)
+	for (uint32_t i = 0; i < (uint32_t)m; i++)
+		pFind_optimal_hashers[i].reset();
+	
+	for (uint32_t i = 0; i < num_match_order; i++)
 	{
-		for (uint32_t x = 0; x < img.get_width(); x++)
+		const uint32_t n = pMatch_order[i].v[0];
+
+		color_rgba delta_color[MAX_DELTA_COLORS];
+		float bits[MAX_DELTA_COLORS], st[MAX_DELTA_COLORS], squared_err[MAX_DELTA_COLORS];
+		for (uint32_t j = 0; j < (uint32_t)m; j++)
 		{
-			const color_rgba& c = img(x, y);
+			bits[j] = 1e+9f;
+			st[j] = 1e+9f;
+			squared_err[j] = 1e+9;
+		}
 
-			if ((c.r == prev_r) && (c.g == prev_g) && (c.b == prev_b) && (c.a == prev_a))
+		uint32_t x_ofs = 0;
+		for (uint32_t j = 0; j < n; j++)
+		{
+			const uint32_t len = pMatch_order[i].v[j + 1];
+			assert((int)len <= m);
+
+			st[j] = 1e+9f;
+														
+			if (len == 1)
 			{
-				cur_run_len++;
-				if (cur_run_len == 62)
+				uint32_t best_type;
+
+				find_optimal_hash_key k;
+				k.m_x_ofs = x_ofs;
+				for (uint32_t q = 0; q < x_ofs; q++)
+					k.m_prev_delta_colors[q] = delta_img(x + q, y);
+
+				auto find_res = pFind_optimal_hashers[0].find(k);
+				if (find_res != pFind_optimal_hashers[0].end())
 				{
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
-				}
-				continue;
-			}
+					const find_optimal_hash_value& v = find_res->second;
 
-			if (cur_run_len)
-			{
-				data.push_back((64 + 128) | (cur_run_len - 1));
-				cur_run_len = 0;
-			}
+					delta_color[j] = v.m_delta_colors[0];
+					bits[j] = v.m_bits;
+					st[j] = v.m_t;
+					squared_err[j] = v.m_squared_err;
+				}
+				else
+				{
+					find_optimal1<MODE, NUM_COMPS>(
+						delta_color[j], bits[j], squared_err[j], st[j], best_type,
+						x + x_ofs, y, min_y,
+						orig_img, coded_img, delta_img,
+						lambda, h0, h1, 
+						smooth_block_mse_scales, filter, num_comps, pLevel, params);
 
-			uint32_t hash_idx = (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
-			color_rgba& hash_color = hash[hash_idx];
+					find_optimal_hash_value v;
+					v.m_delta_colors[0] = delta_color[j];
+					v.m_bits = bits[j];
+					v.m_t = st[j];
+					v.m_squared_err = squared_err[j];
 
-			if (c == hash_color)
-			{
-				data.push_back(hash_idx);
+					pFind_optimal_hashers[0].insert(k, v);
+				}
 			}
 			else
 			{
-				hash[hash_idx] = c;
-
-				int dr = ((int)c.r - prev_r + 2) & 255;
-				int dg = ((int)c.g - prev_g + 2) & 255;
-				int db = ((int)c.b - prev_b + 2) & 255;
+				find_optimal_hash_key k;
+				k.m_x_ofs = x_ofs;
+				for (uint32_t q = 0; q < x_ofs; q++)
+					k.m_prev_delta_colors[q] = delta_img(x + q, y);
 
-				if (c.a == prev_a)
+				auto find_res = pFind_optimal_hashers[len - 1].find(k);
+				if (find_res != pFind_optimal_hashers[len - 1].end())
 				{
-					if ((dr <= 3) && (dg <= 3) && (db <= 3))
-					{
-						data.push_back(64 + (dr << 4) + (dg << 2) + db);
-					}
-					else
-					{
-						int g_diff = (int)c.g - prev_g;
-
-						dg = (g_diff + 32) & 255;
+					const find_optimal_hash_value& v = find_res->second;
 
-						dr = (((int)c.r - prev_r) - g_diff + 8) & 255;
-						db = (((int)c.b - prev_b) - g_diff + 8) & 255;
+					for (uint32_t q = 0; q < len; q++)
+						delta_color[j + q] = v.m_delta_colors[q];
 
-						if ((dg <= 63) && (dr <= 15) && (db <= 15))
-						{
-							data.push_back((uint8_t)(128 + dg));
-							data.push_back((uint8_t)((dr << 4) | db));
-						}
-						else
-						{
-							data.push_back(254);
-							data.push_back((uint8_t)c.r);
-							data.push_back((uint8_t)c.g);
-							data.push_back((uint8_t)c.b);
-						}
-					}
+					bits[j] = v.m_bits;
+					st[j] = v.m_t;
+					squared_err[j] = v.m_squared_err;
 				}
 				else
 				{
-					data.push_back(255);
-					data.push_back((uint8_t)c.r);
-					data.push_back((uint8_t)c.g);
-					data.push_back((uint8_t)c.b);
-					data.push_back((uint8_t)c.a);
+					find_optimal_n<MODE, NUM_COMPS>(len,
+						delta_color + j, bits[j], squared_err[j], st[j],
+						x + x_ofs, y, min_y,
+						orig_img, coded_img, delta_img,
+						lambda, h0, h1, 
+						smooth_block_mse_scales, filter, num_comps, pLevel, params);
+
+					find_optimal_hash_value v;
+					for (uint32_t q = 0; q < len; q++)
+						v.m_delta_colors[q] = delta_color[j + q];
+					v.m_bits = bits[j];
+					v.m_t = st[j];
+					v.m_squared_err = squared_err[j];
+
+					pFind_optimal_hashers[len - 1].insert(k, v);
 				}
 			}
 
-			prev_r = c.r;
-			prev_g = c.g;
-			prev_b = c.b;
-			prev_a = c.a;
-		}
-	}
+			for (uint32_t k = 0; k < len; k++)
+			{
+				delta_img(x + x_ofs + k, y) = delta_color[j + k];
+				coded_img(x + x_ofs + k, y) = png_unpredict(delta_color[j + k], x + x_ofs + k, y, coded_img, filter, num_comps);
+			}
 
-	if (cur_run_len)
-	{
-		data.push_back((64 + 128) | (cur_run_len - 1));
-		cur_run_len = 0;
-	}
+			x_ofs += len;
+		}
+		assert(x_ofs == m);
 
-	for (uint32_t i = 0; i < 7; i++)
-		data.push_back(0);
-	data.push_back(1);
-}
+		float total_bits = 0.0f;
+		float total_se = 0.0f;
+		for (uint32_t j = 0; j < n; j++)
+		{
+			total_bits += bits[j];
+			total_se += squared_err[j];
+		}
+		float mse = total_se / (float)m;
+		float t = mse * mse_smooth_factor + total_bits * lambda;
+		if (t < best_t)
+		{
+			best_t = t;
+			best_idx = i;
+			best_bits = total_bits;
+			best_se = total_se;
 
-static bool encode_rdo_qoi(
-	const image& orig_img,
-	uint8_vec& data,
-	const rdo_png_params& params,
-	const vector2D<float>& smooth_block_mse_scales,
-	float lambda)
-{
-	// This function wasn't designed to deal with lambda=0, so nudge it up.
-	lambda = maximum(lambda, .0000125f);
+			for (uint32_t k = 0; k < (uint32_t)m; k++)
+			{
+				best_delta_color[k] = delta_img(x + k, y);
+			}
 
-	const bool has_alpha = orig_img.has_alpha();
-	uint32_t num_comps = has_alpha ? 4 : 3;
+			if (mse == 0.0f)
+				break;
+		}
 
-	color_rgba hash[64];
-	clear_obj(hash);
+	} // i
 
-	data.resize(0);
+	assert(best_t != 1e+9f);
+}
 
-	qoi_header hdr;
-	memcpy(hdr.magic, "qoif", 4);
-	hdr.width = byteswap_32(orig_img.get_width());
-	hdr.height = byteswap_32(orig_img.get_height());
-	hdr.channels = has_alpha ? 4 : 3;
-	hdr.colorspace = 0;
-	data.resize(sizeof(hdr));
-	memcpy(data.data(), &hdr, sizeof(hdr));
+// Lambda independent data computed from the source image, which rdo_search_lambda() shares between its trial encodes.
+struct rdo_image_cache
+{
+	rdo_image_cache() :
+		m_has_smooth_maps(false),
+		m_has_huffman_stats(false)
+	{
+	}
 
-	int prev_r = 0, prev_g = 0, prev_b = 0, prev_a = 255;
-	uint32_t cur_run_len = 0;
+	vector2D<float> m_smooth_block_mse_scales;
+	bool m_has_smooth_maps;
 
-	enum commands_t
-	{
-		cRUN,
-		cIDX,
-		cDELTA,
-		cLUMA,
-		cRGB,
-		cRGBA,
-	};
+	// PNG only: the Deflate literal/distance histograms of the source image coded with the Average filter, used to build the initial Huffman tables.
+	histogram m_ht0, m_ht1;
+	bool m_has_huffman_stats;
+};
 
-	uint32_t total_run = 0, total_rgb = 0, total_rgba = 0, total_index = 0, total_delta = 0, total_luma = 0, total_run_pixels = 0;
+// The farthest create_smooth_maps() looks from each pixel. Maps computed from a horizontal band of the image padded by this many scanlines match the whole image's maps inside the band.
+const uint32_t SMOOTH_MAP_RADIUS = 5;
 
-	for (uint32_t y = 0; y < orig_img.get_height(); y++)
-	{
-		if (params.m_print_progress)
-		{
-			if ((y & 15) == 0)
-			{
-				printf("\b\b\b\b\b\b\b\b%3.2f%%", y * 100.0f / orig_img.get_height());
-				fflush(stdout);
-			}
-		}
+static void create_smooth_maps(
+	vector2D<float> &smooth_block_mse_scales,
+	const image& orig_img,
+	rdo_png_params &params)
+{
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const uint32_t total_pixels = orig_img.get_total_pixels();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
 
-		for (uint32_t x = 0; x < orig_img.get_width(); x++)
-		{
-			const color_rgba& c = orig_img(x, y);
-			const float mse_scale = smooth_block_mse_scales(x, y);
+	if (params.m_no_mse_scaling)
+	{
+		smooth_block_mse_scales.set_all(1.0f);
+		return;
+	}
 
-			float best_mse = 0.0f;
-			float best_bits = 40.0f;
-			float best_t = best_mse + best_bits * lambda;
-			int best_command = cRGBA;
-			int best_index = 0, best_dr = 0, best_dg = 0, best_db = 0;
+	image smooth_vis(width, height);
+	image alpha_edge_vis(width, height);
+	image ultra_smooth_vis(width, height);
 
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			float alpha_edge_yl = 0.0f;
+			if ((num_comps == 4) && (params.m_alpha_is_opacity))
 			{
-				color_rgba trial_c(c.r, c.g, c.b, prev_a);
-				if (!should_reject(trial_c, c, 4, params))
+				tracked_stat alpha_comp_stats;
+				for (int yd = -3; yd <= 3; yd++)
 				{
-					float mse = compute_se(trial_c, c, 4, params);
-					float bits = 32.0f;
-					float trial_t = mse_scale * mse + bits * lambda;
-					if (trial_t < best_t)
+					for (int xd = -3; xd <= 3; xd++)
 					{
-						best_mse = mse;
-						best_bits = bits;
-						best_t = trial_t;
-						best_command = cRGB;
+						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
+						alpha_comp_stats.update(p[3]);
 					}
 				}
+
+				float max_std_dev = alpha_comp_stats.get_std_dev();
+
+				float yl = clampf(max_std_dev / params.m_max_smooth_std_dev, 0.0f, 1.0f);
+				alpha_edge_yl = yl * yl;
 			}
 
 			{
-				color_rgba trial_c(prev_r, prev_g, prev_b, prev_a);
-				if (!should_reject(trial_c, c, 4, params))
+				tracked_stat comp_stats[4];
+				for (int yd = -1; yd <= 1; yd++)
 				{
-					float mse = compute_se(trial_c, c, 4, params);
-					float bits = cur_run_len ? 0 : 8.0f;
-					float trial_t = mse_scale * mse + bits * lambda;
-					if (trial_t < best_t)
+					for (int xd = -1; xd <= 1; xd++)
 					{
-						best_mse = mse;
-						best_bits = bits;
-						best_t = trial_t;
-						best_command = cRUN;
+						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
+						comp_stats[0].update(p[0]);
+						comp_stats[1].update(p[1]);
+						comp_stats[2].update(p[2]);
+						if (num_comps == 4)
+							comp_stats[3].update(p[3]);
+					}
+				}
 
-						if (best_mse == 0.0f)
-						{
-							cur_run_len++;
-							if (cur_run_len == 62)
-							{
-								total_run_pixels += cur_run_len;
+				float max_std_dev = 0.0f;
+				for (uint32_t i = 0; i < num_comps; i++)
+					max_std_dev = std::max(max_std_dev, comp_stats[i].get_std_dev());
 
-								data.push_back(0xC0 | (cur_run_len - 1));
-								cur_run_len = 0;
+				float yl = clampf(max_std_dev / params.m_max_smooth_std_dev, 0.0f, 1.0f);
+				yl = yl * yl;
 
-								total_run++;
-							}
+				smooth_block_mse_scales(x, y) = lerp(params.m_smooth_max_mse_scale, 1.0f, yl);
 
-							hash[(prev_r * 3 + prev_g * 5 + prev_b * 7 + prev_a * 11) & 63].set(prev_r, prev_g, prev_b, prev_a);
+				if (num_comps == 4)
+				{
+					alpha_edge_vis(x, y).set((int)std::round(alpha_edge_yl * 255.0f));
 
-							continue;
-						}
-					}
+					smooth_block_mse_scales(x, y) = lerp(smooth_block_mse_scales(x, y), params.m_smooth_max_mse_scale, alpha_edge_yl);
 				}
+
+				smooth_vis(x, y).set(clamp((int)((smooth_block_mse_scales(x, y) - 1.0f) / (params.m_smooth_max_mse_scale - 1.0f) * 255.0f + .5f), 0, 255));
 			}
 
-			if (8.0f * lambda < best_t)
 			{
-				uint32_t hash_idx = (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
-				
-				// First try the INDEX command losslessly.
-				if (c == hash[hash_idx])
-				{
-					float bits = 8.0f;
-					float trial_t = bits * lambda;
-
-					assert(trial_t < best_t);
+				tracked_stat comp_stats[4];
 
-					best_mse = 0.0f;
-					best_bits = bits;
-					best_t = trial_t;
-					best_command = cIDX;
-					best_index = hash_idx;
-				}
-				else
+				const int S = SMOOTH_MAP_RADIUS;
+				for (int yd = -S; yd < S; yd++)
 				{
-					// Try a lossy INDEX command.
-					for (uint32_t i = 0; i < 64; i++)
+					for (int xd = -S; xd < S; xd++)
 					{
-						if (!should_reject(hash[i], c, 4, params))
-						{
-							float mse = compute_se(hash[i], c, 4, params);
-							float bits = 8.0f;
-							float trial_t = mse_scale * mse + bits * lambda;
-							if (trial_t < best_t)
-							{
-								best_mse = mse;
-								best_bits = bits;
-								best_t = trial_t;
-								best_command = cIDX;
-								best_index = i;
-							}
-						}
+						const color_rgba& p = orig_img.get_clamped((int)x + xd, (int)y + yd);
+						comp_stats[0].update(p[0]);
+						comp_stats[1].update(p[1]);
+						comp_stats[2].update(p[2]);
+						if (num_comps == 4)
+							comp_stats[3].update(p[3]);
 					}
 				}
-			}
 
-			if (8.0f * lambda < best_t)
-			{
-				bool delta_encodable_losslessly = false;
+				float max_std_dev = 0.0f;
+				for (uint32_t i = 0; i < num_comps; i++)
+					max_std_dev = std::max(max_std_dev, comp_stats[i].get_std_dev());
 
-				// First try the DELTA command losslessly.
-				if (c.a == prev_a)
-				{
-					int dr = ((int)c.r - prev_r + 2) & 255;
-					int dg = ((int)c.g - prev_g + 2) & 255;
-					int db = ((int)c.b - prev_b + 2) & 255;
-					
-					if ((dr <= 3) && (dg <= 3) && (db <= 3))
-					{
-						delta_encodable_losslessly = true;
+				float yl = clampf(max_std_dev / params.m_max_ultra_smooth_std_dev, 0.0f, 1.0f);
+				yl = powf(yl, 3.0f);
 
-						float bits = 8.0f;
-						float trial_t = bits * lambda;
+				smooth_block_mse_scales(x, y) = lerp(params.m_ultra_smooth_max_mse_scale, smooth_block_mse_scales(x, y), yl);
 
-						assert(trial_t < best_t);
-												
-						best_mse = 0.0f;
-						best_bits = bits;
-						best_t = trial_t;
-						best_command = cDELTA;
-						best_dr = dr - 2;
-						best_dg = dg - 2;
-						best_db = db - 2;
-					}
-				}
+				ultra_smooth_vis(x, y).set((int)std::round(yl * 255.0f));
+			}
 
-				// Try a lossy DELTA command.
-				if (!delta_encodable_losslessly)
-				{
-					for (uint32_t i = 0; i < 64; i++)
-					{
-						int dr = ((i >> 4) & 3) - 2;
-						int dg = ((i >> 2) & 3) - 2;
-						int db = (i & 3) - 2;
+		}
+	}
 
-						color_rgba trial_c((prev_r + dr) & 255, (prev_g + dg) & 255, (prev_b + db) & 255, prev_a);
+	if (params.m_debug_images)
+	{
+		save_png("dbg_smooth_vis.png", smooth_vis);
+		save_png("dbg_alpha_edge_vis.png", alpha_edge_vis);
+		save_png("dbg_ultra_smooth_vis.png", ultra_smooth_vis);
+	}
+}
 
-						if (!should_reject(trial_c, c, 4, params))
-						{
-							float mse = compute_se(trial_c, c, 4, params);
-							float bits = 8.0f;
-							float trial_t = mse_scale * mse + bits * lambda;
+// Returns the smooth region MSE scales of params.m_orig_img. They're taken from params.m_pCache when it has them, otherwise they're computed into smooth_block_mse_scales (and copied into the cache).
+static const vector2D<float>& get_smooth_maps(
+	vector2D<float>& smooth_block_mse_scales,
+	rdo_png_params& params)
+{
+	rdo_image_cache* pCache = params.m_pCache;
+	if ((pCache) && (pCache->m_has_smooth_maps))
+		return pCache->m_smooth_block_mse_scales;
 
-							if (trial_t < best_t)
-							{
-								best_mse = mse;
-								best_bits = bits;
-								best_t = trial_t;
-								best_command = cDELTA;
-								best_dr = dr;
-								best_dg = dg;
-								best_db = db;
-							}
+	smooth_block_mse_scales.resize(params.m_orig_img.get_width(), params.m_orig_img.get_height());
+
+	create_smooth_maps(
+		smooth_block_mse_scales,
+		params.m_orig_img,
+		params);
+
+	if (pCache)
+	{
+		pCache->m_smooth_block_mse_scales = smooth_block_mse_scales;
+		pCache->m_has_smooth_maps = true;
+	}
+
+	return smooth_block_mse_scales;
+}
+
+// Per-pass encoder statistics. Each strip accumulates its own copy, which are summed once all strips are coded.
+struct png_scanline_stats
+{
+	png_scanline_stats()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		clear_obj(m_filter_hist);
+		clear_obj(m_match_len_hist);
+		clear_obj(m_type_hist_a);
+		clear_obj(m_type_hist_b);
+		m_total_match_a = 0;
+		m_total_match_b = 0;
+	}
+
+	png_scanline_stats& operator+= (const png_scanline_stats& rhs)
+	{
+		for (uint32_t i = 0; i < 5; i++)
+			m_filter_hist[i] += rhs.m_filter_hist[i];
+		for (uint32_t i = 0; i <= MAX_DELTA_COLORS; i++)
+			m_match_len_hist[i] += rhs.m_match_len_hist[i];
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			m_type_hist_a[i] += rhs.m_type_hist_a[i];
+			m_type_hist_b[i] += rhs.m_type_hist_b[i];
+		}
+		m_total_match_a += rhs.m_total_match_a;
+		m_total_match_b += rhs.m_total_match_b;
+		return *this;
+	}
+
+	uint32_t m_filter_hist[5];
+	uint32_t m_match_len_hist[MAX_DELTA_COLORS + 1];
+	uint32_t m_type_hist_a[256];
+	uint32_t m_type_hist_b[256];
+	uint32_t m_total_match_a, m_total_match_b;
+};
+
+// Tracks how many leading pixels of each scanline are final, so scanlines can be coded concurrently along a diagonal wavefront.
+// The match finders only look m_reach pixels ahead of the current position on the scanlines above, so scanline y may code
+// the pixels starting at x once scanline y-1 has committed its first x + m_reach pixels. Scanlines above y-1 are always
+// even further along, because y-1 itself waited on them.
+class png_wavefront
+{
+public:
+	png_wavefront(uint32_t width, uint32_t height, uint32_t reach) :
+		m_progress(height),
+		m_width(width),
+		m_reach(reach)
+	{
+		for (uint32_t y = 0; y < height; y++)
+			m_progress[y].store(0, std::memory_order_relaxed);
+	}
+
+	inline void wait(uint32_t x, uint32_t y) const
+	{
+		if (!y)
+			return;
+
+		const uint32_t needed = minimum<uint32_t>(x + m_reach, m_width);
+		while (m_progress[y - 1].load(std::memory_order_acquire) < needed)
+			std::this_thread::yield();
+	}
+
+	inline void publish(uint32_t x, uint32_t y)
+	{
+		m_progress[y].store(x, std::memory_order_release);
+	}
+
+private:
+	std::vector< std::atomic<uint32_t> > m_progress;
+	uint32_t m_width, m_reach;
+};
+
+// Codes scanline y using a single PNG filter, returning the scanline's total squared error and bits.
+// If pWavefront isn't nullptr, coding waits for the scanlines above to get far enough along. If pProgress isn't nullptr, the scanline's progress is published as it goes.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void encode_png_scanline_filter(
+	uint32_t filter, uint32_t y, uint32_t min_y,
+	const image& orig_img, image& delta_img, image& coded_img, image& match_vis,
+	find_optimal_hash_map* pFind_optimal_hashers, png_scanline_stats& stats, png_wavefront* pWavefront, png_wavefront* pProgress,
+	float& total_squared_err, float& total_bits,
+	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1,
+	const vector2D<float>& smooth_block_mse_scales, uint32_t num_comps, const rdo_png_level* pLevel, const rdo_png_params& params)
+{
+	const uint32_t width = orig_img.get_width();
+
+	const uint32_t MAX_M = 6;
+
+	const uint32_t M = pLevel->m_M;
+	const uint32_t num_match_order_a = pLevel->m_num_match_order_a;
+	const match_order* pMatch_order_a = pLevel->m_pMatch_order_a;
+
+	const uint32_t num_match_order_b = pLevel->m_num_match_order_b;
+	const match_order* pMatch_order_b = pLevel->m_pMatch_order_b;
+
+	total_squared_err = 0.0f;
+	total_bits = 0;
+
+	if (pLevel->m_double_width)
+	{
+		uint32_t x = 0;
+		while (x < width)
+		{
+			if (pWavefront)
+				pWavefront->wait(x, y);
+
+			if ((x + M * 2) > width)
+			{
+				color_rgba best_delta_color;
+				float best_bits, best_t, best_squared_err;
+				uint32_t best_type;
+
+				find_optimal1<MODE, NUM_COMPS>(best_delta_color, best_bits, best_squared_err, best_t, best_type,
+					x, y, min_y,
+					orig_img, coded_img, delta_img,
+					lambda, h0, h1,
+					smooth_block_mse_scales, filter, num_comps, pLevel, params);
+
+				delta_img(x, y) = best_delta_color;
+				coded_img(x, y) = png_unpredict(best_delta_color, x, y, coded_img, filter, num_comps);
+
+				total_squared_err += compute_se(coded_img(x, y), orig_img(x, y), num_comps, params);
+				total_bits += best_bits;
+
+				stats.m_match_len_hist[1]++;
+
+				if (best_type == 0)
+					match_vis(x, y).set(0, 255, 0, 255);
+				else if (best_type == 1)
+					match_vis(x, y).set(255, 255, 0, 255);
+				else
+					match_vis(x, y).set(255, 255, 255, 255);
+
+				x++;
+			}
+			else
+			{
+				float best_t[3], best_se[3], best_bits[3];
+				uint32_t best_idx[3];
+				color_rgba best_delta_color[3][MAX_M * 2];
+
+				for (uint32_t o = 0; o < 2; o++)
+				{
+					eval_matches<MODE, NUM_COMPS>(M,
+						num_match_order_a, pMatch_order_a,
+						x + o * M, y, min_y,
+						best_t[o], best_se[o], best_bits[o], best_delta_color[o], best_idx[o],
+						pFind_optimal_hashers,
+						filter,
+						lambda,
+						orig_img,
+						delta_img,
+						coded_img,
+						h0,
+						h1,
+						smooth_block_mse_scales, num_comps, pLevel, params);
+
+					for (uint32_t k = 0; k < M; k++)
+					{
+						delta_img(x + o * M + k, y) = best_delta_color[o][k];
+						coded_img(x + o * M + k, y) = png_unpredict(best_delta_color[o][k], x + o * M + k, y, coded_img, filter, num_comps);
+					}
+				}
+
+				eval_matches<MODE, NUM_COMPS>(M * 2,
+					num_match_order_b, pMatch_order_b,
+					x, y, min_y,
+					best_t[2], best_se[2], best_bits[2], best_delta_color[2], best_idx[2],
+					pFind_optimal_hashers,
+					filter,
+					lambda,
+					orig_img,
+					delta_img,
+					coded_img,
+					h0,
+					h1,
+					smooth_block_mse_scales, num_comps, pLevel, params);
+
+				float overall_mse_smooth_factor = 0;
+				for (uint32_t i = 0; i < M * 2; i++)
+					overall_mse_smooth_factor = maximum(overall_mse_smooth_factor, smooth_block_mse_scales(x + i, y));
+
+				float best_se_a = best_se[0] + best_se[1];
+				float best_mse_a = best_se_a * (1.0f / (float)(M * 2));
+				float best_bits_a = best_bits[0] + best_bits[1];
+				float best_t_a = best_mse_a * overall_mse_smooth_factor + best_bits_a * lambda;
+
+				if (best_t_a < best_t[2])
+				{
+					stats.m_total_match_a++;
+					total_bits += best_bits_a;
+
+					for (uint32_t o = 0; o < 2; o++)
+					{
+						for (uint32_t k = 0; k < M; k++)
+						{
+							delta_img(x + o * M + k, y) = best_delta_color[o][k];
+							coded_img(x + o * M + k, y) = png_unpredict(best_delta_color[o][k], x + o * M + k, y, coded_img, filter, num_comps);
+
+							total_squared_err += compute_se(coded_img(x + o * M + k, y), orig_img(x + o * M + k, y), num_comps, params);
+						}
+
+						const uint32_t n = pMatch_order_a[best_idx[o]].v[0];
+						int x_ofs = 0;
+						for (uint32_t i = 0; i < n; i++)
+						{
+							uint32_t l = pMatch_order_a[best_idx[o]].v[1 + i];
+
+							stats.m_match_len_hist[l]++;
+
+							color_rgba c = get_match_len_color(l);
+							for (uint32_t j = 0; j < l; j++)
+								match_vis(x + o * M + x_ofs + j, y) = c;
+
+							x_ofs += l;
 						}
+
+						assert(best_idx[o] < num_match_order_a);
+						stats.m_type_hist_a[best_idx[o]]++;
+					}
+				}
+				else
+				{
+					stats.m_total_match_b++;
+					total_bits += best_bits[2];
+
+					for (uint32_t k = 0; k < M * 2; k++)
+					{
+						delta_img(x + k, y) = best_delta_color[2][k];
+						coded_img(x + k, y) = png_unpredict(best_delta_color[2][k], x + k, y, coded_img, filter, num_comps);
+
+						total_squared_err += compute_se(coded_img(x + k, y), orig_img(x + k, y), num_comps, params);
+					}
+
+					const uint32_t n = pMatch_order_b[best_idx[2]].v[0];
+					int x_ofs = 0;
+					for (uint32_t i = 0; i < n; i++)
+					{
+						uint32_t l = pMatch_order_b[best_idx[2]].v[1 + i];
+
+						stats.m_match_len_hist[l]++;
+
+						color_rgba c = get_match_len_color(l);
+						for (uint32_t j = 0; j < l; j++)
+							match_vis(x + x_ofs + j, y) = c;
+
+						x_ofs += l;
 					}
+
+					assert(best_idx[2] < num_match_order_b);
+					stats.m_type_hist_b[best_idx[2]]++;
 				}
+
+				x += M * 2;
 			}
 
-			if (16.0f * lambda < best_t)
+			assert(x <= width);
+
+			if (pProgress)
+				pProgress->publish(x, y);
+		} // while (x < width)
+	}
+	else
+	{
+		uint32_t x = 0;
+		while (x < width)
+		{
+			if (pWavefront)
+				pWavefront->wait(x, y);
+
+			if ((x + M) > width)
 			{
-				bool luma_encodable_losslessly_in_rgb = false;
+				color_rgba best_delta_color;
+				float best_bits, best_t, best_squared_err;
+				uint32_t best_type;
 
-				// First try the LUMA command losslessly in RGB (may not be lossy in alpha).
+				find_optimal1<MODE, NUM_COMPS>(best_delta_color, best_bits, best_squared_err, best_t, best_type,
+					x, y, min_y,
+					orig_img, coded_img, delta_img,
+					lambda, h0, h1,
+					smooth_block_mse_scales, filter, num_comps, pLevel, params);
+
+				delta_img(x, y) = best_delta_color;
+				coded_img(x, y) = png_unpredict(best_delta_color, x, y, coded_img, filter, num_comps);
+
+				total_squared_err += compute_se(coded_img(x, y), orig_img(x, y), num_comps, params);
+				total_bits += best_bits;
+
+				stats.m_match_len_hist[1]++;
+
+				if (best_type == 0)
+					match_vis(x, y).set(0, 255, 0, 255);
+				else if (best_type == 1)
+					match_vis(x, y).set(255, 255, 0, 255);
+				else
+					match_vis(x, y).set(255, 255, 255, 255);
+
+				x++;
+			}
+			else
+			{
+				float best_t, best_se, best_bits;
+				uint32_t best_idx;
+				color_rgba best_delta_color[MAX_M];
+
+				eval_matches<MODE, NUM_COMPS>(M,
+					num_match_order_a, pMatch_order_a,
+					x, y, min_y,
+					best_t, best_se, best_bits, best_delta_color, best_idx,
+					pFind_optimal_hashers,
+					filter,
+					lambda,
+					orig_img,
+					delta_img,
+					coded_img,
+					h0,
+					h1,
+					smooth_block_mse_scales, num_comps, pLevel, params);
+
+				for (uint32_t k = 0; k < M; k++)
 				{
-					int g_diff = (int)c.g - prev_g;
+					delta_img(x + k, y) = best_delta_color[k];
+					coded_img(x + k, y) = png_unpredict(best_delta_color[k], x + k, y, coded_img, filter, num_comps);
 
-					int dg = (g_diff + 32) & 255;
+					total_squared_err += compute_se(coded_img(x + k, y), orig_img(x + k, y), num_comps, params);
+				}
+
+				stats.m_total_match_a++;
+				total_bits += best_bits;
+
+				const uint32_t n = pMatch_order_a[best_idx].v[0];
+				int x_ofs = 0;
+				for (uint32_t i = 0; i < n; i++)
+				{
+					uint32_t l = pMatch_order_a[best_idx].v[1 + i];
+
+					stats.m_match_len_hist[l]++;
+
+					color_rgba c = get_match_len_color(l);
+					for (uint32_t j = 0; j < l; j++)
+						match_vis(x + x_ofs + j, y) = c;
+
+					x_ofs += l;
+				}
+				assert(x_ofs == M);
+
+				assert(best_idx < num_match_order_a);
+				stats.m_type_hist_a[best_idx]++;
+
+				x += M;
+			}
+
+			assert(x <= width);
+
+			if (pProgress)
+				pProgress->publish(x, y);
+		} // while (x < width)
+	}
+}
+
+// The -adaptive_huff cost model, a single pass alternative to -two_pass. -two_pass codes the image twice, so the second pass can use Huffman tables 
+// built from the DEFLATE symbol counts of the first pass's output. This instead counts the symbols of the scanlines a strip has committed so far, 
+// and rebuilds the strip's tables from them every few rows. Until the first rebuild the strip uses the tables built from the initial counts.
+class png_adaptive_huffman
+{
+public:
+	void init(const histogram& ht0, const histogram& ht1, uint32_t first_y)
+	{
+		memset(m_freq, 0, sizeof(m_freq));
+		m_next_y = first_y;
+
+		m_h0.init(ht0, 15);
+		m_h1.init(ht1, 15);
+	}
+
+	const huffman_encoding_table& get_lit_table() const { return m_h0; }
+	const huffman_encoding_table& get_dist_table() const { return m_h1; }
+
+	// Counts the symbols of the committed scanlines up to end_y (which miniz would write for them), and rebuilds the tables.
+	void update(const image& delta_img, const uint8_vec& filters, uint32_t end_y, uint32_t num_comps)
+	{
+		assert(end_y > m_next_y);
+
+		const uint32_t width = delta_img.get_width();
+
+		// The filtered scanlines, exactly as they're stored in the PNG's IDAT stream.
+		m_buf.resize((end_y - m_next_y) * (1 + width * num_comps));
+		uint8_t* pDst = m_buf.data();
+		for (uint32_t y = m_next_y; y < end_y; y++)
+		{
+			*pDst++ = filters[y];
+			for (uint32_t x = 0; x < width; x++)
+			{
+				memcpy(pDst, &delta_img(x, y), num_comps);
+				pDst += num_comps;
+			}
+		}
+
+		// Same parsing settings as the miniz path the initial counts are collected with (see encoder_context::save_png()).
+		size_t comp_size = 0;
+		void* pComp_data = tdefl_compress_mem_to_heap_ex(m_buf.data(), m_buf.size(), &comp_size, TDEFL_MAX_PROBES_MASK, &m_freq[0][0]);
+		mz_free(pComp_data);
+
+		m_next_y = end_y;
+
+		histogram ht0(288), ht1(32);
+		for (uint32_t i = 0; i < 288; i++)
+			ht0[i] = maximum<uint32_t>(1U, (uint32_t)m_freq[0][i]);
+
+		for (uint32_t i = 0; i < 32; i++)
+			ht1[i] = maximum<uint32_t>(1U, (uint32_t)m_freq[1][i]);
+
+		m_h0.init(ht0, 15);
+		m_h1.init(ht1, 15);
+	}
+
+private:
+	mz_uint64 m_freq[2][TDEFL_MAX_HUFF_SYMBOLS];
+	uint32_t m_next_y;
+	huffman_encoding_table m_h0, m_h1;
+	uint8_vec m_buf;
+};
+
+// Private copies of the scanlines a single candidate PNG filter reads and writes, so a scanline's candidate filters can be coded concurrently.
+// The predictors and match finders only reference the current scanline and the m_num_scanlines_to_check-1 scanlines above it, and PNG match
+// distances only depend on the difference between rows, so scanline y of the image is coded as row m_y of these small images.
+struct png_filter_scratch
+{
+	image m_orig_img, m_delta_img, m_coded_img, m_match_vis;
+	vector2D<float> m_smooth_block_mse_scales;
+	find_optimal_hash_map m_find_optimal_hashers[MAX_DELTA_COLORS];
+	png_scanline_stats m_stats;
+	uint32_t m_y;
+	float m_total_squared_err, m_total_bits;
+
+	png_filter_scratch()
+	{
+		for (uint32_t i = 0; i < MAX_DELTA_COLORS; i++)
+			m_find_optimal_hashers[i].reserve(4);
+	}
+
+	void init(uint32_t y, uint32_t min_y, const image& orig_img, const image& delta_img, const image& coded_img, const vector2D<float>& smooth_block_mse_scales, const rdo_png_level* pLevel)
+	{
+		const uint32_t width = orig_img.get_width();
+		const uint32_t max_rows_above = maximum<int>(pLevel->m_num_scanlines_to_check - 1, 1);
+
+		if ((m_orig_img.get_width() != width) || (m_orig_img.get_height() != max_rows_above + 1))
+		{
+			m_orig_img.resize(width, max_rows_above + 1);
+			m_delta_img.resize(width, max_rows_above + 1);
+			m_coded_img.resize(width, max_rows_above + 1);
+			m_match_vis.resize(width, max_rows_above + 1);
+			m_smooth_block_mse_scales.resize(width, max_rows_above + 1);
+		}
+
+		// The first scanline of the image must stay row 0, so the predictors know there's nothing above it.
+		m_y = minimum(y - min_y, max_rows_above);
+
+		for (uint32_t i = 1; i <= m_y; i++)
+		{
+			memcpy(&m_delta_img(0, m_y - i), &delta_img(0, y - i), width * sizeof(color_rgba));
+			memcpy(&m_coded_img(0, m_y - i), &coded_img(0, y - i), width * sizeof(color_rgba));
+		}
+
+		memcpy(&m_orig_img(0, m_y), &orig_img(0, y), width * sizeof(color_rgba));
+		memcpy(&m_smooth_block_mse_scales(0, m_y), &smooth_block_mse_scales(0, y), width * sizeof(float));
+
+		m_stats.clear();
+	}
+};
+
+// Codes scanline y, trying each of the level's PNG filters and keeping the one with the lowest error.
+// min_y is the first scanline the match finder is allowed to reference (the first scanline of the strip containing y).
+// If pWavefront isn't nullptr, coding waits for the scanlines above to get far enough along and publishes this scanline's progress.
+// If pFilter_job_pool isn't nullptr, the candidate filters are coded concurrently using pFilter_scratch (one per filter). The result is the same either way.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void encode_png_scanline(
+	uint32_t y, uint32_t min_y,
+	const image& orig_img, image& delta_img, image& coded_img, image& match_vis, uint8_vec& filters,
+	find_optimal_hash_map* pFind_optimal_hashers, png_scanline_stats& stats, png_wavefront* pWavefront,
+	job_pool* pFilter_job_pool, png_filter_scratch* pFilter_scratch,
+	float lambda, const huffman_encoding_table& h0, const huffman_encoding_table& h1,
+	const vector2D<float>& smooth_block_mse_scales, uint32_t num_comps, const rdo_png_level* pLevel, const rdo_png_params& params)
+{
+	const uint32_t width = orig_img.get_width();
+
+	const int skip_filter0 = 2;
+
+	// The scanline above the first scanline of a strip belongs to another strip which may not be coded yet, so only the previous pixel filter can be used there.
+	uint32_t first_filter = pLevel->m_first_filter, last_filter = pLevel->m_last_filter;
+	if ((y == min_y) && (y > 0))
+		first_filter = last_filter = PNG_PREV_PIXEL_FILTER;
+
+	uint32_t num_candidate_filters = 0;
+	uint32_t candidate_filters[5];
+	for (uint32_t filter = first_filter; filter <= last_filter; filter++)
+		if ((int)filter != skip_filter0)
+			candidate_filters[num_candidate_filters++] = filter;
+
+	// With a single candidate filter every committed pixel is final, so the scanline can publish its progress as it goes.
+	// Otherwise it can only publish once the winning filter has been copied back in.
+	png_wavefront* pProgress = (num_candidate_filters == 1) ? pWavefront : nullptr;
+
+	float best_scanline_t = 1e+9f;
+	float best_scanline_err = 1e+9f;
+	uint32_t best_filter = 0;
+	std::vector<color_rgba> best_delta_pixels(width);
+	std::vector<color_rgba> best_coded_pixels(width);
+
+	if ((pFilter_job_pool) && (num_candidate_filters > 1))
+	{
+		for (uint32_t i = 0; i < num_candidate_filters; i++)
+		{
+			pFilter_job_pool->add_job([&, i]
+			{
+				png_filter_scratch& scratch = pFilter_scratch[i];
+
+				scratch.init(y, min_y, orig_img, delta_img, coded_img, smooth_block_mse_scales, pLevel);
+
+				encode_png_scanline_filter<MODE, NUM_COMPS>(
+					candidate_filters[i], scratch.m_y, 0,
+					scratch.m_orig_img, scratch.m_delta_img, scratch.m_coded_img, scratch.m_match_vis,
+					scratch.m_find_optimal_hashers, scratch.m_stats, nullptr, nullptr,
+					scratch.m_total_squared_err, scratch.m_total_bits,
+					lambda, h0, h1,
+					scratch.m_smooth_block_mse_scales, num_comps, pLevel, params);
+			});
+		}
+
+		pFilter_job_pool->wait_for_all();
+
+		// Pick the winner in the same order as the serial loop below.
+		for (uint32_t i = 0; i < num_candidate_filters; i++)
+		{
+			const png_filter_scratch& scratch = pFilter_scratch[i];
+
+			float scanline_t = (scratch.m_total_squared_err / width) + scratch.m_total_bits * lambda;
+
+			if (scratch.m_total_squared_err < best_scanline_err)
+			{
+				best_scanline_t = scanline_t;
+				best_scanline_err = scratch.m_total_squared_err;
+				best_filter = candidate_filters[i];
+				memcpy(best_delta_pixels.data(), &scratch.m_delta_img(0, scratch.m_y), width * sizeof(color_rgba));
+				memcpy(best_coded_pixels.data(), &scratch.m_coded_img(0, scratch.m_y), width * sizeof(color_rgba));
+			}
+
+			stats += scratch.m_stats;
+		}
+
+		// The serial loop leaves the last candidate's visualization behind.
+		const png_filter_scratch& last_scratch = pFilter_scratch[num_candidate_filters - 1];
+		memcpy(&match_vis(0, y), &last_scratch.m_match_vis(0, last_scratch.m_y), width * sizeof(color_rgba));
+	}
+	else
+	{
+		for (uint32_t i = 0; i < num_candidate_filters; i++)
+		{
+			const uint32_t filter = candidate_filters[i];
+
+			float total_squared_err, total_bits;
+			encode_png_scanline_filter<MODE, NUM_COMPS>(
+				filter, y, min_y,
+				orig_img, delta_img, coded_img, match_vis,
+				pFind_optimal_hashers, stats, pWavefront, pProgress,
+				total_squared_err, total_bits,
+				lambda, h0, h1,
+				smooth_block_mse_scales, num_comps, pLevel, params);
+
+			float scanline_t = (total_squared_err / width) + total_bits * lambda;
+
+			// TODO - what to default to?
+			//if (scanline_t < best_scanline_t)
+			if (total_squared_err < best_scanline_err)
+			{
+				best_scanline_t = scanline_t;
+				best_scanline_err = total_squared_err;
+				best_filter = filter;
+				memcpy(best_delta_pixels.data(), &delta_img(0, y), width * sizeof(color_rgba));
+				memcpy(best_coded_pixels.data(), &coded_img(0, y), width * sizeof(color_rgba));
+			}
+
+		} // filter
+	}
+
+	// With a single candidate filter the scanline already holds the result (and may be getting read by the scanline below).
+	if (num_candidate_filters > 1)
+	{
+		memcpy(&delta_img(0, y), best_delta_pixels.data(), width * sizeof(color_rgba));
+		memcpy(&coded_img(0, y), best_coded_pixels.data(), width * sizeof(color_rgba));
+	}
+	filters[y] = (uint8_t)best_filter;
+	stats.m_filter_hist[best_filter]++;
+
+	if (pWavefront)
+		pWavefront->publish(width, y);
+}
+
+static bool rdo_png(encoder_context& ctx, rdo_png_params &params)
+{
+	params.m_pTables = &ctx.get_tables();
+
+	const image& orig_img = params.m_orig_img;
+	
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const uint32_t total_pixels = orig_img.get_total_pixels();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
+	
+	if (params.m_debug_images)
+	{
+		ctx.save_png("dbg_orig.png", orig_img, encoder_context::cZlibLodePNG);
+	}
+		
+	uint8_vec filters(height);
+	filters.set_all(PNG_AVG_FILTER);
+
+	histogram ht0(288), ht1(32);
+	
+	if ((params.m_pCache) && (params.m_pCache->m_has_huffman_stats))
+	{
+		ht0 = params.m_pCache->m_ht0;
+		ht1 = params.m_pCache->m_ht1;
+	}
+	else
+	{
+		ctx.clear_deflate_stats();
+
+		uint8_vec orig_avg_png_file;
+		ctx.save_png(orig_avg_png_file, orig_img, encoder_context::cZlibMiniz, 0, 0, filters.data());
+
+		for (uint32_t i = 0; i < 288; i++)
+			ht0[i] = maximum<uint32_t>(1U, (uint32_t)ctx.get_deflate_stats(0)[i]);
+
+		for (uint32_t i = 0; i < 32; i++)
+			ht1[i] = maximum<uint32_t>(1U, (uint32_t)ctx.get_deflate_stats(1)[i]);
+
+		if (params.m_pCache)
+		{
+			params.m_pCache->m_ht0 = ht0;
+			params.m_pCache->m_ht1 = ht1;
+			params.m_pCache->m_has_huffman_stats = true;
+		}
+
+		if (params.m_debug_images)
+		{
+			write_vec_to_file("dbg_orig_avg.png", orig_avg_png_file);
+		}
+	}
+		
+	if (params.m_debug_images)
+	{
+		if (has_alpha)
+		{
+			save_png("dbg_orig_rgb.png", orig_img, cImageSaveIgnoreAlpha);
+			save_png("dbg_orig_alpha.png", orig_img, cImageSaveGrayscale, 3);
+		}
+	}
+	
+	const float lambda = params.m_lambda;
+	
+	// TODO
+	const float max_smooth_std_dev = 35.0f;
+	const float smooth_max_mse_scale = 250.0f;
+
+	const float max_ultra_smooth_std_dev = 5.0f;
+	const float ultra_smooth_max_mse_scale = 1500.0f;
+
+	assert(params.m_level < MAX_LEVELS);
+	const rdo_png_level* pLevel = &g_levels[params.m_level];
+
+	const uint32_t num_match_order_a = pLevel->m_num_match_order_a;
+	const uint32_t num_match_order_b = pLevel->m_num_match_order_b;
+	assert(num_match_order_a <= 256 && num_match_order_b <= 256);
+
+	// Each strip is coded independently: its first scanline only uses the previous pixel filter and matches never reference scanlines above the strip, so strips can be coded in any order.
+	// In wavefront mode there's a single strip, and the threads instead code successive scanlines a little behind each other.
+	// In parallel filters mode there's also a single strip, coded one scanline at a time with the threads each trying a different PNG filter.
+	const uint32_t num_threads = clamp<uint32_t>(params.m_num_threads, 1, height);
+	const bool parallel_filters = params.m_parallel_filters && !params.m_wavefront && (num_threads > 1);
+	const uint32_t num_strips = (params.m_wavefront || parallel_filters) ? 1 : num_threads;
+
+	// Each strip adapts its own Huffman tables to the scanlines it has coded. Wavefront mode codes successive scanlines concurrently, so its output 
+	// couldn't be independent of the thread count, and it keeps the initial tables.
+	const uint32_t adaptive_huff_rows = params.m_wavefront ? 0 : params.m_adaptive_huff_rows;
+
+	std::unique_ptr<job_pool> pJob_pool;
+	if (num_threads > 1)
+		pJob_pool.reset(new job_pool(num_threads));
+
+	std::vector<png_filter_scratch> filter_scratch(parallel_filters ? 4 : 0);
+
+	// How far to the right of the current position the match finders can read on the scanlines above.
+	const uint32_t wavefront_reach = pLevel->m_exhaustive_search ? width : (pLevel->m_search_dist + pLevel->m_M * 2 + MAX_DELTA_COLORS);
+	
+	image match_vis(width, height);
+
+	if (params.m_print_progress)
+	{
+		printf("Stage 1\n");
+	}
+
+	vector2D<float> smooth_block_mse_scales_buf;
+	const vector2D<float>& smooth_block_mse_scales = get_smooth_maps(smooth_block_mse_scales_buf, params);
+			
+	uint64_t comp_size = 0;
+
+	const uint32_t num_encoder_passes = params.m_two_pass ? 2 : 1;
+	
+	image delta_img(width, height);
+	image coded_img(width, height);
+
+	for (uint32_t encoder_pass = 0; encoder_pass < num_encoder_passes; encoder_pass++)
+	{
+		if ((params.m_print_progress) && (num_encoder_passes > 1))
+			printf("\n**** Pass %u\n", encoder_pass + 1);
+		
+		if (encoder_pass)
+		{
+			delta_img.set_all(g_black_color);
+			coded_img.set_all(g_black_color);
+		}
+		
+		huffman_encoding_table h0, h1;
+		h0.init(ht0, 15);
+		h1.init(ht1, 15);
+
+		if (params.m_print_debug_output)
+		{
+			printf("Literal table:\n");
+			for (uint32_t i = 0; i < 288; i++)
+			{
+				printf("%2u ", h0.get_code_sizes()[i]);
+				if ((i & 15) == 15)
+					printf("\n");
+			}
+			printf("\n");
+
+			printf("Distance table:\n");
+			for (uint32_t i = 0; i < 32; i++)
+			{
+				printf("%2u ", h1.get_code_sizes()[i]);
+				if ((i & 15) == 15)
+					printf("\n");
+			}
+			printf("\n");
+		}
+
+		basisu::vector<png_scanline_stats> job_stats(num_threads);
+
+		if (params.m_print_progress)
+		{
+			printf("Stage 2\n");
+		}
+
+		std::atomic<uint32_t> total_scanlines_coded(0);
+
+		std::unique_ptr<png_wavefront> pWavefront;
+		std::atomic<uint32_t> next_wavefront_scanline(0);
+		if (params.m_wavefront)
+			pWavefront.reset(new png_wavefront(width, height, wavefront_reach));
+
+		// Every scanline is coded by the instantiation specialized for this encode's metric and channel count.
+		typedef decltype(&encode_png_scanline<cMetricRGB, 3>) encode_png_scanline_func;
+		static const encode_png_scanline_func s_encode_png_scanline_funcs[cTotalMetricModes][2] = METRIC_KERNEL_TABLE(encode_png_scanline);
+		const encode_png_scanline_func pEncode_png_scanline = s_encode_png_scanline_funcs[get_metric_mode(params)][num_comps - 3];
+
+		auto encode_job = [&](uint32_t job_index)
+		{
+			find_optimal_hash_map find_optimal_hashers[MAX_DELTA_COLORS];
+			for (uint32_t i = 0; i < MAX_DELTA_COLORS; i++)
+				find_optimal_hashers[i].reserve(4);
+
+			// Strip mode codes one strip per job. Wavefront mode hands out scanlines in order, so the lowest unfinished scanline always has a thread and can make progress.
+			const uint32_t first_y = pWavefront ? 0 : (height * job_index) / num_strips;
+			const uint32_t last_y = pWavefront ? height : (height * (job_index + 1)) / num_strips;
+
+			png_adaptive_huffman adaptive_huff;
+			if (adaptive_huff_rows)
+				adaptive_huff.init(ht0, ht1, first_y);
+
+			const huffman_encoding_table& strip_h0 = adaptive_huff_rows ? adaptive_huff.get_lit_table() : h0;
+			const huffman_encoding_table& strip_h1 = adaptive_huff_rows ? adaptive_huff.get_dist_table() : h1;
+
+			for (uint32_t i = first_y; i < last_y; i++)
+			{
+				const uint32_t y = pWavefront ? next_wavefront_scanline++ : i;
+				if (y >= height)
+					break;
+
+				pEncode_png_scanline(
+					y, first_y,
+					orig_img, delta_img, coded_img, match_vis, filters,
+					find_optimal_hashers, job_stats[job_index], pWavefront.get(),
+					parallel_filters ? pJob_pool.get() : nullptr, filter_scratch.data(),
+					lambda, strip_h0, strip_h1,
+					smooth_block_mse_scales, num_comps, pLevel, params);
+
+				if ((adaptive_huff_rows) && (((y + 1 - first_y) % adaptive_huff_rows) == 0) && ((y + 1) < last_y))
+					adaptive_huff.update(delta_img, filters, y + 1, num_comps);
+
+				const uint32_t n = ++total_scanlines_coded;
+				if ((params.m_print_progress) && ((n & 15) == 0))
+				{
+					printf("\b\b\b\b\b\b\b\b%3.2f%%", n * 100.0f / height);
+					fflush(stdout);
+				}
+			}
+		};
+
+		if ((pJob_pool) && (!parallel_filters))
+		{
+			for (uint32_t job_index = 0; job_index < num_threads; job_index++)
+				pJob_pool->add_job([&encode_job, job_index] { encode_job(job_index); });
+
+			pJob_pool->wait_for_all();
+		}
+		else
+		{
+			encode_job(0);
+		}
+
+		png_scanline_stats stats;
+		for (uint32_t job_index = 0; job_index < num_threads; job_index++)
+			stats += job_stats[job_index];
+		
+		if (params.m_print_progress)
+		{
+			printf("\b\b\b\b\b\b\b\b        \b\b\b\b\b\b\b\b\n");
+			fflush(stdout);
+		}
+
+		if (params.m_print_debug_output)
+		{
+			printf("Total match_a: %u match_b: %u\n", stats.m_total_match_a, stats.m_total_match_b);
+			printf("\n");
+
+			printf("Filter hist:\n");
+			for (uint32_t i = 1; i <= 4; i++)
+				printf("%u %u\n", i, stats.m_filter_hist[i]);
+			printf("\n");
+
+			printf("Match len hist:\n");
+			for (uint32_t i = 1; i <= MAX_DELTA_COLORS; i++)
+				printf("%u: %u\n", i, stats.m_match_len_hist[i]);
+			printf("\n");
+
+			printf("Match order A hist:\n");
+			for (uint32_t i = 0; i < num_match_order_a; i++)
+				printf("%u: %u\n", i, stats.m_type_hist_a[i]);
+			printf("\n");
+
+			printf("Match order B hist:\n");
+			for (uint32_t i = 0; i < num_match_order_b; i++)
+				printf("%u: %u\n", i, stats.m_type_hist_b[i]);
+			printf("\n");
+
+			char buf[256];
+			sprintf(buf, "dbg_match_vis_%u.png", encoder_pass);
+			save_png(buf, match_vis);
+
+			sprintf(buf, "dbg_delta_img_%u.png", encoder_pass);
+			save_png(buf, delta_img);
+		}
+
+		if (encoder_pass == (num_encoder_passes - 1))
+		{
+			ctx.save_png(params.m_output_file_data, coded_img, encoder_context::cZlibLodePNG, 0, 0, filters.data(), &comp_size);
+
+			params.m_output_image = coded_img;
+		}
+		else
+		{
+			ctx.clear_deflate_stats();
+
+			uint8_vec pass0_png_file;
+			ctx.save_png(pass0_png_file, coded_img, encoder_context::cZlibMiniz, 0, 0, filters.data());
+
+			for (uint32_t i = 0; i < 288; i++)
+				ht0[i] = maximum<uint32_t>(1U, (uint32_t)ctx.get_deflate_stats(0)[i]);
+
+			for (uint32_t i = 0; i < 32; i++)
+				ht1[i] = maximum<uint32_t>(1U, (uint32_t)ctx.get_deflate_stats(1)[i]);
+
+			// Only written when debugging, so concurrent encodes don't fight over the files.
+			if (params.m_debug_images)
+				write_vec_to_file("pass0_output_miniz.png", pass0_png_file);
+
+			ctx.save_png(pass0_png_file, coded_img, encoder_context::cZlibLodePNG, 0, 0, filters.data(), &comp_size);
+
+			if (params.m_debug_images)
+				write_vec_to_file("pass0_output.png", pass0_png_file);
+		}
+
+		if (has_alpha)
+		{
+			if (params.m_debug_images)
+			{
+				char buf[256];
+				sprintf(buf, "dbg_coded_rgb_%u.png", encoder_pass);
+				save_png(buf, coded_img, cImageSaveIgnoreAlpha, 0);
+				
+				sprintf(buf, "dbg_coded_alpha_%u.png", encoder_pass);
+				save_png(buf, coded_img, cImageSaveGrayscale, 3);
+			}
+		}
+				
+		params.m_psnr = compute_image_metrics(coded_img, orig_img, num_comps, params.m_y_psnr, params.m_print_stats);
+		if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
+			params.m_angular_rms_error = compute_normal_map_image_metrics(coded_img, orig_img, params.m_print_stats, params);
+		
+		params.m_bpp = (comp_size * 8.0f) / (float)total_pixels;
+
+		if (params.m_print_stats)
+		{
+			if (params.m_wavefront)
+				printf("Coded as a wavefront on %u threads\n", num_threads);
+			else if (parallel_filters)
+				printf("Coded PNG filters concurrently on %u threads\n", num_threads);
+			else if (num_strips > 1)
+				printf("Coded %u strips on %u threads\n", num_strips, num_threads);
+
+			printf("Compressed file size: %llu, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
+				(unsigned long long)comp_size,
+				params.m_bpp,
+				params.m_psnr / params.m_bpp,
+				params.m_y_psnr / params.m_bpp);
+		}
+
+		if (params.m_debug_images)
+		{
+			image recovered_img(width, height);
+			for (uint32_t y = 0; y < height; y++)
+				for (uint32_t x = 0; x < width; x++)
+					recovered_img(x, y) = png_unpredict(delta_img(x, y), x, y, recovered_img, filters[y], num_comps);
+
+			char buf[256];
+			sprintf(buf, "dbg_unpredicted_%u.png", encoder_pass);
+			save_png(buf, recovered_img);
+		}
+
+	} // encoder_pass
+	
+	return true;
+}
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+
+#pragma pack(push, 1)
+struct qoi_header
+{
+	char magic[4]; // magic bytes "qoif"
+	uint32_t width; // image width in pixels (BE)
+	uint32_t height; // image height in pixels (BE)
+	uint8_t channels; // 3 = RGB, 4 = RGBA
+	uint8_t colorspace; // 0 = sRGB with linear alpha 1 = all channels linear
+};
+#pragma pack(pop)
+
+static void encode_qoi(const image& img, uint8_vec& data)
+{
+	color_rgba hash[64];
+	clear_obj(hash);
+
+	data.resize(0);
+
+	qoi_header hdr;
+	memcpy(hdr.magic, "qoif", 4);
+	hdr.width = byteswap_32(img.get_width());
+	hdr.height = byteswap_32(img.get_height());
+	hdr.channels = img.has_alpha() ? 4 : 3;
+	hdr.colorspace = 0;
+	data.resize(sizeof(hdr));
+	memcpy(data.data(), &hdr, sizeof(hdr));
+
+	int prev_r = 0, prev_g = 0, prev_b = 0, prev_a = 255;
+	uint32_t cur_run_len = 0;
+
+	for (uint32_t y = 0; y < img.get_height(); y++)
+	{
+		for (uint32_t x = 0; x < img.get_width(); x++)
+		{
+			const color_rgba& c = img(x, y);
+
+			if ((c.r == prev_r) && (c.g == prev_g) && (c.b == prev_b) && (c.a == prev_a))
+			{
+				cur_run_len++;
+				if (cur_run_len == 62)
+				{
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+				}
+				continue;
+			}
+
+			if (cur_run_len)
+			{
+				data.push_back((64 + 128) | (cur_run_len - 1));
+				cur_run_len = 0;
+			}
+
+			uint32_t hash_idx = (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
+			color_rgba& hash_color = hash[hash_idx];
+
+			if (c == hash_color)
+			{
+				data.push_back(hash_idx);
+			}
+			else
+			{
+				hash[hash_idx] = c;
+
+				int dr = ((int)c.r - prev_r + 2) & 255;
+				int dg = ((int)c.g - prev_g + 2) & 255;
+				int db = ((int)c.b - prev_b + 2) & 255;
+
+				if (c.a == prev_a)
+				{
+					if ((dr <= 3) && (dg <= 3) && (db <= 3))
+					{
+						data.push_back(64 + (dr << 4) + (dg << 2) + db);
+					}
+					else
+					{
+						int g_diff = (int)c.g - prev_g;
+
+						dg = (g_diff + 32) & 255;
+
+						dr = (((int)c.r - prev_r) - g_diff + 8) & 255;
+						db = (((int)c.b - prev_b) - g_diff + 8) & 255;
+
+						if ((dg <= 63) && (dr <= 15) && (db <= 15))
+						{
+							data.push_back((uint8_t)(128 + dg));
+							data.push_back((uint8_t)((dr << 4) | db));
+						}
+						else
+						{
+							data.push_back(254);
+							data.push_back((uint8_t)c.r);
+							data.push_back((uint8_t)c.g);
+							data.push_back((uint8_t)c.b);
+						}
+					}
+				}
+				else
+				{
+					data.push_back(255);
+					data.push_back((uint8_t)c.r);
+					data.push_back((uint8_t)c.g);
+					data.push_back((uint8_t)c.b);
+					data.push_back((uint8_t)c.a);
+				}
+			}
+
+			prev_r = c.r;
+			prev_g = c.g;
+			prev_b = c.b;
+			prev_a = c.a;
+		}
+	}
+
+	if (cur_run_len)
+	{
+		data.push_back((64 + 128) | (cur_run_len - 1));
+		cur_run_len = 0;
+	}
+
+	for (uint32_t i = 0; i < 7; i++)
+		data.push_back(0);
+	data.push_back(1);
+}
+
+// Returns a lower bound of the RD cost find_best_candidate<MODE>() would compute for any candidate color with red in [r0,r1], green g, blue in [b0,b1] and alpha a. 
+// The red and blue ranges must be inside one bounds table block. The bound uses the same float operations as the real cost, so it's never above it.
+// Returns QOI_REJECTED_BOX_COST if every candidate would be rejected.
+const float QOI_REJECTED_BOX_COST = 1e+30f;
+
+static float compute_qoi_box_lower_bound(
+	uint32_t r0, uint32_t r1, uint32_t g, uint32_t b0, uint32_t b1, uint32_t a,
+	const color_rgba& orig_color, float mse_scale, float bits_t, const rdo_png_params& params)
+{
+	assert(!params.m_normal_map);
+	
+	if ((params.m_transparent_reject_test) && (((orig_color.a == 0) && (a > 0)) || ((orig_color.a == 255) && (a < 255))))
+		return QOI_REJECTED_BOX_COST;
+
+	const int da = (int)a - (int)orig_color.a;
+	if ((params.m_use_reject_thresholds) && ((uint32_t)abs(da) > params.m_reject_thresholds[3]))
+		return QOI_REJECTED_BOX_COST;
+		
+	float mse;
+
+	if (params.m_perceptual_error)
+	{
+		const Lab16_bounds& bounds = params.m_pTables->get_oklab16_bounds(r0, g, b0);
+		const Lab16 ol(params.m_pTables->get_oklab16(orig_color));
+
+		// The distance from the original's component to the block's range of components.
+		auto get_dist = [](uint32_t lo, uint32_t hi, uint32_t o)
+		{
+			if (o < lo)
+				return lo * SCALE_L - o * SCALE_L;
+			else if (o > hi)
+				return o * SCALE_L - hi * SCALE_L;
+			return 0.0f;
+		};
+
+		const float dL = get_dist(bounds.m_lo.m_L, bounds.m_hi.m_L, ol.m_L);
+		const float d_a = get_dist(bounds.m_lo.m_a, bounds.m_hi.m_a, ol.m_a);
+		const float d_b = get_dist(bounds.m_lo.m_b, bounds.m_hi.m_b, ol.m_b);
+
+		const float dL2 = dL * dL, da2 = d_a * d_a, db2 = d_b * d_b;
+
+		if (params.m_use_reject_thresholds)
+		{
+			if (dL > params.m_reject_thresholds_lab[0])
+				return QOI_REJECTED_BOX_COST;
+
+			if ((da2 + db2) > (params.m_reject_thresholds_lab[1] * params.m_reject_thresholds_lab[1]))
+				return QOI_REJECTED_BOX_COST;
+		}
+
+		mse = (dL2 * params.m_chan_weights_lab[0] + da2 * params.m_chan_weights_lab[1]) + db2 * params.m_chan_weights_lab[2];
+		mse = mse * 350000.0f + params.m_chan_weights_lab[3] * ((float)da * (float)da);
+	}
+	else
+	{
+		const uint32_t dr = (orig_color.r < r0) ? (r0 - orig_color.r) : ((orig_color.r > r1) ? (orig_color.r - r1) : 0);
+		const uint32_t dg = abs((int)g - (int)orig_color.g);
+		const uint32_t db = (orig_color.b < b0) ? (b0 - orig_color.b) : ((orig_color.b > b1) ? (orig_color.b - b1) : 0);
+		
+		if (params.m_use_reject_thresholds)
+		{
+			if ((dr > params.m_reject_thresholds[0]) || (dg > params.m_reject_thresholds[1]) || (db > params.m_reject_thresholds[2]))
+				return QOI_REJECTED_BOX_COST;
+		}
+
+		uint32_t idist;
+		if (params.m_use_chan_weights)
+			idist = params.m_chan_weights[0] * dr * dr + params.m_chan_weights[1] * dg * dg + params.m_chan_weights[2] * db * db + params.m_chan_weights[3] * (uint32_t)(da * da);
+		else
+			idist = dr * dr + dg * dg + db * db + (uint32_t)(da * da);
+
+		mse = (float)idist;
+	}
+
+	return mse_scale * mse + bits_t;
+}
+
+// Finds the best QOI LUMA op for orig_color, with exactly the same result as scoring all 16384 candidates in order with find_best_candidate<MODE>().
+// For each green delta, the candidates form a 16x16 grid of red and blue deltas, which is split at bounds table block boundaries into boxes (16-25 with 4x4x4 blocks, 4-9 with 8x8x8 blocks).
+// Boxes which would be entirely rejected, or whose cost lower bound can't beat best_t, are skipped. What's left is usually a small neighborhood of the ideal residual.
+template<metric_mode MODE>
+static bool find_best_qoi_luma(
+	int prev_r, int prev_g, int prev_b, int prev_a, const color_rgba& orig_color, const Lab& orig_lab,
+	float mse_scale, float lambda, float& best_t, float& best_mse,
+	int& best_dr, int& best_dg, int& best_db,
+	const rdo_png_params& params)
+{
+	const float bits_t = 16.0f * lambda;
+
+	// alive_dr_masks[dg + 32][db + 8] has a bit set for each dr + 8 whose candidate needs to be scored.
+	uint16_t alive_dr_masks[64][16];
+
+	if (params.m_normal_map)
+	{
+		// There's no cheap bound for the normal map metrics.
+		memset(alive_dr_masks, 0xFF, sizeof(alive_dr_masks));
+	}
+	else
+	{
+		memset(alive_dr_masks, 0, sizeof(alive_dr_masks));
+
+		const uint32_t bounds_block_shift = params.m_pTables->get_oklab16_bounds_block_shift();
+		assert(bounds_block_shift >= OKLAB_BOUNDS_BLOCK_SHIFT);
+
+		for (int dg = -32; dg <= 31; dg++)
+		{
+			const uint32_t g = (prev_g + dg) & 255;
+
+			// Split the 16 reds and blues into runs within the same color block. A run never wraps around, because 255 and 0 are in different blocks.
+			uint32_t r_runs[16 / OKLAB_BOUNDS_BLOCK_SIZE + 1][2], b_runs[16 / OKLAB_BOUNDS_BLOCK_SIZE + 1][2];
+			uint32_t num_r_runs = 0, num_b_runs = 0;
+
+			for (uint32_t i = 0; i < 16; i++)
+			{
+				const uint32_t r = (prev_r + dg + (int)i - 8) & 255;
+				if ((!i) || ((r >> bounds_block_shift) != ((uint32_t)((prev_r + dg + (int)i - 9) & 255) >> bounds_block_shift)))
+					r_runs[num_r_runs++][0] = i;
+				r_runs[num_r_runs - 1][1] = i;
+
+				const uint32_t b = (prev_b + dg + (int)i - 8) & 255;
+				if ((!i) || ((b >> bounds_block_shift) != ((uint32_t)((prev_b + dg + (int)i - 9) & 255) >> bounds_block_shift)))
+					b_runs[num_b_runs++][0] = i;
+				b_runs[num_b_runs - 1][1] = i;
+			}
+
+			for (uint32_t ri = 0; ri < num_r_runs; ri++)
+			{
+				const uint32_t r0 = (prev_r + dg + (int)r_runs[ri][0] - 8) & 255;
+				const uint32_t r1 = (prev_r + dg + (int)r_runs[ri][1] - 8) & 255;
+				const uint16_t dr_mask = (uint16_t)(((2U << r_runs[ri][1]) - 1) & ~((1U << r_runs[ri][0]) - 1));
+
+				for (uint32_t bi = 0; bi < num_b_runs; bi++)
+				{
+					const uint32_t b0 = (prev_b + dg + (int)b_runs[bi][0] - 8) & 255;
+					const uint32_t b1 = (prev_b + dg + (int)b_runs[bi][1] - 8) & 255;
+
+					// Candidates can only win if their cost is below best_t, so the box can be skipped.
+					if (compute_qoi_box_lower_bound(r0, r1, g, b0, b1, prev_a, orig_color, mse_scale, bits_t, params) >= best_t)
+						continue;
+
+					for (uint32_t i = b_runs[bi][0]; i <= b_runs[bi][1]; i++)
+						alive_dr_masks[dg + 32][i] |= dr_mask;
+				}
+			}
+		}
+	}
+
+	// Score the remaining candidates in the exhaustive search's order, so ties resolve the same way.
+	const uint32_t CANDS_PER_BATCH = 1024;
+	color_rgba cands[CANDS_PER_BATCH];
+	uint16_t cand_indices[CANDS_PER_BATCH];
+	uint32_t num_cands = 0;
+
+	int best_index = -1;
+
+	for (uint32_t i = 0; i < 16384; i++)
+	{
+		const uint32_t dr_index = (i >> 6) & 15, db_index = (i >> 10) & 15;
+		const uint32_t dg_index = i & 63;
+
+		if ((alive_dr_masks[dg_index][db_index] & (1U << dr_index)) != 0)
+		{
+			int dr = (int)dr_index - 8;
+			int dg = (int)dg_index - 32;
+			int db = (int)db_index - 8;
+
+			cand_indices[num_cands] = (uint16_t)i;
+			cands[num_cands++].set((prev_r + dg + dr) & 255, (prev_g + dg) & 255, (prev_b + dg + db) & 255, prev_a);
+		}
+
+		if ((num_cands == CANDS_PER_BATCH) || ((i == 16383) && (num_cands)))
+		{
+			const int k = find_best_candidate<MODE>(cands, num_cands, orig_color, orig_lab, mse_scale, 16.0f, lambda, best_t, best_mse, params);
+			if (k >= 0)
+				best_index = cand_indices[k];
+
+			num_cands = 0;
+		}
+	}
+
+	if (best_index < 0)
+		return false;
+
+	best_dr = ((best_index >> 6) & 15) - 8;
+	best_dg = (best_index & 63) - 32;
+	best_db = ((best_index >> 10) & 15) - 8;
+
+	return true;
+}
+
+struct qoi_op_stats
+{
+	uint32_t m_total_run = 0, m_total_rgb = 0, m_total_rgba = 0, m_total_index = 0, m_total_delta = 0, m_total_luma = 0, m_total_run_pixels = 0;
+};
+
+// Codes scanlines [first_y, last_y) as QOI ops, appending them to data. A strip which doesn't start at the top of the image doesn't know what the decoder's previous pixel 
+// and color hash will be when it gets there, so it codes its first pixel with an RGBA op and only uses INDEX ops into hash slots it has written itself.
+// That lets strips be coded independently and concatenated into a single standard QOI stream.
+template<metric_mode MODE>
+static void encode_rdo_qoi_strip(
+	const image& orig_img,
+	uint32_t first_y, uint32_t last_y,
+	uint8_vec& data,
+	qoi_op_stats& stats,
+	std::atomic<uint32_t>& total_scanlines_coded,
+	const rdo_png_params& params,
+	const vector2D<float>& smooth_block_mse_scales,
+	float lambda)
+{
+	color_rgba hash[64];
+	clear_obj(hash);
+
+	// The first strip starts with the decoder's all-zero hash, so every slot is usable.
+	uint64_t hash_valid = first_y ? 0 : UINT64_MAX;
+
+	auto set_hash = [&hash, &hash_valid](uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+	{
+		const uint32_t hash_idx = (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+		hash[hash_idx].set(r, g, b, a);
+		hash_valid |= (1ULL << hash_idx);
+	};
+
+	int prev_r = 0, prev_g = 0, prev_b = 0, prev_a = 255;
+	uint32_t cur_run_len = 0;
+
+	enum commands_t
+	{
+		cRUN,
+		cIDX,
+		cDELTA,
+		cLUMA,
+		cRGB,
+		cRGBA,
+	};
+
+	uint32_t total_run = 0, total_rgb = 0, total_rgba = 0, total_index = 0, total_delta = 0, total_luma = 0, total_run_pixels = 0;
+
+	for (uint32_t y = first_y; y < last_y; y++)
+	{
+		for (uint32_t x = 0; x < orig_img.get_width(); x++)
+		{
+			const color_rgba& c = orig_img(x, y);
+			const float mse_scale = smooth_block_mse_scales(x, y);
+			const Lab orig_lab(get_orig_lab(c, params));
+
+			// The decoder's state before the first pixel of a later strip isn't known, so it must be coded with RGBA.
+			// A negative cost rejects every other candidate.
+			const bool force_rgba = (first_y != 0) && (y == first_y) && (x == 0);
+
+			float best_mse = 0.0f;
+			float best_bits = 40.0f;
+			float best_t = force_rgba ? -1.0f : (best_mse + best_bits * lambda);
+			int best_command = cRGBA;
+			int best_index = 0, best_dr = 0, best_dg = 0, best_db = 0;
+
+			{
+				color_rgba trial_c(c.r, c.g, c.b, prev_a);
+				float mse;
+				if (evaluate_candidate_t<MODE, 4>(trial_c, c, orig_lab, params, mse))
+				{
+					float bits = 32.0f;
+					float trial_t = mse_scale * mse + bits * lambda;
+					if (trial_t < best_t)
+					{
+						best_mse = mse;
+						best_bits = bits;
+						best_t = trial_t;
+						best_command = cRGB;
+					}
+				}
+			}
+
+			{
+				color_rgba trial_c(prev_r, prev_g, prev_b, prev_a);
+				float mse;
+				if (evaluate_candidate_t<MODE, 4>(trial_c, c, orig_lab, params, mse))
+				{
+					float bits = cur_run_len ? 0 : 8.0f;
+					float trial_t = mse_scale * mse + bits * lambda;
+					if (trial_t < best_t)
+					{
+						best_mse = mse;
+						best_bits = bits;
+						best_t = trial_t;
+						best_command = cRUN;
+
+						if (best_mse == 0.0f)
+						{
+							cur_run_len++;
+							if (cur_run_len == 62)
+							{
+								total_run_pixels += cur_run_len;
+
+								data.push_back(0xC0 | (cur_run_len - 1));
+								cur_run_len = 0;
+
+								total_run++;
+							}
+
+							set_hash(prev_r, prev_g, prev_b, prev_a);
+
+							continue;
+						}
+					}
+				}
+			}
+
+			if (8.0f * lambda < best_t)
+			{
+				uint32_t hash_idx = (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
+				
+				// First try the INDEX command losslessly.
+				if ((hash_valid & (1ULL << hash_idx)) && (c == hash[hash_idx]))
+				{
+					float bits = 8.0f;
+					float trial_t = bits * lambda;
+
+					assert(trial_t < best_t);
+
+					best_mse = 0.0f;
+					best_bits = bits;
+					best_t = trial_t;
+					best_command = cIDX;
+					best_index = hash_idx;
+				}
+				else
+				{
+					// Try a lossy INDEX command.
+					color_rgba cands[64];
+					uint8_t cand_hash_idx[64];
+					uint32_t num_cands = 0;
+
+					for (uint32_t i = 0; i < 64; i++)
+					{
+						if (hash_valid & (1ULL << i))
+						{
+							cand_hash_idx[num_cands] = (uint8_t)i;
+							cands[num_cands++] = hash[i];
+						}
+					}
+
+					const int k = find_best_candidate<MODE>(cands, num_cands, c, orig_lab, mse_scale, 8.0f, lambda, best_t, best_mse, params);
+					if (k >= 0)
+					{
+						best_bits = 8.0f;
+						best_command = cIDX;
+						best_index = cand_hash_idx[k];
+					}
+				}
+			}
+
+			if (8.0f * lambda < best_t)
+			{
+				bool delta_encodable_losslessly = false;
+
+				// First try the DELTA command losslessly.
+				if (c.a == prev_a)
+				{
+					int dr = ((int)c.r - prev_r + 2) & 255;
+					int dg = ((int)c.g - prev_g + 2) & 255;
+					int db = ((int)c.b - prev_b + 2) & 255;
+					
+					if ((dr <= 3) && (dg <= 3) && (db <= 3))
+					{
+						delta_encodable_losslessly = true;
+
+						float bits = 8.0f;
+						float trial_t = bits * lambda;
+
+						assert(trial_t < best_t);
+												
+						best_mse = 0.0f;
+						best_bits = bits;
+						best_t = trial_t;
+						best_command = cDELTA;
+						best_dr = dr - 2;
+						best_dg = dg - 2;
+						best_db = db - 2;
+					}
+				}
+
+				// Try a lossy DELTA command.
+				if (!delta_encodable_losslessly)
+				{
+					color_rgba cands[64];
+					for (uint32_t i = 0; i < 64; i++)
+					{
+						int dr = ((i >> 4) & 3) - 2;
+						int dg = ((i >> 2) & 3) - 2;
+						int db = (i & 3) - 2;
+
+						cands[i].set((prev_r + dr) & 255, (prev_g + dg) & 255, (prev_b + db) & 255, prev_a);
+					}
+
+					const int k = find_best_candidate<MODE>(cands, 64, c, orig_lab, mse_scale, 8.0f, lambda, best_t, best_mse, params);
+					if (k >= 0)
+					{
+						best_bits = 8.0f;
+						best_command = cDELTA;
+						best_dr = ((k >> 4) & 3) - 2;
+						best_dg = ((k >> 2) & 3) - 2;
+						best_db = (k & 3) - 2;
+					}
+				}
+			}
+
+			if (16.0f * lambda < best_t)
+			{
+				bool luma_encodable_losslessly_in_rgb = false;
+
+				// First try the LUMA command losslessly in RGB (may not be lossy in alpha).
+				{
+					int g_diff = (int)c.g - prev_g;
+
+					int dg = (g_diff + 32) & 255;
+
+					int dr = (((int)c.r - prev_r) - g_diff + 8) & 255;
+					int db = (((int)c.b - prev_b) - g_diff + 8) & 255;
+
+					if ((dg <= 63) && (dr <= 15) && (db <= 15))
+					{
+						luma_encodable_losslessly_in_rgb = true;
+
+						color_rgba trial_c(c.r, c.g, c.b, prev_a);
+
+						float mse;
+						if (evaluate_candidate_t<MODE, 4>(trial_c, c, orig_lab, params, mse))
+						{
+							float bits = 16.0f;
+							float trial_t = mse_scale * mse + bits * lambda;
+
+							if (trial_t < best_t)
+							{
+								best_mse = mse;
+								best_bits = bits;
+								best_t = trial_t;
+								best_command = cLUMA;
+								best_dr = dr - 8;
+								best_dg = dg - 32;
+								best_db = db - 8;
+							}
+						}
+					}
+				}
+
+				// If we can't use it losslessly, try it lossy.
+				if ((!luma_encodable_losslessly_in_rgb) && (params.m_speed_mode != cFastestSpeed))
+				{
+					if (params.m_speed_mode == cNormalSpeed)
+					{
+#if RDO_PNG_PRUNE_QOI_LUMA
+						if (find_best_qoi_luma<MODE>(prev_r, prev_g, prev_b, prev_a, c, orig_lab, mse_scale, lambda, best_t, best_mse, best_dr, best_dg, best_db, params))
+						{
+							best_bits = 16.0f;
+							best_command = cLUMA;
+						}
+#else
+						// Search all encodable LUMA commands, 1024 at a time.
+						const uint32_t CANDS_PER_BATCH = 1024;
+						color_rgba cands[CANDS_PER_BATCH];
+						
+						for (uint32_t first_i = 0; first_i < 16384; first_i += CANDS_PER_BATCH)
+						{
+							for (uint32_t j = 0; j < CANDS_PER_BATCH; j++)
+							{
+								const uint32_t i = first_i + j;
+								int dr = ((i >> 6) & 15) - 8;
+								int dg = (i & 63) - 32;
+								int db = ((i >> 10) & 15) - 8;
+
+								cands[j].set((prev_r + dg + dr) & 255, (prev_g + dg) & 255, (prev_b + dg + db) & 255, prev_a);
+							}
+
+							const int k = find_best_candidate<MODE>(cands, CANDS_PER_BATCH, c, orig_lab, mse_scale, 16.0f, lambda, best_t, best_mse, params);
+							if (k >= 0)
+							{
+								const uint32_t i = first_i + k;
+								best_bits = 16.0f;
+								best_command = cLUMA;
+								best_dr = ((i >> 6) & 15) - 8;
+								best_dg = (i & 63) - 32;
+								best_db = ((i >> 10) & 15) - 8;
+							}
+						}
+#endif
+					}
+					else
+					{
+						// TODO: This isn't very smart. What if the G delta is encodable but R and/or B aren't?
+						const int g_deltas[] = { -24, -16, -14, -12, -10, -8, -6, -4, -3, -2, -1, 0, 1, 2, 3, 4, 6, 8, 10, 12, 14, 16, 24 };
+						const int TOTAL_G_DELTAS = sizeof(g_deltas) / sizeof(g_deltas[0]);
+
+						color_rgba cands[256];
+
+						for (int kg = 0; kg < TOTAL_G_DELTAS; kg++)
+						{
+							const int dg = g_deltas[kg];
+							for (uint32_t i = 0; i < 256; i++)
+							{
+								int dr = (i & 15) - 8;
+								int db = ((i >> 4) & 15) - 8;
+
+								cands[i].set((prev_r + dg + dr) & 255, (prev_g + dg) & 255, (prev_b + dg + db) & 255, prev_a);
+							}
+
+							const int k = find_best_candidate<MODE>(cands, 256, c, orig_lab, mse_scale, 16.0f, lambda, best_t, best_mse, params);
+							if (k >= 0)
+							{
+								best_bits = 16.0f;
+								best_command = cLUMA;
+								best_dr = (k & 15) - 8;
+								best_dg = dg;
+								best_db = ((k >> 4) & 15) - 8;
+							}
+						}
+					}
+				}
+			}
+
+			switch (best_command)
+			{
+			case cRUN:
+			{
+				cur_run_len++;
+				if (cur_run_len == 62)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				set_hash(prev_r, prev_g, prev_b, prev_a);
+
+				break;
+			}
+			case cRGB:
+			{
+				if (cur_run_len)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				data.push_back(254);
+				data.push_back((uint8_t)c.r);
+				data.push_back((uint8_t)c.g);
+				data.push_back((uint8_t)c.b);
+				set_hash(c.r, c.g, c.b, prev_a);
+				prev_r = c.r;
+				prev_g = c.g;
+				prev_b = c.b;
+
+				total_rgb++;
+
+				break;
+			}
+			case cRGBA:
+			{
+				if (cur_run_len)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				data.push_back(255);
+				data.push_back((uint8_t)c.r);
+				data.push_back((uint8_t)c.g);
+				data.push_back((uint8_t)c.b);
+				data.push_back((uint8_t)c.a);
+				set_hash(c.r, c.g, c.b, c.a);
+				prev_r = c.r;
+				prev_g = c.g;
+				prev_b = c.b;
+				prev_a = c.a;
+
+				total_rgba++;
+
+				break;
+			}
+			case cIDX:
+			{
+				if (cur_run_len)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				data.push_back(best_index);
+
+				prev_r = hash[best_index].r;
+				prev_g = hash[best_index].g;
+				prev_b = hash[best_index].b;
+				prev_a = hash[best_index].a;
+
+				total_index++;
+
+				break;
+			}
+			case cDELTA:
+			{
+				if (cur_run_len)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				assert(best_dr >= -2 && best_dr <= 1);
+				assert(best_dg >= -2 && best_dg <= 1);
+				assert(best_db >= -2 && best_db <= 1);
+
+				data.push_back(64 + ((best_dr + 2) << 4) + ((best_dg + 2) << 2) + (best_db + 2));
+
+				uint32_t decoded_r = (prev_r + best_dr) & 0xFF;
+				uint32_t decoded_g = (prev_g + best_dg) & 0xFF;
+				uint32_t decoded_b = (prev_b + best_db) & 0xFF;
+				uint32_t decoded_a = prev_a;
+
+				set_hash(decoded_r, decoded_g, decoded_b, decoded_a);
+
+				prev_r = decoded_r;
+				prev_g = decoded_g;
+				prev_b = decoded_b;
+				prev_a = decoded_a;
+
+				total_delta++;
+
+				break;
+			}
+			case cLUMA:
+			{
+				if (cur_run_len)
+				{
+					total_run_pixels += cur_run_len;
+
+					data.push_back(0xC0 | (cur_run_len - 1));
+					cur_run_len = 0;
+
+					total_run++;
+				}
+
+				assert(best_dr >= -8 && best_dr <= 7);
+				assert(best_dg >= -32 && best_dg <= 31);
+				assert(best_db >= -8 && best_db <= 7);
+
+				data.push_back((uint8_t)(128 + (best_dg + 32)));
+				data.push_back((uint8_t)(((best_dr + 8) << 4) | (best_db + 8)));
+
+				uint32_t decoded_r = (prev_r + best_dr + best_dg) & 0xFF;
+				uint32_t decoded_g = (prev_g + best_dg) & 0xFF;
+				uint32_t decoded_b = (prev_b + best_db + best_dg) & 0xFF;
+				uint32_t decoded_a = prev_a;
+
+				set_hash(decoded_r, decoded_g, decoded_b, decoded_a);
+
+				prev_r = decoded_r;
+				prev_g = decoded_g;
+				prev_b = decoded_b;
+				prev_a = decoded_a;
+
+				total_luma++;
+
+				break;
+			}
+			default:
+			{
+				assert(0);
+				break;
+			}
+			}
+
+		}
+
+		const uint32_t n = ++total_scanlines_coded;
+		if ((params.m_print_progress) && ((n & 15) == 0))
+		{
+			printf("\b\b\b\b\b\b\b\b%3.2f%%", n * 100.0f / orig_img.get_height());
+			fflush(stdout);
+		}
+	}
+
+	if (cur_run_len)
+	{
+		total_run_pixels += cur_run_len;
+
+		data.push_back((64 + 128) | (cur_run_len - 1));
+		cur_run_len = 0;
+
+		total_run++;
+	}
+
+	stats.m_total_run += total_run;
+	stats.m_total_rgb += total_rgb;
+	stats.m_total_rgba += total_rgba;
+	stats.m_total_index += total_index;
+	stats.m_total_delta += total_delta;
+	stats.m_total_luma += total_luma;
+	stats.m_total_run_pixels += total_run_pixels;
+}
+
+static bool encode_rdo_qoi(
+	const image& orig_img,
+	uint8_vec& data,
+	const rdo_png_params& params,
+	const vector2D<float>& smooth_block_mse_scales,
+	float lambda)
+{
+	// This function wasn't designed to deal with lambda=0, so nudge it up.
+	lambda = maximum(lambda, .0000125f);
+
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t height = orig_img.get_height();
+
+	data.resize(0);
+
+	qoi_header hdr;
+	memcpy(hdr.magic, "qoif", 4);
+	hdr.width = byteswap_32(orig_img.get_width());
+	hdr.height = byteswap_32(height);
+	hdr.channels = has_alpha ? 4 : 3;
+	hdr.colorspace = 0;
+	data.resize(sizeof(hdr));
+	memcpy(data.data(), &hdr, sizeof(hdr));
+
+	// With -threads the image is split into horizontal strips which are coded concurrently.
+	const uint32_t num_strips = clamp<uint32_t>(params.m_num_threads, 1, height);
+
+	basisu::vector<uint8_vec> strip_data(num_strips);
+	basisu::vector<qoi_op_stats> strip_stats(num_strips);
+	std::atomic<uint32_t> total_scanlines_coded(0);
+
+	// Every strip is coded by the instantiation specialized for this encode's metric.
+	typedef decltype(&encode_rdo_qoi_strip<cMetricRGB>) encode_rdo_qoi_strip_func;
+	static const encode_rdo_qoi_strip_func s_encode_rdo_qoi_strip_funcs[cTotalMetricModes] = 
+	{ 
+		encode_rdo_qoi_strip<cMetricRGB>, encode_rdo_qoi_strip<cMetricWeightedRGB>, encode_rdo_qoi_strip<cMetricOklab>, encode_rdo_qoi_strip<cMetricNormalMap> 
+	};
+	const encode_rdo_qoi_strip_func pEncode_rdo_qoi_strip = s_encode_rdo_qoi_strip_funcs[get_metric_mode(params)];
+
+	auto encode_strip = [&](uint32_t strip_index)
+	{
+		pEncode_rdo_qoi_strip(
+			orig_img,
+			(height * strip_index) / num_strips, (height * (strip_index + 1)) / num_strips,
+			strip_data[strip_index], strip_stats[strip_index], total_scanlines_coded,
+			params, smooth_block_mse_scales, lambda);
+	};
+
+	if (num_strips > 1)
+	{
+		job_pool pool(num_strips);
+		for (uint32_t strip_index = 0; strip_index < num_strips; strip_index++)
+			pool.add_job([&encode_strip, strip_index] { encode_strip(strip_index); });
+		pool.wait_for_all();
+	}
+	else
+	{
+		encode_strip(0);
+	}
+
+	if (params.m_print_progress)
+	{
+		printf("\b\b\b\b\b\b\b\b        \b\b\b\b\b\b\b\b\n");
+		fflush(stdout);
+	}
+
+	qoi_op_stats stats;
+	for (uint32_t strip_index = 0; strip_index < num_strips; strip_index++)
+	{
+		data.append(strip_data[strip_index]);
+
+		stats.m_total_run += strip_stats[strip_index].m_total_run;
+		stats.m_total_rgb += strip_stats[strip_index].m_total_rgb;
+		stats.m_total_rgba += strip_stats[strip_index].m_total_rgba;
+		stats.m_total_index += strip_stats[strip_index].m_total_index;
+		stats.m_total_delta += strip_stats[strip_index].m_total_delta;
+		stats.m_total_luma += strip_stats[strip_index].m_total_luma;
+		stats.m_total_run_pixels += strip_stats[strip_index].m_total_run_pixels;
+	}
+
+	for (uint32_t i = 0; i < 7; i++)
+		data.push_back(0);
+	data.push_back(1);
+
+	if (params.m_print_stats)
+	{
+		if (num_strips > 1)
+			printf("Coded %u strips on %u threads\n", num_strips, num_strips);
+
+		printf("Totals: Run: %u, Run Pixels: %u %3.2f%%, RGB: %u %3.2f%%, RGBA: %u %3.2f%%, INDEX: %u %3.2f%%, DELTA: %u %3.2f%%, LUMA: %u %3.2f%%\n\n",
+			stats.m_total_run,
+			stats.m_total_run_pixels, (stats.m_total_run_pixels * 100.0f) / orig_img.get_total_pixels(),
+			stats.m_total_rgb, (stats.m_total_rgb * 100.0f) / orig_img.get_total_pixels(),
+			stats.m_total_rgba, (stats.m_total_rgba * 100.0f) / orig_img.get_total_pixels(),
+			stats.m_total_index, (stats.m_total_index * 100.0f) / orig_img.get_total_pixels(),
+			stats.m_total_delta, (stats.m_total_delta * 100.0f) / orig_img.get_total_pixels(),
+			stats.m_total_luma, (stats.m_total_luma * 100.0f) / orig_img.get_total_pixels());
+	}
+
+	return true;
+}
+
+static bool rdo_qoi(encoder_context& ctx, rdo_png_params& params)
+{
+	params.m_pTables = &ctx.get_tables();
+
+	const image& orig_img = params.m_orig_img;
+
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const uint32_t total_pixels = orig_img.get_total_pixels();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
+	
+	float lambda = params.m_lambda;
+
+	if (params.m_debug_images)
+	{
+		ctx.save_png("dbg_orig.png", orig_img, encoder_context::cZlibLodePNG);
+	}
+
+	// The lossless reference encode is only informational, so skip it when nothing will use it (such as in rdo_search_lambda()'s trial encodes).
+	if ((params.m_print_stats) || (params.m_debug_images))
+	{
+		int ref_qoi_len = 0;
+		qoi_desc ref_qoi_desc;
+		ref_qoi_desc.width = orig_img.get_width();
+		ref_qoi_desc.height = orig_img.get_height();
+		ref_qoi_desc.channels = 4;
+		ref_qoi_desc.colorspace = 0;
+		void* pRef_qoi_data = qoi_encode(orig_img.get_ptr(), &ref_qoi_desc, &ref_qoi_len);
+		if (params.m_debug_images)
+			write_data_to_file("dbg_orig.qoi", pRef_qoi_data, ref_qoi_len);
+		free(pRef_qoi_data);
+
+		if (params.m_print_stats)
+			printf("Lossless QOI encoded size: %i bytes, Bitrate: %3.3f bits/pixel\n", ref_qoi_len, (ref_qoi_len * 8.0f) / total_pixels);
+	}
+
+	vector2D<float> smooth_block_mse_scales_buf;
+	const vector2D<float>& smooth_block_mse_scales = get_smooth_maps(smooth_block_mse_scales_buf, params);
+
+	if (!encode_rdo_qoi(
+		orig_img,
+		params.m_output_file_data,
+		params,
+		smooth_block_mse_scales,
+		lambda))
+	{
+		return false;
+	}
+			
+	const uint32_t rdo_qoi_len = params.m_output_file_data.size();
+
+	qoi_desc rdo_qoi_desc;
+	void* pDecoded_RDO_image = qoi_decode((const void*)params.m_output_file_data.data(), (int)rdo_qoi_len, &rdo_qoi_desc, 4);
+	if (!pDecoded_RDO_image)
+	{
+		fprintf(stderr, "qoi_decode() failed!\n");
+		return false;
+	}
+
+	image decoded_image((uint8_t*)pDecoded_RDO_image, rdo_qoi_desc.width, rdo_qoi_desc.height, 4);
+	free(pDecoded_RDO_image);
+	pDecoded_RDO_image = nullptr;
+
+	if (params.m_debug_images)
+	{
+		save_png("dbg_coded.png", decoded_image);
+		save_png("dbg_coded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
+		save_png("dbg_coded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
+	}
+	
+	params.m_output_image = decoded_image;
+
+	params.m_psnr = compute_image_metrics(decoded_image, orig_img, 4, params.m_y_psnr, params.m_print_stats);
+	if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
+		params.m_angular_rms_error = compute_normal_map_image_metrics(decoded_image, orig_img, params.m_print_stats, params);
+
+	params.m_bpp = (rdo_qoi_len * 8.0f) / total_pixels;
+
+	if (params.m_print_stats)
+	{
+		printf("Compressed file size: %u bytes, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
+			rdo_qoi_len,
+			params.m_bpp,
+			params.m_psnr / params.m_bpp,
+			params.m_y_psnr / params.m_bpp);
+	}
+		
+	return true;
+}
+
+#include "lz4.h"
+#include "lz4hc.h"
+
+#pragma pack(push, 1)
+struct lz4i_header
+{
+	char sig[4]; // signature bytes "lz4i"
+	uint32_t width; // image width in pixels (BE)
+	uint32_t height; // image height in pixels (BE)
+	uint8_t channels; // 3 = RGB, 4 = RGBA
+	uint8_t colorspace; // 0 = sRGB with linear alpha 1 = all channels linear
+};
+
+// Tiled .LZ4I files. The image is divided into tiles (or strips) which are LZ4 compressed independently, so they can be decoded concurrently or one at a time.
+// The header is followed by (total tiles + 1) big endian uint32's: the file offset of each tile's LZ4 block in raster order, then the file size.
+// Each block contains the tile's RGB(A) pixels in raster order. Tiles on the right/bottom edges are clipped to the image.
+struct lz4i_tiled_header
+{
+	char sig[4]; // signature bytes "lz4t"
+	uint32_t width; // image width in pixels (BE)
+	uint32_t height; // image height in pixels (BE)
+	uint8_t channels; // 3 = RGB, 4 = RGBA
+	uint8_t colorspace; // 0 = sRGB with linear alpha 1 = all channels linear
+	uint8_t version; // LZ4I_TILED_VERSION
+	uint8_t reserved; // 0
+	uint32_t tile_width; // tile width in pixels (BE)
+	uint32_t tile_height; // tile height in pixels (BE)
+};
+#pragma pack(pop)
+
+const uint8_t LZ4I_TILED_VERSION = 2;
+const uint32_t LZ4I_MAX_DIM = 65536 * 8;
+
+// Returns false if any trial pixel is rejected, otherwise returns true and sets mse to the same value as compute_mse(), looking up each trial pixel's Oklab color once.
+// Also returns false as soon as the cost of the pixels so far, mse_scale * (partial mse) + bits_t, can't beat best_t. pOrig_labs holds get_orig_lab() of each pixel in pOrig_buf.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline bool evaluate_trial_pixels(const uint8_t* pTrial_buf, const uint8_t* pOrig_buf, const Lab* pOrig_labs, uint32_t num_pixels, uint32_t num_comps, 
+	float mse_scale, float bits_t, float best_t, const rdo_png_params& params, float& mse)
+{
+	float total_se = 0.0f;
+
+	uint32_t ofs = 0;
+
+	color_rgba o(0, 255), t(0, 255);
+	for (uint32_t i = 0; i < num_pixels; i++)
+	{
+		t.r = pTrial_buf[ofs];
+		t.g = pTrial_buf[ofs + 1];
+		t.b = pTrial_buf[ofs + 2];
+		if (num_comps == 4)
+			t.a = pTrial_buf[ofs + 3];
+
+		o.r = pOrig_buf[ofs];
+		o.g = pOrig_buf[ofs + 1];
+		o.b = pOrig_buf[ofs + 2];
+		if (num_comps == 4)
+			o.a = pOrig_buf[ofs + 3];
+
+		float se;
+		if (!evaluate_candidate_t<MODE, NUM_COMPS>(t, o, pOrig_labs[i], params, se))
+			return false;
+
+		total_se += se;
+
+		if (((i + 1) < num_pixels) && ((mse_scale * (total_se / num_pixels) + bits_t) >= best_t))
+		{
+			RDO_PNG_COUNT_CANDIDATES_ADD(cCandidatesCutShort, 1);
+			return false;
+		}
+		
+		ofs += num_comps;
+	}
+
+	mse = total_se / num_pixels;
+	return true;
+}
+
+// pOrig_labs holds get_orig_lab() of each pixel in pOrig_buf.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static inline float compute_mse(const uint8_t* pTrial_buf, const uint8_t* pOrig_buf, const Lab* pOrig_labs, uint32_t num_pixels, uint32_t num_comps, const rdo_png_params &params)
+{
+	float total_se = 0.0f;
+
+	uint32_t ofs = 0;
+	
+	color_rgba o(0, 255), t(0, 255);
+	for (uint32_t i = 0; i < num_pixels; i++)
+	{
+		t.r = pTrial_buf[ofs];
+		t.g = pTrial_buf[ofs + 1];
+		t.b = pTrial_buf[ofs + 2];
+		if (num_comps == 4)
+			t.a = pTrial_buf[ofs + 3];
+
+		o.r = pOrig_buf[ofs];
+		o.g = pOrig_buf[ofs + 1];
+		o.b = pOrig_buf[ofs + 2];
+		if (num_comps == 4)
+			o.a = pOrig_buf[ofs + 3];
+				
+		total_se += compute_se_t<MODE, NUM_COMPS>(t, o, pOrig_labs[i], params);
+		
+		ofs += num_comps;
+	}
+	
+	return total_se / num_pixels;
+}
+
+const uint32_t RDO_LZ4_PIXEL_QUANT = 4;
+const uint32_t RDO_LZ4_MIN_MATCH_LEN_IN_BYTES = 4;
+
+const uint32_t LZ4_MIN_MATCH = 4;
+const uint32_t LZ4_LAST_LITERALS = 5;
+const uint32_t LZ4_MF_LIMIT = 12;
+const uint32_t LZ4_MAX_DISTANCE = 65535;
+
+const uint32_t LZ4I_MATCH_HASH_BITS = 16;
+const uint32_t LZ4I_MATCH_HASH_QUANT_SHIFT = 3;
+const uint32_t LZ4I_NORMAL_MAX_CHAIN_LEN = 64;
+const uint32_t LZ4I_FASTER_MAX_CHAIN_LEN = 16;
+const uint32_t LZ4I_FASTEST_MAX_CHAIN_LEN = 4;
+
+// Hash chains over the already coded pixels of a LZ4I strip, keyed by pairs of horizontally adjacent pixels quantized to 5 bits per component.
+// insert_lz4_match<MODE, NUM_COMPS>() walks them to find candidate matches anywhere within LZ4's 64KB window, instead of only near the current pixel.
+struct lz4i_match_index
+{
+	uint32_t m_width;
+	uint32_t m_first_y;
+	uint32_t m_num_comps;
+	uint32_t m_max_chain_len;
+
+	// The most recently inserted position for each hash, and the previous position with the same hash for each position. Positions are pixel indices relative to the strip.
+	uint_vec m_heads;
+	uint_vec m_prev;
+
+	void init(uint32_t width, uint32_t first_y, uint32_t last_y, uint32_t num_comps, uint32_t max_chain_len)
+	{
+		m_width = width;
+		m_first_y = first_y;
+		m_num_comps = num_comps;
+		m_max_chain_len = max_chain_len;
+		
+		m_heads.resize(1U << LZ4I_MATCH_HASH_BITS);
+		m_heads.set_all(UINT32_MAX);
+		
+		m_prev.resize(width * (last_y - first_y));
+		m_prev.set_all(UINT32_MAX);
+	}
+
+	inline uint32_t get_hash(const color_rgba& a, const color_rgba& b) const
+	{
+		const uint32_t S = LZ4I_MATCH_HASH_QUANT_SHIFT;
+		
+		uint32_t qa = (a.r >> S) | ((a.g >> S) << 5) | ((a.b >> S) << 10);
+		uint32_t qb = (b.r >> S) | ((b.g >> S) << 5) | ((b.b >> S) << 10);
+		if (m_num_comps == 4)
+		{
+			qa |= (a.a >> S) << 15;
+			qb |= (b.a >> S) << 15;
+		}
+
+		return ((qa * 2654435761U) ^ (qb * 2246822519U)) >> (32 - LZ4I_MATCH_HASH_BITS);
+	}
+
+	inline uint32_t get_pos(uint32_t x, uint32_t y) const
+	{
+		return x + (y - m_first_y) * m_width;
+	}
+
+	// Inserts the pixel pair starting at (x, y), which must both be coded.
+	inline void insert(const image& coded_img, uint32_t x, uint32_t y)
+	{
+		assert((x + 1) < m_width);
+
+		const uint32_t h = get_hash(coded_img(x, y), coded_img(x + 1, y));
+		const uint32_t pos = get_pos(x, y);
+
+		m_prev[pos] = m_heads[h];
+		m_heads[h] = pos;
+	}
+};
+
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static bool insert_lz4_match(
+	const image &orig_img, image &coded_img,
+	int xi, int yi, int first_y, int width, int height, 
+	uint32_t insert_len_in_bytes, uint32_t dst_insert_ofs,
+	int lookahead_size_in_bytes, int lookahead_size_in_pixels,
+	const uint8_t *pOrig_buf, const Lab *pOrig_labs,
+	uint8_t *pBest_buf, float &best_t, float &best_bits, float &best_mse, uint32_t& best_trial_len, int &best_trial_dist,
+	int match_dist_to_favor, bool &used_favored_match_dist,
+	float lambda, uint32_t num_comps,
+	const vector2D<float>& smooth_block_mse_scales,
+	const lz4i_match_index* pMatch_index,
+	const rdo_png_params &params)
+{
+	bool found_match = false;
+	
+	const bool exhaustive_search = false;
+
+	int SCANLINES_TO_CHECK = 4;
+	int search_dist = 16;
+
+	if (params.m_speed_mode == cNormalSpeed)
+	{
+		SCANLINES_TO_CHECK = 8;
+		search_dist = 64;
+	}
+	else if (params.m_speed_mode == cFasterSpeed)
+	{
+		SCANLINES_TO_CHECK = 4;
+		search_dist = 16;
+	}
+	else if (params.m_speed_mode == cFastestSpeed)
+	{
+		SCANLINES_TO_CHECK = 2;
+		search_dist = 8;
+	}
+		
+	uint8_t initial_buf[RDO_LZ4_PIXEL_QUANT * 4];
+	memcpy(initial_buf, pBest_buf, lookahead_size_in_bytes);
+	
+	best_t = 1e+9f;
+	best_bits = 0.0f;
+	best_mse = 0.0f;
+	best_trial_len = 0;
+	best_trial_dist = 0;
+	used_favored_match_dist = false;
+
+	const uint32_t first_pixel_ofs = dst_insert_ofs / num_comps;
+	const uint32_t first_pixel_byte_ofs = first_pixel_ofs * num_comps;
+		
+	const uint32_t total_pixels = ((dst_insert_ofs + insert_len_in_bytes - 1) / num_comps) - first_pixel_ofs + 1;
+
+	float mse_scale = 0.0f;
+	for (uint32_t i = 0; i < (uint32_t)minimum<uint32_t>(total_pixels, width - xi); i++)
+		mse_scale = maximum(mse_scale, smooth_block_mse_scales(xi + first_pixel_ofs + i, yi));
+		
+	// Tries copying pixels starting at (xd, y), for at most max_match_len_in_pixels pixels.
+	auto try_match = [&](int xd, int y, uint32_t max_match_len_in_pixels)
+	{
+		int cur_match_dist = (int)(xi * num_comps + dst_insert_ofs + yi * width * num_comps) - (int)(xd * num_comps + (dst_insert_ofs % num_comps) + y * width * num_comps);
+
+		float trial_bits = 24.0f;
+		if ((dst_insert_ofs == 0) && (match_dist_to_favor != -1))
+		{
+			if (cur_match_dist == match_dist_to_favor)
+				trial_bits = 0;
+		}
+
+		if (!can_beat_best_t(trial_bits * lambda, best_t))
+			return;
+
+		uint8_t trial_buf[RDO_LZ4_PIXEL_QUANT * 4];
+		memcpy(trial_buf, initial_buf, lookahead_size_in_bytes);
+
+		uint32_t trial_buf_ofs = dst_insert_ofs;
+		const uint32_t end_ofs = dst_insert_ofs + insert_len_in_bytes;
+
+		uint32_t src_pix_ofs = 0;
+		uint32_t cur_comp = dst_insert_ofs % num_comps;
+		while ((trial_buf_ofs < end_ofs) && (src_pix_ofs < max_match_len_in_pixels))
+		{
+			const color_rgba& c = coded_img(xd + src_pix_ofs, y);
+
+			while (cur_comp < num_comps)
+			{
+				assert((trial_buf_ofs % num_comps) == (cur_comp % num_comps));
+
+				trial_buf[trial_buf_ofs++] = c[cur_comp];
+				if (trial_buf_ofs == end_ofs)
+					break;
+
+				cur_comp++;
+			}
+			cur_comp = 0;
+
+			src_pix_ofs++;
+		}
+		assert(trial_buf_ofs <= RDO_LZ4_PIXEL_QUANT * num_comps);
+
+		const uint32_t actual_insert_len_in_bytes = trial_buf_ofs - dst_insert_ofs;
+
+		if (actual_insert_len_in_bytes != insert_len_in_bytes)
+			return;
+
+		assert(cur_match_dist >= (int)num_comps);
+
+		float trial_mse;
+		if (!evaluate_trial_pixels<MODE, NUM_COMPS>(trial_buf + first_pixel_byte_ofs, pOrig_buf + first_pixel_byte_ofs, pOrig_labs + first_pixel_ofs, total_pixels, num_comps, 
+			mse_scale, trial_bits * lambda, best_t, params, trial_mse))
+			return;
+		
+		float trial_t = mse_scale * trial_mse + trial_bits * lambda;
+
+		if (trial_t < best_t)
+		{
+			best_t = trial_t;
+			best_bits = trial_bits;
+			best_mse = trial_mse;
+			memcpy(pBest_buf, trial_buf, lookahead_size_in_bytes);
+			best_trial_len = actual_insert_len_in_bytes;
+			best_trial_dist = cur_match_dist;
+			found_match = true;
+			used_favored_match_dist = (trial_bits == 0.0f);
+		}
+	};
+
+	for (int yd = 0; yd < (int)SCANLINES_TO_CHECK; yd++)
+	{
+		const int y = (int)yi - yd;
+		if (y < first_y)
+			break;
+
+		int x_start, x_end;
+		const int total_passes = ((yd == 1) && !exhaustive_search) ? 2 : 1;
+		for (int pass = 0; pass < total_passes; pass++)
+		{
+			const int n = total_pixels;
+
+			if (exhaustive_search)
+			{
+				x_end = yd ? ((int)width - n) : ((int)xi - n);
+				x_start = 0;
+			}
+			else
+			{
+				if (!yd)
+				{
+					if ((int)xi < n)
+						continue;
+
+					x_start = maximum<int>((int)xi - search_dist * 2, 0);
+					x_end = maximum<int>((int)xi - n, 0);
+				}
+				else if ((yd == 1) && (pass == 0))
+				{
+					if (width <= (uint32_t)search_dist * 2)
+						continue;
+
+					x_start = maximum<int>((int)width - search_dist, 0);
+					x_end = width - n;
+				}
+				else
+				{
+					x_start = maximum<int>((int)xi - search_dist, 0);
+					x_end = minimum<int>((int)xi + search_dist, (int)width - n);
+				}
+			}
+
+			for (int xd = x_end; xd >= x_start; xd--)
+			{
+				assert((xd + n - 1) < (int)width);
+				assert((yd != 0) || ((xd + n - 1) < (int)xi));
+
+				try_match(xd, y, minimum<uint32_t>(x_end - xd + 1, RDO_LZ4_PIXEL_QUANT));
+			} // xd
+		
+		} // pass
+
+	} // yd
+
+	// Now try the earlier pixels whose quantized colors match the original pixels, anywhere in the strip within LZ4's window.
+	if ((pMatch_index) && (pMatch_index->m_max_chain_len) && (total_pixels >= 2))
+	{
+		const int query_x = xi + first_pixel_ofs;
+		const uint32_t cur_pos = pMatch_index->get_pos(query_x, yi);
+		const int n = total_pixels;
+
+		uint32_t pos = pMatch_index->m_heads[pMatch_index->get_hash(orig_img(query_x, yi), orig_img(query_x + 1, yi))];
+		for (uint32_t chain_len = 0; (pos != UINT32_MAX) && (chain_len < pMatch_index->m_max_chain_len); chain_len++, pos = pMatch_index->m_prev[pos])
+		{
+			assert(pos < cur_pos);
+			if ((cur_pos - pos) * num_comps > LZ4_MAX_DISTANCE)
+				break;
+
+			const int xd = pos % width;
+			const int y = pMatch_index->m_first_y + pos / width;
+			
+			const int x_limit = (y == yi) ? (xi - n) : (width - n);
+			if (xd > x_limit)
+				continue;
+
+			try_match(xd, y, minimum<uint32_t>(x_limit - xd + 1, RDO_LZ4_PIXEL_QUANT));
+		}
+	}
+
+	return found_match;
+}
+
+// Chooses the lossy pixels for scanlines [first_y, last_y) of coded_img. Matches only reference scanlines in this range, so strips can be coded concurrently.
+// Each strip only writes the match_distances entries of its own bytes.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static void encode_rdo_lz4i_strip(
+	const image& orig_img,
+	image& coded_img,
+	uint32_t first_y, uint32_t last_y,
+	uint32_t num_comps,
+	int_vec& match_distances,
+	uint32_t* pMatch_order_hist,
+	std::atomic<uint32_t>& total_scanlines_coded,
+	const rdo_png_params& params,
+	const vector2D<float>& smooth_block_mse_scales,
+	float lambda,
+	bool verbose)
+{
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+
+	int match_dist_to_favor = -1;
+
+	// The number of earlier positions with matching quantized colors insert_lz4_match<MODE, NUM_COMPS>() tries, on top of its local search.
+	uint32_t max_chain_len = LZ4I_FASTEST_MAX_CHAIN_LEN;
+	if (params.m_speed_mode == cNormalSpeed)
+		max_chain_len = LZ4I_NORMAL_MAX_CHAIN_LEN;
+	else if (params.m_speed_mode == cFasterSpeed)
+		max_chain_len = LZ4I_FASTER_MAX_CHAIN_LEN;
+
+	lz4i_match_index match_index;
+	match_index.init(width, first_y, last_y, num_comps, max_chain_len);
+
+	for (int yi = first_y; yi < (int)last_y; yi++)
+	{
+		int xi = 0;
+		uint32_t next_insert_x = 0;
+
+		while (xi < (int)width)
+		{
+			const uint32_t lookahead_size_in_pixels = minimum<uint32_t>(RDO_LZ4_PIXEL_QUANT, width - xi);
+			const uint32_t lookahead_size_in_bytes = lookahead_size_in_pixels * num_comps;
+
+			if (lookahead_size_in_pixels * num_comps < RDO_LZ4_MIN_MATCH_LEN_IN_BYTES)
+			{
+				coded_img(xi, yi) = orig_img(xi, yi);
+				xi++;
+				continue;
+			}
+
+			float mse_scale = 0.0f;
+			for (uint32_t i = 0; i < (uint32_t)lookahead_size_in_pixels; i++)
+				mse_scale = maximum(mse_scale, smooth_block_mse_scales(xi + i, yi));
+
+			uint8_t orig_buf[RDO_LZ4_PIXEL_QUANT * 4];
+			Lab orig_labs[RDO_LZ4_PIXEL_QUANT];
+			uint32_t orig_buf_ofs = 0;
+			for (uint32_t i = 0; i < lookahead_size_in_pixels; i++)
+			{
+				const color_rgba& c = orig_img(xi + i, yi);
+				orig_labs[i] = get_orig_lab(c, params);
+				orig_buf[orig_buf_ofs++] = c.r;
+				orig_buf[orig_buf_ofs++] = c.g;
+				orig_buf[orig_buf_ofs++] = c.b;
+				if (num_comps == 4)
+					orig_buf[orig_buf_ofs++] = c.a;
+			}
+
+			float best_mse = 0.0f;
+			float best_bits = (float)(lookahead_size_in_bytes * 8) + (lookahead_size_in_bytes >= 15 ? 16 : 8);
+			float best_t = best_bits * lambda;
+			int best_match_dist_end = -1;
+			uint32_t best_match_order = NUM_LZ4_MATCH_ORDER_12 - 1;
+			uint8_t best_buf[RDO_LZ4_PIXEL_QUANT * 4];
+			memcpy(best_buf, orig_buf, lookahead_size_in_bytes);
+			int best_distances[MAX_DELTA_COLORS];
+			memset(best_distances, 0xFF, sizeof(best_distances));
+
+			for (uint32_t match_order_index = 0; match_order_index < NUM_LZ4_MATCH_ORDER_12; match_order_index++)
+			{
+				const match_order& order = g_lz4_match_order_12_bytes[match_order_index];
+
+				uint32_t total_matches = 0, total_match_len = 0, total_coded_matches = 0;
+
+				uint8_t best_parse_buf[RDO_LZ4_PIXEL_QUANT * 4];
+				memcpy(best_parse_buf, orig_buf, lookahead_size_in_bytes);
+				int trial_match_dist_end = -1;
+				
+				int trial_distances[MAX_DELTA_COLORS];
+				memset(trial_distances, 0xFF, sizeof(trial_distances));
+
+				uint32_t dst_ofs = 0;
+				
+				for (uint32_t l = 0; l < order.v[0]; l++)
+				{
+					uint32_t len = order.v[1 + l];
+					if (len > lookahead_size_in_bytes)
+						goto skip;
+					if ((dst_ofs + len) > lookahead_size_in_bytes)
+						goto skip;
+
+					if (len > 1)
+					{
+						float best_trial_t, best_trial_bits, best_trial_mse;
+						uint32_t best_trial_len;
+						int best_trial_dist;
+						bool used_favored_match_dist;
+
+						bool found_match = insert_lz4_match<MODE, NUM_COMPS>(
+							orig_img, coded_img,
+							xi, yi, first_y, width, height,
+							len, dst_ofs,
+							lookahead_size_in_bytes, lookahead_size_in_pixels,
+							orig_buf, orig_labs,
+							best_parse_buf, best_trial_t, best_trial_bits, best_trial_mse, best_trial_len, best_trial_dist,
+							(dst_ofs == 0) ? match_dist_to_favor : -1, used_favored_match_dist,
+							lambda, num_comps,
+							smooth_block_mse_scales,
+							&match_index,
+							params);
+
+						if (found_match)
+						{
+							trial_distances[l] = best_trial_dist;
+
+							if ((dst_ofs + len) == lookahead_size_in_bytes)
+								trial_match_dist_end = best_trial_dist;
+
+							total_matches++;
+							total_match_len += best_trial_len;
+
+							if (!used_favored_match_dist)
+								total_coded_matches++;
+						}
+					}
+
+					dst_ofs += len;
+				}
+				assert(dst_ofs == lookahead_size_in_bytes);
+
+				if (total_matches)
+				{
+					float trial_mse = compute_mse<MODE, NUM_COMPS>(best_parse_buf, orig_buf, orig_labs, lookahead_size_in_pixels, num_comps, params);
+					float trial_bits = total_coded_matches * 24.0f + (float)(lookahead_size_in_bytes - total_match_len) * 8.0f;
+					float trial_t = mse_scale * trial_mse + trial_bits * lambda;
+
+					if (trial_t < best_t)
+					{
+						best_t = trial_t;
+						best_bits = trial_bits;
+						best_mse = trial_mse;
+						memcpy(best_buf, best_parse_buf, lookahead_size_in_bytes);
+						best_match_order = match_order_index;
+						best_match_dist_end = trial_match_dist_end;
+						memcpy(best_distances, trial_distances, sizeof(best_distances));
+					}
+				}
+
+			skip:;
+			}
+
+			pMatch_order_hist[best_match_order]++;
+
+			uint32_t ofs = 0;
+			for (uint32_t i = 0; i < lookahead_size_in_pixels; i++)
+			{
+				color_rgba& c = coded_img(xi + i, yi);
+
+				c.r = best_buf[ofs++];
+				c.g = best_buf[ofs++];
+				c.b = best_buf[ofs++];
+				if (num_comps == 4)
+					c.a = best_buf[ofs++];
+			}
+																		
+			{
+				const match_order& best_order = g_lz4_match_order_12_bytes[best_match_order];
+
+				const uint32_t cur_ofs = (xi + yi * width) * num_comps;
+
+				uint32_t dst_ofs = 0;
+
+				for (uint32_t l = 0; l < best_order.v[0]; l++)
+				{
+					uint32_t len = best_order.v[1 + l];
+					if (len > lookahead_size_in_bytes)
+						break;
+					if ((dst_ofs + len) > lookahead_size_in_bytes)
+						break;
+
+					if (len > 1)
+					{
+						for (uint32_t j = 0; j < len; j++)
+						{
+							uint32_t ofs = cur_ofs + dst_ofs + j;
+							match_distances[ofs] = best_distances[l];
+						}
+					}
+					else
+					{
+						assert(best_distances[l] == -1);
+					}
+
+					dst_ofs += len;
+				}
+
+			}
+
+			xi += lookahead_size_in_pixels;
+
+			match_dist_to_favor = best_match_dist_end;
+
+			for ( ; next_insert_x + 1 < (uint32_t)xi; next_insert_x++)
+				match_index.insert(coded_img, next_insert_x, yi);
+
+		} // xi
+
+		for ( ; next_insert_x + 1 < width; next_insert_x++)
+			match_index.insert(coded_img, next_insert_x, yi);
+
+		const uint32_t n = ++total_scanlines_coded;
+		if ((verbose) && (params.m_print_progress) && ((n & 15) == 0))
+		{
+			printf("\b\b\b\b\b\b\b\b%3.2f%%", n * 100.0f / height);
+			fflush(stdout);
+		}
+	} // yi
+}
+
+// Returns the root of the set containing ofs, halving the path to it along the way.
+static inline uint32_t find_lz4i_byte_set(uint_vec& set_parents, uint32_t ofs)
+{
+	while (set_parents[ofs] != ofs)
+	{
+		set_parents[ofs] = set_parents[set_parents[ofs]];
+		ofs = set_parents[ofs];
+	}
+	return ofs;
+}
+
+// Chooses the lossy pixels to write to coded_img. Matches never reach outside of orig_img, so to code a tile pass in just the tile's pixels.
+// The image is split into num_strips horizontal strips which are coded concurrently. Matches can't cross strips, but the pixels still go into a single LZ4 block.
+// match_distances receives the byte distance of the match each byte was coded with (or -1 for literals).
+// verbose enables progress, debug output and debug images, which only make sense when coding the whole image.
+static bool encode_rdo_lz4i_pixels(
+	const image& orig_img,
+	image& coded_img,
+	int_vec& match_distances,
+	uint32_t num_comps,
+	uint32_t num_strips,
+	const rdo_png_params& params,
+	const vector2D<float>& smooth_block_mse_scales,
+	float lambda,
+	bool verbose)
+{
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const uint32_t total_pixels = orig_img.get_total_pixels();
+	const uint32_t total_bytes = total_pixels * num_comps;
+
+	coded_img.resize(width, height);
+
+	match_distances.resize(total_bytes);
+	match_distances.set_all(-1);
+
+	num_strips = clamp<uint32_t>(num_strips, 1, height);
+
+	uint_vec strip_match_order_hists(num_strips * NUM_LZ4_MATCH_ORDER_12);
+	std::atomic<uint32_t> total_scanlines_coded(0);
+
+	// Every strip is coded by the instantiation specialized for this encode's metric and channel count.
+	typedef decltype(&encode_rdo_lz4i_strip<cMetricRGB, 3>) encode_rdo_lz4i_strip_func;
+	static const encode_rdo_lz4i_strip_func s_encode_rdo_lz4i_strip_funcs[cTotalMetricModes][2] = METRIC_KERNEL_TABLE(encode_rdo_lz4i_strip);
+	const encode_rdo_lz4i_strip_func pEncode_rdo_lz4i_strip = s_encode_rdo_lz4i_strip_funcs[get_metric_mode(params)][num_comps - 3];
+
+	auto encode_strip = [&](uint32_t strip_index)
+	{
+		pEncode_rdo_lz4i_strip(
+			orig_img, coded_img,
+			(height * strip_index) / num_strips, (height * (strip_index + 1)) / num_strips,
+			num_comps,
+			match_distances, &strip_match_order_hists[strip_index * NUM_LZ4_MATCH_ORDER_12], total_scanlines_coded,
+			params, smooth_block_mse_scales, lambda, verbose);
+	};
+
+	if (num_strips > 1)
+	{
+		job_pool pool(num_strips);
+		for (uint32_t strip_index = 0; strip_index < num_strips; strip_index++)
+			pool.add_job([&encode_strip, strip_index] { encode_strip(strip_index); });
+		pool.wait_for_all();
+	}
+	else
+	{
+		encode_strip(0);
+	}
+
+	if ((verbose) && (params.m_print_progress))
+	{
+		printf("\b\b\b\b\b\b\b\b        \b\b\b\b\b\b\b\b\n");
+		fflush(stdout);
+	}
+
+	uint32_t match_order_hist[NUM_LZ4_MATCH_ORDER_12];
+	clear_obj(match_order_hist);
+	for (uint32_t strip_index = 0; strip_index < num_strips; strip_index++)
+		for (uint32_t i = 0; i < NUM_LZ4_MATCH_ORDER_12; i++)
+			match_order_hist[i] += strip_match_order_hists[strip_index * NUM_LZ4_MATCH_ORDER_12 + i];
+
+	if ((verbose) && (params.m_print_stats) && (num_strips > 1))
+		printf("Coded %u strips on %u threads\n", num_strips, num_strips);
+
+	if ((verbose) && (params.m_print_debug_output))
+	{
+		printf("Match order usage histogram:\n");
+		for (uint32_t i = 0; i < NUM_LZ4_MATCH_ORDER_12; i++)
+		{
+			printf("%u: %u\n", i, match_order_hist[i]);
+		}
+	}
+
+	if ((verbose) && (params.m_debug_images))
+	{
+		save_png("dbg_before_refine.png", coded_img);
+	}
+
+#if 1
+	uint8_vec orig_bytes, coded_bytes;
+	orig_bytes.reserve(total_bytes);
+	coded_bytes.reserve(total_bytes);
+	
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			const color_rgba& c = coded_img(x, y);
+			coded_bytes.push_back(c.r);
+			coded_bytes.push_back(c.g);
+			coded_bytes.push_back(c.b);
+			if (num_comps == 4)
+				coded_bytes.push_back(c.a);
+
+			const color_rgba& o = orig_img(x, y);
+			orig_bytes.push_back(o.r);
+			orig_bytes.push_back(o.g);
+			orig_bytes.push_back(o.b);
+			if (num_comps == 4)
+				orig_bytes.push_back(o.a);
+		}
+	}
+
+	for (uint32_t i = 0; i < total_bytes; i++)
+	{
+		int match_distance = match_distances[i];
+		if (match_distance == -1)
+			continue;
+
+		if ((match_distance == 0) || (match_distance > (int)i))
+		{
+			assert(0);
+			return false;
+		}
+
+		int cur_byte = coded_bytes[i];
+		int match_byte = coded_bytes[i - match_distance];
+
+		if (cur_byte != match_byte)
+		{
+			assert(0);
+			return false;
+		}
+	}
+
+	// Each byte which was coded as part of a match must equal the byte it copies, so every set of bytes linked by matches gets the rounded average of their original values.
+	// The sets are found with a disjoint-set forest over the byte offsets. Each set's root is its lowest offset.
+	uint_vec set_parents(total_bytes);
+	for (uint32_t i = 0; i < total_bytes; i++)
+		set_parents[i] = i;
+
+	for (uint32_t i = 0; i < total_bytes; i++)
+	{
+		if (match_distances[i] == -1)
+			continue;
+
+		uint32_t a = find_lz4i_byte_set(set_parents, i);
+		uint32_t b = find_lz4i_byte_set(set_parents, i - match_distances[i]);
+		if (a != b)
+		{
+			if (a < b)
+				std::swap(a, b);
+			set_parents[a] = b;
+		}
+	}
+
+	// A set can span the whole image (a flat channel of a large untiled image), so its total of 8-bit values needs 64 bits.
+	uint64_vec set_totals(total_bytes);
+	uint_vec set_sizes(total_bytes);
+
+	for (uint32_t i = 0; i < total_bytes; i++)
+	{
+		const uint32_t root = find_lz4i_byte_set(set_parents, i);
+		set_totals[root] += orig_bytes[i];
+		set_sizes[root]++;
+	}
+
+	for (uint32_t ofs = 0; ofs < total_bytes; ofs++)
+	{
+		const uint32_t root = find_lz4i_byte_set(set_parents, ofs);
+		const uint32_t set_size = set_sizes[root];
+		if (set_size < 2)
+			continue;
+
+		assert(coded_bytes[ofs] == coded_bytes[root]);
+
+		const uint8_t new_val = (uint8_t)((set_totals[root] + (set_size / 2)) / set_size);
+
+		uint32_t pixel_index = ofs / num_comps;
+		uint32_t comp_index = ofs % num_comps;
+		uint32_t x = pixel_index % width;
+		uint32_t y = pixel_index / width;
+
+		coded_img(x, y).m_comps[comp_index] = new_val;
+	}
+#endif
+
+	if ((verbose) && (params.m_debug_images))
+	{
+		save_png("dbg_before_dither.png", coded_img);
+	}
+
+	return true;
+}
+
+// Appends the RGB(A) bytes of a rectangle of img to bytes, in raster order.
+static void get_lz4i_pixel_bytes(const image& img, uint32_t x_ofs, uint32_t y_ofs, uint32_t w, uint32_t h, uint32_t num_comps, uint8_vec& bytes)
+{
+	bytes.reserve(bytes.size() + w * h * num_comps);
+	for (uint32_t y = 0; y < h; y++)
+	{
+		for (uint32_t x = 0; x < w; x++)
+		{
+			const color_rgba& c = img(x_ofs + x, y_ofs + y);
+
+			bytes.push_back(c.r);
+			bytes.push_back(c.g);
+			bytes.push_back(c.b);
+			if (num_comps == 4)
+				bytes.push_back(c.a);
+		} // x
+	} // y
+}
+
+// Appends a single LZ4 block to data.
+static bool append_lz4_block(const uint8_vec& bytes_to_compress, uint8_vec& data)
+{
+	const size_t data_ofs = data.size();
+	const int comp_bound = LZ4_compressBound(bytes_to_compress.size());
+	data.resize(data_ofs + comp_bound);
+
+	int lz4_size = LZ4_compress_HC((const char*)bytes_to_compress.data(), (char*)(data.data() + data_ofs), bytes_to_compress.size(), comp_bound, LZ4HC_CLEVEL_MAX);
+	if (!lz4_size)
+	{
+		fprintf(stderr, "LZ4_compress_HC() failed!\n");
+		return false;
+	}
+	
+	data.resize(data_ofs + lz4_size);
+
+	return true;
+}
+
+const uint32_t LZ4_CLEANUP_HASH_BITS = 16;
+
+static inline void append_lz4_length(uint8_vec& data, uint32_t len)
+{
+	while (len >= 255)
+	{
+		data.push_back(255);
+		len -= 255;
+	}
+	data.push_back((uint8_t)len);
+}
+
+static void append_lz4_sequence(uint8_vec& data, const uint8_t* pLiterals, uint32_t num_literals, uint32_t match_dist, uint32_t match_len)
+{
+	const uint32_t match_code = match_len ? (match_len - LZ4_MIN_MATCH) : 0;
+
+	data.push_back((uint8_t)((minimum<uint32_t>(num_literals, 15) << 4) | minimum<uint32_t>(match_code, 15)));
+	
+	if (num_literals >= 15)
+		append_lz4_length(data, num_literals - 15);
+	
+	data.append(pLiterals, num_literals);
+
+	if (!match_len)
+		return;
+
+	data.push_back((uint8_t)match_dist);
+	data.push_back((uint8_t)(match_dist >> 8));
+
+	if (match_code >= 15)
+		append_lz4_length(data, match_code - 15);
+}
+
+static inline uint32_t get_lz4_cleanup_hash(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - LZ4_CLEANUP_HASH_BITS);
+}
+
+// Appends a single LZ4 block to data, using the matches chosen by the RDO parse (match_distances, -1 for literals) instead of searching for them again.
+// Consecutive bytes coded with the same distance become one LZ4 match, so a match continued with the favored distance is free, like insert_lz4_match() assumes.
+// If cleanup is true, this also does a cheap greedy parse on top of the RDO parse: matches are extended in both directions while the bytes still agree, 
+// a small hash table supplies matches the RDO parse couldn't see (such as long runs), and each match is checked against the one starting at the next byte.
+static void append_lz4_block_from_parse(const uint8_vec& bytes, const int_vec& match_distances, bool cleanup, uint8_vec& data)
+{
+	const uint32_t total_bytes = (uint32_t)bytes.size();
+	const uint8_t* pBytes = bytes.data();
+
+	// The block format requires the last match to start at least LZ4_MF_LIMIT bytes before the end, and the final LZ4_LAST_LITERALS bytes to be literals.
+	const uint32_t match_start_limit = (total_bytes > LZ4_MF_LIMIT) ? (total_bytes - LZ4_MF_LIMIT) : 0;
+	const uint32_t match_end_limit = (total_bytes > LZ4_LAST_LITERALS) ? (total_bytes - LZ4_LAST_LITERALS) : 0;
+
+	uint_vec hash_table;
+	if (cleanup)
+	{
+		hash_table.resize(1U << LZ4_CLEANUP_HASH_BITS);
+		hash_table.set_all(UINT32_MAX);
+	}
+
+	uint32_t last_match_dist = 0;
+
+	// Returns the length of the longest match found at ofs (0 if none).
+	auto find_match = [&](uint32_t ofs, uint32_t& match_dist) -> uint32_t
+	{
+		uint32_t match_len = 0;
+
+		const int parse_dist = match_distances[ofs];
+		if ((parse_dist > 0) && ((uint32_t)parse_dist <= LZ4_MAX_DISTANCE))
+		{
+			match_dist = parse_dist;
+			match_len = 1;
+			while ((ofs + match_len < match_end_limit) && (match_distances[ofs + match_len] == parse_dist))
+				match_len++;
+		}
+
+		if (!cleanup)
+			return match_len;
+
+		// Try the position last seen with the same hash, and the previous match's distance.
+		uint32_t prev_ofs[2] = { hash_table[get_lz4_cleanup_hash(pBytes + ofs)], ((last_match_dist) && (last_match_dist <= ofs)) ? (ofs - last_match_dist) : UINT32_MAX };
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			if ((prev_ofs[i] == UINT32_MAX) || ((ofs - prev_ofs[i]) > LZ4_MAX_DISTANCE) || (memcmp(pBytes + prev_ofs[i], pBytes + ofs, LZ4_MIN_MATCH) != 0))
+				continue;
+
+			uint32_t len = LZ4_MIN_MATCH;
+			while ((ofs + len < match_end_limit) && (pBytes[prev_ofs[i] + len] == pBytes[ofs + len]))
+				len++;
+
+			if (len > match_len)
+			{
+				match_dist = ofs - prev_ofs[i];
+				match_len = len;
+			}
+		}
+
+		if (match_len)
+		{
+			while ((ofs + match_len < match_end_limit) && (pBytes[ofs + match_len] == pBytes[ofs + match_len - match_dist]))
+				match_len++;
+		}
+
+		return match_len;
+	};
+
+	auto insert_hash = [&](uint32_t ofs)
+	{
+		if ((cleanup) && (ofs < match_start_limit))
+			hash_table[get_lz4_cleanup_hash(pBytes + ofs)] = ofs;
+	};
+
+	uint32_t anchor = 0, cur_ofs = 0;
+	while (cur_ofs < match_start_limit)
+	{
+		uint32_t match_dist = 0;
+		uint32_t match_len = minimum(find_match(cur_ofs, match_dist), match_end_limit - cur_ofs);
+		insert_hash(cur_ofs);
+
+		if (match_len < LZ4_MIN_MATCH)
+		{
+			cur_ofs++;
+			continue;
+		}
+
+		if (cleanup)
+		{
+			if (cur_ofs + 1 < match_start_limit)
+			{
+				uint32_t next_match_dist = 0;
+				const uint32_t next_match_len = minimum(find_match(cur_ofs + 1, next_match_dist), match_end_limit - (cur_ofs + 1));
+				if (next_match_len > match_len + 1)
+				{
+					insert_hash(cur_ofs + 1);
+					cur_ofs++;
+					match_dist = next_match_dist;
+					match_len = next_match_len;
+				}
+			}
+
+			while ((cur_ofs > anchor) && (cur_ofs > match_dist) && (pBytes[cur_ofs - 1] == pBytes[cur_ofs - 1 - match_dist]))
+			{
+				cur_ofs--;
+				match_len++;
+			}
+		}
+
+		assert((match_dist) && (match_dist <= LZ4_MAX_DISTANCE) && (memcmp(pBytes + cur_ofs, pBytes + cur_ofs - match_dist, match_len) == 0));
+
+		append_lz4_sequence(data, pBytes + anchor, cur_ofs - anchor, match_dist, match_len);
+		last_match_dist = match_dist;
+
+		for (uint32_t i = 1; i < match_len; i++)
+			insert_hash(cur_ofs + i);
+
+		cur_ofs += match_len;
+		anchor = cur_ofs;
+	}
+
+	append_lz4_sequence(data, pBytes + anchor, total_bytes - anchor, 0, 0);
+}
+
+// Appends the LZ4 block for a coded image (or tile) to data.
+static bool append_lz4i_block(const uint8_vec& bytes_to_compress, const int_vec& match_distances, const rdo_png_params& params, uint8_vec& data)
+{
+	if (params.m_lz4i_hc)
+		return append_lz4_block(bytes_to_compress, data);
+
+	append_lz4_block_from_parse(bytes_to_compress, match_distances, params.m_lz4i_cleanup, data);
+	return true;
+}
+
+static inline void append_be32(uint8_vec& data, uint32_t v)
+{
+	data.push_back((uint8_t)(v >> 24));
+	data.push_back((uint8_t)(v >> 16));
+	data.push_back((uint8_t)(v >> 8));
+	data.push_back((uint8_t)v);
+}
+
+static inline uint32_t read_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Codes the w x h rectangle of orig_img at (x_ofs, y_ofs) as a single LZ4 block, which is appended to data. coded_tile receives the tile's coded pixels.
+static bool encode_rdo_lz4i_tile(
+	const image& orig_img,
+	const vector2D<float>& smooth_block_mse_scales,
+	uint32_t x_ofs, uint32_t y_ofs, uint32_t w, uint32_t h,
+	uint32_t num_comps,
+	const rdo_png_params& params,
+	float lambda,
+	image& coded_tile,
+	uint8_vec& data)
+{
+	image tile_img(w, h);
+	vector2D<float> tile_mse_scales(w, h);
+	for (uint32_t y = 0; y < h; y++)
+	{
+		for (uint32_t x = 0; x < w; x++)
+		{
+			tile_img(x, y) = orig_img(x_ofs + x, y_ofs + y);
+			tile_mse_scales(x, y) = smooth_block_mse_scales(x_ofs + x, y_ofs + y);
+		}
+	}
+
+	int_vec match_distances;
+	if (!encode_rdo_lz4i_pixels(tile_img, coded_tile, match_distances, num_comps, 1, params, tile_mse_scales, lambda, false))
+		return false;
+
+	uint8_vec bytes_to_compress;
+	get_lz4i_pixel_bytes(coded_tile, 0, 0, w, h, num_comps, bytes_to_compress);
+
+	return append_lz4i_block(bytes_to_compress, match_distances, params, data);
+}
+
+static void write_lz4i_tiled_header(uint8_vec& data, uint32_t width, uint32_t height, uint32_t num_comps, uint32_t tile_width, uint32_t tile_height)
+{
+	lz4i_tiled_header hdr;
+	memcpy(hdr.sig, "lz4t", 4);
+	hdr.width = byteswap_32(width);
+	hdr.height = byteswap_32(height);
+	hdr.channels = (uint8_t)num_comps;
+	hdr.colorspace = 0;
+	hdr.version = LZ4I_TILED_VERSION;
+	hdr.reserved = 0;
+	hdr.tile_width = byteswap_32(tile_width);
+	hdr.tile_height = byteswap_32(tile_height);
+	data.resize(sizeof(hdr));
+	memcpy(data.data(), &hdr, sizeof(hdr));
+}
+
+static bool encode_rdo_lz4i(
+	const image& orig_img,
+	uint8_vec& data,
+	const rdo_png_params& params,
+	const vector2D<float>& smooth_block_mse_scales,
+	float lambda)
+{
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
+
+	data.resize(0);
+
+	if ((!params.m_lz4i_tile_width) && (!params.m_lz4i_tile_height))
+	{
+		image coded_img;
+		int_vec match_distances;
+		if (!encode_rdo_lz4i_pixels(orig_img, coded_img, match_distances, num_comps, params.m_num_threads, params, smooth_block_mse_scales, lambda, true))
+			return false;
+
+		lz4i_header hdr;
+		memcpy(hdr.sig, "lz4i", 4);
+		hdr.width = byteswap_32(width);
+		hdr.height = byteswap_32(height);
+		hdr.channels = (uint8_t)num_comps;
+		hdr.colorspace = 0;
+		data.resize(sizeof(hdr));
+		memcpy(data.data(), &hdr, sizeof(hdr));
+
+		uint8_vec bytes_to_compress;
+		get_lz4i_pixel_bytes(coded_img, 0, 0, width, height, num_comps, bytes_to_compress);
+
+		return append_lz4i_block(bytes_to_compress, match_distances, params, data);
+	}
+
+	const uint32_t tile_width = params.m_lz4i_tile_width ? minimum(params.m_lz4i_tile_width, width) : width;
+	const uint32_t tile_height = params.m_lz4i_tile_height ? minimum(params.m_lz4i_tile_height, height) : height;
+	const uint32_t num_tiles_x = (width + tile_width - 1) / tile_width;
+	const uint32_t num_tiles_y = (height + tile_height - 1) / tile_height;
+	const uint32_t total_tiles = num_tiles_x * num_tiles_y;
+
+	basisu::vector<uint8_vec> tile_data(total_tiles);
+	std::atomic<bool> failed(false);
+
+	auto encode_tile = [&](uint32_t tile_index)
+	{
+		const uint32_t x_ofs = (tile_index % num_tiles_x) * tile_width;
+		const uint32_t y_ofs = (tile_index / num_tiles_x) * tile_height;
+
+		image coded_tile;
+		if (!encode_rdo_lz4i_tile(orig_img, smooth_block_mse_scales, x_ofs, y_ofs, minimum(tile_width, width - x_ofs), minimum(tile_height, height - y_ofs), num_comps, params, lambda, coded_tile, tile_data[tile_index]))
+			failed = true;
+	};
+
+	// Tiles are independent, so with -threads they're coded concurrently.
+	const uint32_t num_threads = clamp<uint32_t>(params.m_num_threads, 1, total_tiles);
+	if (num_threads > 1)
+	{
+		job_pool pool(num_threads);
+		for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+			pool.add_job([&encode_tile, tile_index] { encode_tile(tile_index); });
+		pool.wait_for_all();
+	}
+	else
+	{
+		for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+			encode_tile(tile_index);
+	}
+
+	if (failed)
+		return false;
+
+	write_lz4i_tiled_header(data, width, height, num_comps, tile_width, tile_height);
+
+	uint64_t cur_ofs = sizeof(lz4i_tiled_header) + (total_tiles + 1) * sizeof(uint32_t);
+	for (uint32_t tile_index = 0; tile_index <= total_tiles; tile_index++)
+	{
+		if (cur_ofs > UINT32_MAX)
+		{
+			fprintf(stderr, "Tiled LZ4I file is too large!\n");
+			return false;
+		}
+
+		append_be32(data, (uint32_t)cur_ofs);
+		
+		if (tile_index < total_tiles)
+			cur_ofs += tile_data[tile_index].size();
+	}
+
+	for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+		data.append(tile_data[tile_index]);
+
+	if (params.m_print_stats)
+		printf("Coded %u %ux%u tiles on %u threads\n", total_tiles, tile_width, tile_height, num_threads);
+
+	return true;
+}
+
+struct lz4i_tile_layout
+{
+	uint32_t m_width, m_height, m_num_comps;
+	uint32_t m_tile_width, m_tile_height;
+	uint32_t m_num_tiles_x, m_num_tiles_y;
+	
+	// Points to the tile offset table.
+	const uint8_t* m_pOffsets;
+};
+
+// Validates a tiled .LZ4I file's header and tile offset table.
+static bool get_lz4i_tile_layout(const uint8_t* pData, size_t data_size, lz4i_tile_layout& layout)
+{
+	if ((data_size > UINT32_MAX) || (data_size < sizeof(lz4i_tiled_header)))
+		return false;
+
+	const lz4i_tiled_header* pHeader = reinterpret_cast<const lz4i_tiled_header*>(pData);
+	if (memcmp(pHeader->sig, "lz4t", 4) != 0)
+		return false;
+
+	if (pHeader->version != LZ4I_TILED_VERSION)
+	{
+		fprintf(stderr, "Unsupported tiled LZ4I version %u\n", pHeader->version);
+		return false;
+	}
+
+	layout.m_width = byteswap_32(pHeader->width);
+	layout.m_height = byteswap_32(pHeader->height);
+	layout.m_num_comps = pHeader->channels;
+	layout.m_tile_width = byteswap_32(pHeader->tile_width);
+	layout.m_tile_height = byteswap_32(pHeader->tile_height);
+
+	if ((layout.m_width < 1) || (layout.m_width > LZ4I_MAX_DIM) || (layout.m_height < 1) || (layout.m_height > LZ4I_MAX_DIM))
+		return false;
+	
+	if ((layout.m_num_comps < 3) || (layout.m_num_comps > 4))
+		return false;
+
+	if ((layout.m_tile_width < 1) || (layout.m_tile_width > layout.m_width) || (layout.m_tile_height < 1) || (layout.m_tile_height > layout.m_height))
+		return false;
+
+	layout.m_num_tiles_x = (layout.m_width + layout.m_tile_width - 1) / layout.m_tile_width;
+	layout.m_num_tiles_y = (layout.m_height + layout.m_tile_height - 1) / layout.m_tile_height;
+
+	const uint64_t total_tiles = (uint64_t)layout.m_num_tiles_x * layout.m_num_tiles_y;
+	const uint64_t first_block_ofs = sizeof(lz4i_tiled_header) + (total_tiles + 1) * sizeof(uint32_t);
+	if (first_block_ofs > data_size)
+		return false;
+
+	layout.m_pOffsets = pData + sizeof(lz4i_tiled_header);
+
+	if (read_be32(layout.m_pOffsets) != first_block_ofs)
+		return false;
+
+	if (read_be32(layout.m_pOffsets + total_tiles * sizeof(uint32_t)) != data_size)
+		return false;
+
+	for (uint32_t i = 0; i < total_tiles; i++)
+	{
+		if (read_be32(layout.m_pOffsets + (i + 1) * sizeof(uint32_t)) <= read_be32(layout.m_pOffsets + i * sizeof(uint32_t)))
+			return false;
+	}
+
+	return true;
+}
+
+// Decodes a single tile of a tiled .LZ4I file into dst_img at (dst_x, dst_y).
+static bool decode_lz4i_tile_block(const uint8_t* pData, const lz4i_tile_layout& layout, uint32_t tile_x, uint32_t tile_y, image& dst_img, uint32_t dst_x, uint32_t dst_y)
+{
+	const uint32_t tile_index = tile_x + tile_y * layout.m_num_tiles_x;
+	const uint32_t block_ofs = read_be32(layout.m_pOffsets + tile_index * sizeof(uint32_t));
+	const uint32_t block_size = read_be32(layout.m_pOffsets + (tile_index + 1) * sizeof(uint32_t)) - block_ofs;
+
+	const uint32_t w = minimum(layout.m_tile_width, layout.m_width - tile_x * layout.m_tile_width);
+	const uint32_t h = minimum(layout.m_tile_height, layout.m_height - tile_y * layout.m_tile_height);
+	const uint32_t num_comps = layout.m_num_comps;
+
+	uint8_vec decomp_buf(w * h * num_comps);
+
+	int res = LZ4_decompress_safe((const char*)pData + block_ofs, (char*)decomp_buf.data(), (int)block_size, (int)decomp_buf.size());
+	if ((res <= 0) || (res != (int)decomp_buf.size()))
+		return false;
+
+	const uint8_t* pSrc = decomp_buf.data();
+	for (uint32_t y = 0; y < h; y++)
+	{
+		for (uint32_t x = 0; x < w; x++)
+		{
+			color_rgba& c = dst_img(dst_x + x, dst_y + y);
+			c.r = pSrc[0];
+			c.g = pSrc[1];
+			c.b = pSrc[2];
+			c.a = (num_comps == 4) ? pSrc[3] : 0xFF;
+			pSrc += num_comps;
+		}
+	}
+
+	return true;
+}
+
+// Decodes only tile (tile_x, tile_y) of a tiled .LZ4I file. tile_img is resized to the tile's dimensions.
+static bool decode_lz4i_tile(const uint8_t* pData, size_t data_size, uint32_t tile_x, uint32_t tile_y, image& tile_img)
+{
+	lz4i_tile_layout layout;
+	if (!get_lz4i_tile_layout(pData, data_size, layout))
+		return false;
+
+	if ((tile_x >= layout.m_num_tiles_x) || (tile_y >= layout.m_num_tiles_y))
+	{
+		fprintf(stderr, "Tile %u,%u is outside of the image's %ux%u tiles\n", tile_x, tile_y, layout.m_num_tiles_x, layout.m_num_tiles_y);
+		return false;
+	}
+
+	tile_img.resize(minimum(layout.m_tile_width, layout.m_width - tile_x * layout.m_tile_width), minimum(layout.m_tile_height, layout.m_height - tile_y * layout.m_tile_height));
+
+	return decode_lz4i_tile_block(pData, layout, tile_x, tile_y, tile_img, 0, 0);
+}
+
+// Decodes a tiled .LZ4I file, decoding up to num_threads tiles concurrently. If pJob_pool isn't nullptr the tiles are decoded on it instead of on a temporary pool.
+static bool decode_lz4i_tiled(const uint8_t* pData, size_t data_size, image& dst_img, uint32_t num_threads, job_pool* pJob_pool)
+{
+	lz4i_tile_layout layout;
+	if (!get_lz4i_tile_layout(pData, data_size, layout))
+		return false;
+
+	dst_img.resize(layout.m_width, layout.m_height);
+
+	const uint32_t total_tiles = layout.m_num_tiles_x * layout.m_num_tiles_y;
+	std::atomic<bool> failed(false);
+
+	auto decode_tile = [&](uint32_t tile_index)
+	{
+		const uint32_t tile_x = tile_index % layout.m_num_tiles_x;
+		const uint32_t tile_y = tile_index / layout.m_num_tiles_x;
+		
+		if (!decode_lz4i_tile_block(pData, layout, tile_x, tile_y, dst_img, tile_x * layout.m_tile_width, tile_y * layout.m_tile_height))
+			failed = true;
+	};
+
+	num_threads = clamp<uint32_t>(num_threads, 1, total_tiles);
+	if (pJob_pool)
+	{
+		for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+			pJob_pool->add_job([&decode_tile, tile_index] { decode_tile(tile_index); });
+		pJob_pool->wait_for_all();
+	}
+	else if (num_threads > 1)
+	{
+		job_pool pool(num_threads);
+		for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+			pool.add_job([&decode_tile, tile_index] { decode_tile(tile_index); });
+		pool.wait_for_all();
+	}
+	else
+	{
+		for (uint32_t tile_index = 0; tile_index < total_tiles; tile_index++)
+			decode_tile(tile_index);
+	}
+
+	return !failed;
+}
+
+// Decodes a .LZ4I file. Tiled files are decoded on up to num_threads threads, or on pJob_pool if it isn't nullptr.
+static bool decode_lz4i(const uint8_t *pData, size_t data_size, image &dst_img, uint32_t num_threads = 1, job_pool* pJob_pool = nullptr)
+{
+	if ((data_size >= 4) && (memcmp(pData, "lz4t", 4) == 0))
+		return decode_lz4i_tiled(pData, data_size, dst_img, num_threads, pJob_pool);
+
+	if ((data_size > INT_MAX) || (data_size < (sizeof(lz4i_header) + 1)))
+		return false;
+
+	const lz4i_header* pHeader = reinterpret_cast<const lz4i_header*>(pData);
+	if (memcmp(pHeader->sig, "lz4i", 4) != 0)
+		return false;
+
+	uint32_t width = byteswap_32(pHeader->width);
+	uint32_t height = byteswap_32(pHeader->height);
+
+	if ((width < 1) || (width > LZ4I_MAX_DIM) || (height < 1) || (height > LZ4I_MAX_DIM))
+		return false;
+
+	uint32_t num_comps = pHeader->channels;
+
+	if ((num_comps < 3) || (num_comps > 4))
+		return false;
+		
+	dst_img.resize(width, height);
+
+	if (num_comps == 3)
+	{
+		uint8_vec decomp_buf(width * height * 3);
+
+		int res = LZ4_decompress_safe((char*)pData + sizeof(lz4i_header), (char*)decomp_buf.data(), (int)(data_size - sizeof(lz4i_header)), (int)decomp_buf.size());
+		if (res <= 0)
+			return false;
+		
+		if (res != (int)decomp_buf.size())
+			return false;
+				
+		const uint8_t* pSrc = decomp_buf.data();
+		uint8_t* pDst = (uint8_t*)dst_img.get_ptr();
+		
+		const uint32_t total_pixels = dst_img.get_total_pixels();
+		for (uint32_t t = 0; t < total_pixels; t++)
+		{
+			pDst[0] = pSrc[0];
+			pDst[1] = pSrc[1];
+			pDst[2] = pSrc[2];
+			pDst[3] = 0xFF;
+			pSrc += 3;
+			pDst += 4;
+		}
+	}
+	else
+	{
+		int res = LZ4_decompress_safe((char*)pData + sizeof(lz4i_header), (char*)dst_img.get_ptr(), (int)(data_size - sizeof(lz4i_header)), width * height * 4);
+		if (res <= 0)
+			return false;
+
+		if (res != width * height * 4)
+			return false;
+	}
+
+	return true;
+}
+
+static bool rdo_lz4i(encoder_context& ctx, rdo_png_params& params)
+{
+	params.m_pTables = &ctx.get_tables();
+
+	const image before_processed_orig_img(params.m_orig_img);
+
+	const image& orig_img = params.m_orig_img;
+
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const uint32_t total_pixels = orig_img.get_total_pixels();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
+
+	float lambda = params.m_lambda;
+
+	if (params.m_debug_images)
+		save_png("dbg_orig.png", orig_img);
+
+	// The lossless reference encode is only informational, so skip it when it won't be printed (such as in rdo_search_lambda()'s trial encodes).
+	if (params.m_print_stats)
+	{
+		uint8_vec rgb_image;
+		for (uint32_t y = 0; y < height; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				const color_rgba& c = orig_img(x, y);
+				rgb_image.push_back(c.r);
+				rgb_image.push_back(c.g);
+				rgb_image.push_back(c.b);
+			}
+		}
+
+		const uint8_t* pOrig_image_bytes = has_alpha ? (const uint8_t *)orig_img.get_ptr() : rgb_image.get_ptr();
+		const uint32_t orig_image_len = orig_img.get_total_pixels() * num_comps;
+
+		uint8_vec orig_image_compressed(LZ4_compressBound(orig_image_len));
+		int lz4i_lossless_size = LZ4_compress_HC((const char *)pOrig_image_bytes, (char *)orig_image_compressed.data(), orig_image_len, orig_image_compressed.size(), LZ4HC_CLEVEL_MAX);
+		if (!lz4i_lossless_size)
+		{
+			fprintf(stderr, "LZ4_compress_HC() failed!\n");
+			return false;
+		}
+		orig_image_compressed.resize(lz4i_lossless_size);
+
+		printf("Lossless LZ4I encoded size: %i bytes, Bitrate: %3.3f bits/pixel\n", lz4i_lossless_size + (uint32_t)sizeof(lz4i_header), ((lz4i_lossless_size + (uint32_t)sizeof(lz4i_header)) * 8.0f) / total_pixels);
+	}
+
+	vector2D<float> smooth_block_mse_scales_buf;
+	const vector2D<float>& smooth_block_mse_scales = get_smooth_maps(smooth_block_mse_scales_buf, params);
+
+#if 0
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			color_rgba &c = params.m_orig_img(x, y);
+
+			const int R = 8;
+
+			int diff[3] = { c.r % R, c.g % R, c.b % R };
+
+			// 0 6
+			// 4 2
+			const int s_matrix[4] = { 0, 6, 4, 2 };
+			int threshold = s_matrix[(x & 1) + (y & 1) * 2];
+
+			uint32_t cur_ofs = (x + y * width) * num_comps;
+						
+			for (int d = 0; d < 3; d++)
+			{
+				if (diff[d] > threshold)
+					c[d] = clamp255(((c[d] / R) + 1) * R);
+				else
+					c[d] = clamp255((c[d] / R) * R);
+			}
+		}
+	}
+	
+	if (params.m_debug_images)
+		save_png("dbg_orig_after_dither.png", params.m_orig_img);
+#endif
+
+	if (!encode_rdo_lz4i(
+		orig_img,
+		params.m_output_file_data,
+		params,
+		smooth_block_mse_scales,
+		lambda))
+	{
+		return false;
+	}
 
-					int dr = (((int)c.r - prev_r) - g_diff + 8) & 255;
-					int db = (((int)c.b - prev_b) - g_diff + 8) & 255;
+	const uint32_t rdo_lz4i_len = (uint32_t)params.m_output_file_data.size();
 
-					if ((dg <= 63) && (dr <= 15) && (db <= 15))
-					{
-						luma_encodable_losslessly_in_rgb = true;
+	image decoded_image;
+	if (!decode_lz4i(params.m_output_file_data.data(), params.m_output_file_data.size(), decoded_image, params.m_num_threads))
+		return false;
 
-						color_rgba trial_c(c.r, c.g, c.b, prev_a);
+	if (params.m_debug_images)
+	{
+		save_png("dbg_coded.png", decoded_image);
+		save_png("dbg_coded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
+		save_png("dbg_coded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
+	}
 
-						if (!should_reject(trial_c, c, 4, params))
-						{
-							float mse = compute_se(trial_c, c, 4, params);
-							float bits = 16.0f;
-							float trial_t = mse_scale * mse + bits * lambda;
+	params.m_output_image = decoded_image;
 
-							if (trial_t < best_t)
-							{
-								best_mse = mse;
-								best_bits = bits;
-								best_t = trial_t;
-								best_command = cLUMA;
-								best_dr = dr - 8;
-								best_dg = dg - 32;
-								best_db = db - 8;
-							}
-						}
-					}
-				}
+	params.m_psnr = compute_image_metrics(decoded_image, before_processed_orig_img, 4, params.m_y_psnr, params.m_print_stats);
+	if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
+		params.m_angular_rms_error = compute_normal_map_image_metrics(decoded_image, before_processed_orig_img, params.m_print_stats, params);
 
-				// If we can't use it losslessly, try it lossy.
-				if ((!luma_encodable_losslessly_in_rgb) && (params.m_speed_mode != cFastestSpeed))
-				{
-					if (params.m_speed_mode == cNormalSpeed)
-					{
-						// Search all encodable LUMA commands.
-						for (uint32_t i = 0; i < 16384; i++)
-						{
-							int dr = ((i >> 6) & 15) - 8;
-							int dg = (i & 63) - 32;
-							int db = ((i >> 10) & 15) - 8;
+	params.m_bpp = (rdo_lz4i_len * 8.0f) / total_pixels;
 
-							color_rgba trial_c((prev_r + dg + dr) & 255, (prev_g + dg) & 255, (prev_b + dg + db) & 255, prev_a);
+	if (params.m_print_stats)
+	{
+		printf("Compressed file size: %u bytes, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
+			rdo_lz4i_len,
+			params.m_bpp,
+			params.m_psnr / params.m_bpp,
+			params.m_y_psnr / params.m_bpp);
+	}
 
-							if (!should_reject(trial_c, c, 4, params))
-							{
-								float mse = compute_se(trial_c, c, 4, params);
-								float bits = 16.0f;
-								float trial_t = mse_scale * mse + bits * lambda;
-
-								if (trial_t < best_t)
-								{
-									best_mse = mse;
-									best_bits = bits;
-									best_t = trial_t;
-									best_command = cLUMA;
-									best_dr = dr;
-									best_dg = dg;
-									best_db = db;
-								}
-							}
-						}
-					}
-					else
-					{
-						// TODO: This isn't very smart. What if the G delta is encodable but R and/or B aren't?
-						const int g_deltas[] = { -24, -16, -14, -12, -10, -8, -6, -4, -3, -2, -1, 0, 1, 2, 3, 4, 6, 8, 10, 12, 14, 16, 24 };
-						const int TOTAL_G_DELTAS = sizeof(g_deltas) / sizeof(g_deltas[0]);
+	return true;
+}
 
-						for (int kg = 0; kg < TOTAL_G_DELTAS; kg++)
-						{
-							const int dg = g_deltas[kg];
-							for (uint32_t i = 0; i < 256; i++)
-							{
-								int dr = (i & 15) - 8;
-								int db = ((i >> 4) & 15) - 8;
+// Accumulates the error histograms behind compute_image_metrics(), so an image coded in pieces can be measured without holding the whole coded image.
+struct image_error_hists
+{
+	enum { cRGB, cRGBA, cR, cG, cB, cA, cY709, cTotal };
 
-								color_rgba trial_c((prev_r + dg + dr) & 255, (prev_g + dg) & 255, (prev_b + dg + db) & 255, prev_a);
-
-								if (!should_reject(trial_c, c, 4, params))
-								{
-									float mse = compute_se(trial_c, c, 4, params);
-									float bits = 16.0f;
-									float trial_t = mse_scale * mse + bits * lambda;
-
-									if (trial_t < best_t)
-									{
-										best_mse = mse;
-										best_bits = bits;
-										best_t = trial_t;
-										best_command = cLUMA;
-										best_dr = dr;
-										best_dg = dg;
-										best_db = db;
-									}
-								}
-							}
-						}
-					}
-				}
-			}
+	image_error_hists() :
+		m_total_pixels(0)
+	{
+		clear_obj(m_hists);
+	}
 
-			switch (best_command)
-			{
-			case cRUN:
+	// Adds the errors of coded_img (w x h) vs. the rectangle of orig_img at (x_ofs, y_ofs).
+	void update(const image& coded_img, const image& orig_img, uint32_t x_ofs, uint32_t y_ofs)
+	{
+		const uint32_t w = coded_img.get_width(), h = coded_img.get_height();
+		for (uint32_t y = 0; y < h; y++)
+		{
+			for (uint32_t x = 0; x < w; x++)
 			{
-				cur_run_len++;
-				if (cur_run_len == 62)
-				{
-					total_run_pixels += cur_run_len;
-
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+				const color_rgba& a = coded_img(x, y);
+				const color_rgba& b = orig_img(x_ofs + x, y_ofs + y);
 
-					total_run++;
+				for (uint32_t c = 0; c < 4; c++)
+				{
+					const int e = iabs(a[c] - b[c]);
+					if (c < 3)
+						m_hists[cRGB][e]++;
+					m_hists[cRGBA][e]++;
+					m_hists[cR + c][e]++;
 				}
 
-				hash[(prev_r * 3 + prev_g * 5 + prev_b * 7 + prev_a * 11) & 63].set(prev_r, prev_g, prev_b, prev_a);
-
-				break;
+				m_hists[cY709][iabs(a.get_709_luma() - b.get_709_luma())]++;
 			}
-			case cRGB:
+		}
+
+		m_total_pixels += (uint64_t)w * h;
+	}
+
+	// Same math as image_metrics::calc().
+	void get_metrics(uint32_t index, image_metrics& im) const
+	{
+		im.m_max = 0;
+		double sum = 0.0f, sum2 = 0.0f;
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			if (m_hists[index][i])
 			{
-				if (cur_run_len)
-				{
-					total_run_pixels += cur_run_len;
+				im.m_max = basisu::maximum<float>(im.m_max, (float)i);
+				double v = i * m_hists[index][i];
+				sum += v;
+				sum2 += i * v;
+			}
+		}
 
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+		const uint32_t num_chans = (index == cRGB) ? 3 : ((index == cRGBA) ? 4 : 1);
+		const double total_values = (double)m_total_pixels * num_chans;
+		im.m_mean = (float)clamp<double>(sum / total_values, 0.0f, 255.0);
+		im.m_mean_squared = (float)clamp<double>(sum2 / total_values, 0.0f, 255.0f * 255.0f);
+		im.m_rms = (float)sqrt(im.m_mean_squared);
+		im.m_psnr = im.m_rms ? (float)clamp<double>(log10(255.0 / im.m_rms) * 20.0f, 0.0f, 100.0f) : 100.0f;
+	}
 
-					total_run++;
-				}
+	// Prints and returns the same metrics as compute_image_metrics().
+	float compute_metrics(uint32_t num_comps, float& y_psnr, bool print) const
+	{
+		image_metrics im;
+		get_metrics(cRGB, im);
+		if (print)
+			im.print("RGB    ");
 
-				data.push_back(254);
-				data.push_back((uint8_t)c.r);
-				data.push_back((uint8_t)c.g);
-				data.push_back((uint8_t)c.b);
-				hash[(c.r * 3 + c.g * 5 + c.b * 7 + prev_a * 11) & 63].set(c.r, c.g, c.b, prev_a);
-				prev_r = c.r;
-				prev_g = c.g;
-				prev_b = c.b;
+		float psnr = im.m_psnr;
 
-				total_rgb++;
+		if (num_comps == 4)
+		{
+			get_metrics(cRGBA, im);
+			if (print)
+				im.print("RGBA   ");
 
-				break;
-			}
-			case cRGBA:
+			psnr = im.m_psnr;
+		}
+
+		if (print)
+		{
+			const char* pNames[4] = { "R      ", "G      ", "B      ", "A      " };
+			for (uint32_t c = 0; c < num_comps; c++)
 			{
-				if (cur_run_len)
-				{
-					total_run_pixels += cur_run_len;
+				get_metrics(cR + c, im);
+				im.print(pNames[c]);
+			}
+		}
 
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+		get_metrics(cY709, im);
+		if (print)
+			im.print("Y 709  ");
 
-					total_run++;
-				}
+		y_psnr = im.m_psnr;
 
-				data.push_back(255);
-				data.push_back((uint8_t)c.r);
-				data.push_back((uint8_t)c.g);
-				data.push_back((uint8_t)c.b);
-				data.push_back((uint8_t)c.a);
-				hash[(c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63] = c;
-				prev_r = c.r;
-				prev_g = c.g;
-				prev_b = c.b;
-				prev_a = c.a;
+		if (print)
+			printf("\n");
 
-				total_rgba++;
+		return psnr;
+	}
 
-				break;
-			}
-			case cIDX:
-			{
-				if (cur_run_len)
-				{
-					total_run_pixels += cur_run_len;
+	double m_hists[cTotal][256];
+	uint64_t m_total_pixels;
+};
 
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+// Returns the process's peak resident memory use in bytes, or 0 if it's unavailable.
+static uint64_t get_peak_memory_use()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
 
-					total_run++;
-				}
+// Without -lz4i_tile, rdo_lz4i_stream() codes full width strips of roughly this many bytes.
+const uint32_t LZ4I_STREAM_STRIP_BYTES = 1024 * 1024;
 
-				data.push_back(best_index);
+// Codes params.m_orig_img to a tiled .LZ4I file, one row of tiles at a time (enough rows to keep every -threads thread busy), writing each row's LZ4 blocks to pOutput_filename as soon as they're coded.
+// Only the rows being coded are held in coded form, and their smooth maps are computed from just those rows (padded by SMOOTH_MAP_RADIUS scanlines), so the memory used beyond the source image depends on the tile size rather than the image size.
+// The output is identical to rdo_lz4i() with the same tile size. The lossless reference encode, normal map metrics and debug images are skipped, and params.m_output_file_data/m_output_image are left empty.
+static bool rdo_lz4i_stream(encoder_context& ctx, rdo_png_params& params, const char* pOutput_filename)
+{
+	params.m_pTables = &ctx.get_tables();
 
-				prev_r = hash[best_index].r;
-				prev_g = hash[best_index].g;
-				prev_b = hash[best_index].b;
-				prev_a = hash[best_index].a;
+	const image& orig_img = params.m_orig_img;
 
-				total_index++;
+	const uint32_t width = orig_img.get_width();
+	const uint32_t height = orig_img.get_height();
+	const bool has_alpha = orig_img.has_alpha();
+	const uint32_t num_comps = has_alpha ? 4 : 3;
+	const float lambda = params.m_lambda;
 
-				break;
-			}
-			case cDELTA:
-			{
-				if (cur_run_len)
-				{
-					total_run_pixels += cur_run_len;
+	const uint32_t tile_width = params.m_lz4i_tile_width ? minimum(params.m_lz4i_tile_width, width) : width;
+	const uint32_t tile_height = params.m_lz4i_tile_height ? minimum(params.m_lz4i_tile_height, height) : clamp<uint32_t>(LZ4I_STREAM_STRIP_BYTES / (tile_width * num_comps), 1, height);
+	const uint32_t num_tiles_x = (width + tile_width - 1) / tile_width;
+	const uint32_t num_tiles_y = (height + tile_height - 1) / tile_height;
+	const uint32_t total_tiles = num_tiles_x * num_tiles_y;
 
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+	const uint32_t tile_rows_per_band = clamp<uint32_t>((params.m_num_threads + num_tiles_x - 1) / num_tiles_x, 1, num_tiles_y);
+	const uint32_t max_tiles_per_band = tile_rows_per_band * num_tiles_x;
+	const uint32_t num_threads = clamp<uint32_t>(params.m_num_threads, 1, max_tiles_per_band);
 
-					total_run++;
-				}
+	FILE* pFile = fopen(pOutput_filename, "wb");
+	if (!pFile)
+	{
+		fprintf(stderr, "Failed creating file \"%s\"\n", pOutput_filename);
+		return false;
+	}
 
-				assert(best_dr >= -2 && best_dr <= 1);
-				assert(best_dg >= -2 && best_dg <= 1);
-				assert(best_db >= -2 && best_db <= 1);
+	// The tile offset table is zeroed for now, and filled in once every tile has been written.
+	uint8_vec header_data;
+	write_lz4i_tiled_header(header_data, width, height, num_comps, tile_width, tile_height);
+	for (uint32_t i = 0; i <= total_tiles; i++)
+		append_be32(header_data, 0);
 
-				data.push_back(64 + ((best_dr + 2) << 4) + ((best_dg + 2) << 2) + (best_db + 2));
+	bool status = fwrite(header_data.data(), header_data.size(), 1, pFile) == 1;
 
-				uint32_t decoded_r = (prev_r + best_dr) & 0xFF;
-				uint32_t decoded_g = (prev_g + best_dg) & 0xFF;
-				uint32_t decoded_b = (prev_b + best_db) & 0xFF;
-				uint32_t decoded_a = prev_a;
+	uint8_vec tile_offsets;
+	uint64_t cur_ofs = header_data.size();
 
-				hash[(decoded_r * 3 + decoded_g * 5 + decoded_b * 7 + decoded_a * 11) & 63].set(decoded_r, decoded_g, decoded_b, decoded_a);
+	image_error_hists error_hists;
 
-				prev_r = decoded_r;
-				prev_g = decoded_g;
-				prev_b = decoded_b;
-				prev_a = decoded_a;
+	std::unique_ptr<job_pool> pPool;
+	if (num_threads > 1)
+		pPool.reset(new job_pool(num_threads));
 
-				total_delta++;
+	basisu::vector<uint8_vec> tile_data(max_tiles_per_band);
+	basisu::vector<image> coded_tiles(max_tiles_per_band);
+	image band_img;
+	vector2D<float> band_mse_scales;
 
-				break;
-			}
-			case cLUMA:
-			{
-				if (cur_run_len)
-				{
-					total_run_pixels += cur_run_len;
+	// The smooth maps are computed for each band, which would overwrite the debug images over and over.
+	const bool debug_images = params.m_debug_images;
+	params.m_debug_images = false;
 
-					data.push_back(0xC0 | (cur_run_len - 1));
-					cur_run_len = 0;
+	for (uint32_t first_tile_y = 0; (status) && (first_tile_y < num_tiles_y); first_tile_y += tile_rows_per_band)
+	{
+		const uint32_t num_band_tile_rows = minimum(tile_rows_per_band, num_tiles_y - first_tile_y);
+		const uint32_t num_band_tiles = num_band_tile_rows * num_tiles_x;
+		const uint32_t band_y = first_tile_y * tile_height;
+		const uint32_t band_end_y = minimum(band_y + num_band_tile_rows * tile_height, height);
 
-					total_run++;
-				}
+		// Pad the band so its smooth maps match the whole image's.
+		const uint32_t padded_y = band_y - minimum(band_y, SMOOTH_MAP_RADIUS);
+		const uint32_t padded_end_y = minimum(band_end_y + SMOOTH_MAP_RADIUS, height);
 
-				assert(best_dr >= -8 && best_dr <= 7);
-				assert(best_dg >= -32 && best_dg <= 31);
-				assert(best_db >= -8 && best_db <= 7);
+		band_img.resize(width, padded_end_y - padded_y);
+		for (uint32_t y = padded_y; y < padded_end_y; y++)
+			memcpy(&band_img(0, y - padded_y), &orig_img(0, y), width * sizeof(color_rgba));
 
-				data.push_back((uint8_t)(128 + (best_dg + 32)));
-				data.push_back((uint8_t)(((best_dr + 8) << 4) | (best_db + 8)));
+		band_mse_scales.resize(width, padded_end_y - padded_y);
+		create_smooth_maps(band_mse_scales, band_img, params);
 
-				uint32_t decoded_r = (prev_r + best_dr + best_dg) & 0xFF;
-				uint32_t decoded_g = (prev_g + best_dg) & 0xFF;
-				uint32_t decoded_b = (prev_b + best_db + best_dg) & 0xFF;
-				uint32_t decoded_a = prev_a;
+		std::atomic<bool> failed(false);
 
-				hash[(decoded_r * 3 + decoded_g * 5 + decoded_b * 7 + decoded_a * 11) & 63].set(decoded_r, decoded_g, decoded_b, decoded_a);
+		auto encode_tile = [&](uint32_t band_tile_index)
+		{
+			const uint32_t x_ofs = (band_tile_index % num_tiles_x) * tile_width;
+			const uint32_t y_ofs = band_y + (band_tile_index / num_tiles_x) * tile_height;
 
-				prev_r = decoded_r;
-				prev_g = decoded_g;
-				prev_b = decoded_b;
-				prev_a = decoded_a;
+			tile_data[band_tile_index].resize(0);
+			if (!encode_rdo_lz4i_tile(band_img, band_mse_scales, x_ofs, y_ofs - padded_y, minimum(tile_width, width - x_ofs), minimum(tile_height, height - y_ofs), num_comps, params, lambda, coded_tiles[band_tile_index], tile_data[band_tile_index]))
+				failed = true;
+		};
 
-				total_luma++;
+		if (pPool)
+		{
+			for (uint32_t band_tile_index = 0; band_tile_index < num_band_tiles; band_tile_index++)
+				pPool->add_job([&encode_tile, band_tile_index] { encode_tile(band_tile_index); });
+			pPool->wait_for_all();
+		}
+		else
+		{
+			for (uint32_t band_tile_index = 0; band_tile_index < num_band_tiles; band_tile_index++)
+				encode_tile(band_tile_index);
+		}
 
-				break;
-			}
-			default:
+		if (failed)
+		{
+			status = false;
+			break;
+		}
+
+		for (uint32_t band_tile_index = 0; band_tile_index < num_band_tiles; band_tile_index++)
+		{
+			if (cur_ofs > UINT32_MAX)
 			{
-				assert(0);
+				fprintf(stderr, "Tiled LZ4I file is too large!\n");
+				status = false;
 				break;
 			}
+
+			append_be32(tile_offsets, (uint32_t)cur_ofs);
+
+			const uint8_vec& block = tile_data[band_tile_index];
+			if (fwrite(block.data(), block.size(), 1, pFile) != 1)
+			{
+				status = false;
+				break;
 			}
 
+			cur_ofs += block.size();
+
+			error_hists.update(coded_tiles[band_tile_index], orig_img, (band_tile_index % num_tiles_x) * tile_width, band_y + (band_tile_index / num_tiles_x) * tile_height);
+		}
+
+		if ((params.m_print_progress) && (status))
+		{
+			printf("\b\b\b\b\b\b\b\b%3.2f%%", band_end_y * 100.0f / height);
+			fflush(stdout);
 		}
 	}
 
+	params.m_debug_images = debug_images;
+
+	if ((status) && (cur_ofs > UINT32_MAX))
+	{
+		fprintf(stderr, "Tiled LZ4I file is too large!\n");
+		status = false;
+	}
+
+	if (status)
+	{
+		append_be32(tile_offsets, (uint32_t)cur_ofs);
+
+		status = (fseek(pFile, sizeof(lz4i_tiled_header), SEEK_SET) == 0) && (fwrite(tile_offsets.data(), tile_offsets.size(), 1, pFile) == 1);
+	}
+
+	if (fclose(pFile) != 0)
+		status = false;
+
 	if (params.m_print_progress)
 	{
 		printf("\b\b\b\b\b\b\b\b        \b\b\b\b\b\b\b\b\n");
 		fflush(stdout);
 	}
 
-	if (cur_run_len)
+	if (!status)
 	{
-		total_run_pixels += cur_run_len;
-
-		data.push_back((64 + 128) | (cur_run_len - 1));
-		cur_run_len = 0;
-
-		total_run++;
+		fprintf(stderr, "Failed writing to file \"%s\"\n", pOutput_filename);
+		return false;
 	}
 
-	for (uint32_t i = 0; i < 7; i++)
-		data.push_back(0);
-	data.push_back(1);
+	params.m_output_file_data.clear();
+	params.m_output_image.clear();
+
+	params.m_psnr = error_hists.compute_metrics(4, params.m_y_psnr, params.m_print_stats);
+	params.m_bpp = (float)((cur_ofs * 8.0f) / orig_img.get_total_pixels());
 
 	if (params.m_print_stats)
 	{
-		printf("Totals: Run: %u, Run Pixels: %u %3.2f%%, RGB: %u %3.2f%%, RGBA: %u %3.2f%%, INDEX: %u %3.2f%%, DELTA: %u %3.2f%%, LUMA: %u %3.2f%%\n\n",
-			total_run,
-			total_run_pixels, (total_run_pixels * 100.0f) / orig_img.get_total_pixels(),
-			total_rgb, (total_rgb * 100.0f) / orig_img.get_total_pixels(),
-			total_rgba, (total_rgba * 100.0f) / orig_img.get_total_pixels(),
-			total_index, (total_index * 100.0f) / orig_img.get_total_pixels(),
-			total_delta, (total_delta * 100.0f) / orig_img.get_total_pixels(),
-			total_luma, (total_luma * 100.0f) / orig_img.get_total_pixels());
+		printf("Coded %u %ux%u tiles on %u threads, %u tile rows at a time\n", total_tiles, tile_width, tile_height, num_threads, tile_rows_per_band);
+
+		printf("Compressed file size: %llu bytes, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
+			(unsigned long long)cur_ofs,
+			params.m_bpp,
+			params.m_psnr / params.m_bpp,
+			params.m_y_psnr / params.m_bpp);
+
+		printf("Peak memory use: %3.1f MB (source image: %3.1f MB)\n", get_peak_memory_use() / (1024.0f * 1024.0f), (orig_img.get_total_pixels() * sizeof(color_rgba)) / (1024.0f * 1024.0f));
 	}
 
 	return true;
 }
 
-static bool rdo_qoi(rdo_png_params& params)
+typedef bool (*rdo_encode_func)(encoder_context& ctx, rdo_png_params& params);
+
+const float MIN_TARGET_SEARCH_LAMBDA = .25f;
+const float MAX_TARGET_SEARCH_LAMBDA = 250000.0f;
+const uint32_t MAX_TARGET_SEARCH_ROUNDS = 16;
+
+// Encodes params.m_orig_img repeatedly with pEncode, searching for the lambda which meets params.m_target_bpp or params.m_target_psnr. 
+// Higher lambdas lower both the bitrate and PSNR, so the search first brackets the target by scaling lambda up or down by 4x, then narrows the bracket.
+// Each round runs up to params.m_num_threads trial encodes concurrently (each one single threaded), and they all share one rdo_image_cache.
+// The search stops once a trial is within params.m_target_tolerance of the target on the allowed side (bitrate <= target or PSNR >= target).
+static bool rdo_search_lambda(encoder_context& ctx, rdo_png_params& params, rdo_encode_func pEncode)
 {
-	const image& orig_img = params.m_orig_img;
+	const bool bpp_target = params.m_target_bpp > 0.0f;
+	const float target = bpp_target ? params.m_target_bpp : params.m_target_psnr;
+	const float tolerance = (params.m_target_tolerance > 0.0f) ? params.m_target_tolerance : (bpp_target ? .05f : .1f);
 
-	const uint32_t width = orig_img.get_width();
-	const uint32_t height = orig_img.get_height();
-	const uint32_t total_pixels = orig_img.get_total_pixels();
-	const bool has_alpha = orig_img.has_alpha();
-	const uint32_t num_comps = has_alpha ? 4 : 3;
-	
-	vector2D<float> smooth_block_mse_scales(width, height);
+	const uint32_t num_threads = clamp<uint32_t>(params.m_num_threads, 1, 256);
 
-	float lambda = params.m_lambda;
+	rdo_image_cache cache;
 
-	if (params.m_debug_images)
-	{
-		g_use_miniz = false;
-		save_png("dbg_orig.png", orig_img);
-		g_use_miniz = true;
-	}
+	rdo_png_params trial_params(params);
+	trial_params.m_print_stats = false;
+	trial_params.m_print_progress = false;
+	trial_params.m_print_debug_output = false;
+	trial_params.m_debug_images = false;
+	trial_params.m_target_bpp = 0.0f;
+	trial_params.m_target_psnr = 0.0f;
+	trial_params.m_num_threads = 1;
+	trial_params.m_pCache = &cache;
 
-	int ref_qoi_len = 0;
-	qoi_desc ref_qoi_desc;
-	ref_qoi_desc.width = orig_img.get_width();
-	ref_qoi_desc.height = orig_img.get_height();
-	ref_qoi_desc.channels = 4;
-	ref_qoi_desc.colorspace = 0;
-	void* pRef_qoi_data = qoi_encode(orig_img.get_ptr(), &ref_qoi_desc, &ref_qoi_len);
-	if (params.m_debug_images)
-		write_data_to_file("dbg_orig.qoi", pRef_qoi_data, ref_qoi_len);
-	free(pRef_qoi_data);
+	basisu::vector<rdo_png_params> trials;
+	basisu::vector<float> slacks;
 
-	if (params.m_print_stats)
-		printf("Lossless QOI encoded size: %i bytes, Bitrate: %3.3f bits/pixel\n", ref_qoi_len, (ref_qoi_len * 8.0f) / total_pixels);
+	// Slack is how far a trial is from the target on the allowed side, so it's negative if the trial misses the target.
+	auto get_slack = [&](const rdo_png_params& p) { return bpp_target ? (target - p.m_bpp) : (p.m_psnr - target); };
 
-	create_smooth_maps(
-		smooth_block_mse_scales,
-		orig_img,
-		params);
+	// True if the trial could use a higher lambda: its bitrate is above the target, or its PSNR has room to spare.
+	auto wants_higher_lambda = [&](const rdo_png_params& p) { return bpp_target ? (p.m_bpp > target) : (p.m_psnr > target); };
 
-	if (!encode_rdo_qoi(
-		orig_img,
-		params.m_output_file_data,
-		params,
-		smooth_block_mse_scales,
-		lambda))
+	auto run_trials = [&](const basisu::vector<float>& lambdas)
 	{
-		return false;
-	}
+		const uint32_t first_trial = trials.size();
+		const uint32_t num_trials = lambdas.size();
+		
+		for (uint32_t i = 0; i < num_trials; i++)
+		{
+			trials.push_back(trial_params);
+			trials.back().m_lambda = lambdas[i];
+		}
+
+		uint8_vec status(num_trials);
+
+		if ((num_threads > 1) && (num_trials > 1))
+		{
+			job_pool pool(minimum<uint32_t>(num_threads, num_trials));
 			
-	const uint32_t rdo_qoi_len = params.m_output_file_data.size();
+			for (uint32_t i = 0; i < num_trials; i++)
+			{
+				pool.add_job([&ctx, &trials, &status, &pEncode, first_trial, i]
+				{
+					encoder_context trial_ctx(ctx.get_tables());
+					status[i] = pEncode(trial_ctx, trials[first_trial + i]);
+				});
+			}
 
-	qoi_desc rdo_qoi_desc;
-	void* pDecoded_RDO_image = qoi_decode((const void*)params.m_output_file_data.data(), (int)rdo_qoi_len, &rdo_qoi_desc, 4);
-	if (!pDecoded_RDO_image)
-	{
-		fprintf(stderr, "qoi_decode() failed!\n");
-		return false;
-	}
+			pool.wait_for_all();
+		}
+		else
+		{
+			for (uint32_t i = 0; i < num_trials; i++)
+				status[i] = pEncode(ctx, trials[first_trial + i]);
+		}
 
-	image decoded_image((uint8_t*)pDecoded_RDO_image, rdo_qoi_desc.width, rdo_qoi_desc.height, 4);
-	free(pDecoded_RDO_image);
-	pDecoded_RDO_image = nullptr;
+		for (uint32_t i = 0; i < num_trials; i++)
+		{
+			rdo_png_params& trial = trials[first_trial + i];
 
-	if (params.m_debug_images)
-	{
-		save_png("dbg_coded.png", decoded_image);
-		save_png("dbg_coded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
-		save_png("dbg_coded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
-	}
-	
-	params.m_output_image = decoded_image;
+			// The trial's copy of the source image isn't needed anymore.
+			trial.m_orig_img.clear();
 
-	params.m_psnr = compute_image_metrics(decoded_image, orig_img, 4, params.m_y_psnr, params.m_print_stats);
-	if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
-		params.m_angular_rms_error = compute_normal_map_image_metrics(decoded_image, orig_img, params.m_print_stats, params);
+			if (!status[i])
+				return false;
 
-	params.m_bpp = (rdo_qoi_len * 8.0f) / total_pixels;
+			slacks.push_back(get_slack(trial));
+
+			if (params.m_print_stats)
+			{
+				printf("Trial %u: lambda %3.3f, Bitrate: %3.3f bits/pixel, RGB(A) PSNR: %3.3f dB, Y PSNR: %3.3f dB\n",
+					first_trial + i, trial.m_lambda, trial.m_bpp, trial.m_psnr, trial.m_y_psnr);
+			}
+		}
+
+		return true;
+	};
 
 	if (params.m_print_stats)
 	{
-		printf("Compressed file size: %u bytes, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
-			rdo_qoi_len,
-			params.m_bpp,
-			params.m_psnr / params.m_bpp,
-			params.m_y_psnr / params.m_bpp);
+		if (bpp_target)
+			printf("Searching for the lambda giving a bitrate <= %3.3f bits/pixel (tolerance %3.3f)\n", target, tolerance);
+		else
+			printf("Searching for the lambda giving a RGB(A) PSNR >= %3.3f dB (tolerance %3.3f)\n", target, tolerance);
 	}
-		
-	return true;
-}
 
-#include "lz4.h"
-#include "lz4hc.h"
+	interval_timer tm;
+	tm.start();
 
-#pragma pack(push, 1)
-struct lz4i_header
-{
-	char sig[4]; // signature bytes "lz4i"
-	uint32_t width; // image width in pixels (BE)
-	uint32_t height; // image height in pixels (BE)
-	uint8_t channels; // 3 = RGB, 4 = RGBA
-	uint8_t colorspace; // 0 = sRGB with linear alpha 1 = all channels linear
-};
-#pragma pack(pop)
+	// The first trial runs alone, so it can fill in the cache before the concurrent trials read it.
+	basisu::vector<float> lambdas;
+	lambdas.push_back(clamp<float>(params.m_lambda, MIN_TARGET_SEARCH_LAMBDA, MAX_TARGET_SEARCH_LAMBDA));
 
-static inline bool check_for_rejection(const uint8_t* pTrial_buf, const uint8_t* pOrig_buf, uint32_t num_pixels, uint32_t num_comps, const rdo_png_params& params)
-{
-	uint32_t ofs = 0;
+	// lo_lambda is the highest lambda which wants a higher lambda, hi_lambda is the lowest lambda which doesn't. 0 if there isn't one yet.
+	float lo_lambda = 0.0f, hi_lambda = 0.0f;
+	uint32_t num_rounds = 0;
 
-	color_rgba o(0, 255), t(0, 255);
-	for (uint32_t i = 0; i < num_pixels; i++)
+	for ( ; ; )
 	{
-		t.r = pTrial_buf[ofs];
-		t.g = pTrial_buf[ofs + 1];
-		t.b = pTrial_buf[ofs + 2];
-		if (num_comps == 4)
-			t.a = pTrial_buf[ofs + 3];
-
-		o.r = pOrig_buf[ofs];
-		o.g = pOrig_buf[ofs + 1];
-		o.b = pOrig_buf[ofs + 2];
-		if (num_comps == 4)
-			o.a = pOrig_buf[ofs + 3];
-
-		if (should_reject(t, o, num_comps, params))
-			return true;
+		const uint32_t first_trial = trials.size();
 		
-		ofs += num_comps;
-	}
+		if (!run_trials(lambdas))
+			return false;
 
-	return false;
-}
+		num_rounds++;
 
-static inline float compute_mse(const uint8_t* pTrial_buf, const uint8_t* pOrig_buf, uint32_t num_pixels, uint32_t num_comps, const rdo_png_params &params)
-{
-	float total_se = 0.0f;
+		bool found = false;
+		for (uint32_t i = first_trial; i < trials.size(); i++)
+		{
+			if ((slacks[i] >= 0.0f) && (slacks[i] <= tolerance))
+				found = true;
 
-	uint32_t ofs = 0;
-	
-	color_rgba o(0, 255), t(0, 255);
-	for (uint32_t i = 0; i < num_pixels; i++)
-	{
-		t.r = pTrial_buf[ofs];
-		t.g = pTrial_buf[ofs + 1];
-		t.b = pTrial_buf[ofs + 2];
-		if (num_comps == 4)
-			t.a = pTrial_buf[ofs + 3];
+			if (wants_higher_lambda(trials[i]))
+				lo_lambda = maximum(lo_lambda, trials[i].m_lambda);
+			else
+				hi_lambda = (hi_lambda == 0.0f) ? trials[i].m_lambda : minimum(hi_lambda, trials[i].m_lambda);
+		}
 
-		o.r = pOrig_buf[ofs];
-		o.g = pOrig_buf[ofs + 1];
-		o.b = pOrig_buf[ofs + 2];
-		if (num_comps == 4)
-			o.a = pOrig_buf[ofs + 3];
-				
-		total_se += compute_se(t, o, num_comps, params);
+		if ((found) || (num_rounds >= MAX_TARGET_SEARCH_ROUNDS))
+			break;
 		
-		ofs += num_comps;
-	}
-	
-	return total_se / num_pixels;
-}
+		// Non-monotonic results can leave the bracket inverted, in which case nothing more can be learned.
+		if ((lo_lambda != 0.0f) && (hi_lambda != 0.0f) && (hi_lambda <= lo_lambda * 1.001f))
+			break;
+				
+		lambdas.resize(0);
 
-const uint32_t RDO_LZ4_PIXEL_QUANT = 4;
-const uint32_t RDO_LZ4_MIN_MATCH_LEN_IN_BYTES = 4;
+		for (uint32_t i = 0; i < num_threads; i++)
+		{
+			float lambda;
+			if (hi_lambda == 0.0f)
+				lambda = minimum(lo_lambda * powf(4.0f, (float)(i + 1)), MAX_TARGET_SEARCH_LAMBDA);
+			else if (lo_lambda == 0.0f)
+				lambda = maximum(hi_lambda / powf(4.0f, (float)(i + 1)), MIN_TARGET_SEARCH_LAMBDA);
+			else
+				lambda = lo_lambda * powf(hi_lambda / lo_lambda, (i + 1.0f) / (num_threads + 1.0f));
+
+			bool already_tried = false;
+			for (uint32_t j = 0; j < trials.size(); j++)
+				if (trials[j].m_lambda == lambda)
+					already_tried = true;
+			for (uint32_t j = 0; j < lambdas.size(); j++)
+				if (lambdas[j] == lambda)
+					already_tried = true;
+			
+			if (!already_tried)
+				lambdas.push_back(lambda);
+		}
 
-static bool insert_lz4_match(
-	const image &orig_img, image &coded_img,
-	int xi, int yi, int width, int height, 
-	uint32_t insert_len_in_bytes, uint32_t dst_insert_ofs,
-	int lookahead_size_in_bytes, int lookahead_size_in_pixels,
-	const uint8_t *pOrig_buf, 
-	uint8_t *pBest_buf, float &best_t, float &best_bits, float &best_mse, uint32_t& best_trial_len, int &best_trial_dist,
-	int match_dist_to_favor, bool &used_favored_match_dist,
-	float lambda, uint32_t num_comps,
-	const vector2D<float>& smooth_block_mse_scales,
-	const rdo_png_params &params)
-{
-	bool found_match = false;
+		// Ran into the lambda limits without bracketing the target.
+		if (lambdas.empty())
+			break;
+	}
 	
-	const bool exhaustive_search = false;
-
-	int SCANLINES_TO_CHECK = 4;
-	int search_dist = 16;
-
-	if (params.m_speed_mode == cNormalSpeed)
+	// Choose the trial closest to the target on the allowed side, or the closest one overall if none got there.
+	int best_trial = -1;
+	for (uint32_t i = 0; i < trials.size(); i++)
 	{
-		SCANLINES_TO_CHECK = 8;
-		search_dist = 64;
+		if ((slacks[i] >= 0.0f) && ((best_trial < 0) || (slacks[i] < slacks[best_trial])))
+			best_trial = i;
 	}
-	else if (params.m_speed_mode == cFasterSpeed)
+
+	if (best_trial < 0)
 	{
-		SCANLINES_TO_CHECK = 4;
-		search_dist = 16;
+		for (uint32_t i = 0; i < trials.size(); i++)
+		{
+			if ((best_trial < 0) || (slacks[i] > slacks[best_trial]))
+				best_trial = i;
+		}
+
+		fprintf(stderr, "Warning: Couldn't reach the target, using the closest trial\n");
 	}
-	else if (params.m_speed_mode == cFastestSpeed)
+
+	const rdo_png_params& best = trials[best_trial];
+
+	params.m_lambda = best.m_lambda;
+	params.m_output_file_data = best.m_output_file_data;
+	params.m_output_image = best.m_output_image;
+	params.m_psnr = best.m_psnr;
+	params.m_y_psnr = best.m_y_psnr;
+	params.m_bpp = best.m_bpp;
+	params.m_angular_rms_error = best.m_angular_rms_error;
+
+	if (params.m_print_stats)
 	{
-		SCANLINES_TO_CHECK = 2;
-		search_dist = 8;
+		printf("Chose lambda %3.3f after %u trials in %u rounds, %3.3f secs\n", best.m_lambda, trials.size(), num_rounds, tm.get_elapsed_secs());
+
+		printf("Compressed file size: %llu, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
+			(unsigned long long)params.m_output_file_data.size(),
+			params.m_bpp,
+			params.m_psnr / params.m_bpp,
+			params.m_y_psnr / params.m_bpp);
 	}
-		
-	uint8_t initial_buf[RDO_LZ4_PIXEL_QUANT * 4];
-	memcpy(initial_buf, pBest_buf, lookahead_size_in_bytes);
-	
-	best_t = 1e+9f;
-	best_bits = 0.0f;
-	best_mse = 0.0f;
-	best_trial_len = 0;
-	best_trial_dist = 0;
-	used_favored_match_dist = false;
 
-	const uint32_t first_pixel_ofs = dst_insert_ofs / num_comps;
-	const uint32_t first_pixel_byte_ofs = first_pixel_ofs * num_comps;
-		
-	const uint32_t total_pixels = ((dst_insert_ofs + insert_len_in_bytes - 1) / num_comps) - first_pixel_ofs + 1;
+	return true;
+}
+
+static void print_help()
+{
+	printf("rdopng " RDO_PNG_VERSION "\n\n");
+
+	printf("Usage: rdopng [options] input_file.png/bmp/tga/jpg\n\n");
+
+	printf("-lambda X: Set quality level, value range is [0-100000], higher=smaller files/lower quality, default is 300\n");
+	printf("-level X: Set parsing level, valid X range is [0-29], default is 0 (fastest/lowest quality/least effective)\n");
+	printf("-two_pass: Compress image in two passes for significantly higher compression\n");
+	printf("-adaptive_huff X: Single pass alternative to -two_pass: rebuild the Huffman cost tables from the scanlines coded so far every X scanlines (try %u), default is 0 (off). Not used with -wavefront\n", DEF_ADAPTIVE_HUFF_ROWS);
+	printf("-linear: Use linear RGB(A) metrics instead of the default perceptual sRGB/Oklab metrics\n");
+	printf("-normal: Normal map mode (linear metrics, print normal map statistics, angular error and rejection metrics)\n");
+	printf("-snorm: Normal map texels use SNORM GPU encoding vs. UNORM\n");
+	printf("-threads X: Split the image into X horizontal strips and code them in parallel on X threads (PNG, QOI and LZ4I), default is 1. Slightly lowers compression. Tiled LZ4I files are coded and unpacked on X threads.\n");
+	printf("-wavefront: With -threads, code scanlines concurrently along a diagonal wavefront instead of in strips. The output doesn't depend on the number of threads.\n");
+	printf("-target_bpp X: Search for the lambda giving the highest quality at a bitrate <= X bits/pixel. Trial encodes run concurrently on -threads threads.\n");
+	printf("-target_psnr X: Search for the lambda giving the smallest file with a RGB(A) PSNR >= X dB. Trial encodes run concurrently on -threads threads.\n");
+	printf("-target_tolerance X: Stop searching once within X of the target, default is .05 bits/pixel or .1 dB\n");
+	printf("-parallel_filters: With -threads, code each scanline's candidate PNG filters concurrently instead of coding strips. The output is identical to a single threaded encode. Only helps levels which try more than one filter, and uses at most 3 threads.\n");
+
+	printf("\n");
+	printf("-quiet: Suppress all output to stdout\n");
+	printf("-no_progress: Suppress all progress related output\n");
+	printf("-output X: Set output filename to X\n");
+	printf("-output_dir X: Write output files to directory X instead of the current directory\n");
+	printf("-batch X: Encode many files in one process. X is a directory (all .png/.bmp/.tga/.jpg files in it), a wildcard pattern, or a text file listing one filename per line\n");
+	printf("-batch_threads X: Number of files to encode concurrently in -batch mode, default is the number of hardware threads\n");
+	printf("-bench_decode X: Benchmark decoding of .LZ4I, .QOI and .PNG files and write the results to a JSON file (-output, default is bench_decode.json). X is a file, directory, wildcard pattern or manifest like -batch\n");
+	printf("-bench_huff X: Encode PNG files in a single pass, with -two_pass and with -adaptive_huff (default %u), and compare their bitrate, PSNR and encode time. X is a file, directory, wildcard pattern or manifest like -batch\n", DEF_ADAPTIVE_HUFF_ROWS);
+	printf("-bench_metrics: Benchmark the per-candidate cost of the error metric kernels, dispatched on every call vs. specialized for each metric and channel count, with and without the rejection test fused in\n");
+	printf("-bench_reps X: Number of timed decodes per file in -bench_decode mode, default is 10\n");
+	printf("-bench_warmup X: Number of untimed decodes per file before timing in -bench_decode mode, default is 1\n");
+	printf("-bench_threads X: Comma separated list of thread counts to benchmark, default is 1. Tiled .LZ4I files split each decode across the threads, other files are decoded by every thread concurrently\n");
+	printf("-debug: Debug output and images\n");
+	printf("-no_cache: Compute the Oklab lookup table at startup instead of caching the table to disk in the executable's directory\n");
+	printf("-oklab_compact: Compute Oklab colors as they're needed instead of using the 96MB lookup table. Uses under 1MB of tables and needs no cache file, but results may differ very slightly\n");
+	printf("-oklab_table: Use the 96MB Oklab lookup table (the default)\n");
+	printf("-table_threads X: Number of threads used to compute the Oklab lookup table when it isn't cached, default is the number of hardware threads\n");
+	printf("-unpack: Unpack .LZ4I file and save as a .PNG file\n");
+	printf("-unpack_tile X Y: With -unpack, only unpack tile X,Y of a tiled .LZ4I file\n");
+	printf("-lz4i: Encode a .LZ4I file instead of a .PNG file\n");
+	printf("-lz4i_tile X Y: Write a tiled .LZ4I file using independently compressed XxY pixel tiles, which can be decoded concurrently or individually. 0 means the full image width or height (0 Y codes strips).\n");
+	printf("-lz4i_hc: Recompress the coded LZ4I pixels with LZ4HC's slowest level, instead of writing the matches chosen by the RDO parse directly\n");
+	printf("-lz4i_no_cleanup: Write exactly the RDO parse's matches, without extending them or searching literal runs for more matches\n");
+	printf("-lz4i_stream: Write a tiled .LZ4I file one row of tiles at a time, so memory use doesn't grow with the image size (for very large images). Without -lz4i_tile, codes strips of about 1MB each\n");
+
+	printf("\nQOI specific options:\n");
+	printf("-qoi: Encode a .QOI file instead of a .PNG file\n");
+	printf("-unpack_qoi_to_png: Unpack coded .QOI file and save as a .PNG file\n");
 
-	float mse_scale = 0.0f;
-	for (uint32_t i = 0; i < (uint32_t)minimum<uint32_t>(total_pixels, width - xi); i++)
-		mse_scale = maximum(mse_scale, smooth_block_mse_scales(xi + first_pixel_ofs + i, yi));
+	printf("\nQOI/LZ4I specific options:\n");
+	printf("-uber: Best LZ4I/QOI compression, but slowest\n");
+	printf("-better: Better LZ4I/QOI compression\n");
+	printf("-fastest: Fastest LZ4I/QOI compression (default)\n");
 		
-	for (int yd = 0; yd < (int)SCANLINES_TO_CHECK; yd++)
-	{
-		const int y = (int)yi - yd;
-		if (y < 0)
-			break;
+	printf("\nColor distance and parsing options:\n");
+	printf("-wr X, -wg X, -wb X, -wa X: Sets individual R,G,B, or A color distance weights to X, valid X range is [0,256], default is 1 (only used in -linear mode)\n");
+	printf("-wlab L a b Alpha: Set Lab and alpha relative color distance weights, must specify 4 floats, defaults are 2 1.5 1 2\n");
+	printf("-match_only: Only try LZ matches, don't try searching for cheaper to code literals\n");
 
-		int x_start, x_end;
-		const int total_passes = ((yd == 1) && !exhaustive_search) ? 2 : 1;
-		for (int pass = 0; pass < total_passes; pass++)
-		{
-			const int n = total_pixels;
+	printf("\nTransparency options:\n");
+	printf("-rt: On 32bpp images, don't allow fully opaque pixels to become transparent, and don't allow fully transparent pixels to become opaque\n");
+	printf("-no_alpha_opacity: Alpha channel does NOT represent transparency, so don't favor the quality of RGB edges near alpha edges\n");
 
-			if (exhaustive_search)
-			{
-				x_end = yd ? ((int)width - n) : ((int)xi - n);
-				x_start = 0;
-			}
-			else
-			{
-				if (!yd)
-				{
-					if ((int)xi < n)
-						continue;
+	printf("\nMatch rejection options:\n");
+	printf("-no_reject: Disable all match rejection\n");
+	printf("-rl X: Set Oklab L reject threshold to X, valid X range is [0,1.0], default is .05, higher values=more allowed lightness error\n");
+	printf("-rlab X: Set Oklab ab reject distance threshold to X, valid X range is [0,1.0], default is .05, higher values=more allowed chroma/hue error\n");
+	printf("-rrgb X: Set RGB reject threshold value to X (only used in -linear mode), valid X range is [0,256], default is 32, higher values=higher max RGB error\n");
+	printf("-rr X, -rg X, -rb, X, -ra X: Set individual R,G,B, or A reject threshold value to X (only used in -linear mode), valid X range is [0,256], default is 32, higher values=higher max alpha error\n");
 
-					x_start = maximum<int>((int)xi - search_dist * 2, 0);
-					x_end = maximum<int>((int)xi - n, 0);
-				}
-				else if ((yd == 1) && (pass == 0))
-				{
-					if (width <= (uint32_t)search_dist * 2)
-						continue;
+	printf("\nPerceptual options:\n");
+	printf("-no_mse_scaling: Disable MSE scaling on smooth/ultra-smooth image regions\n");
+	printf("-max_smooth_std_dev: Set smooth region maximum standard RGB(A) deviation, default is 35\n");
+	printf("-smooth_max_mse_scale: Set smooth region max MSE scale multiplier, default is 250 (PNG) or 2500 (QOI)\n");
+	printf("-max_ultra_smooth_std_dev: Set ultra-smooth region maximum standard RGB(A) deviaton, default is 5\n");
+	printf("-ultra_smooth_max_mse_scale: Set ultra-smooth region max MSE scale multiplier, default is 1500 (PNG) or 2500 (QOI)\n");
+}
 
-					x_start = maximum<int>((int)width - search_dist, 0);
-					x_end = width - n;
-				}
-				else
-				{
-					x_start = maximum<int>((int)xi - search_dist, 0);
-					x_end = minimum<int>((int)xi + search_dist, (int)width - n);
-				}
-			}
+#if 0
+int qoi_test(const image& orig_img)
+{
+	uint8_vec qoi_data;
+	encode_qoi(orig_img, qoi_data);
 
-			for (int xd = x_end; xd >= x_start; xd--)
-			{
-				assert((xd + n - 1) < (int)width);
-				assert((yd != 0) || ((xd + n - 1) < (int)xi));
+	write_vec_to_file("mine.qoi", qoi_data);
 
-				const uint32_t max_match_len_in_pixels = minimum<uint32_t>(x_end - xd + 1, RDO_LZ4_PIXEL_QUANT);
+	printf("My encoded size: %u\n", (uint32_t)qoi_data.size());
 
-				uint8_t trial_buf[RDO_LZ4_PIXEL_QUANT * 4];
-				memcpy(trial_buf, initial_buf, lookahead_size_in_bytes);
+	int qoi_len = 0;
+	qoi_desc desc;
+	desc.width = orig_img.get_width();
+	desc.height = orig_img.get_height();
+	desc.channels = 4;
+	desc.colorspace = 0;
+	void *p = qoi_encode(orig_img.get_ptr(), &desc, &qoi_len);
+	write_data_to_file("image.qoi", p, qoi_len);
+	free(p);
 
-				uint32_t trial_buf_ofs = dst_insert_ofs;
-				const uint32_t end_ofs = dst_insert_ofs + insert_len_in_bytes;
+	printf("QOI encoded size: %i\n", qoi_len);
+			
+	void* pImage = qoi_decode((const void *)qoi_data.data(), (int)qoi_data.size(), &desc, 4);
+	if (!pImage)
+	{
+		fprintf(stderr, "qoi_decode() failed!\n");
+		return EXIT_FAILURE;
+	}
 
-				uint32_t src_pix_ofs = 0;
-				uint32_t cur_comp = dst_insert_ofs % num_comps;
-				while ((trial_buf_ofs < end_ofs) && (src_pix_ofs < max_match_len_in_pixels))
-				{
-					const color_rgba& c = coded_img(xd + src_pix_ofs, y);
+	image decoded_image((uint8_t *)pImage, desc.width, desc.height, 4);
+	free(pImage);
+	pImage = nullptr;
 
-					while (cur_comp < num_comps)
-					{
-						assert((trial_buf_ofs % num_comps) == (cur_comp % num_comps));
+	if (decoded_image != orig_img)
+	{
+		fprintf(stderr, "Decode validation failed!\n");
+	}
 
-						trial_buf[trial_buf_ofs++] = c[cur_comp];
-						if (trial_buf_ofs == end_ofs)
-							break;
+	save_png("decoded.png", decoded_image);
+	save_png("decoded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
+	save_png("decoded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
 
-						cur_comp++;
-					}
-					cur_comp = 0;
+	printf("OK\n");
+			
+	return EXIT_SUCCESS;
+}
+#endif
 
-					src_pix_ofs++;
-				}
-				assert(trial_buf_ofs <= RDO_LZ4_PIXEL_QUANT * num_comps);
+// Each pixel is normalized independently, so with -threads the rows are split between the threads.
+static void normalize_image(image& img, const rdo_png_params &params)
+{
+	image orig_img(img);
 
-				const uint32_t actual_insert_len_in_bytes = trial_buf_ofs - dst_insert_ofs;
+	auto normalize_rows = [&img, &params](uint32_t y_start, uint32_t y_end)
+	{
+		for (uint32_t y = y_start; y < y_end; y++)
+		{
+			for (uint32_t x = 0; x < img.get_width(); x++)
+			{
+				color_rgba& c = img(x, y);
 
-				if (actual_insert_len_in_bytes != insert_len_in_bytes)
-					continue;
+				vec3F cf(decode_normal(c, params));
+				
+				cf.normalize_in_place();
+							
+				c = encode_normal_exhaustive(cf, c.a, params);
 
-				if (check_for_rejection(trial_buf + first_pixel_byte_ofs, pOrig_buf + first_pixel_byte_ofs, total_pixels, num_comps, params))
-					continue;
+			} // x
+		} // y
+	};
 
-				float trial_mse = compute_mse(trial_buf + first_pixel_byte_ofs, pOrig_buf + first_pixel_byte_ofs, total_pixels, num_comps, params);
+	const uint32_t height = img.get_height();
+	const uint32_t num_threads = clamp<uint32_t>(params.m_num_threads, 1, maximum<uint32_t>(height, 1));
+	if (num_threads > 1)
+	{
+		job_pool pool(num_threads);
+		for (uint32_t i = 0; i < num_threads; i++)
+		{
+			const uint32_t y_start = (height * i) / num_threads, y_end = (height * (i + 1)) / num_threads;
+			pool.add_job([&normalize_rows, y_start, y_end] { normalize_rows(y_start, y_end); });
+		}
+		pool.wait_for_all();
+	}
+	else
+	{
+		normalize_rows(0, height);
+	}
 
-				int cur_match_dist = (int)(xi * num_comps + dst_insert_ofs + yi * width * num_comps) - (int)(xd * num_comps + (dst_insert_ofs % num_comps) + y * width * num_comps);
+	if (params.m_print_stats)
+	{
+		printf("\nResults after normalizing normal map:\n");
+		compute_normal_map_image_metrics(img, orig_img, true, params);
+	}
+}
 
-				assert(cur_match_dist >= (int)num_comps);
+enum comp_mode
+{
+	cModePNG,
+	cModeQOI,
+	cModeLZ4I
+};
 
-				float trial_bits = 24.0f;
-				if ((dst_insert_ofs == 0) && (match_dist_to_favor != -1))
-				{
-					if (cur_match_dist == match_dist_to_favor)
-						trial_bits = 0;
-				}
-				
-				float trial_t = mse_scale * trial_mse + trial_bits * lambda;
+// Command line settings which apply to every encoded image, besides the ones in rdo_png_params.
+struct encode_file_options
+{
+	encode_file_options() :
+		m_mode(cModePNG),
+		m_normalize_first(false),
+		m_unpack_qoi_to_png(false),
+		m_quiet(false),
+		m_max_smooth_std_dev(-1.0f),
+		m_smooth_max_mse_scale(-1.0f),
+		m_max_ultra_smooth_std_dev(-1.0f),
+		m_ultra_smooth_max_mse_scale(-1.0f)
+	{
+	}
 
-				if (trial_t < best_t)
-				{
-					best_t = trial_t;
-					best_bits = trial_bits;
-					best_mse = trial_mse;
-					memcpy(pBest_buf, trial_buf, lookahead_size_in_bytes);
-					best_trial_len = actual_insert_len_in_bytes;
-					best_trial_dist = cur_match_dist;
-					found_match = true;
-					used_favored_match_dist = (trial_bits == 0.0f);
-				}
+	comp_mode m_mode;
+	bool m_normalize_first;
+	bool m_unpack_qoi_to_png;
+	bool m_quiet;
 
-			} // xd
-		
-		} // pass
+	float m_max_smooth_std_dev, m_smooth_max_mse_scale, m_max_ultra_smooth_std_dev, m_ultra_smooth_max_mse_scale;
+};
 
-	} // yd
+static std::string get_default_output_filename(const std::string& input_filename, comp_mode mode, bool unpack_flag)
+{
+	std::string output_filename;
+	string_get_filename(input_filename.c_str(), output_filename);
+	string_remove_extension(output_filename);
+	if (!output_filename.size())
+		output_filename = "out";
+
+	if (unpack_flag)
+		output_filename += ".png";
+	else if (mode == cModeLZ4I)
+		output_filename += "_rdo.lz4i";
+	else if (mode == cModeQOI)
+		output_filename += "_rdo.qoi";
+	else
+		output_filename += "_rdo.png";
 
-	return found_match;
+	return output_filename;
 }
 
-static bool encode_rdo_lz4i(
-	const image& orig_img,
-	uint8_vec& data,
-	const rdo_png_params& params,
-	const vector2D<float>& smooth_block_mse_scales,
-	float lambda)
+// Loads, encodes and writes a single image. On return rp holds the loaded image and the encoder's results.
+static bool encode_file(encoder_context& ctx, rdo_png_params& rp, const encode_file_options& opts, const std::string& input_filename, const std::string& output_filename)
 {
-	const uint32_t width = orig_img.get_width();
-	const uint32_t height = orig_img.get_height();
-	const uint32_t total_pixels = orig_img.get_total_pixels();
-	const bool has_alpha = orig_img.has_alpha();
-	const uint32_t num_comps = has_alpha ? 4 : 3;
-	const uint32_t total_bytes = total_pixels * num_comps;
+	uint64_t input_filesize = 0;
+	FILE* pFile = fopen(input_filename.c_str(), "rb");
+	if (!pFile)
+	{
+		fprintf(stderr, "Failed loading file %s\n", input_filename.c_str());
+		return false;
+	}
+	fseek(pFile, 0, SEEK_END);
+	input_filesize = ftell(pFile);
+	fclose(pFile);
 
-	image coded_img(width, height);
+	if (!load_image(input_filename, rp.m_orig_img))
+	{
+		fprintf(stderr, "Failed loading file %s\n", input_filename.c_str());
+		return false;
+	}
+
+	if (!opts.m_quiet)
+	{
+		printf("Loaded file \"%s\", %ux%u, has alpha: %u, size: %llu, bpp: %3.3f\n",
+			input_filename.c_str(), rp.m_orig_img.get_width(), rp.m_orig_img.get_height(), rp.m_orig_img.has_alpha(),
+			(unsigned long long)input_filesize, (input_filesize * 8.0f) / rp.m_orig_img.get_total_pixels());
+	}
 
-	const uint32_t lookahead_size_in_bytes = RDO_LZ4_PIXEL_QUANT * num_comps;
+	if (rp.m_debug_images)
+	{
+		save_png("dbg_loaded.png", rp.m_orig_img);
+	}
 
-	uint8_t initial_match_flags[RDO_LZ4_PIXEL_QUANT * 4];
-	memset(initial_match_flags, 0, sizeof(initial_match_flags));
+	if (opts.m_normalize_first)
+	{
+		normalize_image(rp.m_orig_img, rp);
+	}
 
-	uint32_t match_order_hist[NUM_LZ4_MATCH_ORDER_12];
-	clear_obj(match_order_hist);
+	if (opts.m_mode == cModeLZ4I)
+	{
+		// LZ4-specific settings - more artifact suppression on smooth/ultra-smooth regions vs. PNG.
+		rp.m_smooth_max_mse_scale = LZ4I_DEF_SMOOTH_MAX_MSE_SCALE;
+		rp.m_ultra_smooth_max_mse_scale = LZ4I_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE;
+	}
+	else if (opts.m_mode == cModeQOI)
+	{
+		// QOI-specific settings - more artifact suppression on smooth/ultra-smooth regions vs. PNG.
+		rp.m_smooth_max_mse_scale = QOI_DEF_SMOOTH_MAX_MSE_SCALE;
+		rp.m_ultra_smooth_max_mse_scale = QOI_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE;
+	}
 
-	int match_dist_to_favor = -1;
+	if (opts.m_max_smooth_std_dev != -1.0f)
+		rp.m_max_smooth_std_dev = opts.m_max_smooth_std_dev;
 
-	basisu::vector<uint_vec> future_matches(total_bytes);
-	int_vec match_distances(total_bytes);
-	match_distances.set_all(-1);
+	if (opts.m_smooth_max_mse_scale != -1.0f)
+		rp.m_smooth_max_mse_scale = opts.m_smooth_max_mse_scale;
 
-	for (int yi = 0; yi < (int)height; yi++)
+	if (opts.m_max_ultra_smooth_std_dev != -1.0f)
+		rp.m_ultra_smooth_max_mse_scale = opts.m_max_ultra_smooth_std_dev;
+
+	if (opts.m_ultra_smooth_max_mse_scale != -1.0f)
+		rp.m_ultra_smooth_max_mse_scale = opts.m_ultra_smooth_max_mse_scale;
+
+	if (rp.m_print_debug_output)
 	{
-		if ((yi & 31) == 0)
-			printf("%u\n", yi);
+		printf("\nParameters:\n");
+		rp.print();
+		printf("\n");
+	}
 
-		int xi = 0;
+#if RDO_PNG_COUNT_OKLAB_LOOKUPS
+	g_total_oklab_lookups = 0;
+#endif
+#if RDO_PNG_COUNT_CANDIDATES
+	for (uint32_t i = 0; i < cTotalCandidateCounters; i++)
+		g_candidate_counters[i] = 0;
+#endif
 
-		while (xi < (int)width)
-		{
-			const uint32_t lookahead_size_in_pixels = minimum<uint32_t>(RDO_LZ4_PIXEL_QUANT, width - xi);
-			const uint32_t lookahead_size_in_bytes = lookahead_size_in_pixels * num_comps;
+	interval_timer tm;
+	tm.start();
 
-			if (lookahead_size_in_pixels * num_comps < RDO_LZ4_MIN_MATCH_LEN_IN_BYTES)
-			{
-				coded_img(xi, yi) = orig_img(xi, yi);
-				xi++;
-				continue;
-			}
+	if ((opts.m_mode == cModeLZ4I) && (rp.m_lz4i_stream))
+	{
+		// The streaming encoder writes the output file itself.
+		if (!rdo_lz4i_stream(ctx, rp, output_filename.c_str()))
+			return false;
 
-			float mse_scale = 0.0f;
-			for (uint32_t i = 0; i < (uint32_t)lookahead_size_in_pixels; i++)
-				mse_scale = maximum(mse_scale, smooth_block_mse_scales(xi + i, yi));
+		if (!opts.m_quiet)
+		{
+			printf("Encoded in %3.3f secs\n", tm.get_elapsed_secs());
+			printf("Wrote output file \"%s\"\n", output_filename.c_str());
+		}
 
-			uint8_t orig_buf[RDO_LZ4_PIXEL_QUANT * 4];
-			uint32_t orig_buf_ofs = 0;
-			for (uint32_t i = 0; i < lookahead_size_in_pixels; i++)
-			{
-				const color_rgba& c = orig_img(xi + i, yi);
-				orig_buf[orig_buf_ofs++] = c.r;
-				orig_buf[orig_buf_ofs++] = c.g;
-				orig_buf[orig_buf_ofs++] = c.b;
-				if (num_comps == 4)
-					orig_buf[orig_buf_ofs++] = c.a;
-			}
+		return true;
+	}
 
-			float best_mse = 0.0f;
-			float best_bits = (float)(lookahead_size_in_bytes * 8) + (lookahead_size_in_bytes >= 15 ? 16 : 8);
-			float best_t = best_bits * lambda;
-			int best_match_dist_end = -1;
-			uint32_t best_match_order = NUM_LZ4_MATCH_ORDER_12 - 1;
-			uint8_t best_buf[RDO_LZ4_PIXEL_QUANT * 4];
-			memcpy(best_buf, orig_buf, lookahead_size_in_bytes);
-			int best_distances[MAX_DELTA_COLORS];
-			memset(best_distances, 0xFF, sizeof(best_distances));
+	rdo_encode_func pEncode = rdo_png;
+	if (opts.m_mode == cModeQOI)
+		pEncode = rdo_qoi;
+	else if (opts.m_mode == cModeLZ4I)
+		pEncode = rdo_lz4i;
 
-			for (uint32_t match_order_index = 0; match_order_index < NUM_LZ4_MATCH_ORDER_12; match_order_index++)
-			{
-				const match_order& order = g_lz4_match_order_12_bytes[match_order_index];
+	bool status = false;
+	if ((rp.m_target_bpp > 0.0f) || (rp.m_target_psnr > 0.0f))
+		status = rdo_search_lambda(ctx, rp, pEncode);
+	else
+		status = pEncode(ctx, rp);
+
+	if (!status)
+		return false;
 
-				uint32_t total_matches = 0, total_match_len = 0, total_coded_matches = 0;
+	if (!opts.m_quiet)
+	{
+		printf("Encoded in %3.3f secs\n", tm.get_elapsed_secs());
 
-				uint8_t best_parse_buf[RDO_LZ4_PIXEL_QUANT * 4];
-				memcpy(best_parse_buf, orig_buf, lookahead_size_in_bytes);
-				int trial_match_dist_end = -1;
-				
-				int trial_distances[MAX_DELTA_COLORS];
-				memset(trial_distances, 0xFF, sizeof(trial_distances));
+#if RDO_PNG_COUNT_OKLAB_LOOKUPS
+		const uint64_t total_lookups = g_total_oklab_lookups;
+		printf("Oklab lookups: %llu, %3.3f per pixel\n", (unsigned long long)total_lookups, (double)total_lookups / (rp.m_orig_img.get_width() * rp.m_orig_img.get_height()));
+#endif
 
-				uint32_t dst_ofs = 0;
-				
-				for (uint32_t l = 0; l < order.v[0]; l++)
-				{
-					uint32_t len = order.v[1 + l];
-					if (len > lookahead_size_in_bytes)
-						goto skip;
-					if ((dst_ofs + len) > lookahead_size_in_bytes)
-						goto skip;
+#if RDO_PNG_COUNT_CANDIDATES
+		const uint64_t total_scored = g_candidate_counters[cCandidatesScored], total_pruned = g_candidate_counters[cCandidatesPruned];
+		printf("Candidates: %llu scored (%llu of them cut short), %llu pruned by their rate (%3.1f%%)\n", 
+			(unsigned long long)total_scored, (unsigned long long)g_candidate_counters[cCandidatesCutShort], (unsigned long long)total_pruned, 
+			(total_pruned * 100.0f) / maximum<uint64_t>(total_scored + total_pruned, 1));
+#endif
+	}
 
-					if (len > 1)
-					{
-						float best_trial_t, best_trial_bits, best_trial_mse;
-						uint32_t best_trial_len;
-						int best_trial_dist;
-						bool used_favored_match_dist;
+	if (!write_vec_to_file(output_filename.c_str(), rp.m_output_file_data))
+	{
+		fprintf(stderr, "Failed writing to file \"%s\"\n", output_filename.c_str());
+		return false;
+	}
 
-						bool found_match = insert_lz4_match(
-							orig_img, coded_img,
-							xi, yi, width, height,
-							len, dst_ofs,
-							lookahead_size_in_bytes, lookahead_size_in_pixels,
-							orig_buf,
-							best_parse_buf, best_trial_t, best_trial_bits, best_trial_mse, best_trial_len, best_trial_dist,
-							(dst_ofs == 0) ? match_dist_to_favor : -1, used_favored_match_dist,
-							lambda, num_comps,
-							smooth_block_mse_scales,
-							params);
+	if (!opts.m_quiet)
+	{
+		printf("Wrote output file \"%s\"\n", output_filename.c_str());
+	}
 
-						if (found_match)
-						{
-							trial_distances[l] = best_trial_dist;
+	if (opts.m_unpack_qoi_to_png)
+	{
+		std::string png_filename(output_filename);
+		string_remove_extension(png_filename);
+		png_filename += ".png";
 
-							if ((dst_ofs + len) == lookahead_size_in_bytes)
-								trial_match_dist_end = best_trial_dist;
+		if (!save_png(png_filename.c_str(), rp.m_output_image))
+		{
+			fprintf(stderr, "Failed writing to file \"%s\"\n", png_filename.c_str());
+			return false;
+		}
 
-							total_matches++;
-							total_match_len += best_trial_len;
+		if (!opts.m_quiet)
+		{
+			printf("Wrote output file \"%s\"\n", png_filename.c_str());
+		}
+	}
 
-							if (!used_favored_match_dist)
-								total_coded_matches++;
-						}
-					}
+	return true;
+}
 
-					dst_ofs += len;
-				}
-				assert(dst_ofs == lookahead_size_in_bytes);
+static bool is_batch_image_filename(const char* pFilename)
+{
+	const std::string ext(string_get_extension(std::string(pFilename)));
 
-				if (total_matches)
-				{
-					float trial_mse = compute_mse(best_parse_buf, orig_buf, lookahead_size_in_pixels, num_comps, params);
-					float trial_bits = total_coded_matches * 24.0f + (float)(lookahead_size_in_bytes - total_match_len) * 8.0f;
-					float trial_t = mse_scale * trial_mse + trial_bits * lambda;
+	return (strcasecmp(ext.c_str(), "png") == 0) || (strcasecmp(ext.c_str(), "bmp") == 0) || (strcasecmp(ext.c_str(), "tga") == 0) ||
+		(strcasecmp(ext.c_str(), "jpg") == 0) || (strcasecmp(ext.c_str(), "jpeg") == 0) || (strcasecmp(ext.c_str(), "jfif") == 0);
+}
 
-					if (trial_t < best_t)
-					{
-						best_t = trial_t;
-						best_bits = trial_bits;
-						best_mse = trial_mse;
-						memcpy(best_buf, best_parse_buf, lookahead_size_in_bytes);
-						best_match_order = match_order_index;
-						best_match_dist_end = trial_match_dist_end;
-						memcpy(best_distances, trial_distances, sizeof(best_distances));
-					}
-				}
+// Expands a -batch argument into a sorted list of input files. pSpec can be a directory (every file in it accepted by pFilter, by default PNG/BMP/TGA/JPG files), 
+// a wildcard pattern, or a manifest text file listing one filename per line (blank lines and lines starting with # are ignored).
+static bool get_batch_filenames(const char* pSpec, std::vector<std::string>& filenames, bool (*pFilter)(const char* pFilename) = is_batch_image_filename)
+{
+	filenames.resize(0);
 
-			skip:;
-			}
+	const bool is_pattern = (strchr(pSpec, '*') != nullptr) || (strchr(pSpec, '?') != nullptr);
 
-			match_order_hist[best_match_order]++;
+#ifdef _WIN32
+	const DWORD attribs = GetFileAttributesA(pSpec);
+	const bool is_dir = !is_pattern && (attribs != INVALID_FILE_ATTRIBUTES) && ((attribs & FILE_ATTRIBUTE_DIRECTORY) != 0);
 
-			uint32_t ofs = 0;
-			for (uint32_t i = 0; i < lookahead_size_in_pixels; i++)
-			{
-				color_rgba& c = coded_img(xi + i, yi);
+	if ((is_dir) || (is_pattern))
+	{
+		std::string path, pattern(pSpec);
+		if (is_dir)
+		{
+			path = pSpec;
+			string_combine_path(pattern, pSpec, "*");
+		}
+		else
+			string_get_pathname(pSpec, path);
 
-				c.r = best_buf[ofs++];
-				c.g = best_buf[ofs++];
-				c.b = best_buf[ofs++];
-				if (num_comps == 4)
-					c.a = best_buf[ofs++];
-			}
-																		
+		WIN32_FIND_DATAA find_data;
+		HANDLE hFind = FindFirstFileA(pattern.c_str(), &find_data);
+		if (hFind != INVALID_HANDLE_VALUE)
+		{
+			do
 			{
-				const match_order& best_order = g_lz4_match_order_12_bytes[best_match_order];
+				if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+					continue;
 
-				const uint32_t cur_ofs = (xi + yi * width) * num_comps;
+				if ((is_dir) && (!pFilter(find_data.cFileName)))
+					continue;
 
-				uint32_t dst_ofs = 0;
+				std::string filename;
+				string_combine_path(filename, path.c_str(), find_data.cFileName);
+				filenames.push_back(filename);
+			} while (FindNextFileA(hFind, &find_data));
 
-				for (uint32_t l = 0; l < best_order.v[0]; l++)
-				{
-					uint32_t len = best_order.v[1 + l];
-					if (len > lookahead_size_in_bytes)
-						break;
-					if ((dst_ofs + len) > lookahead_size_in_bytes)
-						break;
+			FindClose(hFind);
+		}
 
-					if (len > 1)
-					{
-						for (uint32_t j = 0; j < len; j++)
-						{
-							uint32_t ofs = cur_ofs + dst_ofs + j;
-							match_distances[ofs] = best_distances[l];
+		std::sort(filenames.begin(), filenames.end());
+		return true;
+	}
+#else
+	struct stat st;
+	const bool is_dir = !is_pattern && (stat(pSpec, &st) == 0) && S_ISDIR(st.st_mode);
 
-							if (best_distances[l] != -1)
-							{
-								future_matches[ofs - best_distances[l]].push_back(ofs);
-							}
-						}
-					}
-					else
-					{
-						assert(best_distances[l] == -1);
-					}
+	if (is_dir)
+	{
+		DIR* pDir = opendir(pSpec);
+		if (!pDir)
+		{
+			fprintf(stderr, "Failed opening directory %s\n", pSpec);
+			return false;
+		}
 
-					dst_ofs += len;
-				}
+		while (struct dirent* pEntry = readdir(pDir))
+		{
+			if (!pFilter(pEntry->d_name))
+				continue;
 
-			}
+			std::string filename;
+			string_combine_path(filename, pSpec, pEntry->d_name);
 
-			xi += lookahead_size_in_pixels;
+			if ((stat(filename.c_str(), &st) == 0) && (S_ISREG(st.st_mode)))
+				filenames.push_back(filename);
+		}
 
-			match_dist_to_favor = best_match_dist_end;
+		closedir(pDir);
 
-		} // xi
-	} // yi
+		std::sort(filenames.begin(), filenames.end());
+		return true;
+	}
 
-	if (params.m_print_debug_output)
+	if (is_pattern)
 	{
-		printf("Match order usage histogram:\n");
-		for (uint32_t i = 0; i < NUM_LZ4_MATCH_ORDER_12; i++)
+		glob_t g;
+		memset(&g, 0, sizeof(g));
+
+		const int res = glob(pSpec, 0, nullptr, &g);
+		if ((res != 0) && (res != GLOB_NOMATCH))
 		{
-			printf("%u: %u\n", i, match_order_hist[i]);
+			fprintf(stderr, "Failed expanding wildcard pattern %s\n", pSpec);
+			return false;
+		}
+
+		for (size_t i = 0; i < g.gl_pathc; i++)
+		{
+			if ((stat(g.gl_pathv[i], &st) == 0) && (S_ISREG(st.st_mode)))
+				filenames.push_back(g.gl_pathv[i]);
 		}
+
+		globfree(&g);
+
+		// glob() already sorts its results.
+		return true;
 	}
+#endif
 
-	if (params.m_debug_images)
+	uint8_vec manifest;
+	if (!read_file_to_vec(pSpec, manifest))
 	{
-		save_png("dbg_before_refine.png", coded_img);
+		fprintf(stderr, "Failed reading batch directory, pattern or manifest file %s\n", pSpec);
+		return false;
 	}
 
-#if 1
-	uint8_vec orig_bytes, coded_bytes;
-	orig_bytes.reserve(total_bytes);
-	coded_bytes.reserve(total_bytes);
-	
-	for (uint32_t y = 0; y < height; y++)
+	std::string line;
+	for (size_t i = 0; i <= manifest.size(); i++)
 	{
-		for (uint32_t x = 0; x < width; x++)
+		const char c = (i < manifest.size()) ? (char)manifest[i] : '\n';
+		if ((c != '\n') && (c != '\r'))
 		{
-			const color_rgba& c = coded_img(x, y);
-			coded_bytes.push_back(c.r);
-			coded_bytes.push_back(c.g);
-			coded_bytes.push_back(c.b);
-			if (num_comps == 4)
-				coded_bytes.push_back(c.a);
-
-			const color_rgba& o = orig_img(x, y);
-			orig_bytes.push_back(o.r);
-			orig_bytes.push_back(o.g);
-			orig_bytes.push_back(o.b);
-			if (num_comps == 4)
-				orig_bytes.push_back(o.a);
+			line.push_back(c);
+			continue;
 		}
+
+		const size_t first = line.find_first_not_of(" \t");
+		if ((first != std::string::npos) && (line[first] != '#'))
+			filenames.push_back(line.substr(first, line.find_last_not_of(" \t") - first + 1));
+		line.resize(0);
 	}
 
-	for (uint32_t i = 0; i < total_bytes; i++)
-	{
-		int match_distance = match_distances[i];
-		if (match_distance == -1)
-			continue;
+	return true;
+}
 
-		if ((match_distance == 0) || (match_distance > (int)i))
+// Returns the nearest rank percentile (0-100) of the sorted values.
+static double get_percentile(const std::vector<double>& sorted_vals, double percentile)
+{
+	if (sorted_vals.empty())
+		return 0.0f;
+
+	const size_t rank = (size_t)ceil(percentile / 100.0f * sorted_vals.size());
+	return sorted_vals[clamp<size_t>(rank, 1, sorted_vals.size()) - 1];
+}
+
+// Encodes many images with one process, so the lookup tables are only initialized once. The files are encoded concurrently by 
+// num_workers threads, each with its own encoder_context.
+static bool encode_batch(
+	const encoder_tables& tables, const rdo_png_params& base_params, const encode_file_options& base_opts, 
+	const std::vector<std::string>& input_filenames, const std::string& output_dir, uint32_t num_workers)
+{
+	// Skip the PNG files an earlier batch wrote (or this one will write), so rerunning a batch on a directory doesn't encode its own output.
+	std::vector<std::string> filenames, output_filenames;
+	uint32_t total_skipped = 0;
+	for (const std::string& input_filename : input_filenames)
+	{
+		std::string name;
+		string_get_filename(input_filename.c_str(), name);
+		if ((name.size() >= 8) && (strcasecmp(name.c_str() + name.size() - 8, "_rdo.png") == 0))
 		{
-			assert(0);
-			return false;
+			total_skipped++;
+			continue;
 		}
 
-		int cur_byte = coded_bytes[i];
-		int match_byte = coded_bytes[i - match_distance];
+		std::string output_filename(get_default_output_filename(input_filename, base_opts.m_mode, false));
+		if (output_dir.size())
+			string_combine_path(output_filename, output_dir.c_str(), output_filename.c_str());
 
-		if (cur_byte != match_byte)
+		filenames.push_back(input_filename);
+		output_filenames.push_back(output_filename);
+	}
+
+	if ((total_skipped) && (!base_opts.m_quiet))
+		printf("Skipping %u files named like encoder output (*_rdo.png)\n", total_skipped);
+
+	const uint32_t total_files = (uint32_t)filenames.size();
+	if (!total_files)
+	{
+		fprintf(stderr, "No files to encode\n");
+		return false;
+	}
+
+	// Output files are named after the input's name without its directory or extension, so inputs like "a/x.png" and "b/x.png", or "x.png" and
+	// "x.jpg", would be written to the same file by concurrent workers.
+	std::vector<std::pair<std::string, uint32_t>> sorted_outputs(total_files);
+	for (uint32_t i = 0; i < total_files; i++)
+		sorted_outputs[i] = std::make_pair(output_filenames[i], i);
+	std::sort(sorted_outputs.begin(), sorted_outputs.end());
+
+	bool has_duplicates = false;
+	for (uint32_t i = 1; i < total_files; i++)
+	{
+		if (sorted_outputs[i].first == sorted_outputs[i - 1].first)
 		{
-			assert(0);
-			return false;
+			fprintf(stderr, "\"%s\" and \"%s\" would both be written to \"%s\"\n",
+				filenames[sorted_outputs[i - 1].second].c_str(), filenames[sorted_outputs[i].second].c_str(), sorted_outputs[i].first.c_str());
+			has_duplicates = true;
 		}
 	}
 
-	uint8_vec byte_processed_flags(total_bytes);
-	//image processed_img(width, height);
-
-	for (uint32_t i = 0; i < total_bytes; i++)
+	if (has_duplicates)
 	{
-		int match_distance = match_distances[i];
-		if (match_distance == -1)
-			continue;
+		fprintf(stderr, "Batch has inputs with the same output filename, rename them or encode them in separate batches\n");
+		return false;
+	}
 
-		if (byte_processed_flags[i])
-			continue;
+	num_workers = clamp<uint32_t>(num_workers, 1, total_files);
 
-		uint_vec byte_indices;
-		uint_vec offset_stack;
+	// The per-image output from concurrent encodes would be interleaved, so each file gets a single summary line instead.
+	encode_file_options opts(base_opts);
+	opts.m_quiet = true;
 
-		offset_stack.push_back(i);
-		while (offset_stack.size())
-		{
-			uint32_t ofs = offset_stack.back();
-			offset_stack.pop_back();
+	std::vector<double> file_secs(total_files);
+	std::vector<uint64_t> file_pixels(total_files);
+	std::vector<bool> file_status(total_files);
 
-			assert(!byte_processed_flags[ofs]);
-						
-			assert(byte_indices.find(ofs) == -1);
-			byte_indices.push_back(ofs);
+	std::atomic<uint32_t> next_file_index(0), total_files_done(0);
+	std::mutex print_mutex;
 
-			if (match_distances[ofs] != -1)
-			{
-				if (byte_indices.find(ofs - match_distances[ofs]) == -1)
-					offset_stack.push_back(ofs - match_distances[ofs]);
-				
-				assert(coded_bytes[ofs] == coded_bytes[ofs - match_distances[ofs]]);
-			}
+	if (!base_opts.m_quiet)
+		printf("Encoding %u files on %u threads\n", total_files, num_workers);
 
-			for (uint32_t i = 0; i < future_matches[ofs].size(); i++)
-			{
-				uint32_t future_ofs = future_matches[ofs][i];
-				
-				assert(coded_bytes[ofs] == coded_bytes[future_ofs]);
+	interval_timer tm;
+	tm.start();
 
-				if (byte_indices.find(future_ofs) == -1)
-					offset_stack.push_back(future_ofs);
-			}
-		}
-				
-		uint32_t total_val = 0;
+	auto worker = [&]()
+	{
+		encoder_context ctx(tables);
 
-		for (uint32_t i = 0; i < byte_indices.size(); i++)
+		for ( ; ; )
 		{
-			uint32_t ofs = byte_indices[i];
+			const uint32_t file_index = next_file_index++;
+			if (file_index >= total_files)
+				break;
 
-			uint32_t pixel_index = ofs / num_comps;
-			uint32_t comp_index = ofs % num_comps;
-			uint32_t x = pixel_index % width;
-			uint32_t y = pixel_index / width;
+			const std::string& input_filename = filenames[file_index];
+			const std::string& output_filename = output_filenames[file_index];
 
-			int orig_val = orig_bytes[ofs];
-			//int coded_val = coded_bytes[ofs];
+			rdo_png_params rp(base_params);
+			rp.m_print_stats = false;
+			rp.m_print_progress = false;
+			rp.m_print_debug_output = false;
+			rp.m_debug_images = false;
 
-			total_val += orig_val;
-		}
+			interval_timer file_tm;
+			file_tm.start();
 
-		const uint8_t new_val = (uint8_t)((total_val + (byte_indices.size() / 2)) / byte_indices.size());
-		
-		for (uint32_t i = 0; i < byte_indices.size(); i++)
-		{
-			uint32_t ofs = byte_indices[i];
+			const bool status = encode_file(ctx, rp, opts, input_filename, output_filename);
 
-			uint32_t pixel_index = ofs / num_comps;
-			uint32_t comp_index = ofs % num_comps;
-			uint32_t x = pixel_index % width;
-			uint32_t y = pixel_index / width;
-						
-			assert(!byte_processed_flags[ofs]);
-			coded_img(x, y).m_comps[comp_index] = new_val;
+			const double secs = file_tm.get_elapsed_secs();
+			const uint64_t total_pixels = rp.m_orig_img.get_total_pixels();
 
-			byte_processed_flags[ofs] = true;
-		}
+			file_secs[file_index] = secs;
+			file_pixels[file_index] = total_pixels;
+			
+			std::lock_guard<std::mutex> lock(print_mutex);
 
-		//printf("%u, %u %u %u\n", byte_indices.size(), vote_add, vote_sub, vote_unchanged);
-	}
-#endif
+			file_status[file_index] = status;
+			const uint32_t n = ++total_files_done;
 
-	if (params.m_debug_images)
+			if (base_opts.m_quiet)
+				continue;
+
+			if (status)
+			{
+				printf("[%u/%u] \"%s\": %ux%u, %llu bytes, %3.3f bpp, %3.3f dB, %3.3f secs, %3.3f MP/s\n",
+					n, total_files, input_filename.c_str(), 
+					rp.m_orig_img.get_width(), rp.m_orig_img.get_height(),
+					(unsigned long long)rp.m_output_file_data.size(), rp.m_bpp, rp.m_psnr,
+					secs, (total_pixels / (1024.0f * 1024.0f)) / maximum(secs, 1e-9));
+			}
+			else
+			{
+				printf("[%u/%u] \"%s\": FAILED\n", n, total_files, input_filename.c_str());
+			}
+		}
+	};
+
+	if (num_workers > 1)
+	{
+		job_pool pool(num_workers);
+		for (uint32_t i = 0; i < num_workers; i++)
+			pool.add_job(worker);
+		pool.wait_for_all();
+	}
+	else
 	{
-		save_png("dbg_before_dither.png", coded_img);
+		worker();
 	}
 
-	data.resize(0);
-
-	lz4i_header hdr;
-	memcpy(hdr.sig, "lz4i", 4);
-	hdr.width = byteswap_32(orig_img.get_width());
-	hdr.height = byteswap_32(orig_img.get_height());
-	hdr.channels = (uint8_t)num_comps;
-	hdr.colorspace = 0;
-	data.resize(sizeof(hdr));
-	memcpy(data.data(), &hdr, sizeof(hdr));
+	const double total_secs = tm.get_elapsed_secs();
 
-	uint8_vec bytes_to_compress;
-	bytes_to_compress.reserve(width * height * num_comps);
-	for (uint32_t y = 0; y < height; y++)
+	uint32_t total_failed = 0;
+	uint64_t total_pixels = 0;
+	std::vector<double> sorted_secs;
+	for (uint32_t i = 0; i < total_files; i++)
 	{
-		for (uint32_t x = 0; x < width; x++)
+		if (!file_status[i])
 		{
-			const color_rgba& c = coded_img(x, y);
-
-			bytes_to_compress.push_back(c.r);
-			bytes_to_compress.push_back(c.g);
-			bytes_to_compress.push_back(c.b);
-			if (num_comps == 4)
-				bytes_to_compress.push_back(c.a);
-		} // x
-	} // y
+			total_failed++;
+			continue;
+		}
 
-	const size_t data_ofs = data.size();
-	const int comp_bound = LZ4_compressBound(bytes_to_compress.size());
-	data.resize(data_ofs + comp_bound);
+		total_pixels += file_pixels[i];
+		sorted_secs.push_back(file_secs[i]);
+	}
+	std::sort(sorted_secs.begin(), sorted_secs.end());
 
-	int lz4_size = LZ4_compress_HC((const char*)bytes_to_compress.data(), (char*)(data.data() + data_ofs), bytes_to_compress.size(), comp_bound, LZ4HC_CLEVEL_MAX);
-	if (!lz4_size)
+	if (!base_opts.m_quiet)
 	{
-		fprintf(stderr, "LZ4_compress_HC() failed!\n");
-		return false;
+		printf("Encoded %u of %u files (%u failed), %3.3f MP in %3.3f secs, %3.3f MP/s, %3.3f files/sec\n",
+			total_files - total_failed, total_files, total_failed,
+			total_pixels / (1024.0f * 1024.0f), total_secs, (total_pixels / (1024.0f * 1024.0f)) / maximum(total_secs, 1e-9),
+			(total_files - total_failed) / maximum(total_secs, 1e-9));
+
+		printf("Per file latency: p50 %3.3f secs, p99 %3.3f secs, max %3.3f secs\n",
+			get_percentile(sorted_secs, 50.0f), get_percentile(sorted_secs, 99.0f), sorted_secs.size() ? sorted_secs.back() : 0.0f);
 	}
-	
-	data.resize(data_ofs + lz4_size);
 
-	return true;
+	return total_failed == 0;
 }
 
-static bool decode_lz4i(const uint8_t *pData, size_t data_size, image &dst_img)
+// Encodes each file as a PNG three ways: in a single pass with the initial Huffman tables, with -two_pass and with -adaptive_huff. Prints the bitrate, 
+// PSNR and encode time of each, and in total how much of -two_pass's bitrate reduction -adaptive_huff gets and what it costs in time.
+static bool bench_huff_modes(const encoder_tables& tables, const rdo_png_params& base_params, const std::vector<std::string>& filenames)
 {
-	if ((data_size > INT_MAX) || (data_size < (sizeof(lz4i_header) + 1)))
+	if (!filenames.size())
+	{
+		fprintf(stderr, "No files to benchmark\n");
 		return false;
+	}
 
-	const lz4i_header* pHeader = reinterpret_cast<const lz4i_header*>(pData);
-	if (memcmp(pHeader->sig, "lz4i", 4) != 0)
-		return false;
+	const uint32_t adaptive_huff_rows = base_params.m_adaptive_huff_rows ? base_params.m_adaptive_huff_rows : DEF_ADAPTIVE_HUFF_ROWS;
 
-	uint32_t width = byteswap_32(pHeader->width);
-	uint32_t height = byteswap_32(pHeader->height);
+	enum { cSinglePass, cTwoPass, cAdaptive, cTotalModes };
+	static const char* s_mode_names[cTotalModes] = { "single pass", "two pass", "adaptive" };
 
-	const uint32_t MAX_DIM = 65536 * 8;
-	if ((width < 1) || (width > MAX_DIM) || (height < 1) || (height > MAX_DIM))
-		return false;
+	double total_secs[cTotalModes] = { 0 }, total_psnr[cTotalModes] = { 0 };
+	uint64_t total_bytes[cTotalModes] = { 0 };
+	uint64_t total_pixels = 0;
+	uint32_t total_files = 0;
 
-	uint32_t num_comps = pHeader->channels;
+	encoder_context ctx(tables);
 
-	if ((num_comps < 3) || (num_comps > 4))
-		return false;
-		
-	dst_img.resize(width, height);
+	printf("Benchmarking %u files, -adaptive_huff %u\n", (uint32_t)filenames.size(), adaptive_huff_rows);
 
-	if (num_comps == 3)
+	for (uint32_t file_index = 0; file_index < filenames.size(); file_index++)
 	{
-		uint8_vec decomp_buf(width * height * 3);
+		const std::string& filename = filenames[file_index];
 
-		interval_timer tm;
-		double min_time = 1e+9f;
-		int res;
-		for (uint32_t i = 0; i < 10; i++)
+		image img;
+		if (!load_image(filename, img))
+		{
+			fprintf(stderr, "Failed loading file %s\n", filename.c_str());
+			return false;
+		}
+
+		printf("\"%s\", %ux%u:\n", filename.c_str(), img.get_width(), img.get_height());
+
+		for (uint32_t mode = 0; mode < cTotalModes; mode++)
 		{
+			rdo_png_params rp(base_params);
+			rp.m_orig_img = img;
+			rp.m_two_pass = (mode == cTwoPass);
+			rp.m_adaptive_huff_rows = (mode == cAdaptive) ? adaptive_huff_rows : 0;
+			rp.m_print_stats = false;
+			rp.m_print_progress = false;
+			rp.m_print_debug_output = false;
+			rp.m_debug_images = false;
+
+			interval_timer tm;
 			tm.start();
 
-			res = LZ4_decompress_safe((char*)pData + sizeof(lz4i_header), (char*)decomp_buf.data(), (int)(data_size - sizeof(lz4i_header)), (int)decomp_buf.size());
-			if (res <= 0)
+			if (!rdo_png(ctx, rp))
+			{
+				fprintf(stderr, "Failed encoding file %s\n", filename.c_str());
 				return false;
-			
-			min_time = minimum(min_time, tm.get_elapsed_secs());
-		}
-		
-		if (res != decomp_buf.size())
-			return false;
+			}
 
-		printf("Decompression rate: %3.3f megapixels/sec\n", ((double)(width * height) / min_time) / (1024.0f*1024.0f));
-				
-		const uint8_t* pSrc = decomp_buf.data();
-		uint8_t* pDst = (uint8_t*)dst_img.get_ptr();
-		
-		const uint32_t total_pixels = dst_img.get_total_pixels();
-		for (uint32_t t = 0; t < total_pixels; t++)
-		{
-			pDst[0] = pSrc[0];
-			pDst[1] = pSrc[1];
-			pDst[2] = pSrc[2];
-			pDst[3] = 0xFF;
-			pSrc += 3;
-			pDst += 4;
+			const double secs = tm.get_elapsed_secs();
+
+			total_secs[mode] += secs;
+			total_psnr[mode] += rp.m_psnr;
+			total_bytes[mode] += rp.m_output_file_data.size();
+
+			printf("  %-11s %3.3f bpp, %3.3f dB, %3.3f secs\n", s_mode_names[mode], rp.m_bpp, rp.m_psnr, secs);
 		}
+
+		total_pixels += img.get_total_pixels();
+		total_files++;
 	}
-	else
-	{
-		int res = LZ4_decompress_safe((char*)pData + sizeof(lz4i_header), (char*)dst_img.get_ptr(), (int)(data_size - sizeof(lz4i_header)), width * height * 4);
-		if (res <= 0)
-			return false;
 
-		if (res != width * height * 4)
-			return false;
+	printf("Totals:\n");
+	for (uint32_t mode = 0; mode < cTotalModes; mode++)
+	{
+		printf("  %-11s %3.3f bpp, %3.3f dB average, %3.3f secs (%3.2fx single pass)\n", s_mode_names[mode],
+			(total_bytes[mode] * 8.0f) / total_pixels, total_psnr[mode] / total_files, total_secs[mode], total_secs[mode] / maximum(total_secs[cSinglePass], 1e-9));
 	}
 
+	const double two_pass_saving = (double)total_bytes[cSinglePass] - (double)total_bytes[cTwoPass];
+	if (two_pass_saving > 0.0f)
+		printf("Adaptive got %3.1f%% of the two pass size reduction\n", ((double)total_bytes[cSinglePass] - (double)total_bytes[cAdaptive]) * 100.0f / two_pass_saving);
+
 	return true;
 }
 
-static bool rdo_lz4i(rdo_png_params& params)
+enum decode_bench_format
 {
-	const image before_processed_orig_img(params.m_orig_img);
-
-	const image& orig_img = params.m_orig_img;
+	cBenchLZ4I,
+	cBenchQOI,
+	cBenchPNG,
+	cBenchUnknown
+};
 
-	const uint32_t width = orig_img.get_width();
-	const uint32_t height = orig_img.get_height();
-	const uint32_t total_pixels = orig_img.get_total_pixels();
-	const bool has_alpha = orig_img.has_alpha();
-	const uint32_t num_comps = has_alpha ? 4 : 3;
+static const char* g_decode_bench_format_names[] = { "lz4i", "qoi", "png" };
 
-	vector2D<float> smooth_block_mse_scales(width, height);
+static bool is_decode_bench_filename(const char* pFilename)
+{
+	const std::string ext(string_get_extension(std::string(pFilename)));
 
-	float lambda = params.m_lambda;
+	return (strcasecmp(ext.c_str(), "lz4i") == 0) || (strcasecmp(ext.c_str(), "qoi") == 0) || (strcasecmp(ext.c_str(), "png") == 0);
+}
 
-	if (params.m_debug_images)
-		save_png("dbg_orig.png", orig_img);
+static decode_bench_format get_decode_bench_format(const uint8_vec& file_data)
+{
+	if (file_data.size() < 8)
+		return cBenchUnknown;
 
-	uint8_vec rgb_image;
-	for (uint32_t y = 0; y < height; y++)
-	{
-		for (uint32_t x = 0; x < width; x++)
-		{
-			const color_rgba& c = orig_img(x, y);
-			rgb_image.push_back(c.r);
-			rgb_image.push_back(c.g);
-			rgb_image.push_back(c.b);
-		}
-	}
+	if ((memcmp(file_data.data(), "lz4i", 4) == 0) || (memcmp(file_data.data(), "lz4t", 4) == 0))
+		return cBenchLZ4I;
+	
+	if (memcmp(file_data.data(), "qoif", 4) == 0)
+		return cBenchQOI;
+	
+	if (memcmp(file_data.data(), "\x89PNG\r\n\x1a\n", 8) == 0)
+		return cBenchPNG;
 
-	const uint8_t* pOrig_image_bytes = has_alpha ? (const uint8_t *)orig_img.get_ptr() : rgb_image.get_ptr();
-	const uint32_t orig_image_len = orig_img.get_total_pixels() * num_comps;
+	return cBenchUnknown;
+}
 
-	uint8_vec orig_image_compressed(LZ4_compressBound(orig_image_len));
-	int lz4i_lossless_size = LZ4_compress_HC((const char *)pOrig_image_bytes, (char *)orig_image_compressed.data(), orig_image_len, orig_image_compressed.size(), LZ4HC_CLEVEL_MAX);
-	if (!lz4i_lossless_size)
+// Decodes file_data into img. Only tiled .LZ4I files can use pJob_pool.
+static bool decode_for_bench(decode_bench_format fmt, const uint8_vec& file_data, image& img, job_pool* pJob_pool)
+{
+	switch (fmt)
 	{
-		fprintf(stderr, "LZ4_compress_HC() failed!\n");
-		return false;
-	}
-	orig_image_compressed.resize(lz4i_lossless_size);
+	case cBenchLZ4I:
+		return decode_lz4i(file_data.data(), file_data.size(), img, 1, pJob_pool);
+	case cBenchQOI:
+	{
+		qoi_desc desc;
+		void* pImage = qoi_decode((const void*)file_data.data(), (int)file_data.size(), &desc, 4);
+		if (!pImage)
+			return false;
 
-	if (params.m_print_stats)
-		printf("Lossless LZ4I encoded size: %i bytes, Bitrate: %3.3f bits/pixel\n", lz4i_lossless_size + (uint32_t)sizeof(lz4i_header), ((lz4i_lossless_size + (uint32_t)sizeof(lz4i_header)) * 8.0f) / total_pixels);
+		img.init((const uint8_t*)pImage, desc.width, desc.height, 4);
+		free(pImage);
+		return true;
+	}
+	case cBenchPNG:
+		return load_png(file_data.data(), file_data.size(), img);
+	default:
+		break;
+	}
 
-	create_smooth_maps(
-		smooth_block_mse_scales,
-		orig_img,
-		params);
+	return false;
+}
 
-#if 0
-	for (uint32_t y = 0; y < height; y++)
+static std::string json_escape(const std::string& str)
+{
+	std::string res;
+	for (char c : str)
 	{
-		for (uint32_t x = 0; x < width; x++)
+		if ((c == '"') || (c == '\\'))
 		{
-			color_rgba &c = params.m_orig_img(x, y);
-
-			const int R = 8;
+			res.push_back('\\');
+			res.push_back(c);
+		}
+		else if ((uint8_t)c < 32)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", (uint8_t)c);
+			res += buf;
+		}
+		else
+			res.push_back(c);
+	}
+	return res;
+}
 
-			int diff[3] = { c.r % R, c.g % R, c.b % R };
+struct decode_bench_options
+{
+	decode_bench_options() :
+		m_reps(10),
+		m_warmup(1),
+		m_quiet(false)
+	{
+		m_thread_counts.push_back(1);
+	}
 
-			// 0 6
-			// 4 2
-			const int s_matrix[4] = { 0, 6, 4, 2 };
-			int threshold = s_matrix[(x & 1) + (y & 1) * 2];
+	uint32_t m_reps;
+	uint32_t m_warmup;
+	std::vector<uint32_t> m_thread_counts;
+	bool m_quiet;
+};
 
-			uint32_t cur_ofs = (x + y * width) * num_comps;
-						
-			for (int d = 0; d < 3; d++)
-			{
-				if (diff[d] > threshold)
-					c[d] = clamp255(((c[d] / R) + 1) * R);
-				else
-					c[d] = clamp255((c[d] / R) * R);
-			}
-		}
+// Times decoding of .LZ4I, .QOI and .PNG files, and writes the results to json_filename. Each file is decoded m_warmup times untimed, then m_reps times for each thread count.
+// Tiled .LZ4I files split each decode across the threads. The other formats can only be decoded serially, so with more than one thread each thread decodes the whole file
+// concurrently and the aggregate throughput is reported.
+static bool bench_decode(const std::vector<std::string>& filenames, const decode_bench_options& opts, const std::string& json_filename)
+{
+	if (!filenames.size())
+	{
+		fprintf(stderr, "No files to benchmark\n");
+		return false;
 	}
-	
-	if (params.m_debug_images)
-		save_png("dbg_orig_after_dither.png", params.m_orig_img);
-#endif
 
-	if (!encode_rdo_lz4i(
-		orig_img,
-		params.m_output_file_data,
-		params,
-		smooth_block_mse_scales,
-		lambda))
+	FILE* pJSON_file = fopen_safe(json_filename.c_str(), "w");
+	if (!pJSON_file)
 	{
+		fprintf(stderr, "Failed creating file %s\n", json_filename.c_str());
 		return false;
 	}
 
-	const uint32_t rdo_lz4i_len = (uint32_t)params.m_output_file_data.size();
+	fprintf(pJSON_file, "{\n  \"version\": \"%s\",\n  \"reps\": %u,\n  \"warmup\": %u,\n  \"results\": [", RDO_PNG_VERSION, opts.m_reps, opts.m_warmup);
 
-	image decoded_image;
-	if (!decode_lz4i(params.m_output_file_data.data(), params.m_output_file_data.size(), decoded_image))
-		return false;
+	bool status = true;
+	uint32_t total_results = 0;
 
-	if (params.m_debug_images)
+	for (uint32_t file_index = 0; file_index < filenames.size(); file_index++)
 	{
-		save_png("dbg_coded.png", decoded_image);
-		save_png("dbg_coded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
-		save_png("dbg_coded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
-	}
+		const std::string& filename = filenames[file_index];
 
-	params.m_output_image = decoded_image;
+		uint8_vec file_data;
+		if (!read_file_to_vec(filename.c_str(), file_data))
+		{
+			fprintf(stderr, "Failed reading file %s\n", filename.c_str());
+			status = false;
+			continue;
+		}
 
-	params.m_psnr = compute_image_metrics(decoded_image, before_processed_orig_img, 4, params.m_y_psnr, params.m_print_stats);
-	if ((params.m_normal_map) || (params.m_print_normal_map_metrics))
-		params.m_angular_rms_error = compute_normal_map_image_metrics(decoded_image, before_processed_orig_img, params.m_print_stats, params);
+		const decode_bench_format fmt = get_decode_bench_format(file_data);
+		if (fmt == cBenchUnknown)
+		{
+			fprintf(stderr, "File %s isn't a .LZ4I, .QOI or .PNG file\n", filename.c_str());
+			status = false;
+			continue;
+		}
 
-	params.m_bpp = (rdo_lz4i_len * 8.0f) / total_pixels;
+		const bool tiled = (fmt == cBenchLZ4I) && (memcmp(file_data.data(), "lz4t", 4) == 0);
 
-	if (params.m_print_stats)
-	{
-		printf("Compressed file size: %u bytes, Bitrate: %3.3f bits/pixel, RGB(A) Effectiveness: %3.3f PSNR per bits/pixel, Y: %3.3f PSNR per bits/pixel\n",
-			rdo_lz4i_len,
-			params.m_bpp,
-			params.m_psnr / params.m_bpp,
-			params.m_y_psnr / params.m_bpp);
-	}
+		for (uint32_t thread_count : opts.m_thread_counts)
+		{
+			std::unique_ptr<job_pool> pJob_pool;
+			if (thread_count > 1)
+				pJob_pool.reset(new job_pool(thread_count));
 
-	return true;
-}
+			const uint32_t num_decodes = tiled ? 1 : thread_count;
+			basisu::vector<image> images(num_decodes);
+			std::atomic<bool> failed(false);
 
-static void print_help()
-{
-	printf("rdopng " RDO_PNG_VERSION "\n\n");
+			auto decode = [&]()
+			{
+				if ((tiled) || (num_decodes == 1))
+				{
+					if (!decode_for_bench(fmt, file_data, images[0], pJob_pool.get()))
+						failed = true;
+					return;
+				}
 
-	printf("Usage: rdopng [options] input_file.png/bmp/tga/jpg\n\n");
+				for (uint32_t i = 0; i < num_decodes; i++)
+				{
+					pJob_pool->add_job([&, i]
+					{
+						if (!decode_for_bench(fmt, file_data, images[i], nullptr))
+							failed = true;
+					});
+				}
+				pJob_pool->wait_for_all();
+			};
 
-	printf("-lambda X: Set quality level, value range is [0-100000], higher=smaller files/lower quality, default is 300\n");
-	printf("-level X: Set parsing level, valid X range is [0-29], default is 0 (fastest/lowest quality/least effective)\n");
-	printf("-two_pass: Compress image in two passes for significantly higher compression\n");
-	printf("-linear: Use linear RGB(A) metrics instead of the default perceptual sRGB/Oklab metrics\n");
-	printf("-normal: Normal map mode (linear metrics, print normal map statistics, angular error and rejection metrics)\n");
-	printf("-snorm: Normal map texels use SNORM GPU encoding vs. UNORM\n");
+			for (uint32_t i = 0; i < opts.m_warmup; i++)
+				decode();
 
-	printf("\n");
-	printf("-quiet: Suppress all output to stdout\n");
-	printf("-no_progress: Suppress all progress related output\n");
-	printf("-output X: Set output filename to X\n");
-	printf("-debug: Debug output and images\n");
-	printf("-no_cache: Compute the Oklab lookup table at startup instead of caching the table to disk in the executable's directory\n");
-	printf("-unpack: Unpack .LZ4I file and save as a .PNG file\n");
-	printf("-lz4i: Encode a .LZ4I file instead of a .PNG file\n");
+			std::vector<double> rep_secs;
+			for (uint32_t i = 0; (i < opts.m_reps) && (!failed); i++)
+			{
+				interval_timer tm;
+				tm.start();
 
-	printf("\nQOI specific options:\n");
-	printf("-qoi: Encode a .QOI file instead of a .PNG file\n");
-	printf("-unpack_qoi_to_png: Unpack coded .QOI file and save as a .PNG file\n");
+				decode();
 
-	printf("\nQOI/LZ4I specific options:\n");
-	printf("-uber: Best LZ4I/QOI compression, but slowest\n");
-	printf("-better: Better LZ4I/QOI compression\n");
-	printf("-fastest: Fastest LZ4I/QOI compression (default)\n");
-		
-	printf("\nColor distance and parsing options:\n");
-	printf("-wr X, -wg X, -wb X, -wa X: Sets individual R,G,B, or A color distance weights to X, valid X range is [0,256], default is 1 (only used in -linear mode)\n");
-	printf("-wlab L a b Alpha: Set Lab and alpha relative color distance weights, must specify 4 floats, defaults are 2 1.5 1 2\n");
-	printf("-match_only: Only try LZ matches, don't try searching for cheaper to code literals\n");
+				rep_secs.push_back(tm.get_elapsed_secs());
+			}
+
+			if ((failed) || (!rep_secs.size()))
+			{
+				fprintf(stderr, "Failed decoding file %s\n", filename.c_str());
+				status = false;
+				break;
+			}
+
+			std::sort(rep_secs.begin(), rep_secs.end());
+
+			const uint32_t width = images[0].get_width(), height = images[0].get_height();
+			const double total_mp = ((double)width * height * num_decodes) / (1024.0f * 1024.0f);
+			const double total_bytes = (double)file_data.size() * num_decodes;
+			const double min_secs = maximum(rep_secs[0], 1e-9), median_secs = maximum(get_percentile(rep_secs, 50.0f), 1e-9);
+
+			if (!opts.m_quiet)
+			{
+				printf("\"%s\": %s%s %ux%u, %llu bytes, %u threads: min %3.6f secs, median %3.6f secs, %3.3f/%3.3f MP/s, %3.3f/%3.3f MB/s (min/median time)\n",
+					filename.c_str(), g_decode_bench_format_names[fmt], tiled ? " (tiled)" : "", width, height, (unsigned long long)file_data.size(), thread_count,
+					min_secs, median_secs, total_mp / min_secs, total_mp / median_secs,
+					total_bytes / min_secs / (1024.0f * 1024.0f), total_bytes / median_secs / (1024.0f * 1024.0f));
+			}
 
-	printf("\nTransparency options:\n");
-	printf("-rt: On 32bpp images, don't allow fully opaque pixels to become transparent, and don't allow fully transparent pixels to become opaque\n");
-	printf("-no_alpha_opacity: Alpha channel does NOT represent transparency, so don't favor the quality of RGB edges near alpha edges\n");
+			fprintf(pJSON_file, "%s\n    { \"file\": \"%s\", \"format\": \"%s\", \"tiled\": %s, \"width\": %u, \"height\": %u, \"bytes\": %llu, \"threads\": %u, \"decodes_per_rep\": %u, "
+				"\"min_secs\": %.9f, \"median_secs\": %.9f, \"min_time_mp_per_sec\": %.3f, \"median_time_mp_per_sec\": %.3f, \"min_time_bytes_per_sec\": %.0f, \"median_time_bytes_per_sec\": %.0f }",
+				total_results ? "," : "",
+				json_escape(filename).c_str(), g_decode_bench_format_names[fmt], tiled ? "true" : "false", width, height, (unsigned long long)file_data.size(), thread_count, num_decodes,
+				min_secs, median_secs, total_mp / min_secs, total_mp / median_secs, total_bytes / min_secs, total_bytes / median_secs);
 
-	printf("\nMatch rejection options:\n");
-	printf("-no_reject: Disable all match rejection\n");
-	printf("-rl X: Set Oklab L reject threshold to X, valid X range is [0,1.0], default is .05, higher values=more allowed lightness error\n");
-	printf("-rlab X: Set Oklab ab reject distance threshold to X, valid X range is [0,1.0], default is .05, higher values=more allowed chroma/hue error\n");
-	printf("-rrgb X: Set RGB reject threshold value to X (only used in -linear mode), valid X range is [0,256], default is 32, higher values=higher max RGB error\n");
-	printf("-rr X, -rg X, -rb, X, -ra X: Set individual R,G,B, or A reject threshold value to X (only used in -linear mode), valid X range is [0,256], default is 32, higher values=higher max alpha error\n");
+			total_results++;
+		}
+	}
 
-	printf("\nPerceptual options:\n");
-	printf("-no_mse_scaling: Disable MSE scaling on smooth/ultra-smooth image regions\n");
-	printf("-max_smooth_std_dev: Set smooth region maximum standard RGB(A) deviation, default is 35\n");
-	printf("-smooth_max_mse_scale: Set smooth region max MSE scale multiplier, default is 250 (PNG) or 2500 (QOI)\n");
-	printf("-max_ultra_smooth_std_dev: Set ultra-smooth region maximum standard RGB(A) deviaton, default is 5\n");
-	printf("-ultra_smooth_max_mse_scale: Set ultra-smooth region max MSE scale multiplier, default is 1500 (PNG) or 2500 (QOI)\n");
+	fprintf(pJSON_file, "\n  ]\n}\n");
+
+	if (fclose(pJSON_file) != 0)
+	{
+		fprintf(stderr, "Failed writing file %s\n", json_filename.c_str());
+		return false;
+	}
+
+	if (!opts.m_quiet)
+		printf("Wrote file %s\n", json_filename.c_str());
+
+	return status;
 }
 
-#if 0
-int qoi_test(const image& orig_img)
+// How score_metric_bench_candidates() scores each candidate.
+enum metric_bench_kernel
 {
-	uint8_vec qoi_data;
-	encode_qoi(orig_img, qoi_data);
+	cBenchDispatched,	// should_reject(), then compute_se(), picking the metric from params on every call
+	cBenchSpecialized,	// should_reject_t(), then compute_se_t()
+	cBenchFused,		// evaluate_candidate_t(), as the encoders' candidate searches do
+	cTotalBenchKernels
+};
 
-	write_vec_to_file("mine.qoi", qoi_data);
+// Scores each candidate like the encoders' search loops, skipping the rejected ones.
+template<metric_mode MODE, uint32_t NUM_COMPS, metric_bench_kernel KERNEL>
+static float score_metric_bench_candidates(const color_rgba* pTrials, const color_rgba* pOrigs, const Lab* pOrig_labs, uint32_t num_cands, const rdo_png_params& params)
+{
+	float total = 0.0f;
 
-	printf("My encoded size: %u\n", (uint32_t)qoi_data.size());
+	for (uint32_t i = 0; i < num_cands; i++)
+	{
+		const uint32_t o = i & 255;
+		
+		if (KERNEL == cBenchDispatched)
+		{
+			if (!should_reject(pTrials[i], pOrigs[o], pOrig_labs[o], NUM_COMPS, params))
+				total += compute_se(pTrials[i], pOrigs[o], pOrig_labs[o], NUM_COMPS, params);
+		}
+		else if (KERNEL == cBenchSpecialized)
+		{
+			if (!should_reject_t<MODE, NUM_COMPS>(pTrials[i], pOrigs[o], pOrig_labs[o], params))
+				total += compute_se_t<MODE, NUM_COMPS>(pTrials[i], pOrigs[o], pOrig_labs[o], params);
+		}
+		else
+		{
+			float se;
+			if (evaluate_candidate_t<MODE, NUM_COMPS>(pTrials[i], pOrigs[o], pOrig_labs[o], params, se))
+				total += se;
+		}
+	}
 
-	int qoi_len = 0;
-	qoi_desc desc;
-	desc.width = orig_img.get_width();
-	desc.height = orig_img.get_height();
-	desc.channels = 4;
-	desc.colorspace = 0;
-	void *p = qoi_encode(orig_img.get_ptr(), &desc, &qoi_len);
-	write_data_to_file("image.qoi", p, qoi_len);
-	free(p);
+	return total;
+}
 
-	printf("QOI encoded size: %i\n", qoi_len);
-			
-	void* pImage = qoi_decode((const void *)qoi_data.data(), (int)qoi_data.size(), &desc, 4);
-	if (!pImage)
+// Prints the per-candidate cost of the error metric kernels for a metric mode and channel count: dispatched on each call, specialized, and specialized with 
+// the rejection test and error fused.
+template<metric_mode MODE, uint32_t NUM_COMPS>
+static bool bench_metric_kernel(const char* pName, const encoder_tables& tables)
+{
+	rdo_png_params params;
+	params.m_pTables = &tables;
+	params.m_perceptual_error = (MODE == cMetricOklab);
+	params.m_use_chan_weights = (MODE == cMetricWeightedRGB);
+	params.m_normal_map = (MODE == cMetricNormalMap);
+	params.m_transparent_reject_test = true;
+	if (MODE == cMetricWeightedRGB)
 	{
-		fprintf(stderr, "qoi_decode() failed!\n");
-		return EXIT_FAILURE;
+		params.m_chan_weights[0] = 3;
+		params.m_chan_weights[1] = 4;
+		params.m_chan_weights[2] = 2;
 	}
 
-	image decoded_image((uint8_t *)pImage, desc.width, desc.height, 4);
-	free(pImage);
-	pImage = nullptr;
+	// Candidates near their original colors, like the encoders try, so some are rejected and some aren't.
+	const uint32_t NUM_CANDS = 1 << 16, NUM_REPS = 50;
+	
+	basisu::rand rnd;
+	rnd.seed(1234);
 
-	if (decoded_image != orig_img)
+	color_rgba origs[256];
+	Lab orig_labs[256];
+	for (uint32_t i = 0; i < 256; i++)
 	{
-		fprintf(stderr, "Decode validation failed!\n");
+		origs[i].set(rnd.byte(), rnd.byte(), rnd.byte(), (NUM_COMPS == 4) ? rnd.byte() : 255);
+		orig_labs[i] = get_orig_lab(origs[i], params);
 	}
 
-	save_png("decoded.png", decoded_image);
-	save_png("decoded_rgb.png", decoded_image, cImageSaveIgnoreAlpha);
-	save_png("decoded_alpha.png", decoded_image, cImageSaveGrayscale, 3);
-
-	printf("OK\n");
-			
-	return EXIT_SUCCESS;
-}
-#endif
+	basisu::vector<color_rgba> trials(NUM_CANDS);
+	for (uint32_t i = 0; i < NUM_CANDS; i++)
+	{
+		const color_rgba& o = origs[i & 255];
+		const int d = (i & 1) ? 8 : 48;
+		trials[i].set(clamp<int>(o.r + rnd.irand(-d, d), 0, 255), clamp<int>(o.g + rnd.irand(-d, d), 0, 255), clamp<int>(o.b + rnd.irand(-d, d), 0, 255), 
+			(NUM_COMPS == 4) ? clamp<int>(o.a + rnd.irand(-d, d), 0, 255) : 255);
+	}
 
-static void normalize_image(image& img, const rdo_png_params &params)
-{
-	image orig_img(img);
+	double best_secs[cTotalBenchKernels] = { 1e+9f, 1e+9f, 1e+9f };
+	float totals[cTotalBenchKernels] = { 0.0f, 0.0f, 0.0f };
 
-	for (uint32_t y = 0; y < img.get_height(); y++)
+	for (uint32_t rep = 0; rep < NUM_REPS; rep++)
 	{
-		for (uint32_t x = 0; x < img.get_width(); x++)
+		for (uint32_t k = 0; k < cTotalBenchKernels; k++)
 		{
-			color_rgba& c = img(x, y);
+			interval_timer tm;
+			tm.start();
 
-			vec3F cf(decode_normal(c, params));
-			
-			cf.normalize_in_place();
-						
-			c = encode_normal_exhaustive(cf, c.a, params);
+			if (k == cBenchDispatched)
+				totals[k] = score_metric_bench_candidates<MODE, NUM_COMPS, cBenchDispatched>(trials.data(), origs, orig_labs, NUM_CANDS, params);
+			else if (k == cBenchSpecialized)
+				totals[k] = score_metric_bench_candidates<MODE, NUM_COMPS, cBenchSpecialized>(trials.data(), origs, orig_labs, NUM_CANDS, params);
+			else
+				totals[k] = score_metric_bench_candidates<MODE, NUM_COMPS, cBenchFused>(trials.data(), origs, orig_labs, NUM_CANDS, params);
 
-		} // x
-	} // y
+			best_secs[k] = minimum(best_secs[k], tm.get_elapsed_secs());
+		}
+	}
 
-	if (params.m_print_stats)
+	double ns[cTotalBenchKernels];
+	for (uint32_t k = 0; k < cTotalBenchKernels; k++)
+		ns[k] = best_secs[k] * 1e+9f / NUM_CANDS;
+
+	printf("%-12s %u comps: dispatched %6.2f, specialized %6.2f, fused %6.2f ns/candidate\n", pName, NUM_COMPS, ns[cBenchDispatched], ns[cBenchSpecialized], ns[cBenchFused]);
+
+	if ((totals[cBenchSpecialized] != totals[cBenchDispatched]) || (totals[cBenchFused] != totals[cBenchDispatched]))
 	{
-		printf("\nResults after normalizing normal map:\n");
-		compute_normal_map_image_metrics(img, orig_img, true, params);
+		fprintf(stderr, "Specialized %s metric doesn't match the dispatched metric!\n", pName);
+		return false;
 	}
+
+	return true;
 }
 
-enum comp_mode
+static bool bench_metric_kernels(const encoder_tables& tables)
 {
-	cModePNG,
-	cModeQOI,
-	cModeLZ4I
-};
+	bool status = true;
+	status = bench_metric_kernel<cMetricRGB, 3>("RGB", tables) && status;
+	status = bench_metric_kernel<cMetricRGB, 4>("RGB", tables) && status;
+	status = bench_metric_kernel<cMetricWeightedRGB, 3>("Weighted RGB", tables) && status;
+	status = bench_metric_kernel<cMetricWeightedRGB, 4>("Weighted RGB", tables) && status;
+	status = bench_metric_kernel<cMetricOklab, 3>("Oklab", tables) && status;
+	status = bench_metric_kernel<cMetricOklab, 4>("Oklab", tables) && status;
+	status = bench_metric_kernel<cMetricNormalMap, 3>("Normal map", tables) && status;
+	status = bench_metric_kernel<cMetricNormalMap, 4>("Normal map", tables) && status;
+	return status;
+}
 
 int main(int arg_c, const char** arg_v)
 {
@@ -4281,14 +8368,18 @@ int main(int arg_c, const char** arg_v)
 		rp.m_print_stats = true;
 		rp.m_print_progress = true;
 
-		bool quiet_mode = false;
+		encode_file_options opts;
 		bool caching_enabled = true;
-		comp_mode mode = cModePNG;
-		bool normalize_first = false;
-		bool unpack_qoi_to_png = false;
+		bool compact_oklab = RDO_PNG_COMPACT_OKLAB != 0;
+		uint32_t table_threads = maximum<uint32_t>(1, std::thread::hardware_concurrency());
 		bool unpack_flag = false;
+		int unpack_tile_x = -1, unpack_tile_y = -1;
 
-		float max_smooth_std_dev = -1.0f, smooth_max_mse_scale = -1.0f, max_ultra_smooth_std_dev = -1.0f, ultra_smooth_max_mse_scale = -1.0f;
+		std::string batch_spec, output_dir;
+		std::string bench_decode_spec, bench_huff_spec;
+		decode_bench_options bench_opts;
+		bool bench_metrics = false;
+		uint32_t batch_threads = maximum<uint32_t>(1, std::thread::hardware_concurrency());
 
 		if (arg_c <= 1)
 		{
@@ -4314,9 +8405,23 @@ int main(int arg_c, const char** arg_v)
 			{
 				caching_enabled = false;
 			}
+			else if (strcasecmp(pArg, "-oklab_compact") == 0)
+			{
+				compact_oklab = true;
+			}
+			else if (strcasecmp(pArg, "-oklab_table") == 0)
+			{
+				compact_oklab = false;
+			}
+			else if (strcasecmp(pArg, "-table_threads") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				table_threads = clamp<int>(atoi(arg_v[arg_index + 1]), 1, 256);
+				arg_count++;
+			}
 			else if (strcasecmp(pArg, "-quiet") == 0)
 			{
-				quiet_mode = true;
+				opts.m_quiet = true;
 			}
 			else if (strcasecmp(pArg, "-no_progress") == 0)
 			{
@@ -4328,19 +8433,45 @@ int main(int arg_c, const char** arg_v)
 			}
 			else if (strcasecmp(pArg, "-qoi") == 0)
 			{
-				mode = cModeQOI;
+				opts.m_mode = cModeQOI;
 			}
 			else if (strcasecmp(pArg, "-lz4i") == 0)
 			{
-				mode = cModeLZ4I;
+				opts.m_mode = cModeLZ4I;
 			}
 			else if (strcasecmp(pArg, "-unpack") == 0)
 			{
 				unpack_flag = true;
 			}
+			else if (strcasecmp(pArg, "-unpack_tile") == 0)
+			{
+				REMAINING_ARGS_CHECK(2);
+				unpack_tile_x = maximum<int>(atoi(arg_v[arg_index + 1]), 0);
+				unpack_tile_y = maximum<int>(atoi(arg_v[arg_index + 2]), 0);
+				arg_count += 2;
+			}
+			else if (strcasecmp(pArg, "-lz4i_tile") == 0)
+			{
+				REMAINING_ARGS_CHECK(2);
+				rp.m_lz4i_tile_width = clamp<int>(atoi(arg_v[arg_index + 1]), 0, LZ4I_MAX_DIM);
+				rp.m_lz4i_tile_height = clamp<int>(atoi(arg_v[arg_index + 2]), 0, LZ4I_MAX_DIM);
+				arg_count += 2;
+			}
+			else if (strcasecmp(pArg, "-lz4i_hc") == 0)
+			{
+				rp.m_lz4i_hc = true;
+			}
+			else if (strcasecmp(pArg, "-lz4i_no_cleanup") == 0)
+			{
+				rp.m_lz4i_cleanup = false;
+			}
+			else if (strcasecmp(pArg, "-lz4i_stream") == 0)
+			{
+				rp.m_lz4i_stream = true;
+			}
 			else if (strcasecmp(pArg, "-unpack_qoi_to_png") == 0)
 			{
-				unpack_qoi_to_png = true;
+				opts.m_unpack_qoi_to_png = true;
 			}
 			else if (strcasecmp(pArg, "-level") == 0)
 			{
@@ -4361,25 +8492,25 @@ int main(int arg_c, const char** arg_v)
 			else if (strcasecmp(pArg, "-max_smooth_std_dev") == 0)
 			{
 				REMAINING_ARGS_CHECK(1);
-				max_smooth_std_dev = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
+				opts.m_max_smooth_std_dev = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
 				arg_count++;
 			}
 			else if (strcasecmp(pArg, "-smooth_max_mse_scale") == 0)
 			{
 				REMAINING_ARGS_CHECK(1);
-				smooth_max_mse_scale = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
+				opts.m_smooth_max_mse_scale = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
 				arg_count++;
 			}
 			else if (strcasecmp(pArg, "-max_ultra_smooth_std_dev") == 0)
 			{
 				REMAINING_ARGS_CHECK(1);
-				max_ultra_smooth_std_dev = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
+				opts.m_max_ultra_smooth_std_dev = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
 				arg_count++;
 			}
 			else if (strcasecmp(pArg, "-ultra_smooth_max_mse_scale") == 0)
 			{
 				REMAINING_ARGS_CHECK(1);
-				ultra_smooth_max_mse_scale = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
+				opts.m_ultra_smooth_max_mse_scale = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.000125f, 250000.0f);
 				arg_count++;
 			}
 			else if (strcasecmp(pArg, "-output") == 0)
@@ -4514,6 +8645,12 @@ int main(int arg_c, const char** arg_v)
 			{
 				rp.m_two_pass = true;
 			}
+			else if (strcasecmp(pArg, "-adaptive_huff") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				rp.m_adaptive_huff_rows = clamp<int>(atoi(arg_v[arg_index + 1]), 0, 65536);
+				arg_count++;
+			}
 			else if (strcasecmp(pArg, "-uber") == 0)
 			{
 				rp.m_speed_mode = cNormalSpeed;
@@ -4540,12 +8677,111 @@ int main(int arg_c, const char** arg_v)
 			}
 			else if (strcasecmp(pArg, "-normalize") == 0)
 			{
-				normalize_first = true;
+				opts.m_normalize_first = true;
 			}
 			else if (strcasecmp(pArg, "-snorm") == 0)
 			{
 				rp.m_snorm8 = true;
 			}
+			else if (strcasecmp(pArg, "-wavefront") == 0)
+			{
+				rp.m_wavefront = true;
+			}
+			else if (strcasecmp(pArg, "-parallel_filters") == 0)
+			{
+				rp.m_parallel_filters = true;
+			}
+			else if (strcasecmp(pArg, "-threads") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				rp.m_num_threads = clamp<int>(atoi(arg_v[arg_index + 1]), 1, 256);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-target_bpp") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				rp.m_target_bpp = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.0f, 64.0f);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-target_psnr") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				rp.m_target_psnr = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.0f, 100.0f);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-target_tolerance") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				rp.m_target_tolerance = clamp<float>((float)atof(arg_v[arg_index + 1]), 0.0f, 100.0f);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-batch") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				batch_spec = arg_v[arg_index + 1];
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-bench_decode") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				bench_decode_spec = arg_v[arg_index + 1];
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-bench_huff") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				bench_huff_spec = arg_v[arg_index + 1];
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-bench_metrics") == 0)
+			{
+				bench_metrics = true;
+			}
+			else if (strcasecmp(pArg, "-bench_reps") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				bench_opts.m_reps = clamp<int>(atoi(arg_v[arg_index + 1]), 1, 100000);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-bench_warmup") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				bench_opts.m_warmup = clamp<int>(atoi(arg_v[arg_index + 1]), 0, 100000);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-bench_threads") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				bench_opts.m_thread_counts.clear();
+				
+				// A comma separated list, such as 1,2,4
+				for (const char* p = arg_v[arg_index + 1]; *p; )
+				{
+					bench_opts.m_thread_counts.push_back(clamp<int>(atoi(p), 1, 256));
+					
+					const char* pComma = strchr(p, ',');
+					if (!pComma)
+						break;
+					p = pComma + 1;
+				}
+
+				if (!bench_opts.m_thread_counts.size())
+					bench_opts.m_thread_counts.push_back(1);
+
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-batch_threads") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				batch_threads = clamp<int>(atoi(arg_v[arg_index + 1]), 1, 256);
+				arg_count++;
+			}
+			else if (strcasecmp(pArg, "-output_dir") == 0)
+			{
+				REMAINING_ARGS_CHECK(1);
+				output_dir = arg_v[arg_index + 1];
+				arg_count++;
+			}
 			else if (pArg[0] == '-')
 			{
 				fprintf(stderr, "Unrecognized command line option: %s\n", pArg);
@@ -4564,193 +8800,166 @@ int main(int arg_c, const char** arg_v)
 			arg_index += arg_count;
 		}
 
-		if (quiet_mode)
+		if (opts.m_quiet)
 		{
 			rp.m_print_stats = false;
 			rp.m_print_progress = false;
 			rp.m_print_debug_output = false;
 		}
 
-		if (!quiet_mode)
+		if (!opts.m_quiet)
 		{
 			printf("rdopng " RDO_PNG_VERSION "\n");
 		}
 
-		init_srgb_to_linear();
-		init_oklab_table(arg_v[0], quiet_mode, caching_enabled);
-		init_acos_lookup();
-
-		if (!input_filename.size())
+		if ((rp.m_target_bpp > 0.0f) && (rp.m_target_psnr > 0.0f))
 		{
-			fprintf(stderr, "No input filename specified\n");
+			fprintf(stderr, "-target_bpp and -target_psnr can't be used together\n");
 			return EXIT_FAILURE;
 		}
 
-		if (!output_filename.size())
+		if ((rp.m_lz4i_stream) && ((rp.m_target_bpp > 0.0f) || (rp.m_target_psnr > 0.0f)))
 		{
-			string_get_filename(input_filename.c_str(), output_filename);
-			string_remove_extension(output_filename);
-			if (!output_filename.size())
-				output_filename = "out";
-			
-			if (unpack_flag)
-				output_filename += ".png";
-			else if (mode == cModeLZ4I)
-				output_filename += "_rdo.lz4i";
-			else if (mode == cModeQOI)
-				output_filename += "_rdo.qoi";
-			else
-				output_filename += "_rdo.png";
+			fprintf(stderr, "-lz4i_stream can't be used with -target_bpp or -target_psnr\n");
+			return EXIT_FAILURE;
 		}
 
-		if (unpack_flag)
+		if (bench_decode_spec.size())
 		{
-			uint8_vec file_data;
-			if (!read_file_to_vec(input_filename.c_str(), file_data))
+			if ((input_filename.size()) || (batch_spec.size()) || (unpack_flag))
 			{
-				fprintf(stderr, "Failed reading file %s\n", input_filename.c_str());
+				fprintf(stderr, "-bench_decode can't be combined with an input filename, -batch or -unpack\n");
 				return EXIT_FAILURE;
 			}
 
-			if (!file_data.size())
-			{
-				fprintf(stderr, "File %s is empty\n", input_filename.c_str());
+			std::vector<std::string> filenames;
+			if (is_decode_bench_filename(bench_decode_spec.c_str()))
+				filenames.push_back(bench_decode_spec);
+			else if (!get_batch_filenames(bench_decode_spec.c_str(), filenames, is_decode_bench_filename))
 				return EXIT_FAILURE;
-			}
 
-			image img;
-			if (!decode_lz4i(&file_data[0], file_data.size(), img))
+			if (!output_filename.size())
 			{
-				fprintf(stderr, "Failed unpacking LZ4I file %s\n", input_filename.c_str());
-				return EXIT_FAILURE;
+				output_filename = "bench_decode.json";
+				if (output_dir.size())
+					string_combine_path(output_filename, output_dir.c_str(), output_filename.c_str());
 			}
 
-			if (!save_png(output_filename.c_str(), img))
-			{
-				fprintf(stderr, "Failed writing to file %s\n", output_filename.c_str());
-				return EXIT_FAILURE;
-			}
-			
-			printf("Wrote file %s, %ux%u, has_alpha: %u\n", output_filename.c_str(), img.get_width(), img.get_height(), img.has_alpha());
+			bench_opts.m_quiet = opts.m_quiet;
 
-			status = EXIT_SUCCESS;
+			if (bench_decode(filenames, bench_opts, output_filename))
+				status = EXIT_SUCCESS;
 		}
-		else
+		else if (bench_huff_spec.size())
 		{
-			uint64_t input_filesize = 0;
-			FILE* pFile = fopen(input_filename.c_str(), "rb");
-			if (!pFile)
+			if ((input_filename.size()) || (batch_spec.size()) || (unpack_flag))
 			{
-				fprintf(stderr, "Failed loading file %s\n", input_filename.c_str());
+				fprintf(stderr, "-bench_huff can't be combined with an input filename, -batch or -unpack\n");
 				return EXIT_FAILURE;
 			}
-			fseek(pFile, 0, SEEK_END);
-			input_filesize = ftell(pFile);
-			fclose(pFile);
 
-			if (!load_image(input_filename, rp.m_orig_img))
-			{
-				fprintf(stderr, "Failed loading file %s\n", input_filename.c_str());
+			std::vector<std::string> filenames;
+			if (is_batch_image_filename(bench_huff_spec.c_str()))
+				filenames.push_back(bench_huff_spec);
+			else if (!get_batch_filenames(bench_huff_spec.c_str(), filenames))
 				return EXIT_FAILURE;
-			}
-
-			if (!quiet_mode)
-			{
-				printf("Loaded file \"%s\", %ux%u, has alpha: %u, size: %llu, bpp: %3.3f\n",
-					input_filename.c_str(), rp.m_orig_img.get_width(), rp.m_orig_img.get_height(), rp.m_orig_img.has_alpha(),
-					(unsigned long long)input_filesize, (input_filesize * 8.0f) / rp.m_orig_img.get_total_pixels());
-			}
 
-			if (rp.m_debug_images)
-			{
-				save_png("dbg_loaded.png", rp.m_orig_img);
-			}
+			encoder_tables tables;
+			tables.init(arg_v[0], opts.m_quiet, caching_enabled, compact_oklab, table_threads);
 
-			if (normalize_first)
-			{
-				normalize_image(rp.m_orig_img, rp);
-			}
+			if (bench_huff_modes(tables, rp, filenames))
+				status = EXIT_SUCCESS;
+		}
+		else if (bench_metrics)
+		{
+			encoder_tables tables;
+			tables.init(arg_v[0], opts.m_quiet, caching_enabled, compact_oklab, table_threads);
 
-			if (mode == cModeLZ4I)
-			{
-				// LZ4-specific settings - more artifact suppression on smooth/ultra-smooth regions vs. PNG.
-				rp.m_smooth_max_mse_scale = LZ4I_DEF_SMOOTH_MAX_MSE_SCALE;
-				rp.m_ultra_smooth_max_mse_scale = LZ4I_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE;
-			}
-			else if (mode == cModeQOI)
+			if (bench_metric_kernels(tables))
+				status = EXIT_SUCCESS;
+		}
+		else if (batch_spec.size())
+		{
+			if ((input_filename.size()) || (output_filename.size()) || (unpack_flag))
 			{
-				// QOI-specific settings - more artifact suppression on smooth/ultra-smooth regions vs. PNG.
-				rp.m_smooth_max_mse_scale = QOI_DEF_SMOOTH_MAX_MSE_SCALE;
-				rp.m_ultra_smooth_max_mse_scale = QOI_DEF_ULTRA_SMOOTH_MAX_MSE_SCALE;
+				fprintf(stderr, "-batch can't be combined with an input filename, -output or -unpack\n");
+				return EXIT_FAILURE;
 			}
 
-			if (max_smooth_std_dev != -1.0f)
-				rp.m_max_smooth_std_dev = max_smooth_std_dev;
+			std::vector<std::string> filenames;
+			if (!get_batch_filenames(batch_spec.c_str(), filenames))
+				return EXIT_FAILURE;
 
-			if (smooth_max_mse_scale != -1.0f)
-				rp.m_smooth_max_mse_scale = smooth_max_mse_scale;
+			encoder_tables tables;
+			tables.init(arg_v[0], opts.m_quiet, caching_enabled, compact_oklab, table_threads);
 
-			if (max_ultra_smooth_std_dev != -1.0f)
-				rp.m_ultra_smooth_max_mse_scale = max_ultra_smooth_std_dev;
+			if (encode_batch(tables, rp, opts, filenames, output_dir, batch_threads))
+				status = EXIT_SUCCESS;
+		}
+		else
+		{
+			encoder_tables tables;
+			tables.init(arg_v[0], opts.m_quiet, caching_enabled, compact_oklab, table_threads);
 
-			if (ultra_smooth_max_mse_scale != -1.0f)
-				rp.m_ultra_smooth_max_mse_scale = ultra_smooth_max_mse_scale;
+			encoder_context ctx(tables);
 
-			if (rp.m_print_debug_output)
+			if (!input_filename.size())
 			{
-				printf("\nParameters:\n");
-				rp.print();
-				printf("\n");
+				fprintf(stderr, "No input filename specified\n");
+				return EXIT_FAILURE;
 			}
 
-			interval_timer tm;
-			tm.start();
-
-			bool status = false;
-
-			if (mode == cModeQOI)
-				status = rdo_qoi(rp);
-			else if (mode == cModeLZ4I)
-				status = rdo_lz4i(rp);
-			else
-				status = rdo_png(rp);
-
-			if (status)
+			if (!output_filename.size())
 			{
-				if (!quiet_mode)
-					printf("Encoded in %3.3f secs\n", tm.get_elapsed_secs());
+				output_filename = get_default_output_filename(input_filename, opts.m_mode, unpack_flag);
+				if (output_dir.size())
+					string_combine_path(output_filename, output_dir.c_str(), output_filename.c_str());
+			}
 
-				if (!write_vec_to_file(output_filename.c_str(), rp.m_output_file_data))
+			if (unpack_flag)
+			{
+				uint8_vec file_data;
+				if (!read_file_to_vec(input_filename.c_str(), file_data))
 				{
-					fprintf(stderr, "Failed writing to file \"%s\"\n", output_filename.c_str());
+					fprintf(stderr, "Failed reading file %s\n", input_filename.c_str());
 					return EXIT_FAILURE;
 				}
 
-				if (!quiet_mode)
+				if (!file_data.size())
 				{
-					printf("Wrote output file \"%s\"\n", output_filename.c_str());
+					fprintf(stderr, "File %s is empty\n", input_filename.c_str());
+					return EXIT_FAILURE;
 				}
 
-				if (unpack_qoi_to_png)
+				image img;
+				if (unpack_tile_x >= 0)
 				{
-					std::string png_filename(output_filename);
-					string_remove_extension(png_filename);
-					png_filename += ".png";
-
-					if (!save_png(png_filename.c_str(), rp.m_output_image))
+					if (!decode_lz4i_tile(&file_data[0], file_data.size(), unpack_tile_x, unpack_tile_y, img))
 					{
-						fprintf(stderr, "Failed writing to file \"%s\"\n", png_filename.c_str());
+						fprintf(stderr, "Failed unpacking tile %i,%i of LZ4I file %s\n", unpack_tile_x, unpack_tile_y, input_filename.c_str());
 						return EXIT_FAILURE;
 					}
+				}
+				else if (!decode_lz4i(&file_data[0], file_data.size(), img, rp.m_num_threads))
+				{
+					fprintf(stderr, "Failed unpacking LZ4I file %s\n", input_filename.c_str());
+					return EXIT_FAILURE;
+				}
 
-					if (!quiet_mode)
-					{
-						printf("Wrote output file \"%s\"\n", png_filename.c_str());
-					}
+				if (!save_png(output_filename.c_str(), img))
+				{
+					fprintf(stderr, "Failed writing to file %s\n", output_filename.c_str());
+					return EXIT_FAILURE;
 				}
+			
+				printf("Wrote file %s, %ux%u, has_alpha: %u\n", output_filename.c_str(), img.get_width(), img.get_height(), img.has_alpha());
 
 				status = EXIT_SUCCESS;
 			}
+			else if (encode_file(ctx, rp, opts, input_filename, output_filename))
+			{
+				status = EXIT_SUCCESS;
+			}
 		}
 	}
 	catch (const std::exception &exc)